@@ -11,14 +11,33 @@
 
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstring>
 #include <initializer_list>
+#include <new>
 #include <string>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 #ifdef _MSC_VER
 #include <intrin.h> // for _BitScanReverse, _BitScanReverse64
 #endif
 
+// STRINGUTILS_HAVE_MMAP: dictionaries are mapped instead of read. Opt in
+// with STRINGUTILS_USE_MMAP, which brings in the POSIX headers.
+#if defined(STRINGUTILS_USE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+  #define STRINGUTILS_HAVE_MMAP
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#else
+  #include <fstream>
+#endif
+
+#include "stringutils_tables.h"
+
 // STRINGUTILS_CPLUSPLUS
 #if defined(_MSC_VER) && defined(_MSVC_LANG)
   #define STRINGUTILS_CPLUSPLUS _MSVC_LANG
@@ -38,6 +57,27 @@
   #define STRINGUTILS_FALLTHROUGH /* fall through */
 #endif
 
+// STRINGUTILS_HAVE_SSE2
+#if !defined(STRINGUTILS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+  #define STRINGUTILS_HAVE_SSE2
+  #include <emmintrin.h>
+#endif
+
+// STRINGUTILS_HAVE_SSSE3
+#if defined(STRINGUTILS_HAVE_SSE2) && (defined(__SSSE3__) || defined(__AVX__))
+  #define STRINGUTILS_HAVE_SSSE3
+  #include <tmmintrin.h>
+#endif
+
+// STRINGUTILS_INDEX_NOEXCEPT: with STRINGUTILS_USTRING_INDEX the utf8 byte
+// queries of ustring extend the index and may throw std::bad_alloc.
+#ifdef STRINGUTILS_USTRING_INDEX
+  #define STRINGUTILS_INDEX_NOEXCEPT
+#else
+  #define STRINGUTILS_INDEX_NOEXCEPT noexcept
+#endif
+
 namespace stringutils {
 
 #define LEFTSTRIP 0
@@ -1127,6 +1167,485 @@ namespace clz_detail {
   #endif
 }
 
+namespace simd_detail {
+  // Population count utility
+  static inline unsigned int popcount(std::uint64_t value) noexcept
+  {
+    #if defined(__GNUC__)
+      return (unsigned int)__builtin_popcountll(value);
+    #else
+      value = value - ((value >> 1) & 0x5555555555555555ULL);
+      value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+      value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+      return (unsigned int)((value * 0x0101010101010101ULL) >> 56);
+    #endif
+  }
+
+  // Return the number of utf8 continuation bytes (10XXXXXX) in the buffer.
+  static inline size_t count_continuation_bytes(const char* str, size_t len) noexcept
+  {
+    size_t cur = 0, count = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    // Continuation bytes are exactly the signed bytes below (signed char)0xC0.
+    const __m128i limit = _mm_set1_epi8(-64);
+    for (; cur + 16 <= len; cur += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      count += popcount((unsigned int)_mm_movemask_epi8(_mm_cmplt_epi8(v, limit)));
+    }
+    #endif
+    for (; cur + 8 <= len; cur += 8)
+    {
+      std::uint64_t word;
+      memcpy(&word, str + cur, 8);
+      count += popcount(word & ~(word << 1) & 0x8080808080808080ULL);
+    }
+    for (; cur < len; cur++)
+      count += ((unsigned char)str[cur] & 0xC0) == 0x80;
+    return count;
+  }
+
+  // Return the position of the first byte from pos on which is not a
+  // continuation byte and is followed by three continuation bytes, that is
+  // which starts a group of at least four bytes, or len if there is none.
+  static inline size_t find_long_group(const char* str, size_t len, size_t pos) noexcept
+  {
+    #ifdef STRINGUTILS_HAVE_SSE2
+    const __m128i limit = _mm_set1_epi8(-64);
+    for (; pos + 19 <= len; pos += 16)
+    {
+      __m128i c0 = _mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)(str + pos)), limit);
+      __m128i c1 = _mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)(str + pos + 1)), limit);
+      __m128i c2 = _mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)(str + pos + 2)), limit);
+      __m128i c3 = _mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)(str + pos + 3)), limit);
+      if (_mm_movemask_epi8(_mm_andnot_si128(c0, _mm_and_si128(c1, _mm_and_si128(c2, c3)))))
+        break;
+    }
+    #endif
+    for (; pos + 11 <= len; pos += 8)
+    {
+      std::uint64_t w[4];
+      for (int i = 0; i < 4; i++)
+      {
+        memcpy(&w[i], str + pos + i, 8);
+        w[i] &= ~(w[i] << 1);
+      }
+      if (~w[0] & w[1] & w[2] & w[3] & 0x8080808080808080ULL)
+        break;
+    }
+    for (; pos + 3 < len; pos++)
+      if (((unsigned char)str[pos] & 0xC0) != 0x80 &&
+          ((unsigned char)str[pos + 1] & 0xC0) == 0x80 &&
+          ((unsigned char)str[pos + 2] & 0xC0) == 0x80 &&
+          ((unsigned char)str[pos + 3] & 0xC0) == 0x80)
+        return pos;
+    return len;
+  }
+
+  #ifdef STRINGUTILS_HAVE_SSE2
+  // Lanes of v whose unsigned byte is at most c.
+  static inline __m128i le_epu8(__m128i v, unsigned char c) noexcept
+  { return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8((char)c)), v); }
+
+  // Shift v up by _Shift lanes, filling the first ones from the end of prev.
+  template <int _Shift>
+  static inline __m128i shift_in(__m128i v, __m128i prev) noexcept
+  { return _mm_or_si128(_mm_slli_si128(v, _Shift), _mm_srli_si128(prev, 16 - _Shift)); }
+  #endif
+
+  // Return the length of a prefix of the buffer made of whole, strictly
+  // valid utf8 characters (no overlong forms, surrogates or code points
+  // above U+10FFFF) and add the number of those that are not ascii to
+  // count. The prefix ends at most 19 bytes before the first error or the
+  // end of the buffer, which is left to a scalar check.
+  static inline size_t utf8_valid_prefix(const char* str, size_t len, size_t& count) noexcept
+  {
+    size_t cur = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    // A lead byte of n bytes requires continuation bytes in the n - 1 lanes
+    // after it, and only there; the second byte has a narrower range after
+    // E0, ED, F0 and F4.
+    const __m128i limit = _mm_set1_epi8(-64);
+    __m128i prev = _mm_setzero_si128(), lead2 = prev, lead3 = prev, lead4 = prev;
+    for (; cur + 16 <= len; cur += 16)
+    {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      const __m128i l2 = _mm_cmpeq_epi8(le_epu8(v, 0xBF), _mm_setzero_si128());
+      const __m128i l3 = _mm_cmpeq_epi8(le_epu8(v, 0xDF), _mm_setzero_si128());
+      const __m128i l4 = _mm_cmpeq_epi8(le_epu8(v, 0xEF), _mm_setzero_si128());
+      const __m128i p = shift_in<1>(v, prev);
+      const __m128i below90 = le_epu8(v, 0x8F), belowA0 = le_epu8(v, 0x9F);
+      __m128i error = _mm_xor_si128(_mm_cmplt_epi8(v, limit),
+          _mm_or_si128(shift_in<1>(l2, lead2),
+          _mm_or_si128(shift_in<2>(l3, lead3), shift_in<3>(l4, lead4))));
+      error = _mm_or_si128(error, _mm_cmpeq_epi8(le_epu8(v, 0xF4), _mm_setzero_si128()));
+      error = _mm_or_si128(error,
+          _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xFE)), _mm_set1_epi8((char)0xC0)));
+      error = _mm_or_si128(error,
+          _mm_and_si128(_mm_cmpeq_epi8(p, _mm_set1_epi8((char)0xE0)), belowA0));
+      error = _mm_or_si128(error,
+          _mm_andnot_si128(belowA0, _mm_cmpeq_epi8(p, _mm_set1_epi8((char)0xED))));
+      error = _mm_or_si128(error,
+          _mm_and_si128(_mm_cmpeq_epi8(p, _mm_set1_epi8((char)0xF0)), below90));
+      error = _mm_or_si128(error,
+          _mm_andnot_si128(below90, _mm_cmpeq_epi8(p, _mm_set1_epi8((char)0xF4))));
+      if (_mm_movemask_epi8(error))
+        break;
+      count += popcount((unsigned int)_mm_movemask_epi8(l2));
+      prev = v;
+      lead2 = l2;
+      lead3 = l3;
+      lead4 = l4;
+    }
+    #else
+    (void)len;
+    #endif
+    // Leave out a character cut by the end of the checked blocks.
+    for (size_t k = 1; k <= 3 && k <= cur; k++)
+    {
+      const unsigned char c = (unsigned char)str[cur - k];
+      if (c >= 0xC0)
+      {
+        if (size_t(1 + (c >= 0xE0) + (c >= 0xF0)) >= k)
+        {
+          cur -= k;
+          count--;
+        }
+        break;
+      }
+      if (c < 0x80)
+        break;
+    }
+    return cur;
+  }
+
+  // Skip the leading 16 and 8-byte blocks while they hold at most count
+  // bytes which are not continuation bytes, subtract those from count and
+  // return the number of bytes skipped.
+  static inline size_t skip_leads(const char* str, size_t len, size_t& count) noexcept
+  {
+    size_t cur = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    const __m128i limit = _mm_set1_epi8(-64);
+    for (; cur + 16 <= len; cur += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      size_t leads = 16 - popcount((unsigned int)_mm_movemask_epi8(_mm_cmplt_epi8(v, limit)));
+      if (leads > count)
+        return cur;
+      count -= leads;
+    }
+    #endif
+    for (; cur + 8 <= len; cur += 8)
+    {
+      std::uint64_t word;
+      memcpy(&word, str + cur, 8);
+      size_t leads = 8 - popcount(word & ~(word << 1) & 0x8080808080808080ULL);
+      if (leads > count)
+        return cur;
+      count -= leads;
+    }
+    return cur;
+  }
+
+  // Return the mask of the bytes which are not continuation bytes among
+  // the first len <= 64 bytes of the buffer, bit i for byte i.
+  static inline std::uint64_t lead_bits(const char* str, size_t len) noexcept
+  {
+    std::uint64_t bits = 0;
+    size_t cur = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    const __m128i limit = _mm_set1_epi8(-64);
+    for (; cur + 16 <= len; cur += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      bits |= (std::uint64_t)(~_mm_movemask_epi8(_mm_cmplt_epi8(v, limit)) & 0xFFFF) << cur;
+    }
+    #endif
+    for (; cur + 8 <= len; cur += 8)
+    {
+      // Gather the top bit of every byte of the word into one byte.
+      std::uint64_t word;
+      memcpy(&word, str + cur, 8);
+      word = ((word & ~(word << 1) & 0x8080808080808080ULL) >> 7) * 0x0102040810204080ULL;
+      bits |= (std::uint64_t)(~(word >> 56) & 0xFF) << cur;
+    }
+    for (; cur < len; cur++)
+      bits |= (std::uint64_t)(((unsigned char)str[cur] & 0xC0) != 0x80) << cur;
+    return bits;
+  }
+
+  // Count the zero bytes at even and at odd offsets of the buffer.
+  static inline void count_zero_bytes(const char* str, size_t len, size_t zeros[2]) noexcept
+  {
+    size_t cur = 0;
+    zeros[0] = zeros[1] = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    // Per-byte counters are summed before they can overflow.
+    const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(0x00FF);
+    while (cur + 16 <= len)
+    {
+      __m128i acc = zero;
+      for (size_t k = 0; k < 255 && cur + 16 <= len; k++, cur += 16)
+        acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(str + cur)), zero));
+      __m128i even = _mm_sad_epu8(_mm_and_si128(acc, low), zero);
+      __m128i odd = _mm_sad_epu8(_mm_srli_epi16(acc, 8), zero);
+      zeros[0] += (size_t)_mm_cvtsi128_si32(even) + (size_t)_mm_extract_epi16(even, 4);
+      zeros[1] += (size_t)_mm_cvtsi128_si32(odd) + (size_t)_mm_extract_epi16(odd, 4);
+    }
+    #endif
+    for (; cur < len; cur++)
+      zeros[cur & 1] += !str[cur];
+  }
+
+  // Return the length of the leading ascii run of the buffer.
+  static inline size_t ascii_prefix(const char* str, size_t len) noexcept
+  {
+    size_t cur = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    for (; cur + 16 <= len; cur += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      if (_mm_movemask_epi8(v))
+        break;
+    }
+    #endif
+    for (; cur + 8 <= len; cur += 8)
+    {
+      std::uint64_t word;
+      memcpy(&word, str + cur, 8);
+      if (word & 0x8080808080808080ULL)
+        break;
+    }
+    while (cur < len && !((unsigned char)str[cur] & 0x80))
+      cur++;
+    return cur;
+  }
+
+  // Return the length of the leading ascii run of the buffer and add its
+  // display width, the number of bytes other than controls, to width.
+  static inline size_t ascii_width(const char* str, size_t len, size_t& width) noexcept
+  {
+    size_t cur = 0, controls = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    for (; cur + 16 <= len; cur += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur));
+      if (_mm_movemask_epi8(v))
+        break;
+      const unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+          _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))));
+      if (mask)
+        controls += popcount(mask);
+    }
+    #endif
+    for (; cur < len && !((unsigned char)str[cur] & 0x80); cur++)
+      controls += (unsigned char)str[cur] < 0x20 || str[cur] == 0x7F;
+    width += cur - controls;
+    return cur;
+  }
+
+  // Fill n code units of 1, 2 or 4 bytes with c. memset is used when all
+  // bytes of c are equal, otherwise c is broadcast to a 16-byte register.
+  template <typename _UnitT>
+  static inline void fill(_UnitT* dest, size_t n, _UnitT c) noexcept
+  {
+    std::uint64_t pattern = (std::uint64_t)c;
+    for (size_t width = sizeof(_UnitT); width < 8; width <<= 1)
+      pattern |= pattern << (width * 8);
+    if (pattern == (pattern & 0xFF) * 0x0101010101010101ULL)
+    {
+      memset(dest, (int)(pattern & 0xFF), n * sizeof(_UnitT));
+      return;
+    }
+    const size_t bytes = n * sizeof(_UnitT);
+    char* d = (char *)dest;
+    size_t cur = 0;
+    #ifdef STRINGUTILS_HAVE_SSE2
+    const __m128i v = _mm_set1_epi64x((long long)pattern);
+    for (; cur + 64 <= bytes; cur += 64)
+    {
+      _mm_storeu_si128((__m128i *)(d + cur), v);
+      _mm_storeu_si128((__m128i *)(d + cur + 16), v);
+      _mm_storeu_si128((__m128i *)(d + cur + 32), v);
+      _mm_storeu_si128((__m128i *)(d + cur + 48), v);
+    }
+    for (; cur + 16 <= bytes; cur += 16)
+      _mm_storeu_si128((__m128i *)(d + cur), v);
+    #endif
+    for (; cur + 8 <= bytes; cur += 8)
+      memcpy(d + cur, &pattern, 8);
+    // The pattern is periodic in sizeof(_UnitT), so any byte offset that is
+    // a multiple of it continues the sequence.
+    if (cur < bytes)
+      memcpy(d + cur, &pattern, bytes - cur);
+  }
+
+  #ifdef STRINGUTILS_HAVE_SSE2
+  // Widen 16 ascii bytes to 16 code units of 2 or 4 bytes.
+  template <typename _CodeT>
+  static inline void widen_ascii(__m128i v, _CodeT* dest) noexcept
+  {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+    if (sizeof(_CodeT) == 2)
+    {
+      _mm_storeu_si128((__m128i *)dest, lo);
+      _mm_storeu_si128((__m128i *)(dest + 8), hi);
+    }
+    else
+    {
+      _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)(dest + 8), _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128((__m128i *)(dest + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+  }
+  #endif
+
+  #ifdef STRINGUTILS_HAVE_SSSE3
+  // pshufb controls indexed by an 8-bit mask, built at first use.
+  struct shuffle_tables
+  {
+    // Pick the utf8 bytes of 8 latin1 characters out of their interleaved
+    // (lead, trail) pairs, the mask marking the characters above 0x7F.
+    unsigned char expand[256][16];
+    // Move the bytes of an 8-byte group marked in the mask to its front.
+    unsigned char compact[256][16];
+    // Number of bits set in the mask.
+    unsigned char count[256];
+    // Spread the bytes of three registers over 48 bytes, the one of register
+    // r going to offsets 3k + r.
+    unsigned char spread[3][3][16];
+
+    shuffle_tables() noexcept
+    {
+      for (unsigned int p = 0; p < 48; p++)
+        for (unsigned int r = 0; r < 3; r++)
+          spread[p / 16][r][p % 16] = p % 3 == r ? (unsigned char)(p / 3) : 0x80;
+      for (unsigned int m = 0; m < 256; m++)
+      {
+        unsigned int e = 0, c = 0;
+        for (unsigned int k = 0; k < 8; k++)
+        {
+          expand[m][e++] = (unsigned char)(2 * k);
+          if (m >> k & 1)
+          {
+            expand[m][e++] = (unsigned char)(2 * k + 1);
+            compact[m][c++] = (unsigned char)k;
+          }
+        }
+        count[m] = (unsigned char)(e - 8);
+        while (e < 16)
+          expand[m][e++] = 0x80;
+        while (c < 16)
+          compact[m][c++] = 0x80;
+      }
+    }
+  };
+
+  static inline const shuffle_tables& shuffles() noexcept
+  {
+    static const shuffle_tables tables;
+    return tables;
+  }
+
+  // Expand 16 latin1 bytes to utf8 and return the number of bytes written.
+  // Up to 32 bytes are stored.
+  static inline size_t expand_latin1(__m128i v, char* dest) noexcept
+  {
+    const __m128i high = _mm_cmplt_epi8(v, _mm_setzero_si128());
+    // 0xC2, or 0xC3 for bytes from 0xC0 on, which are above -65 signed.
+    const __m128i lead_high = _mm_sub_epi8(_mm_set1_epi8((char)0xC2),
+        _mm_cmpgt_epi8(v, _mm_set1_epi8(-65)));
+    const __m128i lead = _mm_or_si128(_mm_and_si128(high, lead_high), _mm_andnot_si128(high, v));
+    const __m128i trail = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi8(0x3F)),
+        _mm_set1_epi8((char)0x80));
+    const unsigned int mask = (unsigned int)_mm_movemask_epi8(high);
+    const shuffle_tables& tables = shuffles();
+    const unsigned int m0 = mask & 0xFF, m1 = mask >> 8;
+    _mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi8(_mm_unpacklo_epi8(lead, trail),
+        _mm_loadu_si128((const __m128i *)tables.expand[m0])));
+    const size_t n0 = 8 + tables.count[m0];
+    _mm_storeu_si128((__m128i *)(dest + n0), _mm_shuffle_epi8(_mm_unpackhi_epi8(lead, trail),
+        _mm_loadu_si128((const __m128i *)tables.expand[m1])));
+    return n0 + 8 + tables.count[m1];
+  }
+
+  // Contract 16 bytes of utf8 made of ascii and two-byte sequences led by
+  // 0xC2 or 0xC3, none of them cut, to latin1. Return the number of bytes
+  // written, or 0 when the block is not of that form.
+  static inline size_t contract_latin1(__m128i v, char* dest) noexcept
+  {
+    const unsigned int leads = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_and_si128(v, _mm_set1_epi8((char)0xFE)), _mm_set1_epi8((char)0xC2)));
+    const unsigned int trails = (unsigned int)_mm_movemask_epi8(
+        _mm_cmplt_epi8(v, _mm_set1_epi8(-64)));
+    const unsigned int high = (unsigned int)_mm_movemask_epi8(v);
+    if ((leads << 1) != trails || (leads | trails) != high)
+      return 0;
+    // A trail byte takes the two low bits of its lead.
+    const __m128i prev = _mm_slli_si128(_mm_and_si128(v, _mm_set1_epi8(3)), 1);
+    const __m128i value = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi8(0x3F)),
+        _mm_slli_epi16(prev, 6));
+    const __m128i t = _mm_cmplt_epi8(v, _mm_set1_epi8(-64));
+    const __m128i out = _mm_or_si128(_mm_and_si128(t, value), _mm_andnot_si128(t, v));
+    const shuffle_tables& tables = shuffles();
+    const unsigned int keep = ~leads & 0xFFFF, k0 = keep & 0xFF, k1 = keep >> 8;
+    _mm_storel_epi64((__m128i *)dest, _mm_shuffle_epi8(out,
+        _mm_loadu_si128((const __m128i *)tables.compact[k0])));
+    const size_t n0 = tables.count[k0];
+    _mm_storel_epi64((__m128i *)(dest + n0), _mm_shuffle_epi8(_mm_srli_si128(out, 8),
+        _mm_loadu_si128((const __m128i *)tables.compact[k1])));
+    return n0 + tables.count[k1];
+  }
+
+  // Expand 16 bytes of printable ascii (0x20-0x7E) to their 48 bytes of
+  // full-width utf8: EF BC/BD xx, or E3 80 80 for the space.
+  static inline void expand_fullwidth(__m128i v, char* dest) noexcept
+  {
+    const __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x20));
+    const __m128i upper = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x5F));
+    const __m128i lead = _mm_xor_si128(_mm_set1_epi8((char)0xEF),
+        _mm_and_si128(space, _mm_set1_epi8(0x0C)));
+    const __m128i mid = _mm_or_si128(_mm_andnot_si128(space,
+        _mm_sub_epi8(_mm_set1_epi8((char)0xBC), upper)), _mm_and_si128(space,
+        _mm_set1_epi8((char)0x80)));
+    // 0x21-0x5F map to 0x81-0xBF and 0x60-0x7E to 0x80-0x9E; the space
+    // lands on 0x80 as well.
+    const __m128i trail = _mm_sub_epi8(_mm_add_epi8(v, _mm_set1_epi8(0x60)),
+        _mm_and_si128(upper, _mm_set1_epi8(0x40)));
+    const shuffle_tables& tables = shuffles();
+    for (int k = 0; k < 3; k++)
+    {
+      __m128i out = _mm_shuffle_epi8(lead, _mm_loadu_si128((const __m128i *)tables.spread[k][0]));
+      out = _mm_or_si128(out, _mm_shuffle_epi8(mid,
+          _mm_loadu_si128((const __m128i *)tables.spread[k][1])));
+      out = _mm_or_si128(out, _mm_shuffle_epi8(trail,
+          _mm_loadu_si128((const __m128i *)tables.spread[k][2])));
+      _mm_storeu_si128((__m128i *)(dest + 16 * k), out);
+    }
+  }
+  #endif
+
+  #ifdef STRINGUTILS_HAVE_SSE2
+  // Mark the bytes of the block that may start a full-width form: EF
+  // followed by BC or BD, E3 followed by 80, and either lead at the end.
+  static inline unsigned int fullwidth_leads(__m128i v) noexcept
+  {
+    const unsigned int ef = (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xEF)));
+    const unsigned int e3 = (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xE3)));
+    const unsigned int bc = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_and_si128(v, _mm_set1_epi8((char)0xFE)), _mm_set1_epi8((char)0xBC)));
+    const unsigned int x80 = (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x80)));
+    return (ef & (bc >> 1)) | (e3 & (x80 >> 1)) | ((ef | e3) & 0x8000);
+  }
+  #endif
+}
+
 /**
  * Return the number of unicode code points in an array.
  * 
@@ -1259,7 +1778,7 @@ static inline _CodeT utf8_decode(const char* str, width_type num_bytes) noexcept
   _CodeT cp = (unsigned char)*str;
   if (num_bytes > 1) 
   {
-    cp &= 0x7F >> num_bytes;
+    cp &= num_bytes < 8 ? 0x7F >> num_bytes : 0;
     for (width_type i = 1; i < num_bytes; i++)
       cp = (cp << 6) | ((unsigned char)str[i] & 0x3F);
   }
@@ -1327,6 +1846,56 @@ static inline width_type utf8_encode(_CodeT cp, char* dest) noexcept
   return num_bytes;
 }
 
+/**
+ * Encode the unicode code point to utf16 code units and return the number of 
+ * units used. Code points above U+10FFFF are replaced by U+FFFD.
+ *
+ * @param cp      unicode code point
+ * @param dest    buffer of at least 2 code units
+ * @return        number of code units used
+ */
+template <typename _CodeT>
+static inline width_type utf16_encode(char32_t cp, _CodeT* dest) noexcept
+{
+  if (cp < 0x10000)
+  {
+    dest[0] = _CodeT(cp);
+    return 1;
+  }
+  if (cp > 0x10FFFF)
+  {
+    dest[0] = _CodeT(0xFFFD);
+    return 1;
+  }
+  cp -= 0x10000;
+  dest[0] = _CodeT(0xD800 + (cp >> 10));
+  dest[1] = _CodeT(0xDC00 + (cp & 0x3FF));
+  return 2;
+}
+
+/**
+ * Decode the first code point of utf16 code units and return the number of 
+ * units it used. Unpaired surrogates are returned as they are.
+ *
+ * @param str     utf16 code units
+ * @param dest    unicode code point
+ * @param len     number of code units left
+ * @return        number of code units used
+ */
+template <typename _CodeT>
+static inline width_type utf16_decode(const _CodeT* str, char32_t& dest,
+    size_t len) noexcept
+{
+  const char32_t hi = (char32_t)str[0];
+  if ((hi & 0xFC00) == 0xD800 && len > 1 && ((char32_t)str[1] & 0xFC00) == 0xDC00)
+  {
+    dest = 0x10000 + ((hi - 0xD800) << 10) + ((char32_t)str[1] - 0xDC00);
+    return 2;
+  }
+  dest = hi;
+  return 1;
+}
+
 /**
  * Return the number of characters in the C string.
  *
@@ -1336,13 +1905,14 @@ static inline width_type utf8_encode(_CodeT cp, char* dest) noexcept
  */
 inline size_t get_characters_number(const char* str, size_t len) noexcept
 {
-  size_t cur_bytes = 0, cur_index = 0;
-  while (cur_bytes < len) 
-  {
-    cur_bytes += get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
-    cur_index ++;
-  }
-  return cur_index;
+  // Every character starts at the first byte or at a byte which is not a
+  // continuation byte, see get_num_bytes_of_utf8_char.
+  if (len == 0)
+    return 0;
+  size_t count = len - simd_detail::count_continuation_bytes(str, len);
+  if (((unsigned char)str[0] & 0xC0) == 0x80)
+    count++;
+  return count;
 }
 
 inline size_t get_characters_number(const std::string& str) noexcept
@@ -1354,103 +1924,464 @@ inline size_t get_characters_number(std::string_view str) noexcept
 #endif
 
 /**
- * Check for valid UTF16 string.
- *  
- * @param str   C string
- * @param len   length of C string
- * @return      an unsigned integer
+ * Return the number of terminal columns taken by the unicode code point:
+ * 0 for control, combining and format characters, 2 for East Asian wide
+ * and full-width characters, 1 otherwise.
+ *
+ * @param cp      unicode code point
+ * @return        0, 1 or 2
  */
-inline size_t check_utf16_is_valid(const char* str, size_t len) noexcept
+inline unsigned int char_width(char32_t cp) noexcept
 {
-  size_t cur_index = 0, cur_bytes = 0;
-  width_type num_bytes;
-  while (cur_bytes < len)
+  if (cp >= 0x110000)
+    return 1;
+  const unsigned int block = table_detail::width_index()[cp >> 8];
+  return (table_detail::width_blocks()[block * 64 + (cp & 0xFF) / 4] >> (2 * (cp & 3))) & 3;
+}
+
+/**
+ * Return the display width of the utf8 string in terminal columns, see
+ * char_width. Ascii runs are measured 16 bytes at a time.
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @return        number of columns
+ */
+inline size_t display_width(const char* str, size_t len) noexcept
+{
+  size_t width = 0, i = 0;
+  char32_t cp;
+  while (i < len)
   {
-    num_bytes = get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
-    if (num_bytes > 3)
-      return cur_bytes;
-    cur_bytes += num_bytes;
-    cur_index ++;
+    if (!((unsigned char)str[i] & 0x80))
+    {
+      i += simd_detail::ascii_width(str + i, len - i, width);
+      continue;
+    }
+    i += utf8_decode(str + i, cp, len - i);
+    width += char_width(cp);
   }
-  return cur_bytes;
+  return width;
 }
 
-inline size_t check_utf16_is_valid(const std::string& str) noexcept
-{ return check_utf16_is_valid(str.c_str(), str.size()); }
+inline size_t display_width(const std::string& str) noexcept
+{ return display_width(str.data(), str.size()); }
 
 #if STRINGUTILS_CPLUSPLUS >= 201703L
-inline size_t check_utf16_is_valid(std::string_view str) noexcept
-{ return check_utf16_is_valid(str.data(), str.size()); }
+inline size_t display_width(std::string_view str) noexcept
+{ return display_width(str.data(), str.size()); }
 #endif
 
-template <typename _CodeT>
-inline void decode(const char* str, size_t len, std::vector<_CodeT>& codepoints)
+/**
+ * Return the number of bytes of the longest prefix of the utf8 string that
+ * fits in the given number of columns. Characters are never split, and
+ * zero-width characters after the last one that fits are kept with it.
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @param width   number of columns
+ * @return        number of bytes of the prefix
+ */
+inline size_t truncate_to_width(const char* str, size_t len, size_t width) noexcept
 {
-  _CodeT cp;
-  width_type num_bytes;
-  size_t cur_bytes = 0;
-  codepoints.reserve(len + 1);
-  while (cur_bytes < len)
+  size_t used = 0, i = 0;
+  char32_t cp;
+  while (i < len)
   {
-    num_bytes = utf8_decode(str + cur_bytes, cp, len - cur_bytes);
-    codepoints.emplace_back(cp);
-    cur_bytes += num_bytes;
+    if (!((unsigned char)str[i] & 0x80))
+    {
+      // An ascii run takes at most one column per byte.
+      const size_t n = simd_detail::ascii_prefix(str + i, len - i);
+      if (n <= width - used)
+      {
+        simd_detail::ascii_width(str + i, n, used);
+        i += n;
+        continue;
+      }
+      for (; i < len && !((unsigned char)str[i] & 0x80); i++)
+      {
+        const unsigned char c = (unsigned char)str[i];
+        const size_t w = c >= 0x20 && c != 0x7F;
+        if (used + w > width)
+          return i;
+        used += w;
+      }
+      continue;
+    }
+    const width_type n = utf8_decode(str + i, cp, len - i);
+    const unsigned int w = char_width(cp);
+    if (used + w > width)
+      return i;
+    used += w;
+    i += n;
   }
+  return len;
 }
 
-template <typename _CodeT>
-inline void decode(const std::string& str, std::vector<_CodeT>& codepoints)
-{ decode(str.c_str(), str.size(), codepoints); }
+inline std::string truncate_to_width(const std::string& str, size_t width)
+{ return str.substr(0, truncate_to_width(str.data(), str.size(), width)); }
 
 #if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline void decode(std::string_view str, std::vector<_CodeT>& codepoints)
-{ decode(str.data(), str.size(), codepoints); }
+inline std::string_view truncate_to_width(std::string_view str, size_t width) noexcept
+{ return str.substr(0, truncate_to_width(str.data(), str.size(), width)); }
 #endif
 
 /**
- * Need to pre-allocate memory:
- * codepoints = (_CodeT *)malloc((len + 1) * sizeof(_CodeT))
+ * Truncate the utf8 string to the given number of columns, ending it with
+ * the ellipsis when it is cut.
+ *
+ * @param str       the source string
+ * @param width     number of columns
+ * @param ellipsis  appended to a truncated string, e.g. "..."
+ * @return          a new string
  */
-template <typename _CodeT>
-inline size_t decode(const char* str, size_t len, _CodeT* codepoints)
+inline std::string truncate_to_width(const std::string& str, size_t width,
+    const std::string& ellipsis)
 {
-  _CodeT cp;
-  width_type num_bytes;
-  size_t cur_index = 0, cur_bytes = 0;
-  while (cur_bytes < len)
+  if (display_width(str) <= width)
+    return str;
+  const size_t ellipsis_width = display_width(ellipsis);
+  if (ellipsis_width > width)
+    return truncate_to_width(ellipsis, width);
+  return str.substr(0, truncate_to_width(str.data(), str.size(), width - ellipsis_width))
+      + ellipsis;
+}
+
+namespace width_detail {
+  // Pad the string to width columns with fill, putting left columns of the
+  // padding before it. Return the number of bytes written.
+  inline size_t pad(const char* str, size_t len, size_t width, char* dest, char fill,
+      size_t (*left)(size_t)) noexcept
   {
-    num_bytes = utf8_decode(str + cur_bytes, cp, len - cur_bytes);
-    codepoints[cur_index++] = cp;
-    cur_bytes += num_bytes;
+    const size_t w = display_width(str, len);
+    const size_t padding = w < width ? width - w : 0, before = left(padding);
+    memset(dest, fill, before);
+    memcpy(dest + before, str, len);
+    memset(dest + before + len, fill, padding - before);
+    return len + padding;
   }
-  codepoints[cur_index] = _CodeT(0);
-  return cur_index;
-}
 
-template <typename _CodeT>
-inline size_t decode(const std::string& str, _CodeT* codepoints)
-{ return decode(str.c_str(), str.size(), codepoints); }
+  inline size_t none(size_t) noexcept { return 0; }
+  inline size_t all(size_t n) noexcept { return n; }
+  inline size_t half(size_t n) noexcept { return n / 2; }
+} // namespace width_detail
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline size_t decode(std::string_view str, _CodeT* codepoints)
-{ return decode(str.data(), str.size(), codepoints); }
+/**
+ * Pad the utf8 string on the right (ljust), on the left (rjust) or on both
+ * sides (center, the extra column going right) with the fill character up
+ * to the given number of columns. A wider string is copied unchanged.
+ * Need to pre-allocate memory: dest = (char *)malloc(len + width)
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @param width   number of columns
+ * @param dest    character buffer
+ * @param fill    ascii fill character
+ * @return        number of bytes written
+ */
+inline size_t ljust(const char* str, size_t len, size_t width, char* dest,
+    char fill = ' ') noexcept
+{ return width_detail::pad(str, len, width, dest, fill, width_detail::none); }
+
+inline size_t rjust(const char* str, size_t len, size_t width, char* dest,
+    char fill = ' ') noexcept
+{ return width_detail::pad(str, len, width, dest, fill, width_detail::all); }
+
+inline size_t center(const char* str, size_t len, size_t width, char* dest,
+    char fill = ' ') noexcept
+{ return width_detail::pad(str, len, width, dest, fill, width_detail::half); }
+
+inline std::string ljust(const std::string& str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(ljust(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
+
+inline std::string rjust(const std::string& str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(rjust(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
+
+inline std::string center(const std::string& str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(center(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string ljust(std::string_view str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(ljust(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
+
+inline std::string rjust(std::string_view str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(rjust(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
+
+inline std::string center(std::string_view str, size_t width, char fill = ' ')
+{
+  std::string result(str.size() + width, '\0');
+  result.resize(center(str.data(), str.size(), width, &result[0], fill));
+  return result;
+}
 #endif
 
-inline std::u16string to_u16string(const char* str, size_t len)
+/**
+ * Return the number of utf16 code units utf8_to_utf16 writes for the C
+ * string, invalid utf8 included.
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @return        number of utf16 code units
+ */
+inline size_t get_utf16_length(const char* str, size_t len) noexcept
+{
+  // A character takes a surrogate pair when it decodes to U+10000..U+10FFFF,
+  // which needs a group of at least four bytes. Such a group starts at the
+  // first byte or at a byte which is not a continuation byte.
+  size_t count = get_characters_number(str, len);
+  for (size_t cur = 0; cur + 3 < len; )
+  {
+    if (cur || ((unsigned char)str[0] & 0xC0) != 0x80)
+    {
+      cur = simd_detail::find_long_group(str, len, cur);
+      if (cur == len)
+        break;
+    }
+    const width_type num_bytes = get_num_bytes_of_utf8_char(str + cur, len - cur);
+    const char32_t cp = utf8_decode<char32_t>(str + cur, num_bytes);
+    count += cp >= 0x10000 && cp <= 0x10FFFF;
+    cur += num_bytes;
+  }
+  return count;
+}
+
+/**
+ * Decode the C string to utf16 code units (or to code points if _CodeT is
+ * wider), pairing surrogates for code points above U+FFFF.
+ * Need to pre-allocate memory: dest = (_CodeT *)malloc(len * sizeof(_CodeT))
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @param dest    code unit buffer
+ * @return        number of code units written
+ */
+template <typename _CodeT>
+inline size_t utf8_to_utf16(const char* str, size_t len, _CodeT* dest) noexcept
 {
-  char16_t cp;
+  size_t cur_bytes = 0, cur_index = 0;
   width_type num_bytes;
+  char32_t cp;
+  while (cur_bytes < len)
+  {
+    #ifdef STRINGUTILS_HAVE_SSE2
+    if ((sizeof(_CodeT) == 2 || sizeof(_CodeT) == 4) && cur_bytes + 16 <= len &&
+        (cur_bytes + 16 == len || ((unsigned char)str[cur_bytes + 16] & 0xC0) != 0x80))
+    {
+      // Ascii blocks are widened directly, unless a continuation byte after
+      // the block groups with its last byte.
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + cur_bytes));
+      if (!_mm_movemask_epi8(v))
+      {
+        simd_detail::widen_ascii(v, dest + cur_index);
+        cur_bytes += 16;
+        cur_index += 16;
+        continue;
+      }
+    }
+    #endif
+    num_bytes = get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
+    cp = utf8_decode<char32_t>(str + cur_bytes, num_bytes);
+    if (sizeof(_CodeT) != 2 || cp < 0x10000)
+      dest[cur_index++] = _CodeT(cp);
+    else
+      cur_index += utf16_encode(cp, dest + cur_index);
+    cur_bytes += num_bytes;
+  }
+  return cur_index;
+}
+
+/**
+ * Return the number of utf8 bytes of utf16 code units.
+ *
+ * @param str     utf16 code units
+ * @param n       number of code units
+ * @return        number of bytes
+ */
+template <typename _CodeT>
+inline size_t get_utf16_bytes(const _CodeT* str, size_t n) noexcept
+{
   size_t cur_bytes = 0;
-  std::u16string result;
-  result.reserve(len);
+  char32_t cp;
+  for (size_t i = 0; i < n; )
+  {
+    i += utf16_decode(str + i, cp, n - i);
+    cur_bytes += get_codepoint_bytes(cp);
+  }
+  return cur_bytes;
+}
+
+/**
+ * Encode utf16 code units to utf8, joining surrogate pairs.
+ * Need to pre-allocate memory: str = (char *)malloc(3 * n)
+ *
+ * @param codeunits   utf16 code units
+ * @param n           number of code units
+ * @param str         character buffer
+ * @return            number of bytes written
+ */
+template <typename _CodeT>
+inline size_t utf16_to_utf8(const _CodeT* codeunits, size_t n, char* str) noexcept
+{
+  size_t i = 0, cur_bytes = 0;
+  char32_t cp;
+  while (i < n)
+  {
+    #ifdef STRINGUTILS_HAVE_SSE2
+    if (sizeof(_CodeT) == 2 && i + 8 <= n)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(codeunits + i));
+      __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xFF80)),
+          _mm_setzero_si128());
+      if (_mm_movemask_epi8(ascii) == 0xFFFF)
+      {
+        _mm_storel_epi64((__m128i *)(str + cur_bytes), _mm_packus_epi16(v, v));
+        cur_bytes += 8;
+        i += 8;
+        continue;
+      }
+      // Blocks without surrogates skip the pairing logic.
+      __m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+          _mm_set1_epi16((short)0xD800));
+      if (!_mm_movemask_epi8(surrogate))
+      {
+        for (size_t end = i + 8; i < end; i++)
+          cur_bytes += utf8_encode((char32_t)codeunits[i], str + cur_bytes);
+        continue;
+      }
+    }
+    #endif
+    i += utf16_decode(codeunits + i, cp, n - i);
+    cur_bytes += utf8_encode(cp, str + cur_bytes);
+  }
+  return cur_bytes;
+}
+
+/**
+ * Check for valid UTF16 string.
+ *  
+ * @param str   C string
+ * @param len   length of C string
+ * @return      an unsigned integer
+ */
+inline size_t check_utf16_is_valid(const char* str, size_t len) noexcept
+{
+  size_t cur_index = 0, cur_bytes = 0;
+  width_type num_bytes;
+  while (cur_bytes < len)
+  {
+    num_bytes = get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
+    if (num_bytes > 3)
+      return cur_bytes;
+    cur_bytes += num_bytes;
+    cur_index ++;
+  }
+  return cur_bytes;
+}
+
+inline size_t check_utf16_is_valid(const std::string& str) noexcept
+{ return check_utf16_is_valid(str.c_str(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline size_t check_utf16_is_valid(std::string_view str) noexcept
+{ return check_utf16_is_valid(str.data(), str.size()); }
+#endif
+
+template <typename _CodeT>
+inline void decode(const char* str, size_t len, std::vector<_CodeT>& codepoints)
+{
+  if (sizeof(_CodeT) == 2)
+  {
+    // utf16 code units, with surrogate pairs above U+FFFF
+    size_t n = codepoints.size();
+    codepoints.resize(n + len);
+    codepoints.resize(n + utf8_to_utf16(str, len, codepoints.data() + n));
+    return;
+  }
+
+  _CodeT cp;
+  width_type num_bytes;
+  size_t cur_bytes = 0;
+  codepoints.reserve(len + 1);
   while (cur_bytes < len)
   {
     num_bytes = utf8_decode(str + cur_bytes, cp, len - cur_bytes);
-    result.push_back(cp);
+    codepoints.emplace_back(cp);
+    cur_bytes += num_bytes;
+  }
+}
+
+template <typename _CodeT>
+inline void decode(const std::string& str, std::vector<_CodeT>& codepoints)
+{ decode(str.c_str(), str.size(), codepoints); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline void decode(std::string_view str, std::vector<_CodeT>& codepoints)
+{ decode(str.data(), str.size(), codepoints); }
+#endif
+
+/**
+ * Need to pre-allocate memory:
+ * codepoints = (_CodeT *)malloc((len + 1) * sizeof(_CodeT))
+ */
+template <typename _CodeT>
+inline size_t decode(const char* str, size_t len, _CodeT* codepoints)
+{
+  if (sizeof(_CodeT) == 2)
+  {
+    size_t n = utf8_to_utf16(str, len, codepoints);
+    codepoints[n] = _CodeT(0);
+    return n;
+  }
+
+  _CodeT cp;
+  width_type num_bytes;
+  size_t cur_index = 0, cur_bytes = 0;
+  while (cur_bytes < len)
+  {
+    num_bytes = utf8_decode(str + cur_bytes, cp, len - cur_bytes);
+    codepoints[cur_index++] = cp;
     cur_bytes += num_bytes;
   }
+  codepoints[cur_index] = _CodeT(0);
+  return cur_index;
+}
+
+template <typename _CodeT>
+inline size_t decode(const std::string& str, _CodeT* codepoints)
+{ return decode(str.c_str(), str.size(), codepoints); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline size_t decode(std::string_view str, _CodeT* codepoints)
+{ return decode(str.data(), str.size(), codepoints); }
+#endif
+
+inline std::u16string to_u16string(const char* str, size_t len)
+{
+  std::u16string result(len, u'\0');
+  if (len)
+    result.resize(utf8_to_utf16(str, len, &result[0]));
   return result;
 }
 
@@ -1506,25 +2437,148 @@ inline std::u32string to_u32string(std::string_view str)
 { return to_u32string(str.data(), str.size()); }
 #endif
 
+/**
+ * Convert utf16 code units to utf32 code points, joining surrogate pairs.
+ * Need to pre-allocate memory: dest = (char32_t *)malloc(n * sizeof(char32_t))
+ *
+ * @param str     utf16 code units
+ * @param n       number of code units
+ * @param dest    code point buffer
+ * @return        number of code points written
+ */
+template <typename _UnitT, typename _CodeT>
+inline size_t utf16_to_utf32(const _UnitT* str, size_t n, _CodeT* dest) noexcept
+{
+  size_t i = 0, cur_index = 0;
+  char32_t cp;
+  while (i < n)
+  {
+    #ifdef STRINGUTILS_HAVE_SSE2
+    if (sizeof(_UnitT) == 2 && sizeof(_CodeT) == 4 && i + 8 <= n)
+    {
+      // Blocks without surrogates are zero extended directly.
+      __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+      __m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+          _mm_set1_epi16((short)0xD800));
+      if (!_mm_movemask_epi8(surrogate))
+      {
+        const __m128i zero = _mm_setzero_si128();
+        _mm_storeu_si128((__m128i *)(dest + cur_index), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128((__m128i *)(dest + cur_index + 4), _mm_unpackhi_epi16(v, zero));
+        i += 8;
+        cur_index += 8;
+        continue;
+      }
+    }
+    #endif
+    i += utf16_decode(str + i, cp, n - i);
+    dest[cur_index++] = _CodeT(cp);
+  }
+  return cur_index;
+}
+
+/**
+ * Convert utf32 code points to utf16 code units, splitting code points above
+ * U+FFFF into surrogate pairs.
+ * Need to pre-allocate memory: dest = (char16_t *)malloc(2 * n * sizeof(char16_t))
+ *
+ * @param str     utf32 code points
+ * @param n       number of code points
+ * @param dest    code unit buffer
+ * @return        number of code units written
+ */
+template <typename _CodeT, typename _UnitT>
+inline size_t utf32_to_utf16(const _CodeT* str, size_t n, _UnitT* dest) noexcept
+{
+  size_t i = 0, cur_index = 0;
+  while (i < n)
+  {
+    #ifdef STRINGUTILS_HAVE_SSE2
+    if (sizeof(_CodeT) == 4 && sizeof(_UnitT) == 2 && i + 8 <= n)
+    {
+      // Blocks within the BMP are narrowed directly.
+      __m128i lo = _mm_loadu_si128((const __m128i *)(str + i));
+      __m128i hi = _mm_loadu_si128((const __m128i *)(str + i + 4));
+      __m128i wide = _mm_or_si128(_mm_srli_epi32(lo, 16), _mm_srli_epi32(hi, 16));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(wide, _mm_setzero_si128())) == 0xFFFF)
+      {
+        lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+        hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+        _mm_storeu_si128((__m128i *)(dest + cur_index), _mm_packs_epi32(lo, hi));
+        i += 8;
+        cur_index += 8;
+        continue;
+      }
+    }
+    #endif
+    cur_index += utf16_encode((char32_t)str[i++], dest + cur_index);
+  }
+  return cur_index;
+}
+
+inline std::u32string to_u32string(const char16_t* str, size_t n)
+{
+  std::u32string result(n, U'\0');
+  if (n)
+    result.resize(utf16_to_utf32(str, n, &result[0]));
+  return result;
+}
+
+inline std::u16string to_u16string(const char32_t* str, size_t n)
+{
+  std::u16string result(2 * n, u'\0');
+  if (n)
+    result.resize(utf32_to_utf16(str, n, &result[0]));
+  return result;
+}
+
+/**
+ * Convert the utf16 string to utf32 string.
+ *
+ * @param str     the source utf16 string
+ * @return        the utf32 string
+ */
+inline std::u32string to_u32string(const std::u16string& str)
+{ return to_u32string(str.data(), str.size()); }
+
+/**
+ * Convert the utf32 string to utf16 string.
+ *
+ * @param str     the source utf32 string
+ * @return        the utf16 string
+ */
+inline std::u16string to_u16string(const std::u32string& str)
+{ return to_u16string(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::u32string to_u32string(std::u16string_view str)
+{ return to_u32string(str.data(), str.size()); }
+
+inline std::u16string to_u16string(std::u32string_view str)
+{ return to_u16string(str.data(), str.size()); }
+#endif
+
+template <typename _CodeT>
+inline size_t encode(const _CodeT* codepoints, size_t n, char* str) noexcept;
+
 template <typename _CodeT>
 inline std::string encode(const _CodeT* codepoints, size_t n)
 {
+  if (sizeof(_CodeT) == 2)
+  {
+    std::string result(get_utf16_bytes(codepoints, n), '\0');
+    if (n)
+      utf16_to_utf8(codepoints, n, &result[0]);
+    return result;
+  }
+
   size_t cur_bytes = 0;
   for (size_t i = 0; i < n; i++)
     cur_bytes += get_codepoint_bytes(codepoints[i]);
   
   std::string result(cur_bytes, '\0');
-  char* dest = (char *)malloc(8);
-  cur_bytes = 0;
-  width_type num_bytes;
-  for (size_t i = 0; i < n; i++)
-  {
-    num_bytes = utf8_encode(codepoints[i], dest);
-    for (size_t j = 0; j < num_bytes; j++)
-      result[cur_bytes + j] = dest[j];
-    cur_bytes += num_bytes;
-  }
-  free(dest);
+  if (n)
+    encode(codepoints, n, &result[0]);
   return result;
 }
 
@@ -1558,26 +2612,87 @@ inline std::string to_u8string(std::u32string_view str)
 
 // Need to pre-allocate memory for str.
 template <typename _CodeT>
-inline size_t encode(const _CodeT* codepoints, size_t n, char* str)
+inline size_t encode(const _CodeT* codepoints, size_t n, char* str) noexcept
 {
-  size_t cur_bytes = 0;
-  width_type num_bytes;
-  char* dest = (char *)malloc(8);
-  for (size_t i = 0; i < n; i++)
+  if (sizeof(_CodeT) == 2)
+    return utf16_to_utf8(codepoints, n, str);
+
+  size_t i = 0, cur_bytes = 0;
+  #ifdef STRINGUTILS_HAVE_SSE2
+  if (sizeof(_CodeT) == 4)
   {
-    num_bytes = utf8_encode(codepoints[i], dest);
-    for (size_t j = 0; j < num_bytes; j++)
-      str[cur_bytes + j] = dest[j];
-    cur_bytes += num_bytes;    
+    // Pack blocks of 8 ascii code points to 8 bytes.
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128i lo = _mm_loadu_si128((const __m128i *)(codepoints + i));
+      __m128i hi = _mm_loadu_si128((const __m128i *)(codepoints + i + 4));
+      __m128i high_bits = _mm_and_si128(_mm_or_si128(lo, hi), _mm_set1_epi32(~0x7F));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(high_bits, _mm_setzero_si128())) != 0xFFFF)
+        break;
+      __m128i v = _mm_packs_epi32(lo, hi);
+      _mm_storel_epi64((__m128i *)(str + cur_bytes), _mm_packus_epi16(v, v));
+      cur_bytes += 8;
+    }
   }
-  free(dest);
+  #endif
+  for (; i < n; i++)
+    cur_bytes += utf8_encode(codepoints[i], str + cur_bytes);
   return cur_bytes;
 }
 
 template <typename _CodeT>
-inline size_t encode(const _CodeT* codepoints, char* str)
+inline size_t encode(const _CodeT* codepoints, char* str) noexcept
 { return encode(codepoints, codelen(codepoints), str); }
 
+/**
+ * Encode code units to utf8 into a buffer of cap bytes. Only whole characters
+ * are written, a surrogate pair is never split.
+ *
+ * @param codepoints    utf16 or utf32 code units
+ * @param n             number of code units
+ * @param str           character buffer
+ * @param cap           size of the buffer
+ * @param consumed      number of code units encoded
+ * @return              number of bytes written
+ */
+template <typename _CodeT>
+inline size_t encode(const _CodeT* codepoints, size_t n, char* str, size_t cap,
+    size_t& consumed) noexcept
+{
+  // Encode blocks that fit even at the longest encoding of a code unit, then
+  // the last few characters one by one.
+  const size_t max_unit_bytes = sizeof(_CodeT) == 2 ? 3 : 7;
+  size_t i = 0, cur_bytes = 0;
+  for (;;)
+  {
+    size_t m = std::min(n - i, (cap - cur_bytes) / max_unit_bytes);
+    if (sizeof(_CodeT) == 2 && m && i + m < n &&
+        ((char32_t)codepoints[i + m - 1] & 0xFC00) == 0xD800)
+      m--;
+    if (m < 16)
+      break;
+    cur_bytes += encode(codepoints + i, m, str + cur_bytes);
+    i += m;
+  }
+  char32_t cp;
+  while (i < n)
+  {
+    width_type num_units = 1;
+    if (sizeof(_CodeT) == 2)
+      num_units = utf16_decode(codepoints + i, cp, n - i);
+    else
+      cp = (char32_t)codepoints[i];
+    width_type num_bytes = get_codepoint_bytes(cp);
+    if (num_bytes > cap - cur_bytes)
+      break;
+    utf8_encode(cp, str + cur_bytes, num_bytes);
+    cur_bytes += num_bytes;
+    i += num_units;
+  }
+  consumed = i;
+  return cur_bytes;
+}
+
 /**
  * Judge whether the first character of string is a Chinese character or not.
  *
@@ -1823,6 +2938,402 @@ inline size_t index2byte(std::string_view str, T* idx2byte)
 { return index2byte(str.data(), str.size(), idx2byte); }
 #endif
 
+/**
+ * Convert a batch of byte positions to character indices in one sweep of
+ * the string, counting characters between successive positions. The end
+ * of string maps to the number of characters, other positions which don't
+ * start a character to T(-1). Positions should be sorted ascending: a
+ * smaller position restarts the sweep from the beginning.
+ *
+ * @param str       C string
+ * @param len       length of C string
+ * @param bytes     byte positions
+ * @param n         number of positions
+ * @param indices   receives the character indices, may be bytes itself
+ */
+template <typename T>
+inline void byte2index(const char* str, size_t len, const T* bytes, size_t n,
+    T* indices) noexcept
+{
+  size_t cur_index = 0, cur_bytes = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    const size_t target = (size_t)bytes[i];
+    if (target > len)
+    {
+      indices[i] = T(-1);
+      continue;
+    }
+    if (target < cur_bytes)
+      cur_index = cur_bytes = 0;
+    if (cur_bytes == 0 && target > 0)
+    {
+      // The first byte starts a character even if it is a continuation byte.
+      cur_index = 1;
+      cur_bytes = 1;
+    }
+    if (target > cur_bytes)
+    {
+      const size_t num_bytes = target - cur_bytes;
+      cur_index += num_bytes - simd_detail::count_continuation_bytes(str + cur_bytes, num_bytes);
+      cur_bytes = target;
+    }
+    const bool is_start = target == 0 || target == len ||
+      ((unsigned char)str[target] & 0xC0) != 0x80;
+    indices[i] = is_start ? T(cur_index) : T(-1);
+  }
+}
+
+template <typename T>
+inline void byte2index(const std::string& str, const std::vector<T>& bytes,
+    std::vector<T>& indices)
+{
+  indices.resize(bytes.size());
+  byte2index(str.c_str(), str.size(), bytes.data(), bytes.size(), indices.data());
+}
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename T>
+inline void byte2index(std::string_view str, const std::vector<T>& bytes,
+    std::vector<T>& indices)
+{
+  indices.resize(bytes.size());
+  byte2index(str.data(), str.size(), bytes.data(), bytes.size(), indices.data());
+}
+#endif
+
+/**
+ * Convert a batch of character indices to byte positions in one sweep of
+ * the string, skipping whole blocks of characters between successive
+ * indices. The number of characters maps to the end of string, larger
+ * indices to T(-1). Indices should be sorted ascending: a smaller index
+ * restarts the sweep from the beginning.
+ *
+ * @param str       C string
+ * @param len       length of C string
+ * @param indices   character indices
+ * @param n         number of indices
+ * @param bytes     receives the byte positions, may be indices itself
+ */
+template <typename T>
+inline void index2byte(const char* str, size_t len, const T* indices, size_t n,
+    T* bytes) noexcept
+{
+  // cur_bytes is the start of character cur_index, or len.
+  size_t cur_index = 0, cur_bytes = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    const size_t target = (size_t)indices[i];
+    if (target < cur_index)
+      cur_index = cur_bytes = 0;
+    size_t count = target - cur_index;
+    if (count && cur_bytes < len)
+    {
+      // Skip the current character, which may start with a continuation
+      // byte at the beginning of string, then count leads up to the target.
+      size_t cur = cur_bytes + 1;
+      count--;
+      cur += simd_detail::skip_leads(str + cur, len - cur, count);
+      for (; cur < len; cur++)
+      {
+        if (((unsigned char)str[cur] & 0xC0) != 0x80)
+        {
+          if (!count)
+            break;
+          count--;
+        }
+      }
+      cur_bytes = cur;
+    }
+    if (count)
+    {
+      bytes[i] = T(-1);
+      cur_index = cur_bytes = 0;
+      continue;
+    }
+    cur_index = target;
+    bytes[i] = T(cur_bytes);
+  }
+}
+
+template <typename T>
+inline void index2byte(const std::string& str, const std::vector<T>& indices,
+    std::vector<T>& bytes)
+{
+  bytes.resize(indices.size());
+  index2byte(str.c_str(), str.size(), indices.data(), indices.size(), bytes.data());
+}
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename T>
+inline void index2byte(std::string_view str, const std::vector<T>& indices,
+    std::vector<T>& bytes)
+{
+  bytes.resize(indices.size());
+  index2byte(str.data(), str.size(), indices.data(), indices.size(), bytes.data());
+}
+#endif
+
+/**
+ * Return the start of the character containing the byte position, looking
+ * at most 3 bytes back. A position in a run of more continuation bytes
+ * than any character has is returned unchanged.
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @param pos     byte position
+ * @return        the greatest character boundary not after pos
+ */
+inline size_t floor_char_boundary(const char* str, size_t len, size_t pos) noexcept
+{
+  if (pos >= len)
+    return len;
+  for (size_t k = 0; k < 4 && k <= pos; k++)
+    if (((unsigned char)str[pos - k] & 0xC0) != 0x80)
+      return pos - k;
+  return pos;
+}
+
+inline size_t floor_char_boundary(const std::string& str, size_t pos) noexcept
+{ return floor_char_boundary(str.data(), str.size(), pos); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline size_t floor_char_boundary(std::string_view str, size_t pos) noexcept
+{ return floor_char_boundary(str.data(), str.size(), pos); }
+#endif
+
+/**
+ * Return the end of the character containing the byte position, looking
+ * at most 3 bytes ahead.
+ *
+ * @param str     C string
+ * @param len     length of C string
+ * @param pos     byte position
+ * @return        the least character boundary not before pos
+ */
+inline size_t ceil_char_boundary(const char* str, size_t len, size_t pos) noexcept
+{
+  if (pos >= len)
+    return len;
+  for (size_t k = 0; k < 4 && pos + k <= len; k++)
+    if (pos + k == len || ((unsigned char)str[pos + k] & 0xC0) != 0x80)
+      return pos + k;
+  return pos;
+}
+
+inline size_t ceil_char_boundary(const std::string& str, size_t pos) noexcept
+{ return ceil_char_boundary(str.data(), str.size(), pos); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline size_t ceil_char_boundary(std::string_view str, size_t pos) noexcept
+{ return ceil_char_boundary(str.data(), str.size(), pos); }
+#endif
+
+/**
+ * Return the length of the longest prefix of at most max_bytes bytes that
+ * doesn't split a character, in constant time.
+ *
+ * @param str         C string
+ * @param len         length of C string
+ * @param max_bytes   maximum number of bytes
+ * @return            length of the prefix
+ */
+inline size_t truncate_bytes(const char* str, size_t len, size_t max_bytes) noexcept
+{ return floor_char_boundary(str, len, max_bytes); }
+
+inline std::string truncate_bytes(const std::string& str, size_t max_bytes)
+{ return str.substr(0, truncate_bytes(str.data(), str.size(), max_bytes)); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string_view truncate_bytes(std::string_view str, size_t max_bytes) noexcept
+{ return str.substr(0, truncate_bytes(str.data(), str.size(), max_bytes)); }
+#endif
+
+/**
+ * Truncate every field of a column to at most max_bytes bytes without
+ * splitting characters. Field i is data[offsets[i], offsets[i + 1]).
+ *
+ * @param data        bytes of the column
+ * @param offsets     n + 1 field offsets
+ * @param n           number of fields
+ * @param max_bytes   maximum number of bytes
+ * @param lens        receives the truncated length of every field
+ */
+template <typename T>
+inline void truncate_bytes(const char* data, const T* offsets, size_t n, size_t max_bytes,
+    T* lens) noexcept
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    const size_t len = (size_t)(offsets[i + 1] - offsets[i]);
+    lens[i] = len <= max_bytes ? T(len) : T(floor_char_boundary(data + offsets[i], len, max_bytes));
+  }
+}
+
+// Truncate every string of the column in place.
+inline void truncate_bytes(std::vector<std::string>& column, size_t max_bytes)
+{
+  for (std::string& str : column)
+    if (str.size() > max_bytes)
+      str.resize(floor_char_boundary(str.data(), str.size(), max_bytes));
+}
+
+/**
+ * Mapping between character index and byte position in about 0.2 bytes
+ * per byte of string, instead of the dense idx2byte and byte2idx arrays:
+ * a bitmap of the bytes starting characters with the rank of every 512
+ * byte block and of every 64-bit word within its block, and the block of
+ * every 512th character to start select.
+ */
+class char_index_map
+{
+  public:
+    using size_type = size_t;
+
+    char_index_map()
+    : _M_len(0), _M_blocks(1, 0) { }
+
+    char_index_map(const char* __str, size_type __len)
+    { assign(__str, __len); }
+
+    explicit
+    char_index_map(const std::string& __str)
+    { assign(__str.data(), __str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    explicit
+    char_index_map(std::string_view __str)
+    { assign(__str.data(), __str.size()); }
+#endif
+
+    // Build the map of the string, 64 bytes at a time.
+    void
+    assign(const char* __str, size_type __len)
+    {
+      const size_type __nwords = (__len + 63) / 64;
+      _M_len = __len;
+      _M_bits.resize(__nwords);
+      _M_ranks.resize(__nwords);
+      _M_blocks.assign(1, 0);
+      _M_samples.clear();
+      size_type __count = 0, __base = 0;
+      for (size_type __w = 0; __w < __nwords; __w++)
+      {
+        if (__w && !(__w & 7))
+        {
+          _M_blocks.push_back(__count);
+          __base = __count;
+        }
+        const size_type __cur = __w * 64;
+        std::uint64_t __bits = simd_detail::lead_bits(__str + __cur,
+          std::min<size_type>(64, __len - __cur));
+        // The first byte starts a character even if it is a continuation byte.
+        if (!__w)
+          __bits |= 1;
+        _M_bits[__w] = __bits;
+        _M_ranks[__w] = std::uint16_t(__count - __base);
+        const size_type __next = __count + simd_detail::popcount(__bits);
+        for (size_type __k = (__count + 511) / 512 * 512; __k < __next; __k += 512)
+          _M_samples.push_back(__w >> 3);
+        __count = __next;
+      }
+      _M_blocks.push_back(__count);
+      _M_samples.push_back(_M_blocks.size() - 2);
+    }
+
+    void
+    assign(const std::string& __str)
+    { assign(__str.data(), __str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    void
+    assign(std::string_view __str)
+    { assign(__str.data(), __str.size()); }
+#endif
+
+    // Number of characters.
+    size_type
+    size() const noexcept
+    { return _M_blocks.back(); }
+
+    // Number of bytes of the string.
+    size_type
+    bytes() const noexcept
+    { return _M_len; }
+
+    // Bytes used by the map.
+    size_type
+    memory_usage() const noexcept
+    {
+      return _M_bits.size() * sizeof(std::uint64_t) + _M_ranks.size() * sizeof(std::uint16_t)
+        + (_M_blocks.size() + _M_samples.size()) * sizeof(size_type);
+    }
+
+    /**
+     * @brief Return the character index starting at byte position
+     * @a __bytes, or npos if no character starts there, like byte2idx.
+     */
+    size_type
+    byte2index(size_type __bytes) const noexcept
+    {
+      if (__bytes >= _M_len)
+        return npos;
+      const std::uint64_t __bits = _M_bits[__bytes >> 6];
+      const std::uint64_t __bit = std::uint64_t(1) << (__bytes & 63);
+      if (!(__bits & __bit))
+        return npos;
+      return _M_blocks[__bytes >> 9] + _M_ranks[__bytes >> 6]
+        + simd_detail::popcount(__bits & (__bit - 1));
+    }
+
+    /**
+     * @brief Return the byte position of character @a __index, or npos
+     * past the last character, like idx2byte.
+     */
+    size_type
+    index2byte(size_type __index) const noexcept
+    {
+      if (__index >= size())
+        return npos;
+      // Last block starting at or before the character, between the samples.
+      size_type __lo = _M_samples[__index >> 9], __hi = _M_samples[(__index >> 9) + 1];
+      while (__lo < __hi)
+      {
+        const size_type __mid = (__lo + __hi + 1) / 2;
+        if (_M_blocks[__mid] <= __index)
+          __lo = __mid;
+        else
+          __hi = __mid - 1;
+      }
+      size_type __rank = __index - _M_blocks[__lo];
+      size_type __w = __lo * 8;
+      const size_type __end = std::min<size_type>(__w + 8, _M_bits.size());
+      while (__w + 1 < __end && _M_ranks[__w + 1] <= __rank)
+        __w++;
+      std::uint64_t __bits = _M_bits[__w];
+      for (__rank -= _M_ranks[__w]; __rank; __rank--)
+        __bits &= __bits - 1;
+      return __w * 64 + simd_detail::popcount((__bits & (0 - __bits)) - 1);
+    }
+
+    void
+    clear()
+    {
+      _M_len = 0;
+      _M_bits.clear();
+      _M_ranks.clear();
+      _M_blocks.assign(1, 0);
+      _M_samples.clear();
+    }
+
+  private:
+    size_type _M_len;
+    std::vector<std::uint64_t> _M_bits;
+    std::vector<std::uint16_t> _M_ranks;
+    std::vector<size_type> _M_blocks;
+    std::vector<size_type> _M_samples;
+};
+
 /**
  * Decode the string to a list of unicode code points, and build the mapping between 
  * character index and byte position.
@@ -1906,6 +3417,64 @@ inline size_t decode_and_build_map(std::string_view str,
 { return decode_and_build_map(str.data(), str.size(), codepoints, idx2byte, byte2idx); }
 #endif
 
+/**
+ * Decode the string to a list of unicode code points, and build the compact
+ * mapping between character index and byte position.
+ *
+ * @param str           C string
+ * @param len           length of C string
+ * @param codepoints    a list of unicode code points
+ * @param map           the mapping between character index and byte position
+ */
+template <typename _CodeT>
+inline void decode_and_build_map(const char* str, size_t len,
+    std::vector<_CodeT>& codepoints, char_index_map& map)
+{
+  map.assign(str, len);
+  codepoints.reserve(codepoints.size() + map.size() + 1);
+  size_t cur_bytes = 0;
+  width_type num_bytes;
+  while (cur_bytes < len)
+  {
+    num_bytes = get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
+    codepoints.emplace_back(utf8_decode<_CodeT>(str + cur_bytes, num_bytes));
+    cur_bytes += num_bytes;
+  }
+}
+
+/**
+ * Need to pre-allocate memory:
+ * codepoints = (_CodeT *)malloc((len + 1) * sizeof(_CodeT))
+ */
+template <typename _CodeT>
+inline size_t decode_and_build_map(const char* str, size_t len,
+    _CodeT* codepoints, char_index_map& map)
+{
+  map.assign(str, len);
+  size_t cur_index = 0, cur_bytes = 0;
+  width_type num_bytes;
+  while (cur_bytes < len)
+  {
+    num_bytes = get_num_bytes_of_utf8_char(str + cur_bytes, len - cur_bytes);
+    codepoints[cur_index++] = utf8_decode<_CodeT>(str + cur_bytes, num_bytes);
+    cur_bytes += num_bytes;
+  }
+  codepoints[cur_index] = _CodeT(0);
+  return cur_index;
+}
+
+template <typename _CodeT>
+inline void decode_and_build_map(const std::string& str, std::vector<_CodeT>& codepoints,
+    char_index_map& map)
+{ decode_and_build_map(str.c_str(), str.size(), codepoints, map); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline void decode_and_build_map(std::string_view str, std::vector<_CodeT>& codepoints,
+    char_index_map& map)
+{ decode_and_build_map(str.data(), str.size(), codepoints, map); }
+#endif
+
 /**
  * Return unicode code point at the specific character index.
  *
@@ -2035,1914 +3604,8479 @@ inline std::string_view substr(std::string_view str, size_t index, size_t n) noe
 }
 #endif
 
-// Base class for unicode string
-template <typename _CodeT>
-class ustring
-{
-  public:
-    // member types
-    using size_type                   = size_t;
-    using pointer                     = _CodeT*;
-    using const_pointer               = const _CodeT*;
-    using reference                   = _CodeT&;
-    using const_reference             = const _CodeT&;
-    using iterator                    = __gnu_cxx::__normal_iterator<pointer, ustring>;
-    using const_iterator              = __gnu_cxx::__normal_iterator<const_pointer, ustring>;
-    using reverse_iterator            = std::reverse_iterator<iterator>;
-    using const_reverse_iterator      = std::reverse_iterator<const_iterator>;
-    
-    // member constants
-    static const size_t max_size = npos >> 2;
+// Legacy multibyte encodings. The code point tables are generated by
+// tools/gen_tables.py into stringutils_tables.h; the encode direction is
+// built from them at first use.
+namespace mb_detail {
+  // Double-byte table: the code point of (row, col) is
+  // cells[(rows[row - row_min] - 1) * width + col - col_min] when
+  // rows[row - row_min] is not 0. Unmapped cells hold 0.
+  struct dbcs_table
+  {
+    unsigned int          row_min, row_max, col_min, col_max;
+    const std::uint16_t*  rows;
+    const std::uint16_t*  cells;
 
-  private:
-    void 
-    _M_capacity(size_type __capacity)
-    { _M_allocated_capacity = __capacity; }
-    
-    void 
-    _M_length(size_type __n)
-    { _M_len = __n; }
-
-    void
-    _M_set_length(size_type __n)
+    char32_t
+    decode(unsigned int row, unsigned int col) const noexcept
     {
-      _M_length(__n);
-      _M_ptr[__n] = _CodeT(0);
-    }
-    
-    void 
-    _M_allocator(size_type __capacity)
-    { 
-      _M_ptr = (_CodeT *)malloc((__capacity + 1) * sizeof(_CodeT));
-      if (!_M_ptr)
-        std::__throw_bad_alloc();
-    }
-    
-    void
-    _M_destroy()
-    { free(_M_ptr); }
-    
-    void
-    _M_realloc(size_type __n)
-    { 
-      pointer __tmp = (_CodeT *)realloc(_M_ptr, (__n + 1) * sizeof(_CodeT));
-      if (__n && !__tmp)
-        std::__throw_bad_alloc();
-      _M_data(__tmp);
+      if (row < row_min || row > row_max || col < col_min || col > col_max)
+        return 0;
+      const unsigned int r = rows[row - row_min];
+      return r ? cells[(r - 1) * (col_max - col_min + 1) + col - col_min] : 0;
     }
 
-    void
-    _M_data(pointer __p)
-    { _M_ptr = __p; }
-    
-    void
-    _M_erase(size_type __pos, size_type __n)
+    // Map every BMP code point to row << 8 | col, 0 if unmapped. The first
+    // (row, col) wins when several map to the same code point.
+    std::vector<std::uint16_t>
+    inverse() const
     {
-      const size_type __how_much = _M_len - __pos - __n;
-      
-      if (__how_much && __n)
-        _S_move(_M_ptr + __pos, _M_ptr + __pos + __n, __how_much);
-      
-      _M_set_length(_M_len - __n);
+      std::vector<std::uint16_t> map(0x10000, 0);
+      for (unsigned int row = row_max + 1; row-- > row_min; )
+        for (unsigned int col = col_max + 1; col-- > col_min; )
+        {
+          char32_t cp = decode(row, col);
+          if (cp)
+            map[cp] = (std::uint16_t)(row << 8 | col);
+        }
+      return map;
     }
+  };
 
-    void 
-    _M_construct(const char* __str, size_type __n)
+  static const char32_t replacement = 0xFFFD;
+
+  inline const dbcs_table& gb18030_table() noexcept
+  {
+    static const dbcs_table table = { 0x81, 0xFE, 0x40, 0xFE,
+      table_detail::gb18030_rows(), table_detail::gb18030_cells() };
+    return table;
+  }
+
+  inline const dbcs_table& big5_table() noexcept
+  {
+    static const dbcs_table table = { 0x81, 0xFE, 0x40, 0xFE,
+      table_detail::big5_rows(), table_detail::big5_cells() };
+    return table;
+  }
+
+  // jis0208 and jis0212 are indexed by row (ku) and column (ten), 1-based.
+  inline const dbcs_table& jis0208_table() noexcept
+  {
+    static const dbcs_table table = { 1, 120, 1, 94,
+      table_detail::jis0208_rows(), table_detail::jis0208_cells() };
+    return table;
+  }
+
+  inline const dbcs_table& jis0212_table() noexcept
+  {
+    static const dbcs_table table = { 1, 94, 1, 94,
+      table_detail::jis0212_rows(), table_detail::jis0212_cells() };
+    return table;
+  }
+
+  inline const std::uint16_t* gb18030_inverse()
+  {
+    static const std::vector<std::uint16_t> map = gb18030_table().inverse();
+    return map.data();
+  }
+
+  // Linear index of the four-byte sequence b1 b2 b3 b4.
+  inline std::uint32_t gb18030_linear(const unsigned char* s) noexcept
+  { return (((s[0] - 0x81) * 10u + (s[1] - 0x30)) * 126u + (s[2] - 0x81)) * 10u + (s[3] - 0x30); }
+
+  // Code point of the four-byte sequence, 0 if it is unassigned.
+  inline char32_t gb18030_decode_four(std::uint32_t linear) noexcept
+  {
+    static const size_t nranges = 206;
+    if (linear < 39420)
     {
-      _M_capacity(__n << 1);
-      _M_allocator(_M_allocated_capacity);
-      _M_set_length(_M_assign(_M_ptr, __str, __n));
+      // Last run starting at or before linear.
+      const std::uint32_t* ranges = table_detail::gb18030_ranges();
+      size_t lo = 0, hi = nranges;
+      while (lo + 1 < hi)
+      {
+        size_t mid = (lo + hi) >> 1;
+        if (ranges[mid * 2] <= linear)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      char32_t cp = ranges[lo * 2 + 1] + (linear - ranges[lo * 2]);
+      return cp >= 0xD800 && cp <= 0xDFFF ? 0 : cp;
     }
-    
-    void
-    _M_construct(const _CodeT* __arr, size_type __n)
+    if (linear >= 189000 && linear < 189000 + 0x100000)
+      return 0x10000 + (linear - 189000);
+    return 0;
+  }
+
+  // Encode cp outside the two-byte table as a four-byte sequence.
+  inline width_type gb18030_encode_four(char32_t cp, char* dest) noexcept
+  {
+    std::uint32_t linear;
+    if (cp >= 0x10000)
+      linear = cp - 0x10000 + 189000;
+    else
     {
-      _M_capacity(__n << 1);
-      _M_allocator(_M_allocated_capacity);
-      if (__n)
-        _M_assign(_M_ptr, __arr, __n);
-      _M_set_length(__n);
+      static const size_t nranges = 206;
+      const std::uint32_t* ranges = table_detail::gb18030_ranges();
+      size_t lo = 0, hi = nranges;
+      while (lo + 1 < hi)
+      {
+        size_t mid = (lo + hi) >> 1;
+        if (ranges[mid * 2 + 1] <= cp)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      linear = ranges[lo * 2] + (cp - ranges[lo * 2 + 1]);
     }
-    
-    template<typename _InIterator>
-      void 
-      _M_construct(_InIterator __beg, _InIterator __end)
+    dest[3] = char(0x30 + linear % 10); linear /= 10;
+    dest[2] = char(0x81 + linear % 126); linear /= 126;
+    dest[1] = char(0x30 + linear % 10);
+    dest[0] = char(0x81 + linear / 10);
+    return 4;
+  }
+
+  // Output of the decoder loop: utf8 bytes.
+  struct utf8_sink
+  {
+    char* dest;
+
+    void ascii(const char* str, size_t n) noexcept
     {
-      const size_type __n = __beg < __end ? __end - __beg : 0;
-      _M_capacity(__n << 1);
-      _M_allocator(_M_allocated_capacity);
-      
-      for (size_type __i = 0; __i < __n; __i++)
-        _M_ptr[__i] = *(__beg + __i);
-      _M_set_length(__n);
+      memcpy(dest, str, n);
+      dest += n;
     }
-    
-    size_type
-    _M_assign(_CodeT* __d, const char* __s, size_type __n)
+
+    void put(char32_t cp) noexcept
+    { dest += utf8_encode(cp, dest); }
+
+    #ifdef STRINGUTILS_HAVE_SSE2
+    // 8 code units without surrogates.
+    void block(__m128i v) noexcept
     {
-      size_type __cur = 0, __idx = 0;
-      width_type __num_bytes;
-      while (__cur < __n)
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xFF80)),
+          _mm_setzero_si128())) == 0xFFFF)
       {
-        __num_bytes = get_num_bytes_of_utf8_char(__s + __cur, __n - __cur);
-        __d[__idx ++] = utf8_decode<_CodeT>(__s + __cur, __num_bytes);
-        __cur += __num_bytes;
+        _mm_storel_epi64((__m128i *)dest, _mm_packus_epi16(v, v));
+        dest += 8;
+        return;
       }
-      return __idx;
+      std::uint16_t units[8];
+      _mm_storeu_si128((__m128i *)units, v);
+      for (int k = 0; k < 8; k++)
+        put(units[k]);
     }
-    
-    void
-    _M_assign(_CodeT* __d, size_type __n, _CodeT __c)
+    #endif
+  };
+
+  // Output of the decoder loop: utf16 code units, or code points if _CodeT
+  // is wider.
+  template <typename _CodeT>
+  struct unit_sink
+  {
+    _CodeT* dest;
+
+    void ascii(const char* str, size_t n) noexcept
+    { dest += utf8_to_utf16(str, n, dest); }
+
+    void put(char32_t cp) noexcept
     {
-      if (__n == 1)
-        *__d = __c;
+      if (sizeof(_CodeT) != 2 || cp < 0x10000)
+        *dest++ = _CodeT(cp);
       else
-        memset(__d, __c, __n * sizeof(_CodeT));
+        dest += utf16_encode(cp, dest);
     }
-    
-    void
-    _M_assign(_CodeT* __d, const _CodeT* __s, size_type __n)
+
+    #ifdef STRINGUTILS_HAVE_SSE2
+    // 8 code units without surrogates.
+    void block(__m128i v) noexcept
     {
-      if (__n == 1)
-        *__d = *__s;
+      if (sizeof(_CodeT) == 2)
+        _mm_storeu_si128((__m128i *)dest, v);
       else
-        memcpy(__d, __s, __n * sizeof(_CodeT));
+      {
+        const __m128i zero = _mm_setzero_si128();
+        _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(v, zero));
+      }
+      dest += 8;
     }
-    
-    size_type
-    _M_check(size_type __pos, const char* __s) const
+    #endif
+  };
+
+  /**
+   * Decoder loop shared by the multibyte encodings. Ascii runs are copied
+   * through the SIMD ascii_prefix kernel, every other sequence goes through
+   * _Codec::step(s, len, cp), which decodes the sequence at s, of which len
+   * bytes are available, into cp and returns its length, or returns 0 when
+   * the sequence is cut by the end of the buffer. Invalid bytes decode to
+   * U+FFFD with length 1.
+   *
+   * @param str       encoded string
+   * @param len       length of str
+   * @param sink      output, see utf8_sink and unit_sink
+   * @param flush     whether a truncated sequence at the end is decoded as
+   *                  U+FFFD instead of being left for the next call
+   * @return          number of bytes of str decoded
+   */
+  template <typename _Codec, typename _Sink>
+  inline size_t decode(const char* str, size_t len, _Sink& sink, bool flush) noexcept
+  {
+    const unsigned char* s = (const unsigned char *)str;
+    size_t i = 0;
+    while (i < len)
     {
-      if (__pos > this->size())
+      if (s[i] < 0x80)
       {
-        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
-               "this->size() (which is %zu)"),
-           __s, __pos, this->size());
+        size_t n = simd_detail::ascii_prefix(str + i, len - i);
+        sink.ascii(str + i, n);
+        i += n;
+        continue;
       }
-      return __pos;
+      char32_t cp;
+      size_t n = _Codec::step(s + i, len - i, cp);
+      if (!n)
+      {
+        if (!flush)
+          break;
+        cp = replacement;
+        n = len - i;
+      }
+      sink.put(cp);
+      i += n;
     }
+    return i;
+  }
 
-    void
-    _M_check_length(size_type __n1, size_type __n2, const char* __s) const
+  // Decode the whole string to utf8 in a buffer of at least 3 * len bytes.
+  template <typename _Codec>
+  inline size_t decode_to_utf8(const char* str, size_t len, char* dest) noexcept
+  {
+    utf8_sink sink = { dest };
+    decode<_Codec>(str, len, sink, true);
+    return sink.dest - dest;
+  }
+
+  template <typename _Codec>
+  inline std::string decode_to_utf8(const char* str, size_t len)
+  {
+    std::string result(3 * len, '\0');
+    if (len)
+      result.resize(decode_to_utf8<_Codec>(str, len, &result[0]));
+    return result;
+  }
+
+  // A lead byte 0x81-0xFE followed by a byte of 0x40-0xFE, or by 0x30-0x39
+  // and two more bytes for the four-byte form.
+  struct gb18030_codec
+  {
+    static const size_t max_length = 4;
+
+    static size_t step(const unsigned char* s, size_t len, char32_t& cp) noexcept
     {
-      if (max_size - (this->size() - __n1) < __n2)
-        std::__throw_length_error(__N(__s));
+      cp = replacement;
+      if (s[0] < 0x81 || s[0] > 0xFE)
+        return 1;
+      if (len == 1)
+        return 0;
+      if (s[1] >= 0x30 && s[1] <= 0x39)
+      {
+        if (len == 2 || (len == 3 && s[2] >= 0x81 && s[2] <= 0xFE))
+          return 0;
+        char32_t c;
+        if (len >= 4 && s[2] >= 0x81 && s[2] <= 0xFE && s[3] >= 0x30 && s[3] <= 0x39 &&
+            (c = gb18030_decode_four(gb18030_linear(s))) != 0)
+        {
+          cp = c;
+          return 4;
+        }
+        return 1;
+      }
+      char32_t c = gb18030_table().decode(s[0], s[1]);
+      if (!c)
+        return 1;
+      cp = c;
+      return 2;
     }
-    
-    size_type
-    _M_limit(size_type __pos, size_type __off) const noexcept
+  };
+
+  // Big5 as extended by Windows code page 950 (ETEN extensions and the
+  // euro sign): a lead byte 0x81-0xFE followed by 0x40-0x7E or 0xA1-0xFE.
+  struct big5_codec
+  {
+    static const size_t max_length = 2;
+
+    static size_t step(const unsigned char* s, size_t len, char32_t& cp) noexcept
     {
-      const bool __testoff = __off < this->size() - __pos;
-      return __testoff ? __off : this->size() - __pos;
+      cp = replacement;
+      if (s[0] < 0x81 || s[0] > 0xFE)
+        return 1;
+      if (len == 1)
+        return 0;
+      char32_t c = big5_table().decode(s[0], s[1]);
+      if (!c)
+        return 1;
+      cp = c;
+      return 2;
     }
+  };
 
-    ustring&
-    _M_replace(size_type __pos, size_type __n1, const _CodeT* __arr,
-        size_type __n2)
+  // Shift_JIS as extended by Windows code page 932: 0xA1-0xDF are half-width
+  // katakana, a lead byte 0x81-0x9F or 0xE0-0xFC followed by 0x40-0xFC
+  // encodes two rows (ku) of jis0208.
+  struct shift_jis_codec
+  {
+    static const size_t max_length = 2;
+
+    static size_t step(const unsigned char* s, size_t len, char32_t& cp) noexcept
     {
-      _M_check_length(__n1, __n2, "ustring::_M_replace");
-      pointer __p = _M_ptr + __pos;
-      if (__n1 == __n2)
+      const unsigned int lead = s[0];
+      if (lead == 0x80)
       {
-        this->_S_copy(__p, __arr, __n2);
-        return *this;
+        cp = 0x80;
+        return 1;
       }
-      
-      const size_type __new_size = _M_len + __n2 - __n1;
-      if (__new_size > this->capacity())
-        this->reserve(__new_size);
-      this->_S_move(__p + __n2, __p + __n1, _M_len - __pos - __n1);
-      this->_S_copy(__p, __arr, __n2);
-      _M_set_length(__new_size);
-      return *this;
+      if (lead >= 0xA1 && lead <= 0xDF)
+      {
+        cp = 0xFF61 + (lead - 0xA1);
+        return 1;
+      }
+      cp = replacement;
+      if (lead == 0xA0 || lead > 0xFC)
+        return 1;
+      if (len == 1)
+        return 0;
+      const unsigned int trail = s[1];
+      if (trail < 0x40 || trail == 0x7F || trail > 0xFC)
+        return 1;
+      unsigned int ku = 2 * lead - (lead < 0xA0 ? 0x101 : 0x181), ten;
+      if (trail >= 0x9F)
+      {
+        ku++;
+        ten = trail - 0x9E;
+      }
+      else
+        ten = trail - (trail < 0x80 ? 0x3F : 0x40);
+      char32_t c = jis0208_table().decode(ku, ten);
+      if (!c)
+        return 1;
+      cp = c;
+      return 2;
     }
+  };
 
-    ustring&
-    _M_replace(size_type __pos, size_type __n1, size_type __n2, _CodeT __c)
+  // EUC-JP: jis0208 in two bytes 0xA1-0xFE, half-width katakana after 0x8E
+  // and jis0212 in three bytes after 0x8F.
+  struct euc_jp_codec
+  {
+    static const size_t max_length = 3;
+
+    static size_t step(const unsigned char* s, size_t len, char32_t& cp) noexcept
     {
-      _M_check_length(__n1, __n2, "ustring::_M_replace");
-      pointer __p = _M_ptr + __pos;
-      if (__n1 == __n2)
+      const unsigned int lead = s[0];
+      cp = replacement;
+      if (lead != 0x8E && lead != 0x8F && (lead < 0xA1 || lead > 0xFE))
+        return 1;
+      if (len == 1)
+        return 0;
+      const unsigned int b1 = s[1];
+      if (lead == 0x8E)
       {
-        this->_M_assign(__p, __n2, __c);
-        return *this;
+        if (b1 < 0xA1 || b1 > 0xDF)
+          return 1;
+        cp = 0xFF61 + (b1 - 0xA1);
+        return 2;
       }
-
-      const size_type __new_size = _M_len + __n2 - __n1;
-      if (__new_size > this->capacity())
-        this->reserve(__new_size);
-      this->_S_move(__p + __n2, __p + __n1, _M_len - __pos - __n1);
-      this->_M_assign(__p, __n2, __c);
-      _M_set_length(__new_size);
-      return *this;
+      // Out of range bytes wrap around and fall outside the tables.
+      char32_t c;
+      if (lead == 0x8F)
+      {
+        if (b1 < 0xA1 || b1 > 0xFE)
+          return 1;
+        if (len == 2)
+          return 0;
+        if (!(c = jis0212_table().decode(b1 - 0xA0, s[2] - 0xA0u)))
+          return 1;
+        cp = c;
+        return 3;
+      }
+      if (!(c = jis0208_table().decode(lead - 0xA0, b1 - 0xA0)))
+        return 1;
+      cp = c;
+      return 2;
     }
+  };
 
-    template <typename _InIterator>
-      ustring&
-      _M_replace(size_type __pos, size_type __n, 
-          _InIterator __k1, _InIterator __k2)
-      {
-        const size_type __size = __k1 < __k2 ? __k2 - __k1 : 0;
-        pointer __p = _M_ptr + __pos;
-        if (__n == __size)
-        {
-          for (size_type __i = 0; __i < __n; __i++)
-            __p[__i] = *(__k1 + __i);
-          return *this;
-        }
+  // Strict utf8: no overlong forms, surrogates or code points above
+  // U+10FFFF. The second byte is range checked so that a cut sequence is
+  // only reported when it can still become valid.
+  struct utf8_codec
+  {
+    static const size_t max_length = 4;
 
-        const size_type __new_size = _M_len + __size - __n;
-        if (__new_size > this->capacity())
-          this->reserve(__new_size);
-        this->_S_move(__p + __size, __p + __n, _M_len - __pos - __n);
-        for (size_type __i = 0; __i < __size; __i++)
-          __p[__i] = *(__k1 + __i);
-        _M_set_length(__new_size);
-        return *this;
-      }
-    
-    static void
-    _S_copy(_CodeT* __d, const _CodeT* __s, size_type __n)
+    static size_t step(const unsigned char* s, size_t len, char32_t& cp) noexcept
     {
-      if (__n == 1)
-        *__d = *__s;
+      const unsigned int lead = s[0];
+      unsigned int lo = 0x80, hi = 0xBF;
+      size_t n;
+      cp = replacement;
+      if (lead >= 0xC2 && lead <= 0xDF)
+        n = 2;
+      else if (lead >= 0xE0 && lead <= 0xEF)
+      {
+        n = 3;
+        if (lead == 0xE0)
+          lo = 0xA0;
+        else if (lead == 0xED)
+          hi = 0x9F;
+      }
+      else if (lead >= 0xF0 && lead <= 0xF4)
+      {
+        n = 4;
+        if (lead == 0xF0)
+          lo = 0x90;
+        else if (lead == 0xF4)
+          hi = 0x8F;
+      }
       else
-        memcpy(__d, __s, __n * sizeof(_CodeT));
-    }
-    
-    static void
-    _S_capacity(size_type& __capacity, size_type __old_capacity)
-    {
-      if (__capacity > max_size)
-        std::__throw_length_error(__N("ustring::_M_create"));
-
-      if (__capacity > __old_capacity && __capacity < 2 * __old_capacity)
+        return 1;
+      char32_t c = lead & (0x7F >> n);
+      for (size_t k = 1; k < n; k++)
       {
-        __capacity = 2 * __old_capacity;
-        if (__capacity > max_size)
-          __capacity = max_size;
+        if (k == len)
+          return 0;
+        if (s[k] < lo || s[k] > hi)
+          return 1;
+        c = c << 6 | (s[k] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
       }
+      cp = c;
+      return n;
     }
-    
-    static void
-    _S_move(_CodeT* __d, const _CodeT* __s, size_type __n)
+  };
+
+  // Every byte is the code point of the same value.
+  struct latin1_codec
+  {
+    static const size_t max_length = 1;
+
+    static size_t step(const unsigned char* s, size_t, char32_t& cp) noexcept
     {
-      if (__n == 1)
-        *__d = *__s;
+      cp = s[0];
+      return 1;
+    }
+  };
+
+  // Windows code page 1252: latin1 but for bytes 0x80-0x9F.
+  struct cp1252_codec
+  {
+    static const size_t max_length = 1;
+
+    static size_t step(const unsigned char* s, size_t, char32_t& cp) noexcept
+    {
+      cp = s[0] < 0xA0 ? table_detail::cp1252_high()[s[0] - 0x80] : s[0];
+      return 1;
+    }
+  };
+
+  /**
+   * Encode utf8 to gb18030, or to gbk when two_byte_only is set, in which
+   * case code points that need four bytes are written as '?'. A lone byte
+   * which is not ascii is invalid utf8 and is written as '?' too, so the
+   * output never takes more than 2 bytes per input byte.
+   *
+   * @param str             utf8 string
+   * @param len             length of str
+   * @param dest            buffer of at least 2 * len bytes
+   * @param two_byte_only   whether to stay within gbk
+   * @return                number of bytes written
+   */
+  inline size_t gb18030_encode(const char* str, size_t len, char* dest,
+      bool two_byte_only) noexcept
+  {
+    const std::uint16_t* inverse = gb18030_inverse();
+    size_t i = 0, cur_bytes = 0;
+    char32_t cp;
+    while (i < len)
+    {
+      if (!((unsigned char)str[i] & 0x80))
+      {
+        size_t n = simd_detail::ascii_prefix(str + i, len - i);
+        memcpy(dest + cur_bytes, str + i, n);
+        cur_bytes += n;
+        i += n;
+        continue;
+      }
+      const width_type n = utf8_decode(str + i, cp, len - i);
+      i += n;
+      if (n == 1)
+        dest[cur_bytes++] = '?';
+      else if (cp < 0x10000 && inverse[cp])
+      {
+        dest[cur_bytes++] = char(inverse[cp] >> 8);
+        dest[cur_bytes++] = char(inverse[cp] & 0xFF);
+      }
+      else if (two_byte_only || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF) || cp < 0x80)
+        dest[cur_bytes++] = '?';
+      else
+        cur_bytes += gb18030_encode_four(cp, dest + cur_bytes);
+    }
+    return cur_bytes;
+  }
+} // namespace mb_detail
+
+/**
+ * Convert the gb18030 (or gbk, its subset) string to utf8. Invalid bytes
+ * are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     gb18030 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t gb18030_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::decode_to_utf8<mb_detail::gb18030_codec>(str, len, dest); }
+
+inline std::string gb18030_to_utf8(const char* str, size_t len)
+{ return mb_detail::decode_to_utf8<mb_detail::gb18030_codec>(str, len); }
+
+inline std::string gb18030_to_utf8(const std::string& str)
+{ return gb18030_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string gb18030_to_utf8(std::string_view str)
+{ return gb18030_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the utf8 string to gb18030. Code points that can't be encoded
+ * (surrogates, above U+10FFFF) and invalid bytes are written as '?'.
+ * Need to pre-allocate memory: dest = (char *)malloc(2 * len)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t utf8_to_gb18030(const char* str, size_t len, char* dest)
+{ return mb_detail::gb18030_encode(str, len, dest, false); }
+
+inline std::string utf8_to_gb18030(const char* str, size_t len)
+{
+  std::string result(2 * len, '\0');
+  if (len)
+    result.resize(utf8_to_gb18030(str, len, &result[0]));
+  return result;
+}
+
+inline std::string utf8_to_gb18030(const std::string& str)
+{ return utf8_to_gb18030(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf8_to_gb18030(std::string_view str)
+{ return utf8_to_gb18030(str.data(), str.size()); }
+#endif
+
+// gbk is the two-byte part of gb18030, so it decodes with the same tables.
+inline size_t gbk_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return gb18030_to_utf8(str, len, dest); }
+
+inline std::string gbk_to_utf8(const char* str, size_t len)
+{ return gb18030_to_utf8(str, len); }
+
+inline std::string gbk_to_utf8(const std::string& str)
+{ return gb18030_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string gbk_to_utf8(std::string_view str)
+{ return gb18030_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the utf8 string to gbk. Code points outside gbk and invalid bytes
+ * are written as '?'.
+ * Need to pre-allocate memory: dest = (char *)malloc(2 * len)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t utf8_to_gbk(const char* str, size_t len, char* dest)
+{ return mb_detail::gb18030_encode(str, len, dest, true); }
+
+inline std::string utf8_to_gbk(const char* str, size_t len)
+{
+  std::string result(2 * len, '\0');
+  if (len)
+    result.resize(utf8_to_gbk(str, len, &result[0]));
+  return result;
+}
+
+inline std::string utf8_to_gbk(const std::string& str)
+{ return utf8_to_gbk(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf8_to_gbk(std::string_view str)
+{ return utf8_to_gbk(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the big5 string to utf8, with the extensions of code page 950.
+ * Invalid bytes are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     big5 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t big5_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::decode_to_utf8<mb_detail::big5_codec>(str, len, dest); }
+
+inline std::string big5_to_utf8(const char* str, size_t len)
+{ return mb_detail::decode_to_utf8<mb_detail::big5_codec>(str, len); }
+
+inline std::string big5_to_utf8(const std::string& str)
+{ return big5_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string big5_to_utf8(std::string_view str)
+{ return big5_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the shift_jis string to utf8, with the NEC and IBM extensions of
+ * code page 932. Invalid bytes are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     shift_jis string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t shift_jis_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::decode_to_utf8<mb_detail::shift_jis_codec>(str, len, dest); }
+
+inline std::string shift_jis_to_utf8(const char* str, size_t len)
+{ return mb_detail::decode_to_utf8<mb_detail::shift_jis_codec>(str, len); }
+
+inline std::string shift_jis_to_utf8(const std::string& str)
+{ return shift_jis_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string shift_jis_to_utf8(std::string_view str)
+{ return shift_jis_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the euc-jp string to utf8, including the three-byte jis0212
+ * plane. Invalid bytes are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     euc-jp string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t euc_jp_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::decode_to_utf8<mb_detail::euc_jp_codec>(str, len, dest); }
+
+inline std::string euc_jp_to_utf8(const char* str, size_t len)
+{ return mb_detail::decode_to_utf8<mb_detail::euc_jp_codec>(str, len); }
+
+inline std::string euc_jp_to_utf8(const std::string& str)
+{ return euc_jp_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string euc_jp_to_utf8(std::string_view str)
+{ return euc_jp_to_utf8(str.data(), str.size()); }
+#endif
+
+namespace mb_detail {
+  /**
+   * Decode latin1, or cp1252 when high is given, to utf8. Ascii runs are
+   * copied through ascii_prefix. Blocks of 16 bytes with high bytes are
+   * expanded with pshufb when SSSE3 is available, unless cp1252 bytes
+   * 0x80-0x9F are among them; otherwise the next 16 bytes are expanded
+   * without branching on each byte.
+   *
+   * @param str     latin1 or cp1252 string
+   * @param len     length of str
+   * @param dest    buffer of at least 2 * len (latin1) or 3 * len (cp1252) bytes
+   * @param high    code points of bytes 0x80-0x9F, nullptr for latin1
+   * @return        number of bytes written
+   */
+  inline size_t single_byte_decode(const char* str, size_t len, char* dest,
+      const std::uint16_t* high) noexcept
+  {
+    size_t i = 0, cur_bytes = 0;
+    while (i < len)
+    {
+      if (!((unsigned char)str[i] & 0x80))
+      {
+        size_t n = simd_detail::ascii_prefix(str + i, len - i);
+        memcpy(dest + cur_bytes, str + i, n);
+        cur_bytes += n;
+        i += n;
+        continue;
+      }
+      #ifdef STRINGUTILS_HAVE_SSSE3
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (!high || !_mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8((char)0xA0))))
+        {
+          cur_bytes += simd_detail::expand_latin1(v, dest + cur_bytes);
+          i += 16;
+          continue;
+        }
+      }
+      #endif
+      // Both bytes are written for every character, the second one is
+      // overwritten by the next character after an ascii byte.
+      const size_t end = std::min(len, i + 16);
+      for (; i < end; i++)
+      {
+        const unsigned int c = (unsigned char)str[i];
+        if (high && c >= 0x80 && c < 0xA0)
+        {
+          cur_bytes += utf8_encode((char32_t)high[c - 0x80], dest + cur_bytes);
+          continue;
+        }
+        dest[cur_bytes] = char(c < 0x80 ? c : 0xC0 | c >> 6);
+        dest[cur_bytes + 1] = char(0x80 | (c & 0x3F));
+        cur_bytes += 1 + (c >> 7);
+      }
+    }
+    return cur_bytes;
+  }
+
+  /**
+   * Encode utf8 to latin1, or to cp1252 when high is given. Code points
+   * that can't be encoded are written as '?'. With SSSE3, blocks of 16
+   * bytes of ascii and U+0080-U+00FF are contracted with pshufb.
+   *
+   * @param str     utf8 string
+   * @param len     length of str
+   * @param dest    buffer of at least len bytes
+   * @param high    code points of bytes 0x80-0x9F, nullptr for latin1
+   * @param error   byte offset in str of the first code point that can't
+   *                be encoded, len if there is none
+   * @return        number of bytes written
+   */
+  inline size_t single_byte_encode(const char* str, size_t len, char* dest,
+      const std::uint16_t* high, size_t& error) noexcept
+  {
+    size_t i = 0, cur_bytes = 0;
+    char32_t cp;
+    error = len;
+    while (i < len)
+    {
+      if (!((unsigned char)str[i] & 0x80))
+      {
+        size_t n = simd_detail::ascii_prefix(str + i, len - i);
+        memcpy(dest + cur_bytes, str + i, n);
+        cur_bytes += n;
+        i += n;
+        continue;
+      }
+      #ifdef STRINGUTILS_HAVE_SSSE3
+      // U+0080-U+009F are not cp1252 characters.
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (!high || !_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xC2))))
+        {
+          size_t n = simd_detail::contract_latin1(v, dest + cur_bytes);
+          if (n)
+          {
+            cur_bytes += n;
+            i += 16;
+            continue;
+          }
+        }
+      }
+      #endif
+      const size_t start = i;
+      i += utf8_decode(str + i, cp, len - i);
+      int c = -1;
+      if (cp >= 0xA0 && cp <= 0xFF)
+        c = (int)cp;
+      else if (!high)
+      {
+        if (cp >= 0x80 && cp < 0xA0)
+          c = (int)cp;
+      }
+      else
+      {
+        for (int k = 0; k < 32; k++)
+          if (high[k] == cp)
+          {
+            c = 0x80 + k;
+            break;
+          }
+      }
+      if (c < 0)
+      {
+        c = '?';
+        if (error == len)
+          error = start;
+      }
+      dest[cur_bytes++] = char(c);
+    }
+    return cur_bytes;
+  }
+} // namespace mb_detail
+
+/**
+ * Convert the latin1 (iso-8859-1) string to utf8.
+ * Need to pre-allocate memory: dest = (char *)malloc(2 * len)
+ *
+ * @param str     latin1 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t latin1_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::single_byte_decode(str, len, dest, nullptr); }
+
+inline std::string latin1_to_utf8(const char* str, size_t len)
+{
+  std::string result(2 * len, '\0');
+  if (len)
+    result.resize(latin1_to_utf8(str, len, &result[0]));
+  return result;
+}
+
+inline std::string latin1_to_utf8(const std::string& str)
+{ return latin1_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string latin1_to_utf8(std::string_view str)
+{ return latin1_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the utf8 string to latin1. Code points above U+00FF are written
+ * as '?'.
+ * Need to pre-allocate memory: dest = (char *)malloc(len)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @param error   byte offset in str of the first code point that can't be
+ *                encoded, len if there is none
+ * @return        number of bytes written
+ */
+inline size_t utf8_to_latin1(const char* str, size_t len, char* dest, size_t& error) noexcept
+{ return mb_detail::single_byte_encode(str, len, dest, nullptr, error); }
+
+inline size_t utf8_to_latin1(const char* str, size_t len, char* dest) noexcept
+{
+  size_t error;
+  return utf8_to_latin1(str, len, dest, error);
+}
+
+inline std::string utf8_to_latin1(const char* str, size_t len)
+{
+  std::string result(len, '\0');
+  if (len)
+    result.resize(utf8_to_latin1(str, len, &result[0]));
+  return result;
+}
+
+inline std::string utf8_to_latin1(const std::string& str)
+{ return utf8_to_latin1(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf8_to_latin1(std::string_view str)
+{ return utf8_to_latin1(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the cp1252 (windows-1252) string to utf8. The five unassigned
+ * bytes of 0x80-0x9F decode to the C1 controls of the same value.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     cp1252 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t cp1252_to_utf8(const char* str, size_t len, char* dest) noexcept
+{ return mb_detail::single_byte_decode(str, len, dest, table_detail::cp1252_high()); }
+
+inline std::string cp1252_to_utf8(const char* str, size_t len)
+{
+  std::string result(3 * len, '\0');
+  if (len)
+    result.resize(cp1252_to_utf8(str, len, &result[0]));
+  return result;
+}
+
+inline std::string cp1252_to_utf8(const std::string& str)
+{ return cp1252_to_utf8(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string cp1252_to_utf8(std::string_view str)
+{ return cp1252_to_utf8(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert the utf8 string to cp1252. Code points that can't be encoded are
+ * written as '?'.
+ * Need to pre-allocate memory: dest = (char *)malloc(len)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @param error   byte offset in str of the first code point that can't be
+ *                encoded, len if there is none
+ * @return        number of bytes written
+ */
+inline size_t utf8_to_cp1252(const char* str, size_t len, char* dest, size_t& error) noexcept
+{ return mb_detail::single_byte_encode(str, len, dest, table_detail::cp1252_high(), error); }
+
+inline size_t utf8_to_cp1252(const char* str, size_t len, char* dest) noexcept
+{
+  size_t error;
+  return utf8_to_cp1252(str, len, dest, error);
+}
+
+inline std::string utf8_to_cp1252(const char* str, size_t len)
+{
+  std::string result(len, '\0');
+  if (len)
+    result.resize(utf8_to_cp1252(str, len, &result[0]));
+  return result;
+}
+
+inline std::string utf8_to_cp1252(const std::string& str)
+{ return utf8_to_cp1252(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf8_to_cp1252(std::string_view str)
+{ return utf8_to_cp1252(str.data(), str.size()); }
+#endif
+
+// Byte order of utf16 byte streams. detect reads it from a BOM, which is
+// then skipped, and falls back to little endian.
+enum class byte_order
+{
+  detect,
+  little,
+  big
+};
+
+namespace mb_detail {
+  #ifdef STRINGUTILS_HAVE_SSE2
+  // Swap the bytes of the 8 code units.
+  static inline __m128i swap_units(__m128i v) noexcept
+  { return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); }
+  #endif
+
+  inline char32_t read_unit(const unsigned char* s, bool big) noexcept
+  { return big ? char32_t(s[0] << 8 | s[1]) : char32_t(s[1] << 8 | s[0]); }
+
+  inline void write_unit(char32_t u, char* dest, bool big) noexcept
+  {
+    dest[big ? 0 : 1] = char(u >> 8);
+    dest[big ? 1 : 0] = char(u & 0xFF);
+  }
+
+  // Resolve byte_order::detect from the BOM and return the number of bytes
+  // to skip.
+  inline size_t utf16_bom(const char* str, size_t len, byte_order& order) noexcept
+  {
+    if (order != byte_order::detect)
+      return 0;
+    order = byte_order::little;
+    if (len < 2)
+      return 0;
+    const unsigned char* s = (const unsigned char *)str;
+    if (s[0] == 0xFE && s[1] == 0xFF)
+    {
+      order = byte_order::big;
+      return 2;
+    }
+    return s[0] == 0xFF && s[1] == 0xFE ? 2 : 0;
+  }
+
+  /**
+   * Decode utf16 bytes. Blocks of 8 code units without surrogates are
+   * byte swapped (for big endian) and handed to the sink in a register.
+   * Unpaired surrogates become U+FFFD.
+   *
+   * @param str       utf16 bytes
+   * @param len       length of str
+   * @param sink      output, see utf8_sink and unit_sink
+   * @param big       whether str is big endian
+   * @param flush     whether an odd byte or a high surrogate at the end is
+   *                  decoded as U+FFFD instead of being left for the next call
+   * @return          number of bytes of str decoded
+   */
+  template <typename _Sink>
+  inline size_t utf16_bytes_decode(const char* str, size_t len, _Sink& sink, bool big,
+      bool flush) noexcept
+  {
+    const unsigned char* s = (const unsigned char *)str;
+    size_t i = 0;
+    while (i + 2 <= len)
+    {
+      #ifdef STRINGUTILS_HAVE_SSE2
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (big)
+          v = swap_units(v);
+        __m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+            _mm_set1_epi16((short)0xD800));
+        if (!_mm_movemask_epi8(surrogate))
+        {
+          sink.block(v);
+          i += 16;
+          continue;
+        }
+      }
+      #endif
+      const char32_t u = read_unit(s + i, big);
+      if ((u & 0xF800) != 0xD800)
+      {
+        sink.put(u);
+        i += 2;
+        continue;
+      }
+      if (u < 0xDC00)
+      {
+        if (i + 4 > len)
+        {
+          if (!flush)
+            return i;
+          sink.put(replacement);
+          return len;
+        }
+        const char32_t lo = read_unit(s + i + 2, big);
+        if ((lo & 0xFC00) == 0xDC00)
+        {
+          sink.put(0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00));
+          i += 4;
+          continue;
+        }
+      }
+      sink.put(replacement);
+      i += 2;
+    }
+    if (i < len && flush)
+    {
+      sink.put(replacement);
+      i = len;
+    }
+    return i;
+  }
+
+  /**
+   * Encode utf8 as utf16 bytes. Ascii blocks of 16 bytes are widened with
+   * SSE2, interleaving zero bytes on the side given by the byte order.
+   *
+   * @param str     utf8 string
+   * @param len     length of str
+   * @param dest    buffer of at least 2 * len bytes
+   * @param big     whether to write big endian
+   * @return        number of bytes written
+   */
+  inline size_t utf16_bytes_encode(const char* str, size_t len, char* dest, bool big) noexcept
+  {
+    size_t i = 0, cur_bytes = 0;
+    char32_t cp;
+    char16_t units[2];
+    while (i < len)
+    {
+      #ifdef STRINGUTILS_HAVE_SSE2
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (!_mm_movemask_epi8(v))
+        {
+          const __m128i zero = _mm_setzero_si128();
+          _mm_storeu_si128((__m128i *)(dest + cur_bytes),
+              big ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero));
+          _mm_storeu_si128((__m128i *)(dest + cur_bytes + 16),
+              big ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero));
+          i += 16;
+          cur_bytes += 32;
+          continue;
+        }
+      }
+      #endif
+      i += utf8_decode(str + i, cp, len - i);
+      const width_type n = utf16_encode(cp, units);
+      for (width_type k = 0; k < n; k++, cur_bytes += 2)
+        write_unit(units[k], dest + cur_bytes, big);
+    }
+    return cur_bytes;
+  }
+} // namespace mb_detail
+
+/**
+ * Convert utf16 bytes to utf8. Unpaired surrogates and an odd byte at the
+ * end are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * (len / 2 + 1))
+ *
+ * @param str     utf16 bytes
+ * @param len     length of str
+ * @param dest    character buffer
+ * @param order   byte order of str, detected from the BOM by default
+ * @return        number of bytes written
+ */
+inline size_t utf16_bytes_to_utf8(const char* str, size_t len, char* dest,
+    byte_order order = byte_order::detect) noexcept
+{
+  const size_t bom = mb_detail::utf16_bom(str, len, order);
+  mb_detail::utf8_sink sink = { dest };
+  mb_detail::utf16_bytes_decode(str + bom, len - bom, sink, order == byte_order::big, true);
+  return sink.dest - dest;
+}
+
+inline std::string utf16_bytes_to_utf8(const char* str, size_t len,
+    byte_order order = byte_order::detect)
+{
+  std::string result(3 * (len / 2 + 1), '\0');
+  result.resize(utf16_bytes_to_utf8(str, len, &result[0], order));
+  return result;
+}
+
+inline std::string utf16_bytes_to_utf8(const std::string& str,
+    byte_order order = byte_order::detect)
+{ return utf16_bytes_to_utf8(str.data(), str.size(), order); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf16_bytes_to_utf8(std::string_view str,
+    byte_order order = byte_order::detect)
+{ return utf16_bytes_to_utf8(str.data(), str.size(), order); }
+#endif
+
+/**
+ * Convert utf16 bytes to utf16 code units (or to code points if _CodeT is
+ * wider) in one pass, swapping bytes as needed. Unpaired surrogates and an
+ * odd byte at the end are replaced by U+FFFD.
+ * Need to pre-allocate memory: dest = (_CodeT *)malloc((len / 2 + 1) * sizeof(_CodeT))
+ *
+ * @param str     utf16 bytes
+ * @param len     length of str
+ * @param dest    code unit buffer
+ * @param order   byte order of str, detected from the BOM by default
+ * @return        number of code units written
+ */
+template <typename _CodeT>
+inline size_t utf16_bytes_to_units(const char* str, size_t len, _CodeT* dest,
+    byte_order order = byte_order::detect) noexcept
+{
+  const size_t bom = mb_detail::utf16_bom(str, len, order);
+  mb_detail::unit_sink<_CodeT> sink = { dest };
+  mb_detail::utf16_bytes_decode(str + bom, len - bom, sink, order == byte_order::big, true);
+  return sink.dest - dest;
+}
+
+inline std::u16string utf16_bytes_to_u16string(const char* str, size_t len,
+    byte_order order = byte_order::detect)
+{
+  std::u16string result(len / 2 + 1, u'\0');
+  result.resize(utf16_bytes_to_units(str, len, &result[0], order));
+  return result;
+}
+
+inline std::u16string utf16_bytes_to_u16string(const std::string& str,
+    byte_order order = byte_order::detect)
+{ return utf16_bytes_to_u16string(str.data(), str.size(), order); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::u16string utf16_bytes_to_u16string(std::string_view str,
+    byte_order order = byte_order::detect)
+{ return utf16_bytes_to_u16string(str.data(), str.size(), order); }
+#endif
+
+/**
+ * Convert the utf8 string to utf16 bytes, optionally preceded by a BOM.
+ * Need to pre-allocate memory: dest = (char *)malloc(2 * len + 2)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @param order   byte order to write, little endian for detect
+ * @param bom     whether to write a BOM first
+ * @return        number of bytes written
+ */
+inline size_t utf8_to_utf16_bytes(const char* str, size_t len, char* dest,
+    byte_order order = byte_order::little, bool bom = false) noexcept
+{
+  const bool big = order == byte_order::big;
+  size_t cur_bytes = 0;
+  if (bom)
+  {
+    mb_detail::write_unit(0xFEFF, dest, big);
+    cur_bytes = 2;
+  }
+  return cur_bytes + mb_detail::utf16_bytes_encode(str, len, dest + cur_bytes, big);
+}
+
+inline std::string utf8_to_utf16_bytes(const char* str, size_t len,
+    byte_order order = byte_order::little, bool bom = false)
+{
+  std::string result(2 * len + 2, '\0');
+  result.resize(utf8_to_utf16_bytes(str, len, &result[0], order, bom));
+  return result;
+}
+
+inline std::string utf8_to_utf16_bytes(const std::string& str,
+    byte_order order = byte_order::little, bool bom = false)
+{ return utf8_to_utf16_bytes(str.data(), str.size(), order, bom); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string utf8_to_utf16_bytes(std::string_view str,
+    byte_order order = byte_order::little, bool bom = false)
+{ return utf8_to_utf16_bytes(str.data(), str.size(), order, bom); }
+#endif
+
+/**
+ * Write utf16 code units (or code points if _CodeT is wider, split into
+ * surrogate pairs above U+FFFF) as utf16 bytes, optionally preceded by a BOM.
+ * Need to pre-allocate memory: dest = (char *)malloc(4 * n + 2)
+ *
+ * @param units   code units
+ * @param n       number of code units
+ * @param dest    character buffer
+ * @param order   byte order to write, little endian for detect
+ * @param bom     whether to write a BOM first
+ * @return        number of bytes written
+ */
+template <typename _CodeT>
+inline size_t units_to_utf16_bytes(const _CodeT* units, size_t n, char* dest,
+    byte_order order = byte_order::little, bool bom = false) noexcept
+{
+  const bool big = order == byte_order::big;
+  size_t i = 0, cur_bytes = 0;
+  char16_t pair[2];
+  if (bom)
+  {
+    mb_detail::write_unit(0xFEFF, dest, big);
+    cur_bytes = 2;
+  }
+  #ifdef STRINGUTILS_HAVE_SSE2
+  if (sizeof(_CodeT) == 2)
+  {
+    for (; i + 8 <= n; i += 8, cur_bytes += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(units + i));
+      _mm_storeu_si128((__m128i *)(dest + cur_bytes), big ? mb_detail::swap_units(v) : v);
+    }
+  }
+  #endif
+  for (; i < n; i++)
+  {
+    const width_type k = sizeof(_CodeT) == 2 ? (pair[0] = char16_t(units[i]), 1) :
+        utf16_encode((char32_t)units[i], pair);
+    for (width_type j = 0; j < k; j++, cur_bytes += 2)
+      mb_detail::write_unit(pair[j], dest + cur_bytes, big);
+  }
+  return cur_bytes;
+}
+
+inline std::string to_utf16_bytes(const std::u16string& str,
+    byte_order order = byte_order::little, bool bom = false)
+{
+  std::string result(2 * str.size() + 2, '\0');
+  result.resize(units_to_utf16_bytes(str.data(), str.size(), &result[0], order, bom));
+  return result;
+}
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string to_utf16_bytes(std::u16string_view str,
+    byte_order order = byte_order::little, bool bom = false)
+{
+  std::string result(2 * str.size() + 2, '\0');
+  result.resize(units_to_utf16_bytes(str.data(), str.size(), &result[0], order, bom));
+  return result;
+}
+#endif
+
+namespace fullwidth_detail {
+  // Does nothing with the conversions of full_to_half and half_to_full.
+  struct no_edits
+  {
+    void operator()(size_t, size_t, size_t) const noexcept { }
+  };
+
+  // The loops of full_to_half and half_to_full, calling edit(pos, n, m)
+  // in order for every n bytes at pos of str converted to m bytes.
+  template <typename _Edit>
+  inline size_t full_to_half(const char* str, size_t len, char* dest, _Edit& edit)
+  {
+    const unsigned char* s = (const unsigned char *)str;
+    size_t i = 0, cur_bytes = 0;
+    while (i < len)
+    {
+      size_t end = len;
+      #ifdef STRINGUTILS_HAVE_SSE2
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        if (!simd_detail::fullwidth_leads(v))
+        {
+          _mm_storeu_si128((__m128i *)(dest + cur_bytes), v);
+          i += 16;
+          cur_bytes += 16;
+          continue;
+        }
+        end = i + 16;
+      }
+      #endif
+      // A form may run past end, the next block starts after it.
+      while (i < end)
+      {
+        if (s[i] == 0xEF && i + 2 < len && (s[i + 1] == 0xBC ? s[i + 2] >= 0x81 && s[i + 2] <= 0xBF :
+            s[i + 1] == 0xBD && s[i + 2] >= 0x80 && s[i + 2] <= 0x9E))
+        {
+          edit(i, 3, 1);
+          dest[cur_bytes++] = char(s[i + 2] - (s[i + 1] == 0xBC ? 0x60 : 0x20));
+          i += 3;
+        }
+        else if (s[i] == 0xE3 && i + 2 < len && s[i + 1] == 0x80 && s[i + 2] == 0x80)
+        {
+          edit(i, 3, 1);
+          dest[cur_bytes++] = ' ';
+          i += 3;
+        }
+        else
+          dest[cur_bytes++] = str[i++];
+      }
+    }
+    return cur_bytes;
+  }
+
+  template <typename _Edit>
+  inline size_t half_to_full(const char* str, size_t len, char* dest, _Edit& edit)
+  {
+    const unsigned char* s = (const unsigned char *)str;
+    size_t i = 0, cur_bytes = 0;
+    while (i < len)
+    {
+      size_t end = len;
+      #ifdef STRINGUTILS_HAVE_SSE2
+      if (i + 16 <= len)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        const unsigned int printable = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F))));
+        if (!printable)
+        {
+          _mm_storeu_si128((__m128i *)(dest + cur_bytes), v);
+          i += 16;
+          cur_bytes += 16;
+          continue;
+        }
+        #ifdef STRINGUTILS_HAVE_SSSE3
+        if (printable == 0xFFFF)
+        {
+          simd_detail::expand_fullwidth(v, dest + cur_bytes);
+          for (size_t k = 0; k < 16; k++)
+            edit(i + k, 1, 3);
+          i += 16;
+          cur_bytes += 48;
+          continue;
+        }
+        #endif
+        end = i + 16;
+      }
+      #endif
+      for (; i < end; i++)
+      {
+        if (s[i] == 0x20)
+        {
+          edit(i, 1, 3);
+          memcpy(dest + cur_bytes, "\xE3\x80\x80", 3);
+          cur_bytes += 3;
+        }
+        else if (s[i] > 0x20 && s[i] < 0x7F)
+        {
+          edit(i, 1, 3);
+          dest[cur_bytes] = char(0xEF);
+          dest[cur_bytes + 1] = char(s[i] < 0x60 ? 0xBC : 0xBD);
+          dest[cur_bytes + 2] = char(s[i] + (s[i] < 0x60 ? 0x60 : 0x20));
+          cur_bytes += 3;
+        }
+        else
+          dest[cur_bytes++] = str[i];
+      }
+    }
+    return cur_bytes;
+  }
+} // namespace fullwidth_detail
+
+/**
+ * Convert full-width ascii forms (U+FF01-U+FF5E) and the ideographic space
+ * (U+3000) of the utf8 string to their half-width ascii, copying everything
+ * else. Blocks of 16 bytes without such a form are copied with SSE2.
+ * Need to pre-allocate memory: dest = (char *)malloc(len), or dest = str to
+ * convert in place.
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t full_to_half(const char* str, size_t len, char* dest) noexcept
+{
+  fullwidth_detail::no_edits edit;
+  return fullwidth_detail::full_to_half(str, len, dest, edit);
+}
+
+inline std::string full_to_half(const char* str, size_t len)
+{
+  std::string result(str, len);
+  result.resize(full_to_half(&result[0], len, &result[0]));
+  return result;
+}
+
+inline std::string full_to_half(const std::string& str)
+{ return full_to_half(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string full_to_half(std::string_view str)
+{ return full_to_half(str.data(), str.size()); }
+#endif
+
+/**
+ * Convert printable ascii (0x20-0x7E) of the utf8 string to its full-width
+ * form, the space to the ideographic space U+3000, copying everything else.
+ * Blocks of 16 bytes without printable ascii are copied with SSE2, and with
+ * SSSE3 blocks of printable ascii are expanded by pshufb.
+ * Need to pre-allocate memory: dest = (char *)malloc(3 * len)
+ *
+ * @param str     utf8 string
+ * @param len     length of str
+ * @param dest    character buffer
+ * @return        number of bytes written
+ */
+inline size_t half_to_full(const char* str, size_t len, char* dest) noexcept
+{
+  fullwidth_detail::no_edits edit;
+  return fullwidth_detail::half_to_full(str, len, dest, edit);
+}
+
+inline std::string half_to_full(const char* str, size_t len)
+{
+  std::string result(3 * len, '\0');
+  result.resize(half_to_full(str, len, &result[0]));
+  return result;
+}
+
+inline std::string half_to_full(const std::string& str)
+{ return half_to_full(str.data(), str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::string half_to_full(std::string_view str)
+{ return half_to_full(str.data(), str.size()); }
+#endif
+
+/**
+ * Alignment between the byte offsets of a source string and of the string
+ * a transformation made of it, as the list of runs it copied or edited.
+ * Copied runs map offsets one to one; an offset inside an edited run maps
+ * to its start, or to its end when rounding up, so span [begin, end) maps
+ * back as [map_back(begin), map_back(end, true)). Consecutive copies are
+ * one run, and run boundaries are kept as running totals searched in
+ * O(log n).
+ */
+class offset_alignment
+{
+  public:
+    using size_type = size_t;
+
+    offset_alignment()
+    : _M_points(1, _Point{0, 0, true}) { }
+
+    // Record n bytes copied unchanged.
+    void
+    copy(size_type __n)
+    {
+      if (__n)
+        _M_append(__n, __n, true);
+    }
+
+    // Record __src bytes of the source turned into __dst bytes.
+    void
+    edit(size_type __src, size_type __dst)
+    {
+      if (__src || __dst)
+        _M_append(__src, __dst, false);
+    }
+
+    // Length of the source and of the transformed string.
+    size_type
+    source_size() const noexcept
+    { return _M_points.back().src; }
+
+    size_type
+    target_size() const noexcept
+    { return _M_points.back().dst; }
+
+    // Number of runs.
+    size_type
+    size() const noexcept
+    { return _M_points.size() - 1; }
+
+    /**
+     * @brief Map an offset of the transformed string back to the source.
+     * @param __offset  Offset up to target_size().
+     * @param __round_up  Round an offset inside an edit to its end rather
+     * than its start, and past rather than before the bytes deleted there.
+     * @return  The source offset, or npos past the end.
+     */
+    size_type
+    map_back(size_type __offset, bool __round_up = false) const noexcept
+    { return _M_map(__offset, __round_up, &_Point::dst, &_Point::src); }
+
+    // Map an offset of the source to the transformed string.
+    size_type
+    map_forward(size_type __offset, bool __round_up = false) const noexcept
+    { return _M_map(__offset, __round_up, &_Point::src, &_Point::dst); }
+
+    /**
+     * @brief Compose with the alignment of the next step, which transformed
+     * the target of this one, so that this maps the final string straight
+     * back to the original source. Edits which overlap across the steps
+     * become one edit.
+     * @return  false if the next step didn't start from the target.
+     */
+    bool
+    then(const offset_alignment& __next)
+    {
+      if (__next.source_size() != target_size())
+        return false;
+      std::vector<_Point> __first;
+      __first.swap(_M_points);
+      _M_points.push_back(_Point{0, 0, true});
+      const std::vector<_Point>& __second = __next._M_points;
+
+      // Walk the runs of both steps over the intermediate string: __ra and
+      // __rb are the intermediate bytes left in the current runs, an edit
+      // giving all of its bytes when entered. An edit stays open while
+      // either step is inside an edited run.
+      size_type __i = 1, __j = 1, __ra = 0, __rb = 0, __src = 0, __dst = 0;
+      bool __open = false;
+      while (__i < __first.size() || __j < __second.size())
+      {
+        if (__open && (!__ra || __first[__i].copy) && (!__rb || __second[__j].copy))
+        {
+          edit(__src, __dst);
+          __src = __dst = 0;
+          __open = false;
+        }
+        if (!__ra && __i < __first.size())
+        {
+          __ra = __first[__i].dst - __first[__i - 1].dst;
+          if (!__first[__i].copy || !__ra)
+          {
+            __src += __first[__i].src - __first[__i - 1].src;
+            __open = true;
+          }
+          if (!__ra)
+          {
+            __i++;
+            continue;
+          }
+        }
+        if (!__rb && __j < __second.size())
+        {
+          __rb = __second[__j].src - __second[__j - 1].src;
+          if (!__second[__j].copy || !__rb)
+          {
+            __dst += __second[__j].dst - __second[__j - 1].dst;
+            __open = true;
+          }
+          if (!__rb)
+          {
+            __j++;
+            continue;
+          }
+        }
+        const size_type __m = std::min(__ra, __rb);
+        if (__first[__i].copy && __second[__j].copy)
+          copy(__m);
+        else
+        {
+          if (__first[__i].copy)
+            __src += __m;
+          if (__second[__j].copy)
+            __dst += __m;
+          __open = true;
+        }
+        if (!(__ra -= __m))
+          __i++;
+        if (!(__rb -= __m))
+          __j++;
+      }
+      if (__open)
+        edit(__src, __dst);
+      return true;
+    }
+
+    void
+    clear()
+    { _M_points.assign(1, _Point{0, 0, true}); }
+
+  private:
+    // End of a run, and whether it is a copy.
+    struct _Point
+    {
+      size_type src;
+      size_type dst;
+      bool copy;
+    };
+
+    void
+    _M_append(size_type __src, size_type __dst, bool __copy)
+    {
+      _Point& __last = _M_points.back();
+      if (__copy && __last.copy && _M_points.size() > 1)
+      {
+        __last.src += __src;
+        __last.dst += __dst;
+      }
+      else
+        _M_points.push_back(_Point{__last.src + __src, __last.dst + __dst, __copy});
+    }
+
+    size_type
+    _M_map(size_type __offset, bool __round_up, size_type _Point::* __from,
+        size_type _Point::* __to) const noexcept
+    {
+      if (__offset > _M_points.back().*__from)
+        return npos;
+      auto __it = std::lower_bound(_M_points.begin(), _M_points.end(), __offset,
+          [__from](const _Point& __p, size_type __o) { return __p.*__from < __o; });
+      if ((*__it).*__from != __offset)
+      {
+        const _Point& __start = *(__it - 1);
+        if (__it->copy)
+          return __start.*__to + (__offset - __start.*__from);
+        // Round to the end or the start of the edit, taken as the offset.
+        if (!__round_up)
+          --__it;
+      }
+      // Runs deleted or inserted at the offset come one after the other.
+      if (__round_up)
+        while (__it + 1 != _M_points.end() && (*(__it + 1)).*__from == (*__it).*__from)
+          ++__it;
+      else
+        while (__it != _M_points.begin() && (*(__it - 1)).*__from == (*__it).*__from)
+          --__it;
+      return (*__it).*__to;
+    }
+
+    std::vector<_Point> _M_points;
+};
+
+namespace align_detail {
+  // Record the edits of full_to_half and half_to_full, and the copies
+  // between them.
+  struct recorder
+  {
+    offset_alignment& align;
+    size_t pos;
+
+    void operator()(size_t at, size_t n, size_t m)
+    {
+      align.copy(at - pos);
+      align.edit(n, m);
+      pos = at + n;
+    }
+  };
+
+  // Bounds [i, j) of the string left by strip, lstrip or rstrip.
+  inline void strip_bounds(const char* str, size_t len, int strip_type,
+      const char* chars, size_t n, size_t& i, size_t& j) noexcept
+  {
+    i = 0;
+    j = len;
+    if (strip_type != RIGHTSTRIP)
+      while (i < len && (n ? memchr(chars, str[i], n) != NULL : isspace(str[i])))
+        i++;
+    if (strip_type != LEFTSTRIP)
+      while (j > i && (n ? memchr(chars, str[j - 1], n) != NULL : isspace(str[j - 1])))
+        j--;
+  }
+
+  inline std::string strip(const char* str, size_t len, int strip_type, const char* chars,
+      size_t n, offset_alignment& align)
+  {
+    size_t i, j;
+    strip_bounds(str, len, strip_type, chars, n, i, j);
+    align.clear();
+    align.edit(i, 0);
+    align.copy(j - i);
+    align.edit(len - j, 0);
+    return std::string(str + i, j - i);
+  }
+} // namespace align_detail
+
+/**
+ * Transformations which record the alignment of their result with the source
+ * string, replacing the previous content of align. toLower and toUpper keep
+ * every offset. Chain steps with align.then(next_align).
+ */
+inline std::string strip(const std::string& str, offset_alignment& align,
+    const std::string& chars = "")
+{ return align_detail::strip(str.data(), str.size(), BOTHSTRIP, chars.data(), chars.size(), align); }
+
+inline std::string lstrip(const std::string& str, offset_alignment& align,
+    const std::string& chars = "")
+{ return align_detail::strip(str.data(), str.size(), LEFTSTRIP, chars.data(), chars.size(), align); }
+
+inline std::string rstrip(const std::string& str, offset_alignment& align,
+    const std::string& chars = "")
+{ return align_detail::strip(str.data(), str.size(), RIGHTSTRIP, chars.data(), chars.size(), align); }
+
+inline std::string replace(const std::string& str, const std::string& oldstr,
+    const std::string& newstr, offset_alignment& align, int count = -1)
+{
+  align.clear();
+  const size_t oldlen = oldstr.size(), len = str.size();
+  std::string result;
+  result.reserve(len);
+  size_t start = 0;
+  for (size_t end = oldlen ? str.find(oldstr) : npos; end != npos && count != 0;
+      end = str.find(oldstr, start), count--)
+  {
+    align.copy(end - start);
+    align.edit(oldlen, newstr.size());
+    result.append(str, start, end - start);
+    result.append(newstr);
+    start = end + oldlen;
+  }
+  align.copy(len - start);
+  result.append(str, start, len - start);
+  return result;
+}
+
+inline std::string full_to_half(const std::string& str, offset_alignment& align)
+{
+  align.clear();
+  align_detail::recorder edit = { align, 0 };
+  std::string result(str);
+  result.resize(fullwidth_detail::full_to_half(&result[0], str.size(), &result[0], edit));
+  align.copy(str.size() - edit.pos);
+  return result;
+}
+
+inline std::string half_to_full(const std::string& str, offset_alignment& align)
+{
+  align.clear();
+  align_detail::recorder edit = { align, 0 };
+  std::string result(3 * str.size(), '\0');
+  result.resize(fullwidth_detail::half_to_full(str.data(), str.size(), &result[0], edit));
+  align.copy(str.size() - edit.pos);
+  return result;
+}
+
+// Encodings told apart by detect_encoding().
+enum class encoding
+{
+  ascii,
+  utf8,
+  utf16le,
+  utf16be,
+  gb18030,
+  big5,
+  shift_jis,
+  euc_jp,
+  latin1
+};
+
+inline const char* encoding_name(encoding enc) noexcept
+{
+  switch (enc)
+  {
+    case encoding::ascii:     return "ascii";
+    case encoding::utf8:      return "utf-8";
+    case encoding::utf16le:   return "utf-16le";
+    case encoding::utf16be:   return "utf-16be";
+    case encoding::gb18030:   return "gb18030";
+    case encoding::big5:      return "big5";
+    case encoding::shift_jis: return "shift_jis";
+    case encoding::euc_jp:    return "euc-jp";
+    case encoding::latin1:    return "iso-8859-1";
+  }
+  return "";
+}
+
+struct encoding_guess
+{
+  encoding  enc;
+  double    confidence;
+};
+
+namespace mb_detail {
+  // Counts over the non-ascii characters of a sample decoded with a codec.
+  struct sample_stats
+  {
+    size_t  total;
+    size_t  invalid;
+    size_t  frequent;   // in the frequent region of the encoding
+    size_t  kana;
+  };
+
+  // Decode the sample with _Codec, up to limit non-ascii characters.
+  // frequent(s, n, avail, cp) tells whether the sequence s of n bytes, of
+  // avail available, is common in text of the encoding. A sequence cut by
+  // the end is invalid if the sample is the whole string (flush), and not
+  // counted otherwise. The counts start from stats, those of the sample
+  // before str.
+  template <typename _Codec, typename _Frequent>
+  inline sample_stats scan(const char* str, size_t len, _Frequent frequent,
+      size_t limit, bool flush, sample_stats stats = sample_stats()) noexcept
+  {
+    const unsigned char* s = (const unsigned char *)str;
+    size_t i = 0;
+    while (i < len && stats.total < limit)
+    {
+      if (s[i] < 0x80)
+      {
+        i += simd_detail::ascii_prefix(str + i, len - i);
+        continue;
+      }
+      char32_t cp;
+      const size_t n = _Codec::step(s + i, len - i, cp);
+      if (!n)
+      {
+        stats.total += flush;
+        stats.invalid += flush;
+        break;
+      }
+      stats.total++;
+      if (n == 1 && cp == replacement)
+        stats.invalid++;
+      else if (frequent(s + i, n, len - i, cp))
+        stats.frequent++;
+      stats.kana += cp >= 0x3040 && cp <= 0x30FF;
+      i += n;
+      // Stop once the encoding is ruled out.
+      if (stats.invalid * 4 > stats.total && stats.total >= 64)
+        break;
+    }
+    return stats;
+  }
+
+  // Frequent characters count fully, other valid ones a quarter and
+  // invalid bytes count against the encoding. A few characters are little
+  // evidence either way.
+  inline double score(const sample_stats& stats) noexcept
+  {
+    const double total = double(stats.total);
+    const double other = total - stats.invalid - stats.frequent;
+    const double value = (stats.frequent + 0.25 * other - 2.0 * stats.invalid) / (total + 4);
+    return value > 0 ? value * 0.99 : 0;
+  }
+
+  inline double kana_ratio(const sample_stats& stats) noexcept
+  { return stats.total ? double(stats.kana) / stats.total : 0; }
+
+  inline bool in_range(unsigned int c, unsigned int lo, unsigned int hi) noexcept
+  { return c >= lo && c <= hi; }
+
+  // Counts over the first limit code units of a sample read as utf16.
+  // Unpaired surrogates, controls and noncharacters are invalid; CJK
+  // ideographs, kana, hangul, CJK and fullwidth punctuation and ascii are
+  // frequent. Ascii text read as utf16 falls mostly in the CJK block, so
+  // nothing is frequent in a sample mostly of printable ascii byte pairs
+  // other than kana. Nor is it in a sample whose units above U+00FF have
+  // no low byte below 0x40, as double-byte legacy text read as utf16 has
+  // not; that of real text is spread evenly.
+  inline sample_stats scan_utf16(const unsigned char* s, size_t len, bool big_endian,
+      size_t limit) noexcept
+  {
+    sample_stats stats = { 0, 0, 0, 0 };
+    size_t ascii_pairs = 0, wide = 0, low = 0;
+    const size_t hi = big_endian ? 0 : 1;
+    for (size_t i = 0; i + 1 < len && stats.total < limit; i += 2)
+    {
+      const unsigned int c = (unsigned int)s[i + hi] << 8 | s[i + 1 - hi];
+      stats.total++;
+      if (in_range(c, 0xD800, 0xDBFF) && i + 3 < len)
+      {
+        const unsigned int d = (unsigned int)s[i + 2 + hi] << 8 | s[i + 3 - hi];
+        if (in_range(d, 0xDC00, 0xDFFF))
+        {
+          i += 2;
+          continue;
+        }
+      }
+      if (in_range(c, 0xD800, 0xDFFF) || (c < 0x20 && c != '\t' && c != '\n' && c != '\r')
+          || c == 0xFFFE || c == 0xFFFF)
+        stats.invalid++;
+      else if (c < 0x80 || in_range(c, 0x3000, 0x30FF) || in_range(c, 0x3400, 0x4DBF) ||
+          in_range(c, 0x4E00, 0x9FFF) || in_range(c, 0xAC00, 0xD7A3) ||
+          in_range(c, 0xFF00, 0xFFEF))
+        stats.frequent++;
+      stats.kana += in_range(c, 0x3040, 0x30FF);
+      ascii_pairs += in_range(s[i], 0x20, 0x7E) && in_range(s[i + 1], 0x20, 0x7E) &&
+          !in_range(c, 0x3000, 0x30FF);
+      wide += c > 0xFF;
+      low += c > 0xFF && (c & 0xFF) < 0x40;
+    }
+    if (ascii_pairs * 2 > stats.total || low * 10 < wide)
+      stats.frequent = 0;
+    return stats;
+  }
+} // namespace mb_detail
+
+/**
+ * Guess the encoding of the string from a sample of its first bytes.
+ * A BOM decides alone. Otherwise the sample is tested for utf16 by its
+ * zero bytes, for ascii and for utf8 validity, and the legacy encodings are
+ * scored by how much of the sample decodes to their most frequent
+ * characters: level 1 hanzi of gb2312, the frequent hanzi block of big5,
+ * kana and level 1 kanji of jis0208, accented latin letters. Japanese
+ * encodings need kana, Chinese encodings are penalized by it. utf16 text
+ * without zero bytes is scored likewise on CJK, kana and hangul code
+ * units with valid surrogates, and only guessed from a score of 0.8.
+ *
+ * @param str     the string
+ * @param len     length of str
+ * @param sample  number of bytes to examine
+ * @return        guesses with a confidence in (0, 1], most likely first;
+ *                the confidence is 1 only for a BOM or pure ascii
+ */
+inline std::vector<encoding_guess> detect_encoding(const char* str, size_t len,
+    size_t sample = 65536)
+{
+  using namespace mb_detail;
+  const unsigned char* s = (const unsigned char *)str;
+  std::vector<encoding_guess> guesses;
+  if (len >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF)
+    guesses.push_back({ encoding::utf8, 1.0 });
+  else if (len >= 2 && s[0] == 0xFF && s[1] == 0xFE)
+    guesses.push_back({ encoding::utf16le, 1.0 });
+  else if (len >= 2 && s[0] == 0xFE && s[1] == 0xFF)
+    guesses.push_back({ encoding::utf16be, 1.0 });
+  if (!guesses.empty())
+    return guesses;
+
+  const bool whole = len <= sample;
+  len = std::min(len, sample);
+  // utf16 text of latin scripts has a zero in every other byte. That of
+  // other scripts is scored with the legacy encodings below.
+  size_t zeros[2];
+  simd_detail::count_zero_bytes(str, len, zeros);
+  const size_t pairs = len / 2;
+  for (int odd = 0; odd < 2; odd++)
+  {
+    if (zeros[odd] * 4 > pairs && zeros[!odd] * 8 < zeros[odd])
+    {
+      double confidence = std::min(0.99, 0.5 + double(zeros[odd]) / pairs);
+      guesses.push_back({ odd ? encoding::utf16le : encoding::utf16be, confidence });
+      return guesses;
+    }
+  }
+
+  if (simd_detail::ascii_prefix(str, len) == len)
+  {
+    guesses.push_back({ encoding::ascii, 1.0 });
+    return guesses;
+  }
+
+  // A few valid utf8 sequences are already unlikely in any other encoding.
+  // Valid blocks are checked with SIMD and the rest decoded.
+  sample_stats utf8 = { 0, 0, 0, 0 };
+  const size_t valid = simd_detail::utf8_valid_prefix(str, len, utf8.total);
+  utf8.frequent = utf8.total;
+  utf8 = scan<utf8_codec>(str + valid, len - valid,
+      [](const unsigned char*, size_t, size_t, char32_t) { return true; }, len, whole, utf8);
+  double confidence = utf8.invalid ? score(utf8) :
+      utf8.total ? std::min(0.99, 0.8 + 0.05 * utf8.total) : 0.5;
+  if (confidence > 0)
+    guesses.push_back({ encoding::utf8, confidence });
+  if (confidence >= 0.99)
+    return guesses;
+
+  // The legacy encodings are told apart well before the end of the sample.
+  const size_t limit = 4096;
+
+  sample_stats gb = scan<gb18030_codec>(str, len,
+      [](const unsigned char* c, size_t n, size_t, char32_t)
+      {
+        return n == 2 && c[1] >= 0xA1 &&
+            (in_range(c[0], 0xB0, 0xD7) || in_range(c[0], 0xA1, 0xA3));
+      }, limit, whole);
+  sample_stats big5 = scan<big5_codec>(str, len,
+      [](const unsigned char* c, size_t n, size_t, char32_t)
+      { return n == 2 && (in_range(c[0], 0xA4, 0xC6) || c[0] == 0xA1); }, limit, whole);
+  sample_stats sjis = scan<shift_jis_codec>(str, len,
+      [](const unsigned char* c, size_t n, size_t, char32_t)
+      { return n == 2 && (c[0] <= 0x83 || in_range(c[0], 0x88, 0x98)); }, limit, whole);
+  sample_stats eucjp = scan<euc_jp_codec>(str, len,
+      [](const unsigned char* c, size_t n, size_t, char32_t)
+      {
+        return n == 2 && (in_range(c[0], 0xA1, 0xA5) || in_range(c[0], 0xB0, 0xCF));
+      }, limit, whole);
+  // Accented letters, mostly followed by an ascii letter or space.
+  sample_stats latin1 = scan<latin1_codec>(str, len,
+      [](const unsigned char* c, size_t, size_t avail, char32_t cp)
+      {
+        return cp >= 0xC0 && cp != 0xD7 && cp != 0xF7 && (avail == 1 || c[1] < 0x80);
+      }, limit, whole);
+
+  const encoding_guess legacy[] = {
+    { encoding::gb18030, score(gb) * (1 - kana_ratio(gb)) },
+    { encoding::big5, score(big5) * (1 - kana_ratio(big5)) },
+    { encoding::shift_jis, score(sjis) * std::min(1.0, 0.5 + 2 * kana_ratio(sjis)) },
+    { encoding::euc_jp, score(eucjp) * std::min(1.0, 0.5 + 2 * kana_ratio(eucjp)) },
+    { encoding::latin1, score(latin1) },
+    { encoding::utf16le, score(scan_utf16(s, len, false, limit)) },
+    { encoding::utf16be, score(scan_utf16(s, len, true, limit)) }
+  };
+  for (const encoding_guess& guess : legacy)
+    if (guess.confidence > 0 && (guess.confidence >= 0.8 ||
+        (guess.enc != encoding::utf16le && guess.enc != encoding::utf16be)))
+      guesses.push_back(guess);
+  std::stable_sort(guesses.begin(), guesses.end(),
+      [](const encoding_guess& a, const encoding_guess& b)
+      { return a.confidence > b.confidence; });
+  return guesses;
+}
+
+inline std::vector<encoding_guess> detect_encoding(const std::string& str,
+    size_t sample = 65536)
+{ return detect_encoding(str.data(), str.size(), sample); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+inline std::vector<encoding_guess> detect_encoding(std::string_view str,
+    size_t sample = 65536)
+{ return detect_encoding(str.data(), str.size(), sample); }
+#endif
+
+// Capacity growth policies for ustring. The policy decides the new capacity
+// when a ustring has to grow from __old_capacity to hold __capacity units.
+// Define STRINGUTILS_GROWTH_POLICY to one of these (or a struct with the same
+// static member) before including this header to change the default.
+namespace growth_policy {
+  // Allocate exactly what is requested, for strings built once.
+  struct exact
+  {
+    static size_t
+    grow(size_t __capacity, size_t /* __old_capacity */) noexcept
+    { return __capacity; }
+  };
+
+  // Grow geometrically by a factor of 1.5.
+  struct factor_1_5
+  {
+    static size_t
+    grow(size_t __capacity, size_t __old_capacity) noexcept
+    {
+      const size_t __grown = __old_capacity + (__old_capacity >> 1);
+      return __capacity > __old_capacity && __capacity < __grown ? __grown : __capacity;
+    }
+  };
+
+  // Grow geometrically by a factor of 2.
+  struct factor_2
+  {
+    static size_t
+    grow(size_t __capacity, size_t __old_capacity) noexcept
+    {
+      const size_t __grown = __old_capacity << 1;
+      return __capacity > __old_capacity && __capacity < __grown ? __grown : __capacity;
+    }
+  };
+}
+
+#ifndef STRINGUTILS_GROWTH_POLICY
+  #define STRINGUTILS_GROWTH_POLICY growth_policy::factor_2
+#endif
+
+// Base class for unicode string
+template <typename _CodeT>
+class ustring
+{
+  public:
+    // member types
+    using traits_type                 = std::char_traits<_CodeT>;
+    using size_type                   = size_t;
+    using pointer                     = _CodeT*;
+    using const_pointer               = const _CodeT*;
+    using reference                   = _CodeT&;
+    using const_reference             = const _CodeT&;
+    using iterator                    = __gnu_cxx::__normal_iterator<pointer, ustring>;
+    using const_iterator              = __gnu_cxx::__normal_iterator<const_pointer, ustring>;
+    using reverse_iterator            = std::reverse_iterator<iterator>;
+    using const_reverse_iterator      = std::reverse_iterator<const_iterator>;
+    
+    // member constants
+    static const size_t max_size = npos >> 2;
+
+  private:
+    void 
+    _M_capacity(size_type __capacity)
+    { _M_allocated_capacity = __capacity; }
+    
+    void 
+    _M_length(size_type __n)
+    { _M_len = __n; }
+
+    void
+    _M_set_length(size_type __n)
+    {
+      _M_invalidate(__n);
+      _M_length(__n);
+      _M_ptr[__n] = _CodeT(0);
+    }
+
+    // Called before the code units from __pos on are modified. The byte
+    // index keeps the samples of the untouched prefix.
+    void
+    _M_invalidate(size_type __pos) noexcept
+    {
+      #ifdef STRINGUTILS_USTRING_INDEX
+      if (__pos >= _M_index_len)
+        return;
+      size_type __k = __pos / _S_index_stride;
+      while (__k && _M_index[__k - 1]._M_pos > __pos)
+        __k--;
+      _M_index.resize(__k);
+      _M_index_len = __k ? _M_index[__k - 1]._M_pos : 0;
+      _M_index_bytes = __k ? _M_index[__k - 1]._M_bytes : 0;
+      #else
+      (void)__pos;
+      #endif
+    }
+
+    #ifdef STRINGUTILS_USTRING_INDEX
+    // Extend the byte index to the whole string. A sample is taken every
+    // _S_index_stride code units, moved past any high surrogate so that no
+    // sample splits a surrogate pair; sample k thus sits at code unit
+    // (k + 1) * stride or just after. Trailing high surrogates are left out
+    // of the index since an append may pair them. The const byte queries
+    // call this, so they may allocate, and a ustring must not be queried
+    // from several threads at once without a lock.
+    void
+    _M_build_index() const
+    {
+      size_type __end = _M_len;
+      while (sizeof(_CodeT) == 2 && __end && ((char32_t)_M_ptr[__end - 1] & 0xFC00) == 0xD800)
+        __end--;
+      for (;;)
+      {
+        size_type __q = (_M_index.size() + 1) * _S_index_stride;
+        if (__q > __end)
+          break;
+        while (sizeof(_CodeT) == 2 && ((char32_t)_M_ptr[__q - 1] & 0xFC00) == 0xD800)
+          __q++;
+        _M_index_bytes += _S_size_bytes(_M_ptr + _M_index_len, __q - _M_index_len);
+        _M_index_len = __q;
+        _M_index.push_back(_IndexSample{__q, _M_index_bytes});
+      }
+      _M_index_bytes += _S_size_bytes(_M_ptr + _M_index_len, __end - _M_index_len);
+      _M_index_len = __end;
+    }
+
+    // The last sample at or before code unit __pos, {0, 0} if none.
+    void
+    _M_index_lookup(size_type __pos, size_type& __cur_pos, size_type& __cur_bytes) const noexcept
+    {
+      size_type __k = std::min(__pos / _S_index_stride, _M_index.size());
+      while (__k && _M_index[__k - 1]._M_pos > __pos)
+        __k--;
+      __cur_pos = __k ? _M_index[__k - 1]._M_pos : 0;
+      __cur_bytes = __k ? _M_index[__k - 1]._M_bytes : 0;
+    }
+    #endif
+    
+    void 
+    _M_allocator(size_type __capacity)
+    { 
+      _M_ptr = (_CodeT *)malloc((__capacity + 1) * sizeof(_CodeT));
+      if (!_M_ptr)
+        std::__throw_bad_alloc();
+    }
+    
+    void
+    _M_destroy()
+    { free(_M_ptr); }
+    
+    void
+    _M_realloc(size_type __n)
+    { 
+      pointer __tmp = (_CodeT *)realloc(_M_ptr, (__n + 1) * sizeof(_CodeT));
+      if (__n && !__tmp)
+        std::__throw_bad_alloc();
+      _M_data(__tmp);
+    }
+
+    void
+    _M_data(pointer __p)
+    { _M_ptr = __p; }
+    
+    void
+    _M_erase(size_type __pos, size_type __n)
+    {
+      const size_type __how_much = _M_len - __pos - __n;
+      
+      _M_invalidate(__pos);
+      if (__how_much && __n)
+        _S_move(_M_ptr + __pos, _M_ptr + __pos + __n, __how_much);
+      
+      _M_set_length(_M_len - __n);
+    }
+
+    void 
+    _M_construct(const char* __str, size_type __n)
+    {
+      const size_type __m = _S_length(__str, __n);
+      _M_capacity(__m);
+      _M_allocator(_M_allocated_capacity);
+      const size_type __len = _M_assign(_M_ptr, __str, __n);
+      // The buffer is sized exactly, so the decoder must agree with _S_length.
+      __glibcxx_assert(__len == __m);
+      _M_set_length(__len);
+    }
+    
+    void
+    _M_construct(const _CodeT* __arr, size_type __n)
+    {
+      _M_capacity(__n);
+      _M_allocator(_M_allocated_capacity);
+      if (__n)
+        _M_assign(_M_ptr, __arr, __n);
+      _M_set_length(__n);
+    }
+    
+    // Construct from code units of another width, transcoding between
+    // utf16 and utf32 when exactly one side is utf16.
+    template <typename _UnitT>
+      void
+      _M_construct_units(const _UnitT* __arr, size_type __n)
+      {
+        if (sizeof(_CodeT) == 2 && sizeof(_UnitT) != 2)
+        {
+          size_type __len = __n;
+          for (size_type __i = 0; __i < __n; __i++)
+            __len += (char32_t)__arr[__i] > 0xFFFF && (char32_t)__arr[__i] <= 0x10FFFF;
+          _M_capacity(__len);
+          _M_allocator(_M_allocated_capacity);
+          _M_set_length(utf32_to_utf16(__arr, __n, _M_ptr));
+        }
+        else if (sizeof(_CodeT) != 2 && sizeof(_UnitT) == 2)
+        {
+          _M_capacity(__n);
+          _M_allocator(_M_allocated_capacity);
+          _M_set_length(utf16_to_utf32(__arr, __n, _M_ptr));
+        }
+        else
+          _M_construct(__arr, __arr + __n);
+      }
+
+    template<typename _InIterator>
+      void 
+      _M_construct(_InIterator __beg, _InIterator __end)
+    {
+      const size_type __n = __beg < __end ? __end - __beg : 0;
+      _M_capacity(__n);
+      _M_allocator(_M_allocated_capacity);
+      
+      for (size_type __i = 0; __i < __n; __i++)
+        _M_ptr[__i] = *(__beg + __i);
+      _M_set_length(__n);
+    }
+    
+    size_type
+    _M_assign(_CodeT* __d, const char* __s, size_type __n)
+    {
+      _M_invalidate(__d - _M_ptr);
+      return utf8_to_utf16(__s, __n, __d);
+    }
+    
+    void
+    _M_assign(_CodeT* __d, size_type __n, _CodeT __c)
+    {
+      _M_invalidate(__d - _M_ptr);
+      if (__n == 1)
+        *__d = __c;
+      else
+        simd_detail::fill(__d, __n, __c);
+    }
+    
+    void
+    _M_assign(_CodeT* __d, const _CodeT* __s, size_type __n)
+    {
+      _M_invalidate(__d - _M_ptr);
+      if (__n == 1)
+        *__d = *__s;
+      else
+        memcpy(__d, __s, __n * sizeof(_CodeT));
+    }
+    
+    size_type
+    _M_check(size_type __pos, const char* __s) const
+    {
+      if (__pos > this->size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           __s, __pos, this->size());
+      }
+      return __pos;
+    }
+
+    void
+    _M_check_length(size_type __n1, size_type __n2, const char* __s) const
+    {
+      if (max_size - (this->size() - __n1) < __n2)
+        std::__throw_length_error(__N(__s));
+    }
+    
+    size_type
+    _M_limit(size_type __pos, size_type __off) const noexcept
+    {
+      const bool __testoff = __off < this->size() - __pos;
+      return __testoff ? __off : this->size() - __pos;
+    }
+
+    ustring&
+    _M_replace(size_type __pos, size_type __n1, const _CodeT* __arr,
+        size_type __n2)
+    {
+      _M_check_length(__n1, __n2, "ustring::_M_replace");
+      _M_invalidate(__pos);
+      pointer __p = _M_ptr + __pos;
+      if (__n1 == __n2)
+      {
+        this->_S_copy(__p, __arr, __n2);
+        return *this;
+      }
+      
+      const size_type __new_size = _M_len + __n2 - __n1;
+      if (__new_size > this->capacity())
+      {
+        this->reserve(__new_size);
+        __p = _M_ptr + __pos;
+      }
+      this->_S_move(__p + __n2, __p + __n1, _M_len - __pos - __n1);
+      this->_S_copy(__p, __arr, __n2);
+      _M_set_length(__new_size);
+      return *this;
+    }
+
+    ustring&
+    _M_replace(size_type __pos, size_type __n1, size_type __n2, _CodeT __c)
+    {
+      _M_check_length(__n1, __n2, "ustring::_M_replace");
+      _M_invalidate(__pos);
+      pointer __p = _M_ptr + __pos;
+      if (__n1 == __n2)
+      {
+        this->_M_assign(__p, __n2, __c);
+        return *this;
+      }
+
+      const size_type __new_size = _M_len + __n2 - __n1;
+      if (__new_size > this->capacity())
+      {
+        this->reserve(__new_size);
+        __p = _M_ptr + __pos;
+      }
+      this->_S_move(__p + __n2, __p + __n1, _M_len - __pos - __n1);
+      this->_M_assign(__p, __n2, __c);
+      _M_set_length(__new_size);
+      return *this;
+    }
+
+    template <typename _InIterator>
+      ustring&
+      _M_replace(size_type __pos, size_type __n, 
+          _InIterator __k1, _InIterator __k2)
+      {
+        const size_type __size = __k1 < __k2 ? __k2 - __k1 : 0;
+        _M_invalidate(__pos);
+        pointer __p = _M_ptr + __pos;
+        if (__n == __size)
+        {
+          for (size_type __i = 0; __i < __n; __i++)
+            __p[__i] = *(__k1 + __i);
+          return *this;
+        }
+
+        const size_type __new_size = _M_len + __size - __n;
+        if (__new_size > this->capacity())
+        {
+          this->reserve(__new_size);
+          __p = _M_ptr + __pos;
+        }
+        this->_S_move(__p + __size, __p + __n, _M_len - __pos - __n);
+        for (size_type __i = 0; __i < __size; __i++)
+          __p[__i] = *(__k1 + __i);
+        _M_set_length(__new_size);
+        return *this;
+      }
+    
+    static void
+    _S_copy(_CodeT* __d, const _CodeT* __s, size_type __n)
+    {
+      if (__n == 1)
+        *__d = *__s;
+      else
+        memcpy(__d, __s, __n * sizeof(_CodeT));
+    }
+    
+    static void
+    _S_capacity(size_type& __capacity, size_type __old_capacity)
+    {
+      if (__capacity > max_size)
+        std::__throw_length_error(__N("ustring::_M_create"));
+
+      __capacity = STRINGUTILS_GROWTH_POLICY::grow(__capacity, __old_capacity);
+      if (__capacity > max_size)
+        __capacity = max_size;
+    }
+
+    // Number of code units needed to hold the decoded utf8 string.
+    static size_type
+    _S_length(const char* __str, size_type __n) noexcept
+    {
+      return sizeof(_CodeT) == 2 ? get_utf16_length(__str, __n) :
+        get_characters_number(__str, __n);
+    }
+    
+    #ifdef STRINGUTILS_USTRING_INDEX
+    static const size_type _S_index_stride = 64;
+
+    struct _IndexSample
+    {
+      size_type _M_pos;
+      size_type _M_bytes;
+    };
+    #endif
+
+    // Number of utf8 bytes of __n code units.
+    static size_type
+    _S_size_bytes(const _CodeT* __arr, size_type __n) noexcept
+    {
+      if (sizeof(_CodeT) == 2)
+        return get_utf16_bytes(__arr, __n);
+      size_type __ret = 0;
+      for (size_type __i = 0; __i < __n; __i++)
+        __ret += get_codepoint_bytes(__arr[__i]);
+      return __ret;
+    }
+
+    static void
+    _S_move(_CodeT* __d, const _CodeT* __s, size_type __n)
+    {
+      if (__n == 1)
+        *__d = *__s;
+      else
+        memmove(__d, __s, __n * sizeof(_CodeT));
+    }
+
+  public:
+    // constructors
+    ustring()
+    : _M_allocated_capacity(0), _M_len(0), _M_ptr(nullptr)
+    { }
+
+    ustring(size_type __n, _CodeT __c)
+    {
+      _M_capacity(__n);
+      _M_allocator(_M_allocated_capacity);
+      _M_assign(_M_ptr, __n, __c);
+      _M_set_length(__n);
+    }
+    
+    ustring(_CodeT* __arr, size_type __n, bool __copy)
+    : _M_allocated_capacity(__n), _M_len(__n), _M_ptr(__arr)
+    {
+      if (__copy) 
+        _M_construct(__arr, __n);
+    }
+    
+    ustring(const _CodeT* __arr, size_type __n)
+    { _M_construct(__arr, __n); }
+    
+    ustring(const _CodeT* __arr)
+    { _M_construct(__arr, codelen(__arr)); }
+
+    ustring(const char* __str, size_type __n)
+    { _M_construct(__str, __n); }
+
+    ustring(const char* __str)
+    { _M_construct(__str, strlen(__str)); }
+    
+    ustring(const std::string& __str)
+    { _M_construct(__str.data(), __str.size()); }
+    
+    ustring(const std::string& __str, size_type __pos, size_type __n = npos)
+    {
+      if (__pos > __str.size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           "basic_string", __pos, __str.size());
+      }
+      __n = std::min(__str.size() - __pos, __n);
+      _M_construct(__str.data() + __pos, __n);
+    }
+        
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring(std::string_view __str)
+    { _M_construct(__str.data(), __str.size()); }
+    #endif
+    
+    ustring(std::initializer_list<_CodeT> __l)
+    { _M_construct(__l.begin(), __l.end()); }
+       
+    template<typename _InputIterator,
+        typename = std::_RequireInputIter<_InputIterator>>
+      ustring(_InputIterator __beg, _InputIterator __end)
+    { _M_construct(__beg, __end); }
+    
+    ustring(const ustring& __str)
+    { _M_construct(__str._M_ptr, __str._M_len); }
+
+    ustring(const ustring& __str, size_type __pos, size_type __n = npos)
+    {
+      const _CodeT* __start = __str._M_ptr + __str._M_check(__pos, "ustring::ustring");
+      _M_construct(__start, __str._M_limit(__pos, __n));
+    }
+
+    // Convert between utf16_string and utf32_string without going through utf8.
+    template <typename _UnitT, typename = typename std::enable_if<
+        !std::is_same<_UnitT, _CodeT>::value>::type>
+      explicit
+      ustring(const ustring<_UnitT>& __str)
+      { _M_construct_units(__str.data(), __str.size()); }
+
+    ustring(ustring&& __str) noexcept
+    {
+      _M_data(__str._M_ptr);
+      _M_capacity(__str._M_allocated_capacity);
+      _M_length(__str._M_len);
+      __str._M_invalidate(0);
+      __str._M_data(nullptr);
+      __str._M_capacity(0);
+      __str._M_length(0);
+    }
+    
+    ustring& 
+    operator=(const std::string& __str)
+    { return this->assign(__str); }
+
+    ustring&
+    operator=(const ustring& __str)
+    { return this->assign(__str); }
+    
+    ustring&
+    operator=(const char* __str)
+    { return this->assign(__str, strlen(__str)); }
+
+    ustring&
+    operator=(const _CodeT* __str)
+    { return this->assign(__str, codelen(__str)); }
+
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring&
+    operator=(std::string_view __str)
+    { return this->assign(__str); }
+    #endif
+
+    ustring&
+    operator=(std::initializer_list<_CodeT> __l)
+    { return this->assign(__l.begin(), __l.end()); }
+
+    ustring&
+    operator=(_CodeT __c)
+    {
+      this->assign(1, __c);
+      return *this;
+    }
+
+    ustring&
+    operator=(ustring&& __str) noexcept
+    {
+      this->swap(__str);
+      return *this;
+    }
+    
+    ~ustring()
+    { _M_destroy(); }
+    
+    // iterator support
+    iterator
+    begin() noexcept
+    {
+      _M_invalidate(0);
+      return iterator(this->_M_ptr);
+    }
+    
+    const_iterator
+    begin() const noexcept
+    { return const_iterator(this->_M_ptr); }
+    
+    iterator
+    end() noexcept
+    {
+      _M_invalidate(0);
+      return iterator(this->_M_ptr + this->_M_len);
+    }
+    
+    const_iterator
+    end() const noexcept
+    { return const_iterator(this->_M_ptr + this->_M_len); }
+    
+    reverse_iterator
+    rbegin() noexcept
+    { return reverse_iterator(this->end()); }
+    
+    const_reverse_iterator
+    rbegin() const noexcept
+    { return const_reverse_iterator(this->end()); }
+    
+    reverse_iterator
+    rend() noexcept
+    { return reverse_iterator(this->begin()); }
+    
+    const_reverse_iterator
+    rend() const noexcept
+    { return const_reverse_iterator(this->begin()); }
+    
+    const_iterator
+    cbegin() const noexcept
+    { return const_iterator(this->_M_ptr); }
+    
+    const_iterator
+    cend() const noexcept
+    { return const_iterator(this->_M_ptr + this->_M_len); }
+    
+    const_reverse_iterator
+    crbegin() const noexcept
+    { return const_reverse_iterator(this->end()); }
+    
+    const_reverse_iterator
+    crend() const noexcept
+    { return const_reverse_iterator(this->begin()); }
+    
+    // observers
+    size_type
+    size() const noexcept
+    { return _M_len; }
+    
+    size_type
+    length() const noexcept
+    { return _M_len; }
+    
+    size_type
+    capacity() const noexcept
+    { return _M_allocated_capacity; }
+    
+    size_type
+    size_bytes() const STRINGUTILS_INDEX_NOEXCEPT
+    {
+      #ifdef STRINGUTILS_USTRING_INDEX
+      _M_build_index();
+      return _M_index_bytes + 3 * (_M_len - _M_index_len);
+      #else
+      return _S_size_bytes(_M_ptr, _M_len);
+      #endif
+    }
+
+    // Return the number of code points, a surrogate pair counts once.
+    size_type
+    size_codepoints() const noexcept
+    {
+      if (sizeof(_CodeT) != 2)
+        return _M_len;
+      size_type __ret = _M_len;
+      for (size_type __i = 1; __i < _M_len; __i++)
+        if (((char32_t)_M_ptr[__i] & 0xFC00) == 0xDC00 &&
+            ((char32_t)_M_ptr[__i - 1] & 0xFC00) == 0xD800)
+          __ret--;
+      return __ret;
+    }
+    
+    bool
+    empty() const noexcept
+    { return this->_M_len == 0; }
+    
+    // element access
+    pointer
+    data() noexcept
+    {
+      _M_invalidate(0);
+      return _M_ptr;
+    }
+    
+    const_pointer
+    data() const noexcept
+    { return _M_ptr; }
+    
+    reference
+    operator[](size_type __pos) noexcept
+    {
+      __glibcxx_assert(__pos <= _M_len);
+      _M_invalidate(__pos);
+      return _M_ptr[__pos];
+    }
+    
+    const_reference
+    operator[](size_type __pos) const noexcept
+    {
+      __glibcxx_assert(__pos <= _M_len);
+      return _M_ptr[__pos];
+    }
+    
+    reference
+    at(size_type __pos) 
+    {
+      if (__pos >= _M_len)
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
+               "this->size() (which is %zu)"),
+           "ustring::at", __pos, _M_len);
+      }
+      _M_invalidate(__pos);
+      return _M_ptr[__pos];
+    }
+    
+    const_reference
+    at(size_type __pos) const 
+    {
+      if (__pos >= _M_len)
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
+               "this->size() (which is %zu)"),
+           "ustring::at", __pos, _M_len);
+      }
+      return _M_ptr[__pos];
+    }
+    
+    reference
+    front() noexcept
+    { return operator[](0); }
+    
+    const_reference
+    front() const noexcept
+    { return operator[](0); }
+    
+    reference
+    back() noexcept
+    { 
+      __glibcxx_assert(!empty());
+      return operator[](_M_len - 1); 
+    }
+    
+    const_reference
+    back() const noexcept
+    { 
+      __glibcxx_assert(!empty());
+      return operator[](_M_len - 1); 
+    }
+
+    // preallocate memory
+    void
+    reserve(size_type __res = 0)
+    {
+      // Make sure we don't shrink below the current size.
+      if (__res < _M_len)
+        __res = _M_len;
+      
+      if (__res != _M_allocated_capacity)
+      {
+        _S_capacity(__res, _M_allocated_capacity);   
+        _M_realloc(__res);
+        _M_capacity(__res);
+      }
+    }
+    
+    void
+    resize(size_type __n, _CodeT __c)
+    {
+      const size_type __size = this->size();
+      if (__size < __n)
+        this->append(__n - __size, __c);
+      else if (__size > __n)
+        this->_M_set_length(__n);
+    }
+    
+    void
+    resize(size_type __n)
+    { this->resize(__n, _CodeT(0)); }
+    
+    void
+    clear() noexcept
+    { _M_set_length(0); }
+
+    void
+    shrink_to_fit() noexcept
+    {
+      if (this->capacity() > this->size())
+        reserve(0);
+    }
+
+    // Make room for __n code units and let __op(data(), __n) write them in
+    // place, returning the final length, as std::string::resize_and_overwrite.
+    template <typename _Operation>
+      void
+      resize_and_overwrite(size_type __n, _Operation __op)
+      {
+        _M_check_length(size_type(0), __n > _M_len ? __n - _M_len : 0,
+            "ustring::resize_and_overwrite");
+        _M_invalidate(0);
+        if (!_M_ptr)
+        {
+          _M_capacity(__n);
+          _M_allocator(_M_allocated_capacity);
+        }
+        else if (__n > this->capacity())
+          this->reserve(__n);
+        const size_type __len = __op(_M_ptr, __n);
+        __glibcxx_assert(__len <= __n);
+        _M_set_length(__len);
+      }
+    
+    void
+    push_back(_CodeT __c)
+    {
+      size_type __new_capacity = _M_len + 1;
+      if (__new_capacity > _M_allocated_capacity)
+      {
+        _S_capacity(__new_capacity, _M_allocated_capacity);
+        _M_realloc(__new_capacity);
+        _M_capacity(__new_capacity);
+      }
+
+      _M_ptr[_M_len] = __c;
+      _M_set_length(_M_len + 1);
+    }
+    
+    void
+    pop_back() noexcept
+    {
+      __glibcxx_assert(!empty());
+      _M_erase(_M_len - 1, 1);
+    }
+
+    ustring&
+    operator+=(const std::string& __str)
+    { return this->append(__str); }
+    
+    ustring&
+    operator+=(const char* __str)
+    { return this->append(__str, strlen(__str)); }
+    
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring&
+    operator+=(std::string_view __str)
+    { return this->append(__str); }
+    #endif
+    
+    ustring&
+    operator+=(const ustring& __str)
+    { return this->append(__str); }
+
+    ustring&
+    operator+=(const _CodeT* __arr)
+    { return this->append(__arr, codelen(__arr)); }
+    
+    ustring&
+    operator+=(std::initializer_list<_CodeT> __l)
+    { return this->append(__l.begin(), __l.end()); }
+    
+    ustring&
+    operator+=(_CodeT __c)
+    { 
+      this->push_back(__c);
+      return *this; 
+    }
+
+    ustring&
+    append(size_type __n, _CodeT __c)
+    {
+      if (__n)
+      {
+        _M_check_length(size_type(0), __n, "ustring::append");
+        const size_type __len = __n + _M_len;
+        if (__len > this->capacity())
+          this->reserve(__len);
+        _M_assign(_M_ptr + _M_len, __n, __c);
+        _M_set_length(__len);
+      }
+      return *this;
+    }
+    
+    ustring&
+    append(const std::string& __str)
+    { return this->append(__str.data(), __str.size()); }
+      
+    ustring&
+    append(const std::string& __str, size_type __pos, size_type __n = npos)
+    {
+      if (__pos > __str.size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           "basic_string", __pos, __str.size());       
+      }
+      __n = std::min(__str.size() - __pos, __n);
+      return this->append(__str.data() + __pos, __n);
+    }
+    
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring&
+    append(std::string_view __str)
+    { return this->append(__str.data(), __str.size()); }
+    #endif
+      
+    ustring&
+    append(const char* __str, size_type __n)
+    {
+      if (__n)
+      {
+        const size_type __m = _S_length(__str, __n);
+        _M_check_length(size_type(0), __m, "ustring::append");
+        const size_type __len = __m + _M_len;
+        if (__len > this->capacity())
+          this->reserve(__len);
+        const size_type __written = _M_assign(_M_ptr + _M_len, __str, __n);
+        __glibcxx_assert(__written == __m);
+        _M_set_length(__written + _M_len);
+      }
+      return *this;
+    }
+    
+    ustring&
+    append(const char* __str)
+    { return this->append(__str, strlen(__str)); }
+    
+    ustring&
+    append(const ustring& __str)
+    { return this->append(__str._M_ptr, __str._M_len); }
+    
+    ustring&
+    append(const ustring& __str, size_type __pos, size_type __n = npos)
+    {
+      return this->append(__str._M_ptr + __str._M_check(__pos, "ustring::append"),
+          __str._M_limit(__pos, __n));
+    }
+    
+    ustring&
+    append(const _CodeT* __arr, size_type __n)
+    {
+      if (__n)
+      {
+        _M_check_length(size_type(0), __n, "ustring::append");
+        const size_type __len = __n + _M_len;
+        if (__len > this->capacity())
+          this->reserve(__len);
+        _M_assign(_M_ptr + _M_len, __arr, __n);
+        _M_set_length(__len);
+      }
+      return *this;
+    }
+
+    ustring&
+    append(const _CodeT* __arr)
+    { return this->append(__arr, codelen(__arr)); }
+    
+    ustring&
+    append(std::initializer_list<_CodeT> __l)
+    { return this->append(__l.begin(), __l.end()); }
+    
+    template<class _InputIterator,
+        typename = std::_RequireInputIter<_InputIterator>>
+      ustring&
+      append(_InputIterator __first, _InputIterator __last)
+    {
+      const size_type __n = __first < __last ? __last - __first : 0;
+      if (__n)
+      {
+        _M_check_length(size_type(0), __n, "ustring::append");
+        const size_type __len = __n + _M_len;
+        if (__len > this->capacity())
+          this->reserve(__len);
+        for (size_type __i = 0; __i < __n; __i++)
+          _M_ptr[_M_len + __i] = *(__first + __i);
+        _M_set_length(__len);
+      }
+      return *this;
+    }
+
+    ustring&
+    assign(size_type __n, _CodeT __c)
+    {
+      if (__n > this->capacity())
+        this->reserve(__n);
+      else
+      {
+        const size_type __capacity = __n << 1;
+        if (__capacity < this->capacity())
+        {
+          _M_realloc(__capacity);
+          _M_capacity(__capacity);
+        }
+      }
+
+      if (__n)
+        _M_assign(_M_ptr, __n, __c);
+      _M_set_length(__n);
+      return *this;
+    }
+    
+    ustring&
+    assign(const std::string& __str)
+    { return this->assign(__str.data(), __str.size()); }
+    
+    ustring&
+    assign(const std::string& __str, size_type __pos, size_type __n = npos)
+    {
+      if (__pos > __str.size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           "basic_string", __pos, __str.size());
+      }
+      __n = std::min(__str.size() - __pos, __n);
+      return this->assign(__str.data() + __pos, __n);
+    }
+    
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring&
+    assign(std::string_view __str)
+    { return this->assign(__str.data(), __str.size()); }
+    #endif
+    
+    ustring& 
+    assign(const char* __str, size_type __n)
+    {
+      const size_type __m = _S_length(__str, __n);
+      if (__m > this->capacity())
+        this->reserve(__m);
+      else
+      {
+        const size_type __capacity = __m << 1;
+        if (__capacity < this->capacity())
+        {
+          _M_realloc(__capacity);
+          _M_capacity(__capacity);
+        }
+      }
+
+      if (__n)
+        __n = _M_assign(_M_ptr, __str, __n);
+      __glibcxx_assert(__n == __m);
+      _M_set_length(__n);
+      return *this;
+    }
+    
+    ustring&
+    assign(const char* __str)
+    { return this->assign(__str, strlen(__str)); }
+    
+    ustring&
+    assign(const ustring& __str)
+    { return this->assign(__str._M_ptr, __str._M_len); }
+    
+    ustring&
+    assign(const ustring& __str, size_type __pos, size_type __n = npos)
+    {
+      return this->assign(__str._M_ptr + __str._M_check(__pos, "ustring::assign"),
+          __str._M_limit(__pos, __n));
+    }
+    
+    ustring&
+    assign(const _CodeT* __arr, size_type __n)
+    {
+      if (__n > this->capacity())
+        this->reserve(__n);
+      else
+      {
+        const size_type __capacity = __n << 1;
+        if (__capacity < this->capacity())
+        {
+          _M_realloc(__capacity);
+          _M_capacity(__capacity);
+        }
+      }
+      
+      if (__n)
+        _M_assign(_M_ptr, __arr, __n);
+      _M_set_length(__n);
+      return *this;
+    }
+
+    ustring&
+    assign(const _CodeT* __arr)
+    { return this->assign(__arr, codelen(__arr)); }
+    
+    ustring&
+    assign(std::initializer_list<_CodeT> __l)
+    { return this->assign(__l.begin(), __l.end()); }
+    
+    template<class _InputIterator,
+        typename = std::_RequireInputIter<_InputIterator>>
+      ustring&
+      assign(_InputIterator __first, _InputIterator __last)
+    {
+      const size_type __n = __first < __last ? __last - __first : 0;
+      if (__n > this->capacity())
+        this->reserve(__n);
+      else
+      {
+        const size_type __capacity = __n << 1;
+        if (__capacity < this->capacity())
+        {
+          _M_realloc(__capacity);
+          _M_capacity(__capacity);
+        }
+      }
+      
+      _M_invalidate(0);
+      for (size_type __i = 0; __i < __n; __i++)
+        _M_ptr[__i] = *(__first + __i);
+      _M_set_length(__n);
+      return *this;
+    }
+
+    ustring&
+    assign(ustring&& __str) noexcept
+    { return *this = std::move(__str); }
+
+    ustring&
+    replace(size_type __pos, size_type __n, const ustring& __str)
+    { return this->replace(__pos, __n, __str._M_ptr, __str._M_len); }
+
+    ustring&
+    replace(size_type __pos1, size_type __n1, const ustring& __str,
+        size_type __pos2, size_type __n2 = npos)
+    {
+      return this->replace(__pos1, __n1, __str._M_ptr + 
+          __str._M_check(__pos2, "ustring::replace"),
+          __str._M_limit(__pos2, __n2));
+    }
+
+    ustring&
+    replace(size_type __pos, size_type __n1, const _CodeT* __arr,
+        size_type __n2)
+    {
+      return _M_replace(_M_check(__pos, "ustring::replace"), 
+          _M_limit(__pos, __n1), __arr, __n2);
+    }
+
+    ustring&
+    replace(size_type __pos, size_type __n, const _CodeT* __arr)
+    {
+      return _M_replace(_M_check(__pos, "ustring::replace"),
+          _M_limit(__pos, __n), __arr, codelen(__arr));
+    }
+    
+    ustring&
+    replace(size_type __pos, size_type __n1, size_type __n2, _CodeT __c)
+    {
+      return _M_replace(_M_check(__pos, "ustring::replace"),
+          _M_limit(__pos, __n1), __n2, __c);
+    }
+
+    ustring&
+    replace(const_iterator __i1, const_iterator __i2, const ustring& __str)
+    { return this->replace(__i1, __i2, __str._M_ptr, __str._M_len); }
+
+    ustring&
+    replace(const_iterator __i1, const_iterator __i2, const _CodeT* __arr,
+        size_type __n)
+    {
+      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
+      return this->replace(__i1 - begin(), __i2 - __i1, __arr, __n);
+    }
+
+    ustring&
+    replace(const_iterator __i1, const_iterator __i2, const _CodeT* __arr)
+    { return this->replace(__i1, __i2, __arr, codelen(__arr)); }
+
+    ustring&
+    replace(const_iterator __i1, const_iterator __i2, size_type __n, 
+        _CodeT __c)
+    {
+      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
+      return this->replace(__i1 - begin(), __i2 - __i1, __n, __c);
+    }
+
+    template<class _InputIterator,
+        typename = std::_RequireInputIter<_InputIterator>>
+      ustring&
+      replace(const_iterator __i1, const_iterator __i2,
+          _InputIterator __k1, _InputIterator __k2)
+    {
+      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
+      return _M_replace(__i1 - begin(), __i2 - __i1, __k1, __k2);
+    }
+
+    ustring&
+    replace(const_iterator __i1, const_iterator __i2,
+        std::initializer_list<_CodeT> __l)
+    { return this->replace(__i1, __i2, __l.begin(), __l.size()); }
+
+    iterator
+    insert(const_iterator __p, size_type __n, _CodeT __c)
+    {
+      __glibcxx_assert(__p >= begin() && __p <= end());
+      const size_type __pos = __p - begin();
+      _M_replace(__pos, size_type(0), __n, __c);
+      return iterator(_M_ptr + __pos);
+    }
+
+    template<class _InputIterator,
+        typename = std::_RequireInputIter<_InputIterator>>
+      iterator
+      insert(const_iterator __p, _InputIterator __beg, _InputIterator __end)
+    {
+      __glibcxx_assert(__p >= begin() && __p <= end());
+      const size_type __pos = __p - begin();
+      _M_replace(__pos, size_type(0), __beg, __end);
+      return iterator(_M_ptr + __pos);
+    }
+
+    iterator
+    insert(const_iterator __p, std::initializer_list<_CodeT> __l)
+    { return this->insert(__p, __l.begin(), __l.end()); }
+
+    ustring&
+    insert(size_type __pos, const ustring& __str)
+    { return this->replace(__pos, size_type(0), __str._M_ptr, __str._M_len); }
+
+    ustring&
+    insert(size_type __pos1, const ustring& __str, size_type __pos2,
+        size_type __n2 = npos)
+    { 
+      return this->replace(__pos1, size_type(0), __str._M_ptr + 
+          __str._M_check(__pos2, "ustring::insert"), 
+          __str._M_limit(__pos2, __n2)); 
+    }
+
+    ustring&
+    insert(size_type __pos, const _CodeT* __arr, size_type __n)
+    { return this->replace(__pos, size_type(0), __arr, __n); }
+
+    ustring&
+    insert(size_type __pos, const _CodeT* __arr)
+    { return this->replace(__pos, size_type(0), __arr, codelen(__arr)); }
+
+    ustring&
+    insert(size_type __pos, size_type __n, _CodeT __c)
+    { return _M_replace(_M_check(__pos, "ustring::insert"), size_type(0), __n, __c); }
+
+    iterator
+    insert(const_iterator __p, _CodeT __c)
+    {
+      __glibcxx_assert(__p >= begin() && __p <= end());
+      const size_type __pos = __p - begin();
+      _M_replace(__pos, size_type(0), size_type(1), __c);
+      return iterator(_M_ptr + __pos);
+    }
+
+    ustring& 
+    erase(size_type __pos = 0, size_type __n = npos)
+    {
+      _M_check(__pos, "ustring::erase");
+      if (__n == npos)
+        this->_M_set_length(__pos);
+      else if (__n != 0)
+        this->_M_erase(__pos, _M_limit(__pos, __n));
+      return *this; 
+    }
+    
+    iterator
+    erase(const_iterator __position)
+    {
+      __glibcxx_assert(__position >= begin() && 
+          __position < end());
+      const size_type __pos = __position - begin();
+      this->_M_erase(__pos, size_type(1));
+      return iterator(_M_ptr + __pos);
+    }
+    
+    iterator
+    erase(const_iterator __first, const_iterator __last)
+    {
+      __glibcxx_assert(__first >= begin() && __first <= __last &&
+          __last <= end());
+      const size_type __pos = __first - begin();
+      if (__last == end())
+        this->_M_set_length(__pos);
+      else
+        this->_M_erase(__pos, __last - __first);
+      return iterator(_M_ptr + __pos);
+    }
+
+    size_type
+    copy(_CodeT* __arr, size_type __n, size_type __pos = 0) const
+    {
+      _M_check(__pos, "ustring::copy");
+      __n = _M_limit(__pos, __n);
+      if (__n)
+        _S_copy(__arr, _M_ptr + __pos, __n);
+      return __n;
+    }
+
+    void swap(ustring& __str) noexcept
+    {
+      size_type __capacity = __str._M_allocated_capacity;
+      size_type __len = __str._M_len;
+      pointer __p = __str._M_ptr;
+
+      __str._M_capacity(this->_M_allocated_capacity);
+      __str._M_length(this->_M_len);
+      __str._M_data(this->_M_ptr);
+
+      _M_capacity(__capacity);
+      _M_length(__len);
+      _M_data(__p);
+      #ifdef STRINGUTILS_USTRING_INDEX
+      _M_index.swap(__str._M_index);
+      std::swap(_M_index_len, __str._M_index_len);
+      std::swap(_M_index_bytes, __str._M_index_bytes);
+      #endif
+    }
+
+    int
+    compare(const std::string& __str) const
+    { return this->compare(__str.data(), __str.size()); }
+
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    int 
+    compare(std::string_view __str) const
+    { return this->compare(__str.data(), __str.size()); }
+    #endif
+
+    int
+    compare(const std::string& __str, size_type __pos, size_type __n = npos) const
+    {
+      if (__pos > __str.size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           "basic_string", __pos, __str.size());
+      }
+      __n = std::min(__str.size() - __pos, __n);
+      return this->compare(__str.data() + __pos, __n);
+    }
+
+    int
+    compare(const char* __str, size_type __n) const
+    {
+      _CodeT __units[2];
+      width_type __num_bytes, __num_units;
+      size_type __cur = 0, __idx = 0;
+      while (__cur < __n)
+      {
+        __num_bytes = get_num_bytes_of_utf8_char(__str + __cur, __n - __cur);
+        if (sizeof(_CodeT) == 2)
+          __num_units = utf16_encode(utf8_decode<char32_t>(__str + __cur, __num_bytes),
+              __units);
+        else
+        {
+          __units[0] = utf8_decode<_CodeT>(__str + __cur, __num_bytes);
+          __num_units = 1;
+        }
+
+        for (width_type __i = 0; __i < __num_units; __i++, __idx++)
+        {
+          if (__idx == _M_len || _M_ptr[__idx] < __units[__i])
+            return -1;
+          else if (_M_ptr[__idx] > __units[__i])
+            return 1;
+        }
+        __cur += __num_bytes;
+      }
+      return __idx < _M_len ? 1 : 0;
+    }
+
+    int
+    compare(const char* __str) const
+    { return this->compare(__str, strlen(__str)); }
+
+    int 
+    compare(const ustring& __str) const
+    { return this->compare(__str._M_ptr, __str._M_len); }
+
+    int 
+    compare(const ustring& __str, size_type __pos, size_type __n = npos) const
+    {
+      return this->compare(0, _M_len, 
+          __str._M_ptr + __str._M_check(__pos, "ustring::compare"),
+          __str._M_limit(__pos, __n));
+    }
+
+    int 
+    compare(size_type __pos, size_type __n, const ustring& __str) const
+    { return this->compare(__pos, __n, __str._M_ptr, __str._M_len); }
+
+    int 
+    compare(size_type __pos1, size_type __n1, const ustring& __str,
+        size_type __pos2, size_type __n2 = npos) const
+    {
+      return this->compare(__pos1, __n1, 
+          __str._M_ptr + __str._M_check(__pos2, "ustring::compare"),
+          __str._M_limit(__pos2, __n2));
+    }
+
+    int
+    compare(const _CodeT* __arr, size_type __n) const
+    {
+      const size_type __size = std::min(__n, _M_len);
+      // Code units compare by value, not by their bytes in memory.
+      int __ret = __size ? traits_type::compare(_M_ptr, __arr, __size) : 0;
+      if (!__ret && __n != _M_len)
+        __ret = __n < _M_len ? 1 : -1;
+      return __ret;
+    }
+
+    int
+    compare(size_type __pos1, size_type __n1, const _CodeT* __arr,
+        size_type __n2) const
+    {
+      _M_check(__pos1, "ustring::compare");
+      __n1 = _M_limit(__pos1, __n1);
+
+      const size_type __size = std::min(__n1, __n2);
+      int __ret = __size ? traits_type::compare(_M_ptr + __pos1, __arr, __size) : 0;
+      if (!__ret && __n1 != __n2)
+        __ret = __n1 < __n2 ? -1 : 1;
+      return __ret;
+    }
+
+    int 
+    compare(const _CodeT* __arr) const
+    { return this->compare(__arr, codelen(__arr)); }
+
+    ustring
+    substr(size_type __pos = 0, size_type __n = npos) const
+    { return ustring(*this, _M_check(__pos, "ustring::substr"), __n); }
+
+    // search
+    size_type
+    find(const ustring& __str, size_type __pos = 0) const noexcept
+    { return this->find(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      if (__n == 0)
+        return __pos <= _M_len ? __pos : npos;
+      
+      if (__n <= _M_len)
+      {
+        for (; __pos <= _M_len - __n; __pos++)
+          if (_M_ptr[__pos] == __arr[0] &&
+              memcmp(_M_ptr + __pos + 1, __arr + 1, (__n - 1) * sizeof(_CodeT)) == 0)
+            return __pos;
+      }
+      return npos;
+    }
+
+    size_type
+    find(const _CodeT* __arr, size_type __pos = 0) const
+    { return this->find(__arr, __pos, codelen(__arr)); } 
+
+    size_type 
+    find(_CodeT __c, size_type __pos = 0) const noexcept
+    {
+      for (; __pos < _M_len; __pos++)
+        if (_M_ptr[__pos] == __c)
+          return __pos;
+      return npos;
+    }
+
+    size_type
+    rfind(const ustring& __str, size_type __pos = npos) const noexcept
+    { return this->rfind(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    rfind(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      if (__n <= _M_len)
+      {
+        __pos = std::min(_M_len - __n, __pos);
+        do
+        {
+          if (memcmp(_M_ptr + __pos, __arr, __n * sizeof(_CodeT)) == 0)
+            return __pos;
+        } while (__pos-- > 0);
+      }
+      return npos;
+    }
+
+    size_type
+    rfind(const _CodeT* __arr, size_type __pos = npos) const
+    { return this->rfind(__arr, __pos, codelen(__arr)); }
+
+    size_type
+    rfind(_CodeT __c, size_type __pos = npos) const noexcept
+    {
+      size_type __len = this->_M_len;
+      if (__len > 0)
+      {
+        __pos = std::min(--__len, __pos);
+        for (__pos++; __pos-- > 0; )
+          if (_M_ptr[__pos] == __c)
+            return __pos;
+      }
+      return npos;
+    }
+
+    size_type
+    find_first_of(const ustring& __str, size_type __pos = 0) const noexcept
+    { return this->find_first_of(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find_first_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      for (; __n && __pos < _M_len; __pos++)
+      {
+        for (size_type __i = 0; __i < __n; __i++)
+          if (__arr[__i] == _M_ptr[__pos])
+            return __pos;
+      }
+      return npos;
+    }
+
+    size_type
+    find_first_of(const _CodeT* __arr, size_type __pos = 0) const
+    { return this->find_first_of(__arr, __pos, codelen(__arr)); }
+
+    size_type
+    find_first_of(_CodeT __c, size_type __pos = 0) const noexcept
+    { return this->find(__c, __pos); }
+
+    size_type
+    find_last_of(const ustring& __str, size_type __pos = npos) const noexcept
+    { return this->find_last_of(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find_last_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      size_type __len = this->_M_len;
+      if (__len && __n)
+      {
+        __pos = std::min(--__len, __pos);
+        do
+        {
+          for (size_type __i = 0; __i < __n; __i++)
+            if (__arr[__i] == _M_ptr[__pos])
+              return __pos;
+        } while (__pos-- > 0);
+      }
+      return npos;
+    }
+
+    size_type
+    find_last_of(const _CodeT* __arr, size_type __pos = npos) const
+    { return this->find_last_of(__arr, __pos, codelen(__arr)); }
+
+    size_type
+    find_last_of(_CodeT __c, size_type __pos = npos) const noexcept
+    { return this->rfind(__c, __pos); }
+
+    size_type
+    find_first_not_of(const ustring& __str, size_type __pos = 0) const noexcept
+    { return this->find_first_not_of(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find_first_not_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      bool flag = true;
+      for (; __pos < _M_len; __pos++)
+      {
+        flag = true;
+        for (size_type __i = 0; __i < __n; __i++)
+        {
+          if (__arr[__i] == _M_ptr[__pos])
+          {
+            flag = false;
+            break;
+          }
+        }
+        if (flag)
+          return __pos;
+      }
+      return npos;
+    }
+
+    size_type
+    find_first_not_of(const _CodeT* __arr, size_type __pos = 0) const
+    { return this->find_first_not_of(__arr, __pos, codelen(__arr)); }
+
+    size_type
+    find_first_not_of(_CodeT __c, size_type __pos = 0) const noexcept
+    {
+      for (; __pos < _M_len; __pos++)
+        if (_M_ptr[__pos] != __c)
+          return __pos;
+      return npos;
+    }
+
+    size_type
+    find_last_not_of(const ustring& __str, size_type __pos = npos) const noexcept
+    { return this->find_last_not_of(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type 
+    find_last_not_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    {
+      bool flag = true;
+      size_type __len = this->_M_len;
+      if (__len)
+      {
+        __pos = std::min(--__len, __pos);
+        do
+        {
+          flag = true;
+          for (size_type __i = 0; __i < __n; __i++)
+          {
+            if (__arr[__i] == _M_ptr[__pos])
+            {
+              flag = false;
+              break;
+            }
+          }
+          if (flag)
+            return __pos;
+        } while (__pos-- > 0);
+      }
+      return npos;
+    }
+
+    size_type
+    find_last_not_of(const _CodeT* __arr, size_type __pos = npos) const
+    { return this->find_last_not_of(__arr, __pos, codelen(__arr)); }
+
+    size_type
+    find_last_not_of(_CodeT __c, size_type __pos = npos) const noexcept
+    {
+      size_type __len = this->_M_len;
+      if (__len)
+      {
+        __pos = std::min(--__len, __pos);
+        do
+        {
+          if (_M_ptr[__pos] != __c)
+            return __pos;
+        } while (__pos-- > 0);
+      }
+      return npos;
+    }
+
+    // convert to utf8 string
+    std::string 
+    to_string() const
+    { return encode(_M_ptr, _M_len); }
+
+    // Encode into __str, reusing its capacity.
+    void
+    to_string(std::string& __str) const
+    {
+      __str.clear();
+      this->append_to(__str);
+    }
+
+    // Append the utf8 encoding to __str. When __str has room for the longest
+    // possible encoding, the string is encoded in a single pass; otherwise
+    // the exact size is computed first so that __str grows only once.
+    void
+    append_to(std::string& __str) const
+    {
+      const size_type __old = __str.size();
+      size_type __bound = _M_len * (sizeof(_CodeT) == 2 ? 3 : 4);
+      if (__str.capacity() - __old < __bound)
+        __bound = this->size_bytes();
+      __str.resize(__old + __bound);
+      size_type __consumed;
+      size_type __bytes = encode(_M_ptr, _M_len, &__str[0] + __old, __bound, __consumed);
+      if (__consumed < _M_len)
+      {
+        // Only utf32 code points above U+1FFFFF take more than 4 bytes.
+        __str.resize(__old + __bytes + _S_size_bytes(_M_ptr + __consumed, _M_len - __consumed));
+        __bytes += encode(_M_ptr + __consumed, _M_len - __consumed, &__str[0] + __old + __bytes);
+      }
+      __str.resize(__old + __bytes);
+    }
+
+    /**
+     * Encode into __buf like snprintf: write only whole characters, at most
+     * __cap - 1 bytes followed by a null character.
+     *
+     * @param __buf   character buffer
+     * @param __cap   size of __buf
+     * @return        number of bytes of the whole utf8 encoding, the output
+     *                was truncated if it is not less than __cap
+     */
+    size_type
+    encode_into(char* __buf, size_type __cap) const STRINGUTILS_INDEX_NOEXCEPT
+    {
+      if (__cap == 0)
+        return this->size_bytes();
+      size_type __consumed;
+      const size_type __bytes = encode(_M_ptr, _M_len, __buf, __cap - 1, __consumed);
+      __buf[__bytes] = '\0';
+      return __bytes + _S_size_bytes(_M_ptr + __consumed, _M_len - __consumed);
+    }
+
+    char*
+    to_c_str() const
+    {
+      char* __str = (char *)malloc(this->size_bytes() + 1);
+      if (!__str)
+        std::__throw_bad_alloc();
+      __str[encode(_M_ptr, _M_len, __str)] = '\0';
+      return __str;
+    }
+
+    // Return the number of utf8 bytes of the code unit. For utf16 the high
+    // surrogate of a pair carries all 4 bytes and the low surrogate none.
+    width_type
+    get_unit_bytes(size_type __pos) const noexcept
+    {
+      __glibcxx_assert(__pos < _M_len);
+      if (sizeof(_CodeT) == 2 && ((char32_t)_M_ptr[__pos] & 0xF800) == 0xD800)
+      {
+        char32_t __cp;
+        if (((char32_t)_M_ptr[__pos] & 0xFC00) == 0xDC00)
+          return __pos > 0 && utf16_decode(_M_ptr + __pos - 1, __cp, 2) == 2 ? 0 : 3;
+        return utf16_decode(_M_ptr + __pos, __cp, _M_len - __pos) == 2 ? 4 : 3;
+      }
+      return get_codepoint_bytes(_M_ptr[__pos]);
+    }
+
+    // Return the code point starting at code unit __pos, joining a utf16
+    // surrogate pair. Use next_codepoint() to iterate by code point.
+    char32_t
+    codepoint_at(size_type __pos) const noexcept
+    {
+      __glibcxx_assert(__pos < _M_len);
+      if (sizeof(_CodeT) != 2)
+        return (char32_t)_M_ptr[__pos];
+      char32_t __cp;
+      utf16_decode(_M_ptr + __pos, __cp, _M_len - __pos);
+      return __cp;
+    }
+
+    // Return the code point starting at code unit __pos and advance __pos to
+    // the next code point. Iterating with begin() / end() visits code units.
+    char32_t
+    next_codepoint(size_type& __pos) const noexcept
+    {
+      __glibcxx_assert(__pos < _M_len);
+      if (sizeof(_CodeT) != 2)
+        return (char32_t)_M_ptr[__pos++];
+      char32_t __cp;
+      __pos += utf16_decode(_M_ptr + __pos, __cp, _M_len - __pos);
+      return __cp;
+    }
+
+    size_type
+    get_index(size_type __bytes) const STRINGUTILS_INDEX_NOEXCEPT
+    {
+      size_type __cur_pos = 0, __cur_bytes = 0;
+      #ifdef STRINGUTILS_USTRING_INDEX
+      _M_build_index();
+      if (!_M_index.empty())
+      {
+        // Binary search the last sample at or before __bytes.
+        size_type __lo = 0, __hi = _M_index.size();
+        while (__lo < __hi)
+        {
+          const size_type __mid = (__lo + __hi) >> 1;
+          if (_M_index[__mid]._M_bytes <= __bytes)
+            __lo = __mid + 1;
+          else
+            __hi = __mid;
+        }
+        if (__lo)
+        {
+          __cur_pos = _M_index[__lo - 1]._M_pos;
+          __cur_bytes = _M_index[__lo - 1]._M_bytes;
+        }
+      }
+      #endif
+      while (__cur_pos < _M_len)
+      {
+        if (__cur_bytes == __bytes)
+          return __cur_pos;
+        else if (__cur_bytes > __bytes)
+          return npos;
+        __cur_bytes += get_codepoint_bytes(next_codepoint(__cur_pos));
+      }
+      return npos;
+    }
+
+    size_type
+    get_byte_position(size_type __pos) const STRINGUTILS_INDEX_NOEXCEPT
+    {
+      __glibcxx_assert(__pos < _M_len);
+      size_type __cur_pos = 0, __cur_bytes = 0;
+      #ifdef STRINGUTILS_USTRING_INDEX
+      _M_build_index();
+      _M_index_lookup(__pos, __cur_pos, __cur_bytes);
+      #endif
+      while (__cur_pos < _M_len)
+      {
+        if (__cur_pos == __pos)
+          return __cur_bytes;
+        __cur_bytes += get_codepoint_bytes(next_codepoint(__cur_pos));
+      }
+      return npos;
+    }
+
+  private:
+    size_type _M_allocated_capacity;
+    size_type _M_len;
+    pointer   _M_ptr;
+
+    #ifdef STRINGUTILS_USTRING_INDEX
+    // utf8 bytes of the first _M_index_len code units, with samples.
+    mutable std::vector<_IndexSample>  _M_index;
+    mutable size_type                  _M_index_len = 0;
+    mutable size_type                  _M_index_bytes = 0;
+    #endif
+};
+
+// operator==
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) == 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) == 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) == 0; }
+
+// operator!=
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) != 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) != 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) != 0; }
+
+// operator>=
+template <typename _CodeT>
+inline bool
+operator>=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) <= 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator>=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) <= 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator>=(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator>=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) <= 0; }
+
+// operator<=
+template <typename _CodeT>
+inline bool
+operator<=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) >= 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator<=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) >= 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator<=(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) >= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) <= 0; }
+
+template <typename _CodeT>
+inline bool
+operator<=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) >= 0; }
+
+// operator>
+template <typename _CodeT>
+inline bool
+operator>(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) < 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator>(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) < 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator>(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) < 0; }
+
+// operator<
+template <typename _CodeT>
+inline bool
+operator<(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) > 0; }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline bool
+operator<(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{ return __lhs.compare(__rhs) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) > 0; }
+#endif
+
+template <typename _CodeT>
+inline bool
+operator<(const ustring<_CodeT>& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs, strlen(__rhs)) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const char* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, strlen(__lhs)) > 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{ return __lhs.compare(__rhs, codelen(__rhs)) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs, codelen(__lhs)) > 0; }
+
+// operator+
+// With STRINGUTILS_USE_CONCAT_EXPR the lvalue overloads are replaced by the
+// lazy concat_expr below.
+#ifndef STRINGUTILS_USE_CONCAT_EXPR
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __rhs.size());
+  __str.append(__lhs);
+  __str.append(__rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, const std::string& __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __rhs.size());
+  __str.append(__lhs);
+  __str.append(__rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const std::string& __lhs, const ustring<_CodeT>& __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __rhs.size());
+  __str.append(__lhs);
+  __str.append(__rhs);
+  return __str;
+}
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, std::string_view __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __rhs.size());
+  __str.append(__lhs);
+  __str.append(__rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(std::string_view __lhs, const ustring<_CodeT>& __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __rhs.size());
+  __str.append(__lhs);
+  __str.append(__rhs);
+  return __str;
+}
+#endif
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, const char* __rhs)
+{
+  const size_t __len = strlen(__rhs);
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __len);
+  __str.append(__lhs);
+  __str.append(__rhs, __len);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const char* __lhs, const ustring<_CodeT>& __rhs)
+{
+  const size_t __len = strlen(__lhs);
+  ustring<_CodeT> __str;
+  __str.reserve(__len + __rhs.size());
+  __str.append(__lhs, __len);
+  __str.append(__rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
+{
+  const size_t __len = codelen(__rhs);
+  ustring<_CodeT> __str;
+  __str.reserve(__lhs.size() + __len);
+  __str.append(__lhs);
+  __str.append(__rhs, __len);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
+{
+  const size_t __len = codelen(__lhs);
+  ustring<_CodeT> __str;
+  __str.reserve(__len + __rhs.size());
+  __str.append(__lhs, __len);
+  __str.append(__rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, _CodeT __rhs)
+{
+  ustring<_CodeT> __str(__lhs);
+  __str.append(1, __rhs);
+  return __str;
+}
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(_CodeT __lhs, const ustring<_CodeT>& __rhs)
+{
+  ustring<_CodeT> __str;
+  __str.reserve(__rhs.size() + 1);
+  __str.append(1, __lhs);
+  __str.append(__rhs);
+  return __str;
+}
+
+#endif // STRINGUTILS_USE_CONCAT_EXPR
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(ustring<_CodeT>&& __lhs, const ustring<_CodeT>& __rhs)
+{ return std::move(__lhs.append(__rhs)); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const ustring<_CodeT>& __lhs, ustring<_CodeT>&& __rhs)
+{ return std::move(__rhs.insert(0, __lhs)); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(ustring<_CodeT>&& __lhs, ustring<_CodeT>&& __rhs)
+{ return std::move(__lhs.append(__rhs)); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(ustring<_CodeT>&& __lhs, const _CodeT* __rhs)
+{ return std::move(__lhs.append(__rhs, codelen(__rhs))); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(const _CodeT* __lhs, ustring<_CodeT>&& __rhs)
+{ return std::move(__rhs.insert(0, __lhs)); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(ustring<_CodeT>&& __lhs, _CodeT __rhs)
+{ return std::move(__lhs.append(1, __rhs)); }
+
+template <typename _CodeT>
+inline ustring<_CodeT>
+operator+(_CodeT __lhs, ustring<_CodeT>&& __rhs)
+{ return std::move(__rhs.insert(0, 1, __lhs)); }
+
+// Concatenation of several pieces into a single allocation: the length of
+// every piece is computed once, then each piece is written (utf8 pieces
+// decoded) straight into the destination.
+namespace concat_detail
+{
+  template <typename _CodeT, typename _Tp>
+  struct piece
+  { };
+
+  template <typename _CodeT>
+  struct piece<_CodeT, ustring<_CodeT>>
+  {
+    using stored_type = const ustring<_CodeT>&;
+
+    static size_t
+    size(const ustring<_CodeT>& __s) noexcept
+    { return __s.size(); }
+
+    static _CodeT*
+    write(const ustring<_CodeT>& __s, _CodeT* __d) noexcept
+    {
+      if (__s.size())
+        memcpy(__d, __s.data(), __s.size() * sizeof(_CodeT));
+      return __d + __s.size();
+    }
+  };
+
+  template <typename _CodeT>
+  struct piece<_CodeT, const _CodeT*>
+  {
+    using stored_type = const _CodeT*;
+
+    static size_t
+    size(const _CodeT* __s) noexcept
+    { return codelen(__s); }
+
+    static _CodeT*
+    write(const _CodeT* __s, _CodeT* __d) noexcept
+    {
+      const size_t __n = codelen(__s);
+      memcpy(__d, __s, __n * sizeof(_CodeT));
+      return __d + __n;
+    }
+  };
+
+  template <typename _CodeT>
+  struct piece<_CodeT, _CodeT*> : piece<_CodeT, const _CodeT*>
+  { };
+
+  template <typename _CodeT, size_t _Nm>
+  struct piece<_CodeT, _CodeT[_Nm]> : piece<_CodeT, const _CodeT*>
+  { };
+
+  template <typename _CodeT>
+  struct piece<_CodeT, _CodeT>
+  {
+    using stored_type = _CodeT;
+
+    static size_t
+    size(_CodeT) noexcept
+    { return 1; }
+
+    static _CodeT*
+    write(_CodeT __c, _CodeT* __d) noexcept
+    {
+      *__d = __c;
+      return __d + 1;
+    }
+  };
+
+  template <typename _CodeT>
+  inline size_t
+  utf8_units(const char* __str, size_t __n) noexcept
+  {
+    return sizeof(_CodeT) == 2 ? get_utf16_length(__str, __n) :
+      get_characters_number(__str, __n);
+  }
+
+  template <typename _CodeT>
+  struct piece<_CodeT, std::string>
+  {
+    using stored_type = const std::string&;
+
+    static size_t
+    size(const std::string& __s) noexcept
+    { return utf8_units<_CodeT>(__s.data(), __s.size()); }
+
+    static _CodeT*
+    write(const std::string& __s, _CodeT* __d) noexcept
+    { return __d + utf8_to_utf16(__s.data(), __s.size(), __d); }
+  };
+
+  #if STRINGUTILS_CPLUSPLUS >= 201703L
+  template <typename _CodeT>
+  struct piece<_CodeT, std::string_view>
+  {
+    using stored_type = std::string_view;
+
+    static size_t
+    size(std::string_view __s) noexcept
+    { return utf8_units<_CodeT>(__s.data(), __s.size()); }
+
+    static _CodeT*
+    write(std::string_view __s, _CodeT* __d) noexcept
+    { return __d + utf8_to_utf16(__s.data(), __s.size(), __d); }
+  };
+  #endif
+
+  template <typename _CodeT>
+  struct piece<_CodeT, const char*>
+  {
+    using stored_type = const char*;
+
+    static size_t
+    size(const char* __s) noexcept
+    { return utf8_units<_CodeT>(__s, strlen(__s)); }
+
+    static _CodeT*
+    write(const char* __s, _CodeT* __d) noexcept
+    { return __d + utf8_to_utf16(__s, strlen(__s), __d); }
+  };
+
+  template <typename _CodeT>
+  struct piece<_CodeT, char*> : piece<_CodeT, const char*>
+  { };
+
+  template <typename _CodeT, size_t _Nm>
+  struct piece<_CodeT, char[_Nm]> : piece<_CodeT, const char*>
+  { };
+
+  template <typename _CodeT>
+  inline size_t
+  size_all() noexcept
+  { return 0; }
+
+  template <typename _CodeT, typename _Tp, typename... _Args>
+  inline size_t
+  size_all(const _Tp& __x, const _Args&... __args) noexcept
+  { return piece<_CodeT, _Tp>::size(__x) + size_all<_CodeT, _Args...>(__args...); }
+
+  template <typename _CodeT>
+  inline _CodeT*
+  write_all(_CodeT* __d) noexcept
+  { return __d; }
+
+  template <typename _CodeT, typename _Tp, typename... _Args>
+  inline _CodeT*
+  write_all(_CodeT* __d, const _Tp& __x, const _Args&... __args) noexcept
+  { return write_all(piece<_CodeT, _Tp>::write(__x, __d), __args...); }
+} // namespace concat_detail
+
+/**
+ * @brief Concatenate ustrings, utf8 strings (std::string, std::string_view,
+ * const char*), code unit arrays and code units with a single allocation.
+ * @param __args  The pieces in order.
+ * @return The concatenated ustring<_CodeT>.
+ */
+template <typename _CodeT, typename... _Args>
+inline ustring<_CodeT>
+concat(const _Args&... __args)
+{
+  ustring<_CodeT> __str;
+  __str.resize_and_overwrite(concat_detail::size_all<_CodeT>(__args...),
+      [&](_CodeT* __d, size_t) -> size_t
+      { return concat_detail::write_all(__d, __args...) - __d; });
+  return __str;
+}
+
+template <typename _CodeT, typename... _Args>
+inline ustring<_CodeT>
+concat(const ustring<_CodeT>& __first, const _Args&... __args)
+{ return concat<_CodeT, ustring<_CodeT>, _Args...>(__first, __args...); }
+
+/**
+ * @brief Append the pieces to @a __str, growing it at most once.
+ * @param __str  The ustring to append to.
+ * @param __args  The pieces in order.
+ * @return @a __str.
+ */
+template <typename _CodeT, typename... _Args>
+inline ustring<_CodeT>&
+concat_to(ustring<_CodeT>& __str, const _Args&... __args)
+{
+  const size_t __len = __str.size();
+  __str.resize_and_overwrite(__len + concat_detail::size_all<_CodeT>(__args...),
+      [&](_CodeT* __d, size_t) -> size_t
+      { return concat_detail::write_all(__d + __len, __args...) - __d; });
+  return __str;
+}
+
+#ifdef STRINGUTILS_USE_CONCAT_EXPR
+// Lazy operator+: a + b + c builds a concat_expr holding references to the
+// operands, and converting it to ustring allocates once. Like QStringBuilder,
+// an expression must not outlive its operands, so don't keep it in `auto`.
+template <typename _CodeT, typename _Lhs, typename _Rhs>
+class concat_expr
+{
+  public:
+    concat_expr(const _Lhs& __lhs, const _Rhs& __rhs) noexcept
+    : _M_lhs(__lhs), _M_rhs(__rhs)
+    { }
+
+    size_t
+    size() const noexcept
+    {
+      return concat_detail::piece<_CodeT, _Lhs>::size(_M_lhs) +
+        concat_detail::piece<_CodeT, _Rhs>::size(_M_rhs);
+    }
+
+    _CodeT*
+    write(_CodeT* __d) const noexcept
+    {
+      __d = concat_detail::piece<_CodeT, _Lhs>::write(_M_lhs, __d);
+      return concat_detail::piece<_CodeT, _Rhs>::write(_M_rhs, __d);
+    }
+
+    ustring<_CodeT>
+    to_ustring() const
+    { return concat<_CodeT>(*this); }
+
+    operator ustring<_CodeT>() const
+    { return concat<_CodeT>(*this); }
+
+  private:
+    typename concat_detail::piece<_CodeT, _Lhs>::stored_type   _M_lhs;
+    typename concat_detail::piece<_CodeT, _Rhs>::stored_type   _M_rhs;
+};
+
+namespace concat_detail
+{
+  template <typename _CodeT, typename _Lhs, typename _Rhs>
+  struct piece<_CodeT, concat_expr<_CodeT, _Lhs, _Rhs>>
+  {
+    using stored_type = concat_expr<_CodeT, _Lhs, _Rhs>;
+
+    static size_t
+    size(const stored_type& __e) noexcept
+    { return __e.size(); }
+
+    static _CodeT*
+    write(const stored_type& __e, _CodeT* __d) noexcept
+    { return __e.write(__d); }
+  };
+
+  // The code unit type of an operand, void if it is not a ustring or an
+  // expression.
+  template <typename _Tp>
+  struct code_type
+  { using type = void; };
+
+  template <typename _CodeT>
+  struct code_type<ustring<_CodeT>>
+  { using type = _CodeT; };
+
+  template <typename _CodeT, typename _Lhs, typename _Rhs>
+  struct code_type<concat_expr<_CodeT, _Lhs, _Rhs>>
+  { using type = _CodeT; };
+
+  template <typename _CodeT, typename _Tp, typename = void>
+  struct is_piece : std::false_type
+  { };
+
+  template <typename _CodeT, typename _Tp>
+  struct is_piece<_CodeT, _Tp, decltype((void)&piece<_CodeT, _Tp>::size)>
+  : std::true_type
+  { };
+
+  // Whether the operand is a ustring or an expression.
+  template <typename _Tp>
+  struct is_operand
+  : std::integral_constant<bool, !std::is_void<typename code_type<_Tp>::type>::value>
+  { };
+
+  // The type of a + b, if any. The specializations are exclusive: both
+  // operands of one code unit type, or one of them and a piece of its type.
+  template <typename _Lhs, typename _Rhs,
+            typename _LT = typename code_type<_Lhs>::type,
+            typename _RT = typename code_type<_Rhs>::type,
+            typename = void>
+  struct expr_result
+  { };
+
+  template <typename _Lhs, typename _Rhs, typename _CodeT>
+  struct expr_result<_Lhs, _Rhs, _CodeT, _CodeT,
+      typename std::enable_if<!std::is_void<_CodeT>::value>::type>
+  { using type = concat_expr<_CodeT, _Lhs, _Rhs>; };
+
+  template <typename _Lhs, typename _Rhs, typename _CodeT>
+  struct expr_result<_Lhs, _Rhs, _CodeT, void,
+      typename std::enable_if<!std::is_void<_CodeT>::value &&
+                              is_piece<_CodeT, _Rhs>::value>::type>
+  { using type = concat_expr<_CodeT, _Lhs, _Rhs>; };
+
+  template <typename _Lhs, typename _Rhs, typename _CodeT>
+  struct expr_result<_Lhs, _Rhs, void, _CodeT,
+      typename std::enable_if<!std::is_void<_CodeT>::value &&
+                              is_piece<_CodeT, _Lhs>::value>::type>
+  { using type = concat_expr<_CodeT, _Lhs, _Rhs>; };
+} // namespace concat_detail
+
+// Only viable when an operand is a ustring or an expression, so that ADL
+// doesn't offer it for std::string or iterator arithmetic.
+template <typename _Lhs, typename _Rhs,
+          typename = typename std::enable_if<concat_detail::is_operand<_Lhs>::value ||
+                                             concat_detail::is_operand<_Rhs>::value>::type>
+inline typename concat_detail::expr_result<_Lhs, _Rhs>::type
+operator+(const _Lhs& __lhs, const _Rhs& __rhs) noexcept
+{ return typename concat_detail::expr_result<_Lhs, _Rhs>::type(__lhs, __rhs); }
+
+template <typename _CodeT, typename _Lhs, typename _Rhs>
+inline ustring<_CodeT>&
+operator+=(ustring<_CodeT>& __str, const concat_expr<_CodeT, _Lhs, _Rhs>& __e)
+{ return concat_to(__str, __e); }
+
+template <typename _CodeT, typename _Lhs, typename _Rhs>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const concat_expr<_CodeT, _Lhs, _Rhs>& __rhs)
+{ return __lhs == __rhs.to_ustring(); }
+
+template <typename _CodeT, typename _Lhs, typename _Rhs>
+inline bool
+operator==(const concat_expr<_CodeT, _Lhs, _Rhs>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.to_ustring() == __rhs; }
+#endif // STRINGUTILS_USE_CONCAT_EXPR
+
+using utf16_string = ustring<char16_t>;
+using utf32_string = ustring<char32_t>;
+
+// Unicode string with adaptive storage (Latin-1 / UCS-2 / UCS-4): every code
+// point takes 1, 2 or 4 bytes depending on the largest code point held, and the
+// storage is widened on demand when a wider code point is inserted. Indexing
+// stays O(1) and the API mirrors ustring, with code points returned by value.
+class compact_ustring
+{
+  public:
+    // member types
+    using size_type                   = size_t;
+    using value_type                  = char32_t;
+
+    // member constants
+    static const size_t max_size = npos >> 2;
+
+  private:
+    static width_type
+    _S_width(char32_t __c) noexcept
+    { return __c <= 0xFF ? 1 : (__c <= 0xFFFF ? 2 : 4); }
+
+    template <typename _UnitT>
+      static _UnitT
+      _S_max_unit() noexcept
+      { return _UnitT(-1); }
+
+    void
+    _M_allocator(size_type __capacity, width_type __width)
+    {
+      _M_ptr = malloc((__capacity + 1) * __width);
+      if (!_M_ptr)
+        std::__throw_bad_alloc();
+    }
+
+    void
+    _M_destroy()
+    { free(_M_ptr); }
+
+    char32_t
+    _M_get(size_type __pos) const noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:   return ((const std::uint8_t *)_M_ptr)[__pos];
+        case 2:   return ((const std::uint16_t *)_M_ptr)[__pos];
+        default:  return ((const std::uint32_t *)_M_ptr)[__pos];
+      }
+    }
+
+    // The caller guarantees that __c fits in the current width.
+    void
+    _M_put(size_type __pos, char32_t __c) noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:   ((std::uint8_t *)_M_ptr)[__pos] = (std::uint8_t)__c; break;
+        case 2:   ((std::uint16_t *)_M_ptr)[__pos] = (std::uint16_t)__c; break;
+        default:  ((std::uint32_t *)_M_ptr)[__pos] = (std::uint32_t)__c; break;
+      }
+    }
+
+    template <typename _DestT, typename _SrcT>
+      static void
+      _S_convert(_DestT* __d, const _SrcT* __s, size_type __n) noexcept
+      {
+        if (sizeof(_DestT) == sizeof(_SrcT))
+          memcpy(__d, __s, __n * sizeof(_DestT));
+        else
+          for (size_type __i = 0; __i < __n; __i++)
+            __d[__i] = _DestT(__s[__i]);
+      }
+
+    template <typename _DestT>
+      static void
+      _S_convert(_DestT* __d, const void* __s, width_type __width,
+          size_type __n) noexcept
+      {
+        switch (__width)
+        {
+          case 1:   _S_convert(__d, (const std::uint8_t *)__s, __n); break;
+          case 2:   _S_convert(__d, (const std::uint16_t *)__s, __n); break;
+          default:  _S_convert(__d, (const std::uint32_t *)__s, __n); break;
+        }
+      }
+
+    // Copy __n code points stored with __width bytes into position __pos,
+    // the current width must not be narrower than __width.
+    void
+    _M_copy(size_type __pos, const void* __s, width_type __width,
+        size_type __n) noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:   _S_convert((std::uint8_t *)_M_ptr + __pos, __s, __width, __n); break;
+        case 2:   _S_convert((std::uint16_t *)_M_ptr + __pos, __s, __width, __n); break;
+        default:  _S_convert((std::uint32_t *)_M_ptr + __pos, __s, __width, __n); break;
+      }
+    }
+
+    // Reallocate the storage with at least __capacity code points of
+    // __width bytes, converting the existing code points.
+    void
+    _M_reshape(size_type __capacity, width_type __width)
+    {
+      if (__capacity > max_size)
+        std::__throw_length_error(__N("compact_ustring::_M_reshape"));
+      if (__width == _M_width)
+      {
+        void* __tmp = realloc(_M_ptr, (__capacity + 1) * __width);
+        if (!__tmp)
+          std::__throw_bad_alloc();
+        _M_ptr = __tmp;
+      }
+      else
+      {
+        void* __old = _M_ptr;
+        width_type __old_width = _M_width;
+        _M_allocator(__capacity, __width);
+        _M_width = __width;
+        _M_copy(0, __old, __old_width, _M_len);
+        free(__old);
+      }
+      _M_allocated_capacity = __capacity;
+    }
+
+    // Make room for __n more code points of at most __width bytes.
+    void
+    _M_grow(size_type __n, width_type __width)
+    {
+      if (max_size - _M_len < __n)
+        std::__throw_length_error(__N("compact_ustring::_M_grow"));
+      size_type __capacity = _M_len + __n;
+      if (__width < _M_width)
+        __width = _M_width;
+      if (__capacity > _M_allocated_capacity)
+        __capacity = STRINGUTILS_GROWTH_POLICY::grow(__capacity, _M_allocated_capacity);
+      else if (__width == _M_width)
+        return;
+      else
+        __capacity = _M_allocated_capacity;
+      _M_reshape(__capacity, __width);
+    }
+
+    // Call __f(index, code point) on the code points of the utf8 string,
+    // each a byte with the continuation bytes after it, and return their
+    // number. _S_scan and _S_decode must group the bytes alike.
+    template <typename _Func>
+      static size_type
+      _S_for_each(const char* __s, size_type __n, _Func __f) noexcept
+      {
+        size_type __cur = 0, __idx = 0;
+        width_type __num_bytes;
+        while (__cur < __n)
+        {
+          __num_bytes = get_num_bytes_of_utf8_char(__s + __cur, __n - __cur);
+          __f(__idx++, utf8_decode<char32_t>(__s + __cur, __num_bytes));
+          __cur += __num_bytes;
+        }
+        return __idx;
+      }
+
+    template <typename _UnitT>
+      static size_type
+      _S_decode(_UnitT* __d, const char* __s, size_type __n) noexcept
+      {
+        return _S_for_each(__s, __n,
+            [__d](size_type __i, char32_t __c) { __d[__i] = _UnitT(__c); });
+      }
+
+    // Return the width needed by the utf8 string and its number of code points.
+    static width_type
+    _S_scan(const char* __s, size_type __n, size_type& __count) noexcept
+    {
+      // The last ascii byte groups with a continuation byte after it.
+      size_type __cur = simd_detail::ascii_prefix(__s, __n);
+      if (__cur && __cur < __n && ((unsigned char)__s[__cur] & 0xC0) == 0x80)
+        __cur--;
+      if (__cur == __n)
+      {
+        __count = __n;
+        return 1;
+      }
+      char32_t __max = 0;
+      __count = __cur + _S_for_each(__s + __cur, __n - __cur,
+          [&__max](size_type, char32_t __c) { __max = std::max(__max, __c); });
+      return _S_width(__max);
+    }
+
+    // Append the utf8 string, __count and __width come from _S_scan.
+    void
+    _M_append_utf8(const char* __s, size_type __n, size_type __count,
+        width_type __width)
+    {
+      if (!__n)
+        return;
+      _M_grow(__count, __width);
+      switch (_M_width)
+      {
+        case 1:
+          if (__count == __n)
+            memcpy((std::uint8_t *)_M_ptr + _M_len, __s, __n);
+          else
+            _S_decode((std::uint8_t *)_M_ptr + _M_len, __s, __n);
+          break;
+        case 2:   _S_decode((std::uint16_t *)_M_ptr + _M_len, __s, __n); break;
+        default:  _S_decode((std::uint32_t *)_M_ptr + _M_len, __s, __n); break;
+      }
+      _M_len += __count;
+    }
+
+    template <typename _UnitT>
+      static size_type
+      _S_find(const _UnitT* __p, size_type __len, char32_t __c,
+          size_type __pos) noexcept
+      {
+        if (__c > _S_max_unit<_UnitT>())
+          return npos;
+        if (sizeof(_UnitT) == 1)
+        {
+          if (__pos >= __len)
+            return npos;
+          const void* __r = memchr(__p + __pos, int(__c), __len - __pos);
+          return __r ? (const _UnitT *)__r - __p : npos;
+        }
+        const _UnitT __u = _UnitT(__c);
+        for (; __pos < __len; __pos++)
+          if (__p[__pos] == __u)
+            return __pos;
+        return npos;
+      }
+
+    template <typename _UnitT>
+      static size_type
+      _S_rfind(const _UnitT* __p, size_type __len, char32_t __c,
+          size_type __pos) noexcept
+      {
+        if (__len == 0 || __c > _S_max_unit<_UnitT>())
+          return npos;
+        const _UnitT __u = _UnitT(__c);
+        for (__pos = std::min(__len - 1, __pos) + 1; __pos-- > 0; )
+          if (__p[__pos] == __u)
+            return __pos;
+        return npos;
+      }
+
+    template <typename _UnitT1, typename _UnitT2>
+      static int
+      _S_compare(const _UnitT1* __p1, const _UnitT2* __p2, size_type __n) noexcept
+      {
+        if (sizeof(_UnitT1) == 1 && sizeof(_UnitT2) == 1)
+          return memcmp(__p1, __p2, __n);
+        for (size_type __i = 0; __i < __n; __i++)
+          if (char32_t(__p1[__i]) != char32_t(__p2[__i]))
+            return char32_t(__p1[__i]) < char32_t(__p2[__i]) ? -1 : 1;
+        return 0;
+      }
+
+    template <typename _UnitT>
+      static int
+      _S_compare(const _UnitT* __p1, const void* __p2, width_type __width,
+          size_type __n) noexcept
+      {
+        switch (__width)
+        {
+          case 1:   return _S_compare(__p1, (const std::uint8_t *)__p2, __n);
+          case 2:   return _S_compare(__p1, (const std::uint16_t *)__p2, __n);
+          default:  return _S_compare(__p1, (const std::uint32_t *)__p2, __n);
+        }
+      }
+
+    // Compare __n code points at __pos1 with __n code points of __str at __pos2.
+    int
+    _M_compare(size_type __pos1, const compact_ustring& __str, size_type __pos2,
+        size_type __n) const noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:
+          return _S_compare((const std::uint8_t *)_M_ptr + __pos1,
+              (const char *)__str._M_ptr + __pos2 * __str._M_width, __str._M_width, __n);
+        case 2:
+          return _S_compare((const std::uint16_t *)_M_ptr + __pos1,
+              (const char *)__str._M_ptr + __pos2 * __str._M_width, __str._M_width, __n);
+        default:
+          return _S_compare((const std::uint32_t *)_M_ptr + __pos1,
+              (const char *)__str._M_ptr + __pos2 * __str._M_width, __str._M_width, __n);
+      }
+    }
+
+    size_type
+    _M_check(size_type __pos, const char* __s) const
+    {
+      if (__pos > this->size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           __s, __pos, this->size());
+      }
+      return __pos;
+    }
+
+    size_type
+    _M_limit(size_type __pos, size_type __off) const noexcept
+    {
+      const bool __testoff = __off < this->size() - __pos;
+      return __testoff ? __off : this->size() - __pos;
+    }
+
+    const void*
+    _M_at(size_type __pos) const noexcept
+    { return (const char *)_M_ptr + __pos * _M_width; }
+
+  public:
+    // constructors
+    compact_ustring()
+    : _M_allocated_capacity(0), _M_len(0), _M_width(1), _M_ptr(nullptr)
+    { }
+
+    compact_ustring(size_type __n, char32_t __c)
+    : compact_ustring()
+    { this->append(__n, __c); }
+
+    compact_ustring(const char32_t* __arr, size_type __n)
+    : compact_ustring()
+    { this->append(__arr, __n); }
+
+    compact_ustring(const char* __str, size_type __n)
+    : compact_ustring()
+    { this->append(__str, __n); }
+
+    compact_ustring(const char* __str)
+    : compact_ustring()
+    { this->append(__str, strlen(__str)); }
+
+    compact_ustring(const std::string& __str)
+    : compact_ustring()
+    { this->append(__str.data(), __str.size()); }
+
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    compact_ustring(std::string_view __str)
+    : compact_ustring()
+    { this->append(__str.data(), __str.size()); }
+    #endif
+
+    template <typename _CodeT>
+      explicit
+      compact_ustring(const ustring<_CodeT>& __str)
+      : compact_ustring()
+      {
+        if (sizeof(_CodeT) == 2)
+        {
+          for (size_type __pos = 0; __pos < __str.size(); )
+            this->push_back(__str.next_codepoint(__pos));
+          return;
+        }
+        char32_t __max = 0;
+        for (size_type __i = 0; __i < __str.size(); __i++)
+          if (char32_t(__str[__i]) > __max)
+            __max = __str[__i];
+        _M_grow(__str.size(), _S_width(__max));
+        switch (_M_width)
+        {
+          case 1:   _S_convert((std::uint8_t *)_M_ptr, __str.data(), __str.size()); break;
+          case 2:   _S_convert((std::uint16_t *)_M_ptr, __str.data(), __str.size()); break;
+          default:  _S_convert((std::uint32_t *)_M_ptr, __str.data(), __str.size()); break;
+        }
+        _M_len = __str.size();
+      }
+
+    compact_ustring(const compact_ustring& __str)
+    : compact_ustring()
+    { this->append(__str); }
+
+    compact_ustring(compact_ustring&& __str) noexcept
+    : _M_allocated_capacity(__str._M_allocated_capacity), _M_len(__str._M_len),
+      _M_width(__str._M_width), _M_ptr(__str._M_ptr)
+    {
+      __str._M_allocated_capacity = 0;
+      __str._M_len = 0;
+      __str._M_width = 1;
+      __str._M_ptr = nullptr;
+    }
+
+    compact_ustring&
+    operator=(const compact_ustring& __str)
+    {
+      if (this != &__str)
+      {
+        this->clear();
+        this->append(__str);
+      }
+      return *this;
+    }
+
+    compact_ustring&
+    operator=(compact_ustring&& __str) noexcept
+    {
+      this->swap(__str);
+      return *this;
+    }
+
+    compact_ustring&
+    operator=(const std::string& __str)
+    {
+      this->clear();
+      return this->append(__str.data(), __str.size());
+    }
+
+    compact_ustring&
+    operator=(const char* __str)
+    {
+      this->clear();
+      return this->append(__str, strlen(__str));
+    }
+
+    ~compact_ustring()
+    { _M_destroy(); }
+
+    // observers
+    size_type
+    size() const noexcept
+    { return _M_len; }
+
+    size_type
+    length() const noexcept
+    { return _M_len; }
+
+    size_type
+    capacity() const noexcept
+    { return _M_allocated_capacity; }
+
+    // Return the number of bytes used by every code point.
+    width_type
+    width() const noexcept
+    { return _M_width; }
+
+    size_type
+    size_bytes() const noexcept
+    {
+      if (_M_width == 1)
+      {
+        size_type __ret = _M_len;
+        for (size_type __i = 0; __i < _M_len; __i++)
+          __ret += ((const std::uint8_t *)_M_ptr)[__i] >> 7;
+        return __ret;
+      }
+      size_type __ret = 0;
+      for (size_type __i = 0; __i < _M_len; __i++)
+        __ret += get_codepoint_bytes(_M_get(__i));
+      return __ret;
+    }
+
+    bool
+    empty() const noexcept
+    { return _M_len == 0; }
+
+    // element access
+    const void*
+    data() const noexcept
+    { return _M_ptr; }
+
+    char32_t
+    operator[](size_type __pos) const noexcept
+    {
+      __glibcxx_assert(__pos < _M_len);
+      return _M_get(__pos);
+    }
+
+    char32_t
+    at(size_type __pos) const
+    {
+      if (__pos >= _M_len)
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
+               "this->size() (which is %zu)"),
+           "compact_ustring::at", __pos, _M_len);
+      }
+      return _M_get(__pos);
+    }
+
+    char32_t
+    front() const noexcept
+    { return operator[](0); }
+
+    char32_t
+    back() const noexcept
+    {
+      __glibcxx_assert(!empty());
+      return operator[](_M_len - 1);
+    }
+
+    // preallocate memory
+    void
+    reserve(size_type __res = 0)
+    {
+      if (__res < _M_len)
+        __res = _M_len;
+      if (__res != _M_allocated_capacity)
+        _M_reshape(__res, _M_width);
+    }
+
+    void
+    resize(size_type __n, char32_t __c = 0)
+    {
+      if (_M_len < __n)
+        this->append(__n - _M_len, __c);
       else
-        memmove(__d, __s, __n * sizeof(_CodeT));
+        _M_len = __n;
+    }
+
+    void
+    clear() noexcept
+    { _M_len = 0; }
+
+    // Release unused capacity and narrow the storage to the widest code
+    // point still held.
+    void
+    shrink_to_fit()
+    {
+      char32_t __max = 0;
+      for (size_type __i = 0; __max <= 0xFFFF && __i < _M_len; __i++)
+        if (_M_get(__i) > __max)
+          __max = _M_get(__i);
+      if (_M_ptr && (_M_len < _M_allocated_capacity || _S_width(__max) < _M_width))
+        _M_reshape(_M_len, _S_width(__max));
+    }
+
+    // modifiers
+    void
+    push_back(char32_t __c)
+    {
+      _M_grow(1, _S_width(__c));
+      _M_put(_M_len++, __c);
+    }
+
+    void
+    pop_back() noexcept
+    {
+      __glibcxx_assert(!empty());
+      _M_len--;
+    }
+
+    compact_ustring&
+    operator+=(const compact_ustring& __str)
+    { return this->append(__str); }
+
+    compact_ustring&
+    operator+=(const std::string& __str)
+    { return this->append(__str.data(), __str.size()); }
+
+    compact_ustring&
+    operator+=(const char* __str)
+    { return this->append(__str, strlen(__str)); }
+
+    compact_ustring&
+    operator+=(char32_t __c)
+    {
+      this->push_back(__c);
+      return *this;
+    }
+
+    compact_ustring&
+    append(size_type __n, char32_t __c)
+    {
+      _M_grow(__n, _S_width(__c));
+      switch (_M_width)
+      {
+        case 1:   simd_detail::fill((std::uint8_t *)_M_ptr + _M_len, __n, (std::uint8_t)__c); break;
+        case 2:   simd_detail::fill((std::uint16_t *)_M_ptr + _M_len, __n, (std::uint16_t)__c); break;
+        default:  simd_detail::fill((std::uint32_t *)_M_ptr + _M_len, __n, (std::uint32_t)__c); break;
+      }
+      _M_len += __n;
+      return *this;
+    }
+
+    compact_ustring&
+    append(const compact_ustring& __str)
+    { return this->append(__str, 0, __str._M_len); }
+
+    compact_ustring&
+    append(const compact_ustring& __str, size_type __pos, size_type __n = npos)
+    {
+      __str._M_check(__pos, "compact_ustring::append");
+      __n = __str._M_limit(__pos, __n);
+      _M_grow(__n, __str._M_width);
+      _M_copy(_M_len, __str._M_at(__pos), __str._M_width, __n);
+      _M_len += __n;
+      return *this;
+    }
+
+    compact_ustring&
+    append(const char32_t* __arr, size_type __n)
+    {
+      char32_t __max = 0;
+      for (size_type __i = 0; __i < __n; __i++)
+        if (__arr[__i] > __max)
+          __max = __arr[__i];
+      _M_grow(__n, _S_width(__max));
+      _M_copy(_M_len, __arr, 4, __n);
+      _M_len += __n;
+      return *this;
+    }
+
+    compact_ustring&
+    append(const char* __str, size_type __n)
+    {
+      size_type __count;
+      width_type __width = _S_scan(__str, __n, __count);
+      _M_append_utf8(__str, __n, __count, __width);
+      return *this;
+    }
+
+    compact_ustring&
+    append(const char* __str)
+    { return this->append(__str, strlen(__str)); }
+
+    compact_ustring&
+    append(const std::string& __str)
+    { return this->append(__str.data(), __str.size()); }
+
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    compact_ustring&
+    append(std::string_view __str)
+    { return this->append(__str.data(), __str.size()); }
+    #endif
+
+    compact_ustring&
+    insert(size_type __pos, const compact_ustring& __str)
+    {
+      _M_check(__pos, "compact_ustring::insert");
+      if (this == &__str)
+      {
+        compact_ustring __tmp(__str);
+        return this->insert(__pos, __tmp);
+      }
+      const size_type __n = __str._M_len;
+      _M_grow(__n, __str._M_width);
+      char* __p = (char *)_M_ptr + __pos * _M_width;
+      memmove(__p + __n * _M_width, __p, (_M_len - __pos) * _M_width);
+      _M_copy(__pos, __str._M_ptr, __str._M_width, __n);
+      _M_len += __n;
+      return *this;
+    }
+
+    compact_ustring&
+    insert(size_type __pos, size_type __n, char32_t __c)
+    {
+      _M_check(__pos, "compact_ustring::insert");
+      _M_grow(__n, _S_width(__c));
+      char* __p = (char *)_M_ptr + __pos * _M_width;
+      memmove(__p + __n * _M_width, __p, (_M_len - __pos) * _M_width);
+      for (size_type __i = 0; __i < __n; __i++)
+        _M_put(__pos + __i, __c);
+      _M_len += __n;
+      return *this;
+    }
+
+    compact_ustring&
+    erase(size_type __pos = 0, size_type __n = npos)
+    {
+      _M_check(__pos, "compact_ustring::erase");
+      __n = _M_limit(__pos, __n);
+      char* __p = (char *)_M_ptr + __pos * _M_width;
+      memmove(__p, __p + __n * _M_width, (_M_len - __pos - __n) * _M_width);
+      _M_len -= __n;
+      return *this;
+    }
+
+    void
+    swap(compact_ustring& __str) noexcept
+    {
+      std::swap(_M_allocated_capacity, __str._M_allocated_capacity);
+      std::swap(_M_len, __str._M_len);
+      std::swap(_M_width, __str._M_width);
+      std::swap(_M_ptr, __str._M_ptr);
+    }
+
+    int
+    compare(const compact_ustring& __str) const noexcept
+    {
+      const size_type __size = std::min(_M_len, __str._M_len);
+      int __ret = _M_compare(0, __str, 0, __size);
+      if (!__ret && _M_len != __str._M_len)
+        __ret = _M_len < __str._M_len ? -1 : 1;
+      return __ret;
+    }
+
+    int
+    compare(const char* __str, size_type __n) const noexcept
+    {
+      char32_t __c;
+      width_type __num_bytes;
+      size_type __cur = 0, __idx = 0;
+      while (__cur < __n)
+      {
+        __num_bytes = get_num_bytes_of_utf8_char(__str + __cur, __n - __cur);
+        __c = utf8_decode<char32_t>(__str + __cur, __num_bytes);
+
+        if (__idx == _M_len || _M_get(__idx) < __c)
+          return -1;
+        else if (_M_get(__idx) > __c)
+          return 1;
+
+        __idx ++;
+        __cur += __num_bytes;
+      }
+      return __idx < _M_len ? 1 : 0;
+    }
+
+    int
+    compare(const char* __str) const noexcept
+    { return this->compare(__str, strlen(__str)); }
+
+    int
+    compare(const std::string& __str) const noexcept
+    { return this->compare(__str.data(), __str.size()); }
+
+    compact_ustring
+    substr(size_type __pos = 0, size_type __n = npos) const
+    {
+      compact_ustring __str;
+      __str.append(*this, __pos, __n);
+      return __str;
+    }
+
+    // search
+    size_type
+    find(char32_t __c, size_type __pos = 0) const noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:   return _S_find((const std::uint8_t *)_M_ptr, _M_len, __c, __pos);
+        case 2:   return _S_find((const std::uint16_t *)_M_ptr, _M_len, __c, __pos);
+        default:  return _S_find((const std::uint32_t *)_M_ptr, _M_len, __c, __pos);
+      }
+    }
+
+    size_type
+    find(const compact_ustring& __str, size_type __pos = 0) const noexcept
+    {
+      const size_type __n = __str._M_len;
+      if (__n == 0)
+        return __pos <= _M_len ? __pos : npos;
+      if (__n > _M_len)
+        return npos;
+
+      const char32_t __first = __str._M_get(0);
+      for (__pos = this->find(__first, __pos);
+           __pos != npos && __pos <= _M_len - __n;
+           __pos = this->find(__first, __pos + 1))
+        if (_M_compare(__pos + 1, __str, 1, __n - 1) == 0)
+          return __pos;
+      return npos;
     }
 
+    size_type
+    rfind(char32_t __c, size_type __pos = npos) const noexcept
+    {
+      switch (_M_width)
+      {
+        case 1:   return _S_rfind((const std::uint8_t *)_M_ptr, _M_len, __c, __pos);
+        case 2:   return _S_rfind((const std::uint16_t *)_M_ptr, _M_len, __c, __pos);
+        default:  return _S_rfind((const std::uint32_t *)_M_ptr, _M_len, __c, __pos);
+      }
+    }
+
+    size_type
+    rfind(const compact_ustring& __str, size_type __pos = npos) const noexcept
+    {
+      const size_type __n = __str._M_len;
+      if (__n > _M_len)
+        return npos;
+      __pos = std::min(_M_len - __n, __pos);
+      do
+      {
+        if (_M_compare(__pos, __str, 0, __n) == 0)
+          return __pos;
+      } while (__pos-- > 0);
+      return npos;
+    }
+
+    // convert to utf8 string
+    std::string
+    to_string() const
+    {
+      std::string __str(this->size_bytes(), '\0');
+      if (_M_width == 1 && __str.size() == _M_len)
+      {
+        if (_M_len)
+          memcpy(&__str[0], _M_ptr, _M_len);
+        return __str;
+      }
+      size_type __cur = 0;
+      for (size_type __i = 0; __i < _M_len; __i++)
+      {
+        const char32_t __c = _M_get(__i);
+        const width_type __num_bytes = get_codepoint_bytes(__c);
+        utf8_encode(__c, &__str[__cur], __num_bytes);
+        __cur += __num_bytes;
+      }
+      return __str;
+    }
+
+    template <typename _CodeT>
+      ustring<_CodeT>
+      to_ustring() const
+      {
+        ustring<_CodeT> __str;
+        if (sizeof(_CodeT) == 2 && _M_width == 4)
+        {
+          _CodeT __units[2];
+          __str.reserve(_M_len);
+          for (size_type __i = 0; __i < _M_len; __i++)
+            __str.append(__units, utf16_encode(_M_get(__i), __units));
+          return __str;
+        }
+        __str.resize(_M_len);
+        _S_convert(__str.data(), _M_ptr, _M_width, _M_len);
+        return __str;
+      }
+
+  private:
+    size_type     _M_allocated_capacity;
+    size_type     _M_len;
+    width_type    _M_width;
+    void*         _M_ptr;
+};
+
+inline bool
+operator==(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+inline bool
+operator==(const compact_ustring& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+inline bool
+operator==(const std::string& __lhs, const compact_ustring& __rhs)
+{ return __rhs.compare(__lhs) == 0; }
+
+inline bool
+operator==(const compact_ustring& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+inline bool
+operator==(const char* __lhs, const compact_ustring& __rhs)
+{ return __rhs.compare(__lhs) == 0; }
+
+inline bool
+operator!=(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+inline bool
+operator!=(const compact_ustring& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+inline bool
+operator!=(const std::string& __lhs, const compact_ustring& __rhs)
+{ return __rhs.compare(__lhs) != 0; }
+
+inline bool
+operator!=(const compact_ustring& __lhs, const char* __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+inline bool
+operator!=(const char* __lhs, const compact_ustring& __rhs)
+{ return __rhs.compare(__lhs) != 0; }
+
+inline bool
+operator<(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) < 0; }
+
+inline bool
+operator>(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) > 0; }
+
+inline bool
+operator<=(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) <= 0; }
+
+inline bool
+operator>=(const compact_ustring& __lhs, const compact_ustring& __rhs)
+{ return __lhs.compare(__rhs) >= 0; }
+
+// Immutable unicode string whose code units live in one atomically reference
+// counted buffer. Copies and substrings share the buffer, so they are O(1)
+// and may be handed to other threads freely.
+template <typename _CodeT>
+class shared_ustring
+{
   public:
-    // constructors
-    ustring()
-    : _M_allocated_capacity(0), _M_len(0), _M_ptr(nullptr)
-    { }
+    // member types
+    using traits_type                 = std::char_traits<_CodeT>;
+    using size_type                   = size_t;
+    using const_pointer               = const _CodeT*;
+    using const_reference             = const _CodeT&;
+    using const_iterator              = __gnu_cxx::__normal_iterator<const_pointer, shared_ustring>;
+    using const_reverse_iterator      = std::reverse_iterator<const_iterator>;
 
-    ustring(size_type __n, _CodeT __c)
+  private:
+    struct _Rep
     {
-      _M_capacity(__n << 1);
-      _M_allocator(_M_allocated_capacity);
-      _M_assign(_M_ptr, __n, __c);
-      _M_set_length(__n);
+      std::atomic<size_type> _M_refcount;
+
+      _CodeT*
+      _M_data() noexcept
+      { return reinterpret_cast<_CodeT *>(this + 1); }
+    };
+
+    // Allocate a buffer for __n code units with a reference count of one.
+    static _Rep*
+    _S_create(size_type __n)
+    {
+      if (__n > ustring<_CodeT>::max_size)
+        std::__throw_length_error(__N("shared_ustring::_S_create"));
+      void* __p = malloc(sizeof(_Rep) + (__n + 1) * sizeof(_CodeT));
+      if (!__p)
+        std::__throw_bad_alloc();
+      _Rep* __rep = ::new (__p) _Rep;
+      __rep->_M_refcount.store(1, std::memory_order_relaxed);
+      return __rep;
     }
-    
-    ustring(_CodeT* __arr, size_type __n, bool __copy)
-    : _M_allocated_capacity(__n), _M_len(__n), _M_ptr(__arr)
+
+    void
+    _M_acquire() noexcept
     {
-      if (__copy) 
-        _M_construct(__arr, __n);
+      if (_M_rep)
+        _M_rep->_M_refcount.fetch_add(1, std::memory_order_relaxed);
     }
-    
-    ustring(const _CodeT* __arr, size_type __n)
-    { _M_construct(__arr, __n); }
-    
-    ustring(const _CodeT* __arr)
-    { _M_construct(__arr, codelen(__arr)); }
 
-    ustring(const char* __str, size_type __n)
-    { _M_construct(__str, __n); }
+    void
+    _M_release() noexcept
+    {
+      if (_M_rep && _M_rep->_M_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      {
+        _M_rep->~_Rep();
+        free(_M_rep);
+      }
+    }
 
-    ustring(const char* __str)
-    { _M_construct(__str, strlen(__str)); }
-    
-    ustring(const std::string& __str)
-    { _M_construct(__str.data(), __str.size()); }
-    
-    ustring(const std::string& __str, size_type __pos, size_type __n = npos)
+    void
+    _M_construct(const _CodeT* __arr, size_type __n)
     {
-      if (__pos > __str.size())
+      _M_rep = _S_create(__n);
+      _CodeT* __d = _M_rep->_M_data();
+      if (__n)
+        memcpy(__d, __arr, __n * sizeof(_CodeT));
+      __d[__n] = _CodeT(0);
+      _M_ptr = __d;
+      _M_len = __n;
+    }
+
+    void
+    _M_construct(const char* __str, size_type __n)
+    {
+      _M_rep = _S_create(sizeof(_CodeT) == 2 ? get_utf16_length(__str, __n) :
+          get_characters_number(__str, __n));
+      _CodeT* __d = _M_rep->_M_data();
+      _M_len = utf8_to_utf16(__str, __n, __d);
+      __d[_M_len] = _CodeT(0);
+      _M_ptr = __d;
+    }
+
+    size_type
+    _M_check(size_type __pos, const char* __s) const
+    {
+      if (__pos > this->size())
       {
         std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
                "this->size() (which is %zu)"),
-           "basic_string", __pos, __str.size());
+           __s, __pos, this->size());
       }
-      __n = std::min(__str.size() - __pos, __n);
-      _M_construct(__str.data() + __pos, __n);
+      return __pos;
     }
-        
-    #if STRINGUTILS_CPLUSPLUS >= 201703L
-    ustring(std::string_view __str)
-    { _M_construct(__str.data(), __str.size()); }
-    #endif
-    
-    ustring(std::initializer_list<_CodeT> __l)
-    { _M_construct(__l.begin(), __l.end()); }
-       
-    template<typename _InputIterator,
-        typename = std::_RequireInputIter<_InputIterator>>
-      ustring(_InputIterator __beg, _InputIterator __end)
-    { _M_construct(__beg, __end); }
-    
-    ustring(const ustring& __str)
-    { _M_construct(__str._M_ptr, __str._M_len); }
 
-    ustring(const ustring& __str, size_type __pos, size_type __n = npos)
+    size_type
+    _M_limit(size_type __pos, size_type __off) const noexcept
     {
-      const _CodeT* __start = __str._M_ptr + __str._M_check(__pos, "ustring::ustring");
-      _M_construct(__start, __str._M_limit(__pos, __n));
+      const bool __testoff = __off < this->size() - __pos;
+      return __testoff ? __off : this->size() - __pos;
     }
 
-    ustring(ustring&& __str) noexcept
-    {
-      _M_data(__str._M_ptr);
-      _M_capacity(__str._M_allocated_capacity);
-      _M_length(__str._M_len);
-      __str._M_data(nullptr);
-      __str._M_capacity(0);
-      __str._M_length(0);
-    }
-    
-    ustring& 
-    operator=(const std::string& __str)
-    { return this->assign(__str); }
+  public:
+    // constructors
+    shared_ustring() noexcept
+    : _M_rep(nullptr), _M_ptr(nullptr), _M_len(0)
+    { }
 
-    ustring&
-    operator=(const ustring& __str)
-    { return this->assign(__str); }
-    
-    ustring&
-    operator=(const char* __str)
-    { return this->assign(__str, strlen(__str)); }
+    shared_ustring(const _CodeT* __arr, size_type __n)
+    { _M_construct(__arr, __n); }
 
-    ustring&
-    operator=(const _CodeT* __str)
-    { return this->assign(__str, codelen(__str)); }
+    shared_ustring(const char* __str, size_type __n)
+    { _M_construct(__str, __n); }
+
+    shared_ustring(const char* __str)
+    { _M_construct(__str, strlen(__str)); }
+
+    shared_ustring(const std::string& __str)
+    { _M_construct(__str.data(), __str.size()); }
 
     #if STRINGUTILS_CPLUSPLUS >= 201703L
-    ustring&
-    operator=(std::string_view __str)
-    { return this->assign(__str); }
+    shared_ustring(std::string_view __str)
+    { _M_construct(__str.data(), __str.size()); }
     #endif
 
-    ustring&
-    operator=(std::initializer_list<_CodeT> __l)
-    { return this->assign(__l.begin(), __l.end()); }
+    shared_ustring(const ustring<_CodeT>& __str)
+    { _M_construct(__str.data(), __str.size()); }
 
-    ustring&
-    operator=(_CodeT __c)
+    shared_ustring(const shared_ustring& __str) noexcept
+    : _M_rep(__str._M_rep), _M_ptr(__str._M_ptr), _M_len(__str._M_len)
+    { _M_acquire(); }
+
+    shared_ustring(shared_ustring&& __str) noexcept
+    : _M_rep(__str._M_rep), _M_ptr(__str._M_ptr), _M_len(__str._M_len)
     {
-      this->assign(1, __c);
+      __str._M_rep = nullptr;
+      __str._M_ptr = nullptr;
+      __str._M_len = 0;
+    }
+
+    // Share the buffer of __str, from __pos with at most __n code units.
+    shared_ustring(const shared_ustring& __str, size_type __pos, size_type __n = npos)
+    : _M_rep(__str._M_rep),
+      _M_ptr(__str._M_ptr + __str._M_check(__pos, "shared_ustring::shared_ustring")),
+      _M_len(__str._M_limit(__pos, __n))
+    { _M_acquire(); }
+
+    shared_ustring&
+    operator=(const shared_ustring& __str) noexcept
+    {
+      shared_ustring(__str).swap(*this);
       return *this;
     }
 
-    ustring&
-    operator=(ustring&& __str) noexcept
+    shared_ustring&
+    operator=(shared_ustring&& __str) noexcept
     {
       this->swap(__str);
       return *this;
     }
-    
-    ~ustring()
-    { _M_destroy(); }
-    
+
+    ~shared_ustring()
+    { _M_release(); }
+
     // iterator support
-    iterator
-    begin() noexcept
-    { return iterator(this->_M_ptr); }
-    
     const_iterator
     begin() const noexcept
-    { return const_iterator(this->_M_ptr); }
-    
-    iterator
-    end() noexcept
-    { return iterator(this->_M_ptr + this->_M_len); }
-    
+    { return const_iterator(_M_ptr); }
+
     const_iterator
     end() const noexcept
-    { return const_iterator(this->_M_ptr + this->_M_len); }
-    
-    reverse_iterator
-    rbegin() noexcept
-    { return reverse_iterator(this->end()); }
-    
+    { return const_iterator(_M_ptr + _M_len); }
+
     const_reverse_iterator
     rbegin() const noexcept
     { return const_reverse_iterator(this->end()); }
-    
-    reverse_iterator
-    rend() noexcept
-    { return reverse_iterator(this->begin()); }
-    
+
     const_reverse_iterator
     rend() const noexcept
     { return const_reverse_iterator(this->begin()); }
-    
-    const_iterator
-    cbegin() const noexcept
-    { return const_iterator(this->_M_ptr); }
-    
-    const_iterator
-    cend() const noexcept
-    { return const_iterator(this->_M_ptr + this->_M_len); }
-    
-    const_reverse_iterator
-    crbegin() const noexcept
-    { return const_reverse_iterator(this->end()); }
-    
-    const_reverse_iterator
-    crend() const noexcept
-    { return const_reverse_iterator(this->begin()); }
-    
+
     // observers
     size_type
     size() const noexcept
     { return _M_len; }
-    
+
     size_type
     length() const noexcept
     { return _M_len; }
-    
-    size_type
-    capacity() const noexcept
-    { return _M_allocated_capacity; }
-    
+
+    bool
+    empty() const noexcept
+    { return _M_len == 0; }
+
     size_type
     size_bytes() const noexcept
     {
+      if (sizeof(_CodeT) == 2)
+        return get_utf16_bytes(_M_ptr, _M_len);
       size_type __ret = 0;
       for (size_type __i = 0; __i < _M_len; __i++)
         __ret += get_codepoint_bytes(_M_ptr[__i]);
       return __ret;
     }
-    
-    bool
-    empty() const noexcept
-    { return this->_M_len == 0; }
-    
+
+    // Return the number of strings sharing the buffer.
+    size_type
+    use_count() const noexcept
+    { return _M_rep ? _M_rep->_M_refcount.load(std::memory_order_relaxed) : 0; }
+
     // element access
-    pointer
-    data() noexcept
-    { return _M_ptr; }
-    
     const_pointer
     data() const noexcept
     { return _M_ptr; }
-    
-    reference
-    operator[](size_type __pos) noexcept
-    {
-      __glibcxx_assert(__pos <= _M_len);
-      return _M_ptr[__pos];
-    }
-    
+
     const_reference
     operator[](size_type __pos) const noexcept
     {
-      __glibcxx_assert(__pos <= _M_len);
-      return _M_ptr[__pos];
-    }
-    
-    reference
-    at(size_type __pos) 
-    {
-      if (__pos >= _M_len)
-      {
-        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
-               "this->size() (which is %zu)"),
-           "ustring::at", __pos, _M_len);
-      }
+      __glibcxx_assert(__pos < _M_len);
       return _M_ptr[__pos];
     }
-    
+
     const_reference
-    at(size_type __pos) const 
+    at(size_type __pos) const
     {
       if (__pos >= _M_len)
       {
         std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
                "this->size() (which is %zu)"),
-           "ustring::at", __pos, _M_len);
+           "shared_ustring::at", __pos, _M_len);
       }
       return _M_ptr[__pos];
     }
-    
-    reference
-    front() noexcept
-    { return operator[](0); }
-    
+
     const_reference
     front() const noexcept
     { return operator[](0); }
-    
-    reference
-    back() noexcept
-    { 
-      __glibcxx_assert(!empty());
-      return operator[](_M_len - 1); 
-    }
-    
+
     const_reference
     back() const noexcept
-    { 
+    {
       __glibcxx_assert(!empty());
-      return operator[](_M_len - 1); 
+      return operator[](_M_len - 1);
     }
 
-    // preallocate memory
     void
-    reserve(size_type __res = 0)
+    swap(shared_ustring& __str) noexcept
     {
-      // Make sure we don't shrink below the current size.
-      if (__res < _M_len)
-        __res = _M_len;
-      
-      if (__res != _M_allocated_capacity)
+      std::swap(_M_rep, __str._M_rep);
+      std::swap(_M_ptr, __str._M_ptr);
+      std::swap(_M_len, __str._M_len);
+    }
+
+    // The substring shares the buffer instead of copying it.
+    shared_ustring
+    substr(size_type __pos = 0, size_type __n = npos) const
+    { return shared_ustring(*this, __pos, __n); }
+
+    int
+    compare(const _CodeT* __arr, size_type __n) const noexcept
+    {
+      const size_type __size = std::min(__n, _M_len);
+      // Code units compare by value, not by their bytes in memory.
+      int __ret = __size ? traits_type::compare(_M_ptr, __arr, __size) : 0;
+      if (!__ret && __n != _M_len)
+        __ret = __n < _M_len ? 1 : -1;
+      return __ret;
+    }
+
+    int
+    compare(const shared_ustring& __str) const noexcept
+    { return this->compare(__str._M_ptr, __str._M_len); }
+
+    int
+    compare(const ustring<_CodeT>& __str) const noexcept
+    { return this->compare(__str.data(), __str.size()); }
+
+    int
+    compare(const char* __str, size_type __n) const noexcept
+    {
+      _CodeT __units[2];
+      width_type __num_bytes, __num_units;
+      size_type __cur = 0, __idx = 0;
+      while (__cur < __n)
       {
-        _S_capacity(__res, _M_allocated_capacity);   
-        _M_realloc(__res);
-        _M_capacity(__res);
+        __num_bytes = get_num_bytes_of_utf8_char(__str + __cur, __n - __cur);
+        if (sizeof(_CodeT) == 2)
+          __num_units = utf16_encode(utf8_decode<char32_t>(__str + __cur, __num_bytes),
+              __units);
+        else
+        {
+          __units[0] = utf8_decode<_CodeT>(__str + __cur, __num_bytes);
+          __num_units = 1;
+        }
+
+        for (width_type __i = 0; __i < __num_units; __i++, __idx++)
+        {
+          if (__idx == _M_len || _M_ptr[__idx] < __units[__i])
+            return -1;
+          else if (_M_ptr[__idx] > __units[__i])
+            return 1;
+        }
+        __cur += __num_bytes;
       }
+      return __idx < _M_len ? 1 : 0;
     }
-    
-    void
-    resize(size_type __n, _CodeT __c)
+
+    int
+    compare(const char* __str) const noexcept
+    { return this->compare(__str, strlen(__str)); }
+
+    int
+    compare(const std::string& __str) const noexcept
+    { return this->compare(__str.data(), __str.size()); }
+
+    // search
+    size_type
+    find(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
     {
-      const size_type __size = this->size();
-      if (__size < __n)
-        this->append(__n - __size, __c);
-      else if (__size > __n)
-        this->_M_set_length(__n);
+      if (__n == 0)
+        return __pos <= _M_len ? __pos : npos;
+
+      if (__n <= _M_len)
+      {
+        for (; __pos <= _M_len - __n; __pos++)
+          if (_M_ptr[__pos] == __arr[0] &&
+              memcmp(_M_ptr + __pos + 1, __arr + 1, (__n - 1) * sizeof(_CodeT)) == 0)
+            return __pos;
+      }
+      return npos;
     }
-    
-    void
-    resize(size_type __n)
-    { this->resize(__n, _CodeT(0)); }
-    
-    void
-    clear() noexcept
-    { _M_set_length(0); }
 
-    void
-    shrink_to_fit() noexcept
+    size_type
+    find(const shared_ustring& __str, size_type __pos = 0) const noexcept
+    { return this->find(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find(const ustring<_CodeT>& __str, size_type __pos = 0) const noexcept
+    { return this->find(__str.data(), __pos, __str.size()); }
+
+    size_type
+    find(_CodeT __c, size_type __pos = 0) const noexcept
     {
-      if (this->capacity() > this->size())
-        reserve(0);
+      for (; __pos < _M_len; __pos++)
+        if (_M_ptr[__pos] == __c)
+          return __pos;
+      return npos;
     }
-    
-    void
-    push_back(_CodeT __c)
+
+    size_type
+    rfind(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
     {
-      size_type __new_capacity = _M_len + 1;
-      if (__new_capacity > _M_allocated_capacity)
+      if (__n <= _M_len)
       {
-        _S_capacity(__new_capacity, _M_allocated_capacity);
-        _M_realloc(__new_capacity);
-        _M_capacity(__new_capacity);
+        __pos = std::min(_M_len - __n, __pos);
+        do
+        {
+          if (memcmp(_M_ptr + __pos, __arr, __n * sizeof(_CodeT)) == 0)
+            return __pos;
+        } while (__pos-- > 0);
       }
+      return npos;
+    }
 
-      _M_ptr[_M_len] = __c;
-      _M_set_length(_M_len + 1);
+    size_type
+    rfind(const shared_ustring& __str, size_type __pos = npos) const noexcept
+    { return this->rfind(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    rfind(const ustring<_CodeT>& __str, size_type __pos = npos) const noexcept
+    { return this->rfind(__str.data(), __pos, __str.size()); }
+
+    size_type
+    rfind(_CodeT __c, size_type __pos = npos) const noexcept
+    {
+      if (_M_len > 0)
+      {
+        __pos = std::min(_M_len - 1, __pos);
+        for (__pos++; __pos-- > 0; )
+          if (_M_ptr[__pos] == __c)
+            return __pos;
+      }
+      return npos;
     }
-    
-    void
-    pop_back() noexcept
+
+    size_type
+    find_first_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
     {
-      __glibcxx_assert(!empty());
-      _M_erase(_M_len - 1, 1);
+      for (; __n && __pos < _M_len; __pos++)
+      {
+        for (size_type __i = 0; __i < __n; __i++)
+          if (__arr[__i] == _M_ptr[__pos])
+            return __pos;
+      }
+      return npos;
     }
 
-    ustring&
-    operator+=(const std::string& __str)
-    { return this->append(__str); }
-    
-    ustring&
-    operator+=(const char* __str)
-    { return this->append(__str, strlen(__str)); }
-    
-    #if STRINGUTILS_CPLUSPLUS >= 201703L
-    ustring&
-    operator+=(std::string_view __str)
-    { return this->append(__str); }
-    #endif
-    
-    ustring&
-    operator+=(const ustring& __str)
-    { return this->append(__str); }
+    size_type
+    find_first_of(const shared_ustring& __str, size_type __pos = 0) const noexcept
+    { return this->find_first_of(__str._M_ptr, __pos, __str._M_len); }
+
+    size_type
+    find_first_of(const ustring<_CodeT>& __str, size_type __pos = 0) const noexcept
+    { return this->find_first_of(__str.data(), __pos, __str.size()); }
+
+    // conversion
+    ustring<_CodeT>
+    to_ustring() const
+    { return ustring<_CodeT>(_M_ptr, _M_len); }
+
+    std::string
+    to_string() const
+    { return encode(_M_ptr, _M_len); }
+
+  private:
+    _Rep*         _M_rep;
+    const_pointer _M_ptr;
+    size_type     _M_len;
+};
+
+template <typename _CodeT>
+inline bool
+operator==(const shared_ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const shared_ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator==(const shared_ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) == 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const shared_ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const shared_ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __rhs.compare(__lhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator!=(const shared_ustring<_CodeT>& __lhs, const std::string& __rhs)
+{ return __lhs.compare(__rhs) != 0; }
+
+template <typename _CodeT>
+inline bool
+operator<(const shared_ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) < 0; }
+
+template <typename _CodeT>
+inline bool
+operator>(const shared_ustring<_CodeT>& __lhs, const shared_ustring<_CodeT>& __rhs)
+{ return __lhs.compare(__rhs) > 0; }
+
+using shared_utf16_string = shared_ustring<char16_t>;
+using shared_utf32_string = shared_ustring<char32_t>;
 
-    ustring&
-    operator+=(const _CodeT* __arr)
-    { return this->append(__arr, codelen(__arr)); }
-    
-    ustring&
-    operator+=(std::initializer_list<_CodeT> __l)
-    { return this->append(__l.begin(), __l.end()); }
-    
-    ustring&
-    operator+=(_CodeT __c)
-    { 
-      this->push_back(__c);
-      return *this; 
-    }
+// Unicode text stored as a treap of chunks of at most chunk_size code units.
+// Every node caches the number of code units and utf8 bytes of its subtree,
+// so that insert, erase, indexing, substr and byte <-> index translation take
+// O(log n) instead of moving the whole tail as ustring does.
+template <typename _CodeT>
+class ustring_rope
+{
+  public:
+    // member types
+    using size_type                   = size_t;
 
-    ustring&
-    append(size_type __n, _CodeT __c)
+    // member constants
+    static const size_type chunk_size = 512;
+
+  private:
+    struct _Node
     {
-      if (__n)
+      _Node*            _M_left;
+      _Node*            _M_right;
+      unsigned int      _M_priority;
+      size_type         _M_size;
+      size_type         _M_bytes;
+      size_type         _M_chunk_bytes;
+      ustring<_CodeT>   _M_chunk;
+
+      _Node(const _CodeT* __arr, size_type __n, unsigned int __priority)
+      : _M_left(nullptr), _M_right(nullptr), _M_priority(__priority),
+        _M_chunk(__arr, __n)
       {
-        _M_check_length(size_type(0), __n, "ustring::append");
-        const size_type __len = __n + _M_len;
-        if (__len > this->capacity())
-          this->reserve(__len);
-        _M_assign(_M_ptr + _M_len, __n, __c);
-        _M_set_length(__len);
+        _M_chunk_bytes = _M_chunk.size_bytes();
+        _M_size = __n;
+        _M_bytes = _M_chunk_bytes;
       }
-      return *this;
+    };
+
+    static size_type
+    _S_size(const _Node* __t) noexcept
+    { return __t ? __t->_M_size : 0; }
+
+    static size_type
+    _S_bytes(const _Node* __t) noexcept
+    { return __t ? __t->_M_bytes : 0; }
+
+    static void
+    _S_update(_Node* __t) noexcept
+    {
+      __t->_M_size = _S_size(__t->_M_left) + __t->_M_chunk.size() + _S_size(__t->_M_right);
+      __t->_M_bytes = _S_bytes(__t->_M_left) + __t->_M_chunk_bytes + _S_bytes(__t->_M_right);
     }
-    
-    ustring&
-    append(const std::string& __str)
-    { return this->append(__str.data(), __str.size()); }
-      
-    ustring&
-    append(const std::string& __str, size_type __pos, size_type __n = npos)
+
+    static void
+    _S_destroy(_Node* __t) noexcept
     {
-      if (__pos > __str.size())
+      while (__t)
       {
-        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
-               "this->size() (which is %zu)"),
-           "basic_string", __pos, __str.size());       
+        _S_destroy(__t->_M_left);
+        _Node* __right = __t->_M_right;
+        delete __t;
+        __t = __right;
       }
-      __n = std::min(__str.size() - __pos, __n);
-      return this->append(__str.data() + __pos, __n);
     }
-    
-    #if STRINGUTILS_CPLUSPLUS >= 201703L
-    ustring&
-    append(std::string_view __str)
-    { return this->append(__str.data(), __str.size()); }
-    #endif
-      
-    ustring&
-    append(const char* __str, size_type __n)
+
+    static _Node*
+    _S_clone(const _Node* __t)
     {
-      if (__n)
-      {
-        _M_check_length(size_type(0), __n, "ustring::append");
-        const size_type __len = __n + _M_len;
-        if (__len > this->capacity())
-          this->reserve(__len);
-        _M_set_length(_M_assign(_M_ptr + _M_len, __str, __n) + _M_len);
-      }
-      return *this;
+      if (!__t)
+        return nullptr;
+      _Node* __n = new _Node(*__t);
+      __n->_M_left = _S_clone(__t->_M_left);
+      __n->_M_right = _S_clone(__t->_M_right);
+      return __n;
     }
-    
-    ustring&
-    append(const char* __str)
-    { return this->append(__str, strlen(__str)); }
-    
-    ustring&
-    append(const ustring& __str)
-    { return this->append(__str._M_ptr, __str._M_len); }
-    
-    ustring&
-    append(const ustring& __str, size_type __pos, size_type __n = npos)
+
+    // xorshift32
+    unsigned int
+    _M_random() noexcept
     {
-      return this->append(__str._M_ptr + __str._M_check(__pos, "ustring::append"),
-          __str._M_limit(__pos, __n));
+      _M_seed ^= _M_seed << 13;
+      _M_seed ^= _M_seed >> 17;
+      _M_seed ^= _M_seed << 5;
+      return _M_seed;
     }
-    
-    ustring&
-    append(const _CodeT* __arr, size_type __n)
+
+    static _Node*
+    _S_merge(_Node* __l, _Node* __r) noexcept
     {
-      if (__n)
+      if (!__l)
+        return __r;
+      if (!__r)
+        return __l;
+      if (__l->_M_priority >= __r->_M_priority)
       {
-        _M_check_length(size_type(0), __n, "ustring::append");
-        const size_type __len = __n + _M_len;
-        if (__len > this->capacity())
-          this->reserve(__len);
-        _M_assign(_M_ptr + _M_len, __arr, __n);
-        _M_set_length(__len);
+        __l->_M_right = _S_merge(__l->_M_right, __r);
+        _S_update(__l);
+        return __l;
       }
-      return *this;
+      __r->_M_left = _S_merge(__l, __r->_M_left);
+      _S_update(__r);
+      return __r;
     }
 
-    ustring&
-    append(const _CodeT* __arr)
-    { return this->append(__arr, codelen(__arr)); }
-    
-    ustring&
-    append(std::initializer_list<_CodeT> __l)
-    { return this->append(__l.begin(), __l.end()); }
-    
-    template<class _InputIterator,
-        typename = std::_RequireInputIter<_InputIterator>>
-      ustring&
-      append(_InputIterator __first, _InputIterator __last)
+    // Split __t into the first __pos code units and the rest, cutting a
+    // chunk in two when __pos falls inside it.
+    static void
+    _S_split(_Node* __t, size_type __pos, _Node*& __l, _Node*& __r)
     {
-      const size_type __n = __first < __last ? __last - __first : 0;
-      if (__n)
+      if (!__t)
       {
-        _M_check_length(size_type(0), __n, "ustring::append");
-        const size_type __len = __n + _M_len;
-        if (__len > this->capacity())
-          this->reserve(__len);
-        for (size_type __i = 0; __i < __n; __i++)
-          _M_ptr[_M_len + __i] = *(__first + __i);
-        _M_set_length(__len);
+        __l = __r = nullptr;
+        return;
+      }
+      const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+      if (__pos <= __ls)
+      {
+        _S_split(__t->_M_left, __pos, __l, __t->_M_left);
+        _S_update(__t);
+        __r = __t;
+      }
+      else if (__pos >= __ls + __cs)
+      {
+        _S_split(__t->_M_right, __pos - __ls - __cs, __t->_M_right, __r);
+        _S_update(__t);
+        __l = __t;
+      }
+      else
+      {
+        const size_type __off = __pos - __ls;
+        _Node* __n = new _Node(__t->_M_chunk.data() + __off, __cs - __off, __t->_M_priority);
+        __t->_M_chunk.erase(__off);
+        __t->_M_chunk_bytes = __t->_M_chunk.size_bytes();
+        __n->_M_right = __t->_M_right;
+        __t->_M_right = nullptr;
+        _S_update(__t);
+        _S_update(__n);
+        __l = __t;
+        __r = __n;
       }
-      return *this;
     }
 
-    ustring&
-    assign(size_type __n, _CodeT __c)
+    // Build a treap holding __n code units, without splitting surrogate pairs
+    // between chunks.
+    _Node*
+    _M_build(const _CodeT* __arr, size_type __n)
     {
-      if (__n > this->capacity())
-        this->reserve(__n);
-      else
+      _Node* __root = nullptr;
+      while (__n)
       {
-        const size_type __capacity = __n << 1;
-        if (__capacity < this->capacity())
+        size_type __m = std::min(__n, chunk_size);
+        if (sizeof(_CodeT) == 2 && __m < __n && __m > 1 &&
+            ((char32_t)__arr[__m - 1] & 0xFC00) == 0xD800)
+          __m--;
+        __root = _S_merge(__root, new _Node(__arr, __m, _M_random()));
+        __arr += __m;
+        __n -= __m;
+      }
+      return __root;
+    }
+
+    // Insert into the chunk holding __pos when it has room. The byte count
+    // delta is added modulo 2^N, so it also works when it shrinks.
+    static bool
+    _S_insert(_Node* __t, size_type __pos, const _CodeT* __arr, size_type __n,
+        size_type& __delta)
+    {
+      if (!__t)
+        return false;
+      const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+      bool __done;
+      if (__pos < __ls)
+        __done = _S_insert(__t->_M_left, __pos, __arr, __n, __delta);
+      else if (__pos <= __ls + __cs)
+      {
+        __done = __cs + __n <= chunk_size;
+        if (__done)
         {
-          _M_realloc(__capacity);
-          _M_capacity(__capacity);
+          __t->_M_chunk.insert(__pos - __ls, __arr, __n);
+          __delta = __t->_M_chunk.size_bytes() - __t->_M_chunk_bytes;
+          __t->_M_chunk_bytes += __delta;
         }
       }
-
-      if (__n)
-        _M_assign(_M_ptr, __n, __c);
-      _M_set_length(__n);
-      return *this;
+      else
+        __done = _S_insert(__t->_M_right, __pos - __ls - __cs, __arr, __n, __delta);
+      if (__done)
+      {
+        __t->_M_size += __n;
+        __t->_M_bytes += __delta;
+      }
+      return __done;
     }
-    
-    ustring&
-    assign(const std::string& __str)
-    { return this->assign(__str.data(), __str.size()); }
-    
-    ustring&
-    assign(const std::string& __str, size_type __pos, size_type __n = npos)
+
+    // Erase inside a single chunk when the chunk does not become empty.
+    static bool
+    _S_erase(_Node* __t, size_type __pos, size_type __n, size_type& __delta)
     {
-      if (__pos > __str.size())
+      if (!__t)
+        return false;
+      const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+      bool __done;
+      if (__pos < __ls)
+        __done = __pos + __n <= __ls && _S_erase(__t->_M_left, __pos, __n, __delta);
+      else if (__pos < __ls + __cs)
       {
-        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
-               "this->size() (which is %zu)"),
-           "basic_string", __pos, __str.size());
+        __done = __pos + __n <= __ls + __cs && __n < __cs;
+        if (__done)
+        {
+          __t->_M_chunk.erase(__pos - __ls, __n);
+          __delta = __t->_M_chunk.size_bytes() - __t->_M_chunk_bytes;
+          __t->_M_chunk_bytes += __delta;
+        }
       }
-      __n = std::min(__str.size() - __pos, __n);
-      return this->assign(__str.data() + __pos, __n);
+      else
+        __done = _S_erase(__t->_M_right, __pos - __ls - __cs, __n, __delta);
+      if (__done)
+      {
+        __t->_M_size -= __n;
+        __t->_M_bytes += __delta;
+      }
+      return __done;
     }
-    
-    #if STRINGUTILS_CPLUSPLUS >= 201703L
-    ustring&
-    assign(std::string_view __str)
-    { return this->assign(__str.data(), __str.size()); }
-    #endif
-    
-    ustring& 
-    assign(const char* __str, size_type __n)
+
+    // Whether the code unit __pos, which must exist, starts a chunk.
+    static bool
+    _S_starts_chunk(const _Node* __t, size_type __pos) noexcept
     {
-      if (__n > this->capacity())
-        this->reserve(__n);
-      else
+      for (;;)
       {
-        const size_type __capacity = __n << 1;
-        if (__capacity < this->capacity())
+        const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+        if (__pos < __ls)
+          __t = __t->_M_left;
+        else if (__pos < __ls + __cs)
+          return __pos == __ls;
+        else
         {
-          _M_realloc(__capacity);
-          _M_capacity(__capacity);
+          __pos -= __ls + __cs;
+          __t = __t->_M_right;
         }
       }
-
-      if (__n)
-        __n = _M_assign(_M_ptr, __str, __n);
-      _M_set_length(__n);
-      return *this;
     }
-    
-    ustring&
-    assign(const char* __str)
-    { return this->assign(__str, strlen(__str)); }
-    
-    ustring&
-    assign(const ustring& __str)
-    { return this->assign(__str._M_ptr, __str._M_len); }
-    
-    ustring&
-    assign(const ustring& __str, size_type __pos, size_type __n = npos)
+
+    // Remove the code unit __pos of __t.
+    static _Node*
+    _S_remove(_Node* __t, size_type __pos)
     {
-      return this->assign(__str._M_ptr + __str._M_check(__pos, "ustring::assign"),
-          __str._M_limit(__pos, __n));
+      size_type __delta = 0;
+      if (_S_erase(__t, __pos, 1, __delta))
+        return __t;
+      _Node *__l, *__m, *__r;
+      _S_split(__t, __pos, __l, __r);
+      _S_split(__r, 1, __m, __r);
+      _S_destroy(__m);
+      return _S_merge(__l, __r);
     }
-    
-    ustring&
-    assign(const _CodeT* __arr, size_type __n)
+
+    // Keep a surrogate pair cut by the chunk boundary at __pos in one chunk,
+    // so that every chunk encodes and counts its bytes on its own. Edits
+    // call this at the ends of the edited range.
+    void
+    _M_repair(size_type __pos)
     {
-      if (__n > this->capacity())
-        this->reserve(__n);
+      if (sizeof(_CodeT) != 2 || __pos == 0 || __pos >= this->size())
+        return;
+      const _CodeT __pair[2] = { (*this)[__pos - 1], (*this)[__pos] };
+      if (((char32_t)__pair[0] & 0xFC00) != 0xD800 || ((char32_t)__pair[1] & 0xFC00) != 0xDC00 ||
+          !_S_starts_chunk(_M_root, __pos))
+        return;
+      // Splitting at a chunk boundary doesn't cut a chunk.
+      _Node *__l, *__r;
+      _S_split(_M_root, __pos, __l, __r);
+      size_type __delta = 0;
+      if (_S_insert(__l, __pos, __pair + 1, 1, __delta))
+        __r = _S_remove(__r, 0);
+      else if (_S_insert(__r, 0, __pair, 1, __delta))
+        __l = _S_remove(__l, __pos - 1);
       else
       {
-        const size_type __capacity = __n << 1;
-        if (__capacity < this->capacity())
+        __l = _S_merge(_S_remove(__l, __pos - 1), new _Node(__pair, 2, _M_random()));
+        __r = _S_remove(__r, 0);
+      }
+      _M_root = _S_merge(__l, __r);
+    }
+
+    // Append __n code units from __pos to __str.
+    static void
+    _S_collect(const _Node* __t, size_type __pos, size_type __n, ustring<_CodeT>& __str)
+    {
+      while (__t && __n)
+      {
+        const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+        if (__pos < __ls)
         {
-          _M_realloc(__capacity);
-          _M_capacity(__capacity);
+          const size_type __m = std::min(__n, __ls - __pos);
+          _S_collect(__t->_M_left, __pos, __m, __str);
+          __n -= __m;
+          __pos = __ls;
+        }
+        if (__n && __pos < __ls + __cs)
+        {
+          const size_type __m = std::min(__n, __ls + __cs - __pos);
+          __str.append(__t->_M_chunk.data() + __pos - __ls, __m);
+          __n -= __m;
+          __pos = __ls + __cs;
         }
+        __pos -= __ls + __cs;
+        __t = __t->_M_right;
       }
-      
-      if (__n)
-        _M_assign(_M_ptr, __arr, __n);
-      _M_set_length(__n);
+    }
+
+    size_type
+    _M_check(size_type __pos, const char* __s) const
+    {
+      if (__pos > this->size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
+               "this->size() (which is %zu)"),
+           __s, __pos, this->size());
+      }
+      return __pos;
+    }
+
+    size_type
+    _M_limit(size_type __pos, size_type __off) const noexcept
+    {
+      const bool __testoff = __off < this->size() - __pos;
+      return __testoff ? __off : this->size() - __pos;
+    }
+
+  public:
+    // constructors
+    ustring_rope() noexcept
+    : _M_root(nullptr), _M_seed(2463534242u)
+    { }
+
+    ustring_rope(const _CodeT* __arr, size_type __n)
+    : ustring_rope()
+    { _M_root = _M_build(__arr, __n); }
+
+    ustring_rope(const ustring<_CodeT>& __str)
+    : ustring_rope()
+    { _M_root = _M_build(__str.data(), __str.size()); }
+
+    ustring_rope(const char* __str, size_type __n)
+    : ustring_rope()
+    { this->insert(0, __str, __n); }
+
+    ustring_rope(const std::string& __str)
+    : ustring_rope()
+    { this->insert(0, __str.data(), __str.size()); }
+
+    #if STRINGUTILS_CPLUSPLUS >= 201703L
+    ustring_rope(std::string_view __str)
+    : ustring_rope()
+    { this->insert(0, __str.data(), __str.size()); }
+    #endif
+
+    ustring_rope(const ustring_rope& __rope)
+    : _M_root(_S_clone(__rope._M_root)), _M_seed(__rope._M_seed)
+    { }
+
+    ustring_rope(ustring_rope&& __rope) noexcept
+    : _M_root(__rope._M_root), _M_seed(__rope._M_seed)
+    { __rope._M_root = nullptr; }
+
+    ustring_rope&
+    operator=(const ustring_rope& __rope)
+    {
+      ustring_rope(__rope).swap(*this);
       return *this;
     }
 
-    ustring&
-    assign(const _CodeT* __arr)
-    { return this->assign(__arr, codelen(__arr)); }
-    
-    ustring&
-    assign(std::initializer_list<_CodeT> __l)
-    { return this->assign(__l.begin(), __l.end()); }
-    
-    template<class _InputIterator,
-        typename = std::_RequireInputIter<_InputIterator>>
-      ustring&
-      assign(_InputIterator __first, _InputIterator __last)
+    ustring_rope&
+    operator=(ustring_rope&& __rope) noexcept
     {
-      const size_type __n = __first < __last ? __last - __first : 0;
-      if (__n > this->capacity())
-        this->reserve(__n);
-      else
-      {
-        const size_type __capacity = __n << 1;
-        if (__capacity < this->capacity())
-        {
-          _M_realloc(__capacity);
-          _M_capacity(__capacity);
-        }
-      }
-      
-      for (size_type __i = 0; __i < __n; __i++)
-        _M_ptr[__i] = *(__first + __i);
-      _M_set_length(__n);
+      this->swap(__rope);
       return *this;
     }
 
-    ustring&
-    assign(ustring&& __str) noexcept
-    { return *this = std::move(__str); }
+    ~ustring_rope()
+    { _S_destroy(_M_root); }
 
-    ustring&
-    replace(size_type __pos, size_type __n, const ustring& __str)
-    { return this->replace(__pos, __n, __str._M_ptr, __str._M_len); }
+    // observers
+    size_type
+    size() const noexcept
+    { return _S_size(_M_root); }
 
-    ustring&
-    replace(size_type __pos1, size_type __n1, const ustring& __str,
-        size_type __pos2, size_type __n2 = npos)
-    {
-      return this->replace(__pos1, __n1, __str._M_ptr + 
-          __str._M_check(__pos2, "ustring::replace"),
-          __str._M_limit(__pos2, __n2));
-    }
+    size_type
+    length() const noexcept
+    { return _S_size(_M_root); }
 
-    ustring&
-    replace(size_type __pos, size_type __n1, const _CodeT* __arr,
-        size_type __n2)
+    // Return the number of bytes of the utf8 encoded text in O(1).
+    size_type
+    size_bytes() const noexcept
+    { return _S_bytes(_M_root); }
+
+    bool
+    empty() const noexcept
+    { return _M_root == nullptr; }
+
+    // element access
+    _CodeT
+    operator[](size_type __pos) const noexcept
     {
-      return _M_replace(_M_check(__pos, "ustring::replace"), 
-          _M_limit(__pos, __n1), __arr, __n2);
+      __glibcxx_assert(__pos < this->size());
+      const _Node* __t = _M_root;
+      for (;;)
+      {
+        const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+        if (__pos < __ls)
+          __t = __t->_M_left;
+        else if (__pos < __ls + __cs)
+          return __t->_M_chunk[__pos - __ls];
+        else
+        {
+          __pos -= __ls + __cs;
+          __t = __t->_M_right;
+        }
+      }
     }
 
-    ustring&
-    replace(size_type __pos, size_type __n, const _CodeT* __arr)
+    _CodeT
+    at(size_type __pos) const
     {
-      return _M_replace(_M_check(__pos, "ustring::replace"),
-          _M_limit(__pos, __n), __arr, codelen(__arr));
+      if (__pos >= this->size())
+      {
+        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) >= "
+               "this->size() (which is %zu)"),
+           "ustring_rope::at", __pos, this->size());
+      }
+      return (*this)[__pos];
     }
-    
-    ustring&
-    replace(size_type __pos, size_type __n1, size_type __n2, _CodeT __c)
+
+    // modifiers
+    ustring_rope&
+    insert(size_type __pos, const _CodeT* __arr, size_type __n)
     {
-      return _M_replace(_M_check(__pos, "ustring::replace"),
-          _M_limit(__pos, __n1), __n2, __c);
+      _M_check(__pos, "ustring_rope::insert");
+      size_type __delta = 0;
+      if (__n == 0)
+        return *this;
+      if (!_S_insert(_M_root, __pos, __arr, __n, __delta))
+      {
+        _Node *__l, *__r;
+        _S_split(_M_root, __pos, __l, __r);
+        _M_root = _S_merge(_S_merge(__l, _M_build(__arr, __n)), __r);
+      }
+      _M_repair(__pos);
+      _M_repair(__pos + __n);
+      return *this;
     }
 
-    ustring&
-    replace(const_iterator __i1, const_iterator __i2, const ustring& __str)
-    { return this->replace(__i1, __i2, __str._M_ptr, __str._M_len); }
+    ustring_rope&
+    insert(size_type __pos, const ustring<_CodeT>& __str)
+    { return this->insert(__pos, __str.data(), __str.size()); }
 
-    ustring&
-    replace(const_iterator __i1, const_iterator __i2, const _CodeT* __arr,
-        size_type __n)
+    ustring_rope&
+    insert(size_type __pos, const char* __str, size_type __n)
     {
-      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
-      return this->replace(__i1 - begin(), __i2 - __i1, __arr, __n);
+      ustring<_CodeT> __tmp(__str, __n);
+      return this->insert(__pos, __tmp.data(), __tmp.size());
     }
 
-    ustring&
-    replace(const_iterator __i1, const_iterator __i2, const _CodeT* __arr)
-    { return this->replace(__i1, __i2, __arr, codelen(__arr)); }
+    ustring_rope&
+    insert(size_type __pos, const std::string& __str)
+    { return this->insert(__pos, __str.data(), __str.size()); }
 
-    ustring&
-    replace(const_iterator __i1, const_iterator __i2, size_type __n, 
-        _CodeT __c)
+    ustring_rope&
+    append(const _CodeT* __arr, size_type __n)
+    { return this->insert(this->size(), __arr, __n); }
+
+    ustring_rope&
+    append(const ustring<_CodeT>& __str)
+    { return this->insert(this->size(), __str.data(), __str.size()); }
+
+    ustring_rope&
+    append(const std::string& __str)
+    { return this->insert(this->size(), __str.data(), __str.size()); }
+
+    ustring_rope&
+    erase(size_type __pos = 0, size_type __n = npos)
     {
-      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
-      return this->replace(__i1 - begin(), __i2 - __i1, __n, __c);
+      _M_check(__pos, "ustring_rope::erase");
+      __n = _M_limit(__pos, __n);
+      size_type __delta = 0;
+      if (__n == 0)
+        return *this;
+      if (!_S_erase(_M_root, __pos, __n, __delta))
+      {
+        _Node *__l, *__m, *__r;
+        _S_split(_M_root, __pos, __l, __r);
+        _S_split(__r, __n, __m, __r);
+        _S_destroy(__m);
+        _M_root = _S_merge(__l, __r);
+      }
+      _M_repair(__pos);
+      return *this;
     }
 
-    template<class _InputIterator,
-        typename = std::_RequireInputIter<_InputIterator>>
-      ustring&
-      replace(const_iterator __i1, const_iterator __i2,
-          _InputIterator __k1, _InputIterator __k2)
+    ustring_rope&
+    replace(size_type __pos, size_type __n, const ustring<_CodeT>& __str)
     {
-      __glibcxx_assert(begin() <= __i1 && __i1 <= __i2 && __i2 <= end());
-      return _M_replace(__i1 - begin(), __i2 - __i1, __k1, __k2);
+      this->erase(__pos, __n);
+      return this->insert(__pos, __str);
     }
 
-    ustring&
-    replace(const_iterator __i1, const_iterator __i2,
-        std::initializer_list<_CodeT> __l)
-    { return this->replace(__i1, __i2, __l.begin(), __l.size()); }
-
-    iterator
-    insert(const_iterator __p, size_type __n, _CodeT __c)
+    void
+    clear() noexcept
     {
-      __glibcxx_assert(__p >= begin() && __p <= end());
-      const size_type __pos = __p - begin();
-      _M_replace(__pos, size_type(0), __n, __c);
-      return iterator(_M_ptr + __pos);
+      _S_destroy(_M_root);
+      _M_root = nullptr;
     }
 
-    template<class _InputIterator,
-        typename = std::_RequireInputIter<_InputIterator>>
-      iterator
-      insert(const_iterator __p, _InputIterator __beg, _InputIterator __end)
+    void
+    swap(ustring_rope& __rope) noexcept
     {
-      __glibcxx_assert(__p >= begin() && __p <= end());
-      const size_type __pos = __p - begin();
-      _M_replace(__pos, size_type(0), __beg, __end);
-      return iterator(_M_ptr + __pos);
+      std::swap(_M_root, __rope._M_root);
+      std::swap(_M_seed, __rope._M_seed);
     }
 
-    iterator
-    insert(const_iterator __p, std::initializer_list<_CodeT> __l)
-    { return this->insert(__p, __l.begin(), __l.end()); }
-
-    ustring&
-    insert(size_type __pos, const ustring& __str)
-    { return this->replace(__pos, size_type(0), __str._M_ptr, __str._M_len); }
-
-    ustring&
-    insert(size_type __pos1, const ustring& __str, size_type __pos2,
-        size_type __n2 = npos)
-    { 
-      return this->replace(__pos1, size_type(0), __str._M_ptr + 
-          __str._M_check(__pos2, "ustring::insert"), 
-          __str._M_limit(__pos2, __n2)); 
+    ustring<_CodeT>
+    substr(size_type __pos = 0, size_type __n = npos) const
+    {
+      _M_check(__pos, "ustring_rope::substr");
+      __n = _M_limit(__pos, __n);
+      ustring<_CodeT> __str;
+      __str.reserve(__n);
+      _S_collect(_M_root, __pos, __n, __str);
+      return __str;
     }
 
-    ustring&
-    insert(size_type __pos, const _CodeT* __arr, size_type __n)
-    { return this->replace(__pos, size_type(0), __arr, __n); }
-
-    ustring&
-    insert(size_type __pos, const _CodeT* __arr)
-    { return this->replace(__pos, size_type(0), __arr, codelen(__arr)); }
-
-    ustring&
-    insert(size_type __pos, size_type __n, _CodeT __c)
-    { return _M_replace(_M_check(__pos, "ustring::insert"), size_type(0), __n, __c); }
-
-    iterator
-    insert(const_iterator __p, _CodeT __c)
+    // Convert the utf8 byte position to code unit index, npos if it does
+    // not start a character.
+    size_type
+    get_index(size_type __bytes) const STRINGUTILS_INDEX_NOEXCEPT
     {
-      __glibcxx_assert(__p >= begin() && __p <= end());
-      const size_type __pos = __p - begin();
-      _M_replace(__pos, size_type(0), size_type(1), __c);
-      return iterator(_M_ptr + __pos);
+      const _Node* __t = _M_root;
+      size_type __base = 0;
+      while (__t)
+      {
+        const size_type __lb = _S_bytes(__t->_M_left);
+        if (__bytes < __lb)
+        {
+          __t = __t->_M_left;
+          continue;
+        }
+        __base += _S_size(__t->_M_left);
+        __bytes -= __lb;
+        if (__bytes < __t->_M_chunk_bytes)
+        {
+          const size_type __idx = __t->_M_chunk.get_index(__bytes);
+          return __idx == npos ? npos : __base + __idx;
+        }
+        __base += __t->_M_chunk.size();
+        __bytes -= __t->_M_chunk_bytes;
+        __t = __t->_M_right;
+      }
+      return npos;
     }
 
-    ustring& 
-    erase(size_type __pos = 0, size_type __n = npos)
+    // Convert the code unit index to utf8 byte position.
+    size_type
+    get_byte_position(size_type __pos) const STRINGUTILS_INDEX_NOEXCEPT
     {
-      _M_check(__pos, "ustring::erase");
-      if (__n == npos)
-        this->_M_set_length(__pos);
-      else if (__n != 0)
-        this->_M_erase(__pos, _M_limit(__pos, __n));
-      return *this; 
+      const _Node* __t = _M_root;
+      size_type __base = 0;
+      while (__t)
+      {
+        const size_type __ls = _S_size(__t->_M_left), __cs = __t->_M_chunk.size();
+        if (__pos < __ls)
+        {
+          __t = __t->_M_left;
+          continue;
+        }
+        __base += _S_bytes(__t->_M_left);
+        if (__pos < __ls + __cs)
+        {
+          const size_type __b = __t->_M_chunk.get_byte_position(__pos - __ls);
+          return __b == npos ? npos : __base + __b;
+        }
+        __base += __t->_M_chunk_bytes;
+        __pos -= __ls + __cs;
+        __t = __t->_M_right;
+      }
+      return npos;
     }
-    
-    iterator
-    erase(const_iterator __position)
+
+    // conversion
+    ustring<_CodeT>
+    to_ustring() const
+    { return this->substr(0, npos); }
+
+    std::string
+    to_string() const
     {
-      __glibcxx_assert(__position >= begin() && 
-          __position < end());
-      const size_type __pos = __position - begin();
-      this->_M_erase(__pos, size_type(1));
-      return iterator(_M_ptr + __pos);
+      std::string __str;
+      __str.reserve(this->size_bytes());
+      _M_append_to(_M_root, __str);
+      return __str;
     }
-    
-    iterator
-    erase(const_iterator __first, const_iterator __last)
+
+  private:
+    static void
+    _M_append_to(const _Node* __t, std::string& __str)
     {
-      __glibcxx_assert(__first >= begin() && __first <= __last &&
-          __last <= end());
-      const size_type __pos = __first - begin();
-      if (__last == end())
-        this->_M_set_length(__pos);
-      else
-        this->_M_erase(__pos, __last - __first);
-      return iterator(_M_ptr + __pos);
+      for (; __t; __t = __t->_M_right)
+      {
+        _M_append_to(__t->_M_left, __str);
+        __str.append(encode(__t->_M_chunk.data(), __t->_M_chunk.size()));
+      }
     }
 
-    size_type
-    copy(_CodeT* __arr, size_type __n, size_type __pos = 0) const
+    _Node*        _M_root;
+    unsigned int  _M_seed;
+};
+
+template <typename _CodeT>
+const typename ustring_rope<_CodeT>::size_type ustring_rope<_CodeT>::chunk_size;
+
+using utf16_rope = ustring_rope<char16_t>;
+using utf32_rope = ustring_rope<char32_t>;
+
+/**
+ * @brief Streaming decoder of a legacy multibyte encoding to utf8 or
+ * ustring. A sequence cut by the end of a chunk is kept and completed by
+ * the next chunk, so the input may be split anywhere.
+ *
+ * @tparam _Codec  One of the codecs of mb_detail.
+ */
+template <typename _Codec>
+class mb_decoder
+{
+  public:
+    using size_type = size_t;
+
+    mb_decoder() noexcept
+    : _M_npending(0) { }
+
+    /**
+     * @brief Decode a chunk and append the utf8 result to @a __out.
+     * @param __str  The chunk.
+     * @param __len  Length of the chunk.
+     * @param __out  The string to append to.
+     * @param __last  Whether this is the last chunk: bytes still pending at
+     * its end are then replaced by U+FFFD and the decoder is reset.
+     */
+    void
+    decode(const char* __str, size_type __len, std::string& __out, bool __last = false)
     {
-      _M_check(__pos, "ustring::copy");
-      __n = _M_limit(__pos, __n);
-      if (__n)
-        _S_copy(__arr, _M_ptr + __pos, __n);
-      return __n;
+      const size_type __old = __out.size();
+      __out.resize(__old + 3 * (__len + _M_npending));
+      mb_detail::utf8_sink __sink = { &__out[0] + __old };
+      _M_decode(__str, __len, __sink, __last);
+      __out.resize(__sink.dest - &__out[0]);
     }
 
-    void swap(ustring& __str) noexcept
-    {
-      size_type __capacity = __str._M_allocated_capacity;
-      size_type __len = __str._M_len;
-      pointer __p = __str._M_ptr;
+    void
+    decode(const std::string& __str, std::string& __out, bool __last = false)
+    { decode(__str.data(), __str.size(), __out, __last); }
 
-      __str._M_capacity(this->_M_allocated_capacity);
-      __str._M_length(this->_M_len);
-      __str._M_data(this->_M_ptr);
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    void
+    decode(std::string_view __str, std::string& __out, bool __last = false)
+    { decode(__str.data(), __str.size(), __out, __last); }
+#endif
 
-      _M_capacity(__capacity);
-      _M_length(__len);
-      _M_data(__p);
-    }
+    /**
+     * @brief Decode a chunk straight into the code units of @a __out.
+     * @param __str  The chunk.
+     * @param __len  Length of the chunk.
+     * @param __out  The ustring to append to.
+     * @param __last  Whether this is the last chunk.
+     */
+    template <typename _CodeT>
+      void
+      decode(const char* __str, size_type __len, ustring<_CodeT>& __out, bool __last = false)
+      {
+        const size_type __old = __out.size();
+        __out.resize_and_overwrite(__old + __len + _M_npending,
+            [&](_CodeT* __d, size_type) -> size_type
+            {
+              mb_detail::unit_sink<_CodeT> __sink = { __d + __old };
+              _M_decode(__str, __len, __sink, __last);
+              return __sink.dest - __d;
+            });
+      }
 
-    int
-    compare(const std::string& __str) const
-    { return this->compare(__str.data(), __str.size()); }
+    // Number of bytes of a cut sequence kept for the next chunk.
+    size_type
+    pending() const noexcept
+    { return _M_npending; }
 
-    #if STRINGUTILS_CPLUSPLUS >= 201703L
-    int 
-    compare(std::string_view __str) const
-    { return this->compare(__str.data(), __str.size()); }
-    #endif
+    void
+    reset() noexcept
+    { _M_npending = 0; }
 
-    int
-    compare(const std::string& __str, size_type __pos, size_type __n = npos) const
-    {
-      if (__pos > __str.size())
+  private:
+    template <typename _Sink>
+      void
+      _M_decode(const char* __str, size_type __len, _Sink& __sink, bool __last) noexcept
       {
-        std::__throw_out_of_range_fmt(__N("%s: __pos (which is %zu) > "
-               "this->size() (which is %zu)"),
-           "basic_string", __pos, __str.size());
+        // Complete the pending sequence one byte at a time. Single-byte
+        // codecs never leave one.
+        size_type __i = 0;
+        while (_Codec::max_length > 1 && _M_npending && __i < __len)
+        {
+          _M_pending[_M_npending++] = __str[__i++];
+          _M_drop(mb_detail::decode<_Codec>(_M_pending, _M_npending, __sink, false));
+        }
+        if (!_M_npending)
+        {
+          const size_type __n = mb_detail::decode<_Codec>(__str + __i, __len - __i,
+              __sink, __last);
+          _M_npending = __len - __i - __n;
+          memcpy(_M_pending, __str + __i + __n, _M_npending);
+        }
+        if (__last && _M_npending)
+        {
+          mb_detail::decode<_Codec>(_M_pending, _M_npending, __sink, true);
+          _M_npending = 0;
+        }
       }
-      __n = std::min(__str.size() - __pos, __n);
-      return this->compare(__str.data() + __pos, __n);
-    }
 
-    int
-    compare(const char* __str, size_type __n) const
+    void
+    _M_drop(size_type __n) noexcept
     {
-      _CodeT cp;
-      width_type __num_bytes;
-      size_type __cur = 0, __idx = 0;
-      while (__cur < __n)
-      {
-        __num_bytes = get_num_bytes_of_utf8_char(__str + __cur, __n - __cur);
-        cp = utf8_decode<_CodeT>(__str + __cur, __num_bytes);
+      _M_npending -= __n;
+      memmove(_M_pending, _M_pending + __n, _M_npending);
+    }
 
-        if (__idx == _M_len || _M_ptr[__idx] < cp)
-          return -1;
-        else if (_M_ptr[__idx] > cp)
-          return 1;
+    char          _M_pending[_Codec::max_length];
+    size_type     _M_npending;
+};
 
-        __idx ++;
-        __cur += __num_bytes;
-      }
-      return __idx < _M_len ? 1 : 0;
+using gb18030_decoder = mb_decoder<mb_detail::gb18030_codec>;
+using big5_decoder = mb_decoder<mb_detail::big5_codec>;
+using shift_jis_decoder = mb_decoder<mb_detail::shift_jis_codec>;
+using euc_jp_decoder = mb_decoder<mb_detail::euc_jp_codec>;
+using latin1_decoder = mb_decoder<mb_detail::latin1_codec>;
+using cp1252_decoder = mb_decoder<mb_detail::cp1252_codec>;
+
+/**
+ * @brief Streaming decoder of utf16 bytes to utf8, std::u16string or
+ * ustring. An odd byte or a high surrogate at the end of a chunk is kept
+ * and completed by the next chunk, so the input may be split anywhere.
+ * With byte_order::detect the order is read from a BOM at the start of the
+ * stream.
+ */
+class utf16_decoder
+{
+  public:
+    using size_type = size_t;
+
+    explicit
+    utf16_decoder(byte_order __order = byte_order::detect) noexcept
+    : _M_init(__order), _M_order(__order), _M_npending(0) { }
+
+    /**
+     * @brief Decode a chunk and append the utf8 result to @a __out.
+     * @param __str  The chunk.
+     * @param __len  Length of the chunk.
+     * @param __out  The string to append to.
+     * @param __last  Whether this is the last chunk: bytes still pending at
+     * its end are then replaced by U+FFFD and the decoder is reset.
+     */
+    void
+    decode(const char* __str, size_type __len, std::string& __out, bool __last = false)
+    {
+      const size_type __old = __out.size();
+      __out.resize(__old + 3 * ((__len + _M_npending) / 2 + 1));
+      mb_detail::utf8_sink __sink = { &__out[0] + __old };
+      _M_decode(__str, __len, __sink, __last);
+      __out.resize(__sink.dest - &__out[0]);
     }
 
-    int
-    compare(const char* __str) const
-    { return this->compare(__str, strlen(__str)); }
+    void
+    decode(const std::string& __str, std::string& __out, bool __last = false)
+    { decode(__str.data(), __str.size(), __out, __last); }
 
-    int 
-    compare(const ustring& __str) const
-    { return this->compare(__str._M_ptr, __str._M_len); }
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    void
+    decode(std::string_view __str, std::string& __out, bool __last = false)
+    { decode(__str.data(), __str.size(), __out, __last); }
+#endif
 
-    int 
-    compare(const ustring& __str, size_type __pos, size_type __n = npos) const
+    /**
+     * @brief Decode a chunk and append the code units to @a __out.
+     * @param __str  The chunk.
+     * @param __len  Length of the chunk.
+     * @param __out  The string to append to.
+     * @param __last  Whether this is the last chunk.
+     */
+    void
+    decode(const char* __str, size_type __len, std::u16string& __out, bool __last = false)
     {
-      return this->compare(0, _M_len, 
-          __str._M_ptr + __str._M_check(__pos, "ustring::compare"),
-          __str._M_limit(__pos, __n));
+      const size_type __old = __out.size();
+      __out.resize(__old + (__len + _M_npending) / 2 + 1);
+      mb_detail::unit_sink<char16_t> __sink = { &__out[0] + __old };
+      _M_decode(__str, __len, __sink, __last);
+      __out.resize(__sink.dest - &__out[0]);
     }
 
-    int 
-    compare(size_type __pos, size_type __n, const ustring& __str) const
-    { return this->compare(__pos, __n, __str._M_ptr, __str._M_len); }
+    /**
+     * @brief Decode a chunk straight into the code units of @a __out.
+     * @param __str  The chunk.
+     * @param __len  Length of the chunk.
+     * @param __out  The ustring to append to.
+     * @param __last  Whether this is the last chunk.
+     */
+    template <typename _CodeT>
+      void
+      decode(const char* __str, size_type __len, ustring<_CodeT>& __out, bool __last = false)
+      {
+        const size_type __old = __out.size();
+        __out.resize_and_overwrite(__old + (__len + _M_npending) / 2 + 1,
+            [&](_CodeT* __d, size_type) -> size_type
+            {
+              mb_detail::unit_sink<_CodeT> __sink = { __d + __old };
+              _M_decode(__str, __len, __sink, __last);
+              return __sink.dest - __d;
+            });
+      }
 
-    int 
-    compare(size_type __pos1, size_type __n1, const ustring& __str,
-        size_type __pos2, size_type __n2 = npos) const
+    // Byte order in use, detect until the first two bytes have been seen.
+    byte_order
+    order() const noexcept
+    { return _M_order; }
+
+    // Number of bytes kept for the next chunk.
+    size_type
+    pending() const noexcept
+    { return _M_npending; }
+
+    void
+    reset() noexcept
     {
-      return this->compare(__pos1, __n1, 
-          __str._M_ptr + __str._M_check(__pos2, "ustring::compare"),
-          __str._M_limit(__pos2, __n2));
+      _M_order = _M_init;
+      _M_npending = 0;
     }
 
-    int
-    compare(const _CodeT* __arr, size_type __n) const
+  private:
+    template <typename _Sink>
+      void
+      _M_decode(const char* __str, size_type __len, _Sink& __sink, bool __last) noexcept
+      {
+        size_type __i = 0;
+        if (_M_order == byte_order::detect)
+        {
+          while (_M_npending < 2 && __i < __len)
+            _M_pending[_M_npending++] = __str[__i++];
+          if (_M_npending < 2 && !__last)
+            return;
+          _M_drop(mb_detail::utf16_bom(_M_pending, _M_npending, _M_order));
+        }
+        const bool __big = _M_order == byte_order::big;
+        // Complete the pending unit or surrogate pair one byte at a time.
+        while (_M_npending && __i < __len)
+        {
+          _M_pending[_M_npending++] = __str[__i++];
+          _M_drop(mb_detail::utf16_bytes_decode(_M_pending, _M_npending, __sink, __big, false));
+        }
+        if (!_M_npending)
+        {
+          const size_type __n = mb_detail::utf16_bytes_decode(__str + __i, __len - __i,
+              __sink, __big, __last);
+          _M_npending = __len - __i - __n;
+          memcpy(_M_pending, __str + __i + __n, _M_npending);
+        }
+        if (__last)
+        {
+          mb_detail::utf16_bytes_decode(_M_pending, _M_npending, __sink, __big, true);
+          reset();
+        }
+      }
+
+    void
+    _M_drop(size_type __n) noexcept
     {
-      const size_type __size = std::min(__n, _M_len);
-      int __ret = memcmp(_M_ptr, __arr, __size * sizeof(_CodeT));
-      if (!__ret && __n != _M_len)
-        __ret = __n < _M_len ? 1 : -1;
-      return __ret;
+      _M_npending -= __n;
+      memmove(_M_pending, _M_pending + __n, _M_npending);
     }
 
-    int
-    compare(size_type __pos1, size_type __n1, const _CodeT* __arr,
-        size_type __n2) const
-    {
-      _M_check(__pos1, "ustring::compare");
-      __n1 = _M_limit(__pos1, __n1);
+    byte_order    _M_init;
+    byte_order    _M_order;
+    char          _M_pending[4];
+    size_type     _M_npending;
+};
 
-      const size_type __size = std::min(__n1, __n2);
-      int __ret = memcmp(_M_ptr + __pos1, __arr, __size * sizeof(_CodeT));
-      if (!__ret && __n1 != __n2)
-        __ret = __n1 < __n2 ? -1 : 1;
-      return __ret;
-    }
 
-    int 
-    compare(const _CodeT* __arr) const
-    { return this->compare(__arr, codelen(__arr)); }
+namespace dict_detail {
+  /**
+   * @brief Read-only contents of a dictionary file, mapped into memory
+   * with STRINGUTILS_USE_MMAP where mmap is available and read into a
+   * buffer otherwise.
+   */
+  class mapped_file
+  {
+    public:
+      mapped_file() noexcept
+      : _M_data(nullptr), _M_size(0) { }
 
-    ustring
-    substr(size_type __pos = 0, size_type __n = npos) const
-    { return ustring(*this, _M_check(__pos, "ustring::substr"), __n); }
+      mapped_file(const mapped_file&) = delete;
+      mapped_file& operator=(const mapped_file&) = delete;
 
-    // search
-    size_type
-    find(const ustring& __str, size_type __pos = 0) const noexcept
-    { return this->find(__str._M_ptr, __pos, __str._M_len); }
+      ~mapped_file()
+      { close(); }
 
-    size_type
-    find(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+      bool
+      open(const char* __path)
+      {
+        close();
+#ifdef STRINGUTILS_HAVE_MMAP
+        const int __fd = ::open(__path, O_RDONLY);
+        if (__fd < 0)
+          return false;
+        struct stat __st;
+        if (fstat(__fd, &__st) == 0 && __st.st_size > 0)
+        {
+          void* __p = mmap(nullptr, (size_t)__st.st_size, PROT_READ, MAP_PRIVATE, __fd, 0);
+          if (__p != MAP_FAILED)
+          {
+            _M_data = (const char *)__p;
+            _M_size = (size_t)__st.st_size;
+          }
+        }
+        ::close(__fd);
+        return _M_data != nullptr;
+#else
+        std::ifstream __in(__path, std::ios::binary);
+        if (!__in)
+          return false;
+        _M_buffer.assign(std::istreambuf_iterator<char>(__in), std::istreambuf_iterator<char>());
+        _M_data = _M_buffer.data();
+        _M_size = _M_buffer.size();
+        return _M_size != 0;
+#endif
+      }
+
+      void
+      close() noexcept
+      {
+#ifdef STRINGUTILS_HAVE_MMAP
+        if (_M_data)
+          munmap((void *)_M_data, _M_size);
+#else
+        _M_buffer.clear();
+#endif
+        _M_data = nullptr;
+        _M_size = 0;
+      }
+
+      const char*
+      data() const noexcept
+      { return _M_data; }
+
+      size_t
+      size() const noexcept
+      { return _M_size; }
+
+    private:
+      const char*   _M_data;
+      size_t        _M_size;
+#ifndef STRINGUTILS_HAVE_MMAP
+      std::string   _M_buffer;
+#endif
+  };
+
+  /**
+   * @brief Trie laid out breadth first by the tools/ compilers, on utf8
+   * bytes or on code points. Node n is nodes[stride * n ...]: first edge,
+   * number of edges, then stride - 2 words of payload. The edges of a node
+   * are consecutive and sorted by label; node 0 is the root, so no edge
+   * leads to 0.
+   */
+  template <typename _LabelT>
+  struct basic_trie
+  {
+    const std::uint32_t*  nodes;
+    const std::uint32_t*  targets;
+    const _LabelT*        labels;
+    size_t                stride;
+    // Child of the root for the bytes, or the BMP code points.
+    std::vector<std::uint32_t> root;
+
+    // Whether the trie of nnodes nodes and nedges edges is well formed: the
+    // edges of every node in range and sorted, and every edge leading to a
+    // later node, so that walks end and depths take one pass in node order.
+    static bool
+    check(const std::uint32_t* n, const std::uint32_t* t, const _LabelT* l, size_t s,
+        size_t nnodes, size_t nedges) noexcept
     {
-      if (__n == 0)
-        return __pos <= _M_len ? __pos : npos;
-      
-      if (__n <= _M_len)
+      for (size_t i = 0; i < nnodes; i++)
       {
-        for (; __pos <= _M_len - __n; __pos++)
-          if (_M_ptr[__pos] == __arr[0] &&
-              memcmp(_M_ptr + __pos + 1, __arr + 1, (__n - 1) * sizeof(_CodeT)) == 0)
-            return __pos;
+        const std::uint32_t* p = n + s * i;
+        if (p[0] > nedges || p[1] > nedges - p[0])
+          return false;
+        for (std::uint32_t e = p[0]; e < p[0] + p[1]; e++)
+          if (t[e] <= i || t[e] >= nnodes || (e > p[0] && !(l[e - 1] < l[e])))
+            return false;
       }
-      return npos;
+      return true;
     }
 
-    size_type
-    find(const _CodeT* __arr, size_type __pos = 0) const
-    { return this->find(__arr, __pos, codelen(__arr)); } 
-
-    size_type 
-    find(_CodeT __c, size_type __pos = 0) const noexcept
+    void
+    assign(const std::uint32_t* n, const std::uint32_t* t, const _LabelT* l, size_t s)
     {
-      for (; __pos < _M_len; __pos++)
-        if (_M_ptr[__pos] == __c)
-          return __pos;
-      return npos;
+      nodes = n;
+      targets = t;
+      labels = l;
+      stride = s;
+      root.assign(sizeof(_LabelT) == 1 ? 0x100 : 0x10000, 0);
+      for (std::uint32_t e = nodes[0]; e < nodes[0] + nodes[1]; e++)
+        if (labels[e] < root.size())
+          root[labels[e]] = targets[e];
     }
 
-    size_type
-    rfind(const ustring& __str, size_type __pos = npos) const noexcept
-    { return this->rfind(__str._M_ptr, __pos, __str._M_len); }
+    const std::uint32_t*
+    node(std::uint32_t n) const noexcept
+    { return nodes + stride * n; }
 
-    size_type
-    rfind(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    // Child of node n along label c, 0 if none.
+    std::uint32_t
+    child(std::uint32_t n, _LabelT c) const noexcept
     {
-      if (__n <= _M_len)
-      {
-        __pos = std::min(_M_len - __n, __pos);
-        do
-        {
-          if (memcmp(_M_ptr + __pos, __arr, __n * sizeof(_CodeT)) == 0)
-            return __pos;
-        } while (__pos-- > 0);
-      }
-      return npos;
+      if (!n && c < root.size())
+        return root[c];
+      const std::uint32_t* p = node(n);
+      const _LabelT* first = labels + p[0];
+      const _LabelT* last = first + p[1];
+      const _LabelT* it = std::lower_bound(first, last, c);
+      return it != last && *it == c ? targets[it - labels] : 0;
     }
+  };
 
-    size_type
-    rfind(const _CodeT* __arr, size_type __pos = npos) const
-    { return this->rfind(__arr, __pos, codelen(__arr)); }
+  using byte_trie = basic_trie<unsigned char>;
+  using code_trie = basic_trie<char32_t>;
+} // namespace dict_detail
 
-    size_type
-    rfind(_CodeT __c, size_type __pos = npos) const noexcept
+/**
+ * @brief Traditional/Simplified Chinese converter on utf8 bytes. The
+ * dictionary, compiled by tools/gen_zhconv.py, is used in place: a
+ * two-level table maps single characters, and a trie on utf8 bytes maps
+ * phrases by longest match. Either direction is a separate dictionary.
+ *
+ * @code
+ *   zh_converter s2t;
+ *   if (s2t.open("s2t.bin"))
+ *     std::string text = s2t.convert(u8"头发干了");  // 頭髮乾了
+ * @endcode
+ */
+class zh_converter
+{
+  public:
+    using size_type = size_t;
+
+    zh_converter() noexcept
+    : _M_index(nullptr), _M_pages(nullptr), _M_pool(nullptr), _M_ratio(1),
+      _M_ascii_plain(true)
+    { _M_trie.nodes = nullptr; }
+
+    zh_converter(const zh_converter&) = delete;
+    zh_converter& operator=(const zh_converter&) = delete;
+
+    /**
+     * @brief Load the dictionary file at @a __path.
+     * @return  Whether the file is a valid dictionary.
+     */
+    bool
+    open(const char* __path)
+    { return _M_file.open(__path) && assign(_M_file.data(), _M_file.size()); }
+
+    bool
+    open(const std::string& __path)
+    { return open(__path.c_str()); }
+
+    /**
+     * @brief Use a dictionary already in memory, which must outlive the
+     * converter. @a __data must be 4-byte aligned. Every table is checked,
+     * so a corrupt or hostile file is rejected rather than read out of
+     * bounds.
+     * @return  Whether the buffer is a valid dictionary.
+     */
+    bool
+    assign(const char* __data, size_type __size)
     {
-      size_type __len = this->_M_len;
-      if (__len > 0)
-      {
-        __pos = std::min(--__len, __pos);
-        for (__pos++; __pos-- > 0; )
-          if (_M_ptr[__pos] == __c)
-            return __pos;
-      }
-      return npos;
+      const std::uint32_t* __h = (const std::uint32_t *)__data;
+      _M_trie.nodes = nullptr;
+      if (__size < _S_header_size || __h[0] != _S_magic || __h[1] != _S_version)
+        return false;
+      const size_type __npages = __h[2], __nnodes = __h[3], __nedges = __h[4];
+      const size_type __expected = _S_header_size + 2 * _S_index_size + 1024 * __npages
+          + 16 * __nnodes + 5 * __nedges + __h[5];
+      if (__nnodes == 0 || __size != __expected)
+        return false;
+      _M_index = (const std::uint16_t *)(__data + _S_header_size);
+      _M_pages = (const std::uint32_t *)(_M_index + _S_index_size);
+      const std::uint32_t* __nodes = _M_pages + 256 * __npages;
+      const std::uint32_t* __targets = __nodes + 4 * __nnodes;
+      const unsigned char* __labels = (const unsigned char *)(__targets + __nedges);
+      _M_pool = (const char *)(__labels + __nedges);
+      // The ratio the tables need, which the header must not understate.
+      _M_ratio = _M_check(__npages, __nnodes, __nedges, __h[5]);
+      if (!_M_ratio || _M_ratio > std::max<size_type>(__h[6], 1))
+        return false;
+      _M_trie.assign(__nodes, __targets, __labels, 4);
+      // Ascii runs are copied as is unless the dictionary maps ascii.
+      _M_ascii_plain = true;
+      for (unsigned int __c = 0; __c < 0x80; __c++)
+        if (_M_trie.root[__c] || (_M_index[0] && _M_pages[(_M_index[0] - 1) * 256 + __c]))
+          _M_ascii_plain = false;
+      return true;
     }
 
-    size_type
-    find_first_of(const ustring& __str, size_type __pos = 0) const noexcept
-    { return this->find_first_of(__str._M_ptr, __pos, __str._M_len); }
+    // Whether a dictionary is loaded.
+    bool
+    valid() const noexcept
+    { return _M_trie.nodes != nullptr; }
 
+    // Size of the buffer needed to convert @a __len bytes.
     size_type
-    find_first_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    max_size(size_type __len) const noexcept
+    { return _M_ratio * __len; }
+
+    /**
+     * @brief Convert the utf8 string. Characters and phrases not in the
+     * dictionary, and invalid bytes, are copied unchanged.
+     * Need to pre-allocate memory: dest = (char *)malloc(max_size(len))
+     * @param __str  utf8 string.
+     * @param __len  Length of @a __str.
+     * @param __dest  Character buffer.
+     * @return  Number of bytes written.
+     */
+    size_type
+    convert(const char* __str, size_type __len, char* __dest) const noexcept
     {
-      for (; __n && __pos < _M_len; __pos++)
+      if (!valid())
       {
-        for (size_type __i = 0; __i < __n; __i++)
-          if (__arr[__i] == _M_ptr[__pos])
-            return __pos;
+        memcpy(__dest, __str, __len);
+        return __len;
       }
-      return npos;
+      const unsigned char* __s = (const unsigned char *)__str;
+      size_type __i = 0, __cur = 0;
+      while (__i < __len)
+      {
+        if (_M_ascii_plain && __s[__i] < 0x80)
+        {
+          const size_type __n = simd_detail::ascii_prefix(__str + __i, __len - __i);
+          memcpy(__dest + __cur, __str + __i, __n);
+          __i += __n;
+          __cur += __n;
+          continue;
+        }
+        const char* __value = nullptr;
+        size_type __vlen = 0;
+        const size_type __klen = _M_match(__s + __i, __len - __i, __value, __vlen);
+        if (__klen)
+        {
+          memcpy(__dest + __cur, __value, __vlen);
+          __i += __klen;
+          __cur += __vlen;
+          continue;
+        }
+        char32_t __cp;
+        const width_type __n = utf8_decode(__str + __i, __cp, __len - __i);
+        const char32_t __to = _M_map(__cp);
+        if (__to)
+          __cur += utf8_encode(__to, __dest + __cur);
+        else
+        {
+          memcpy(__dest + __cur, __str + __i, __n);
+          __cur += __n;
+        }
+        __i += __n;
+      }
+      return __cur;
     }
 
-    size_type
-    find_first_of(const _CodeT* __arr, size_type __pos = 0) const
-    { return this->find_first_of(__arr, __pos, codelen(__arr)); }
-
-    size_type
-    find_first_of(_CodeT __c, size_type __pos = 0) const noexcept
-    { return this->find(__c, __pos); }
+    std::string
+    convert(const char* __str, size_type __len) const
+    {
+      std::string __result(max_size(__len), '\0');
+      __result.resize(convert(__str, __len, &__result[0]));
+      return __result;
+    }
 
-    size_type
-    find_last_of(const ustring& __str, size_type __pos = npos) const noexcept
-    { return this->find_last_of(__str._M_ptr, __pos, __str._M_len); }
+    std::string
+    convert(const std::string& __str) const
+    { return convert(__str.data(), __str.size()); }
+
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    std::string
+    convert(std::string_view __str) const
+    { return convert(__str.data(), __str.size()); }
+#endif
+
+    // The mapping of a single code point, or @a __cp when it has none.
+    char32_t
+    convert(char32_t __cp) const noexcept
+    {
+      const char32_t __to = valid() ? _M_map(__cp) : 0;
+      return __to ? __to : __cp;
+    }
 
+  private:
+    static const std::uint32_t _S_magic = 0x5643485A;  // 'ZHCV'
+    static const std::uint32_t _S_version = 1;
+    static const size_type _S_header_size = 32;
+    static const size_type _S_index_size = 0x1100;
+
+    // Check the tables against their sizes and return the expansion ratio
+    // of the mappings, which max_size() relies on, or 0 if they are not
+    // valid. A lone byte decodes to a code point up to U+00FF, so those may
+    // come from a single byte.
     size_type
-    find_last_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    _M_check(size_type __npages, size_type __nnodes, size_type __nedges,
+        size_type __pool_size) const
     {
-      size_type __len = this->_M_len;
-      if (__len && __n)
+      size_type __ratio = 1;
+      for (size_type __i = 0; __i < _S_index_size; __i++)
       {
-        __pos = std::min(--__len, __pos);
-        do
+        if (_M_index[__i] > __npages)
+          return 0;
+        if (!_M_index[__i])
+          continue;
+        const std::uint32_t* __page = _M_pages + (_M_index[__i] - 1) * 256;
+        for (char32_t __c = 0; __c < 256; __c++)
         {
-          for (size_type __i = 0; __i < __n; __i++)
-            if (__arr[__i] == _M_ptr[__pos])
-              return __pos;
-        } while (__pos-- > 0);
+          const char32_t __cp = (char32_t)(__i << 8) + __c;
+          const size_type __from = __cp <= 0xFF ? 1 : get_codepoint_bytes(__cp);
+          if (__page[__c] >= 0x110000)
+            return 0;
+          __ratio = std::max<size_type>(__ratio,
+              (get_codepoint_bytes(__page[__c]) + __from - 1) / __from);
+        }
       }
-      return npos;
+      const std::uint32_t* __nodes = _M_pages + 256 * __npages;
+      const std::uint32_t* __targets = __nodes + 4 * __nnodes;
+      const unsigned char* __labels = (const unsigned char *)(__targets + __nedges);
+      if (!dict_detail::byte_trie::check(__nodes, __targets, __labels, 4, __nnodes, __nedges))
+        return 0;
+      // Keys are as long as their depth; children come after their parent.
+      std::vector<std::uint32_t> __depth(__nnodes, 0);
+      for (size_type __i = 0; __i < __nnodes; __i++)
+      {
+        const std::uint32_t* __n = __nodes + 4 * __i;
+        if (__n[2] > __pool_size || __n[3] > __pool_size - __n[2] || (__n[3] && !__depth[__i]))
+          return 0;
+        if (__n[3])
+          __ratio = std::max<size_type>(__ratio, (__n[3] + __depth[__i] - 1) / __depth[__i]);
+        for (std::uint32_t __e = __n[0]; __e < __n[0] + __n[1]; __e++)
+          __depth[__targets[__e]] = __depth[__i] + 1;
+      }
+      return __ratio;
     }
 
-    size_type
-    find_last_of(const _CodeT* __arr, size_type __pos = npos) const
-    { return this->find_last_of(__arr, __pos, codelen(__arr)); }
-
-    size_type
-    find_last_of(_CodeT __c, size_type __pos = npos) const noexcept
-    { return this->rfind(__c, __pos); }
-
-    size_type
-    find_first_not_of(const ustring& __str, size_type __pos = 0) const noexcept
-    { return this->find_first_not_of(__str._M_ptr, __pos, __str._M_len); }
+    char32_t
+    _M_map(char32_t __cp) const noexcept
+    {
+      if (__cp >= 0x110000)
+        return 0;
+      const unsigned int __page = _M_index[__cp >> 8];
+      return __page ? _M_pages[(__page - 1) * 256 + (__cp & 0xFF)] : 0;
+    }
 
+    // Longest phrase at the start of @a __s: return its length in bytes, 0
+    // if there is none, and its value.
     size_type
-    find_first_not_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    _M_match(const unsigned char* __s, size_type __len, const char*& __value,
+        size_type& __vlen) const noexcept
     {
-      bool flag = true;
-      for (; __pos < _M_len; __pos++)
+      std::uint32_t __node = _M_trie.root[__s[0]];
+      size_type __best = 0;
+      for (size_type __i = 1; __node; __i++)
       {
-        flag = true;
-        for (size_type __i = 0; __i < __n; __i++)
+        const std::uint32_t* __n = _M_trie.node(__node);
+        if (__n[3])
         {
-          if (__arr[__i] == _M_ptr[__pos])
-          {
-            flag = false;
-            break;
-          }
+          __best = __i;
+          __value = _M_pool + __n[2];
+          __vlen = __n[3];
         }
-        if (flag)
-          return __pos;
+        if (__i == __len || !__n[1])
+          break;
+        __node = _M_trie.child(__node, __s[__i]);
       }
-      return npos;
+      return __best;
     }
 
-    size_type
-    find_first_not_of(const _CodeT* __arr, size_type __pos = 0) const
-    { return this->find_first_not_of(__arr, __pos, codelen(__arr)); }
+    dict_detail::mapped_file  _M_file;
+    dict_detail::byte_trie    _M_trie;
+    const std::uint16_t*      _M_index;
+    const std::uint32_t*      _M_pages;
+    const char*               _M_pool;
+    size_type                 _M_ratio;
+    bool                      _M_ascii_plain;
+};
 
-    size_type
-    find_first_not_of(_CodeT __c, size_type __pos = 0) const noexcept
+
+// Dictionary matching strategy of segmenter.
+enum class match_mode
+{
+  forward,
+  backward,
+  bidirectional
+};
+
+// A token of segmenter: byte offset and length in the input.
+struct token_span
+{
+  size_t offset;
+  size_t length;
+};
+
+/**
+ * @brief Chinese word segmentation by maximum matching over a dictionary
+ * compiled by tools/gen_segdict.py, with an optional HMM (Viterbi over the
+ * B/E/M/S states) joining runs of single characters into unknown words.
+ * The words are kept in a forward and a backward trie on code points.
+ *
+ * Runs of Han characters are segmented; runs of ascii letters and digits,
+ * runs of ascii spaces and every other character are tokens of their own.
+ * The dictionary is checked when loaded and never modified, so one
+ * segmenter can be shared by any number of threads, each with its own
+ * workspace.
+ *
+ * @code
+ *   segmenter seg;
+ *   seg.open("dict.bin");
+ *   segmenter::workspace ws;
+ *   std::vector<token_span> tokens;
+ *   seg.cut(text.data(), text.size(), tokens, ws);
+ * @endcode
+ */
+class segmenter
+{
+  public:
+    using size_type = size_t;
+
+    // Buffers reused across calls of cut(), one per thread.
+    class workspace
     {
-      for (; __pos < _M_len; __pos++)
-        if (_M_ptr[__pos] != __c)
-          return __pos;
-      return npos;
+      friend class segmenter;
+
+      // Words of the current run of Han characters, in characters.
+      std::vector<token_span>   _M_forward;
+      std::vector<token_span>   _M_backward;
+      std::vector<char32_t>     _M_chars;
+      // Byte offset of every character of the run, and of its end.
+      std::vector<size_type>    _M_offsets;
+      std::vector<std::uint8_t> _M_path;
+    };
+
+    segmenter() noexcept
+    : _M_start(nullptr), _M_trans(nullptr), _M_index(nullptr), _M_pages(nullptr),
+      _M_hmm(false)
+    { _M_forward.nodes = nullptr; }
+
+    segmenter(const segmenter&) = delete;
+    segmenter& operator=(const segmenter&) = delete;
+
+    /**
+     * @brief Load the dictionary file at @a __path.
+     * @return  Whether the file is a valid dictionary.
+     */
+    bool
+    open(const char* __path)
+    { return _M_file.open(__path) && assign(_M_file.data(), _M_file.size()); }
+
+    bool
+    open(const std::string& __path)
+    { return open(__path.c_str()); }
+
+    /**
+     * @brief Use a dictionary already in memory, which must outlive the
+     * segmenter. @a __data must be 4-byte aligned.
+     * @return  Whether the buffer is a valid dictionary.
+     */
+    bool
+    assign(const char* __data, size_type __size)
+    {
+      const std::uint32_t* __h = (const std::uint32_t *)__data;
+      _M_forward.nodes = nullptr;
+      if (__size < _S_header_size || __h[0] != _S_magic || __h[1] != _S_version)
+        return false;
+      const size_type __fnodes = __h[2], __fedges = __h[3], __bnodes = __h[4],
+          __bedges = __h[5], __npages = __h[6];
+      const size_type __expected = _S_header_size + 80 + 2 * _S_index_size
+          + 4096 * __npages + 12 * (__fnodes + __bnodes) + 8 * (__fedges + __bedges);
+      if (__fnodes == 0 || __bnodes == 0 || __size != __expected)
+        return false;
+      _M_start = (const float *)(__data + _S_header_size);
+      _M_trans = _M_start + 4;
+      _M_index = (const std::uint16_t *)(_M_trans + 16);
+      _M_pages = (const float *)(_M_index + _S_index_size);
+      const std::uint32_t* __fn = (const std::uint32_t *)(_M_pages + 1024 * __npages);
+      const std::uint32_t* __ft = __fn + 3 * __fnodes;
+      const char32_t* __fl = (const char32_t *)(__ft + __fedges);
+      const std::uint32_t* __bn = (const std::uint32_t *)(__fl + __fedges);
+      const std::uint32_t* __bt = __bn + 3 * __bnodes;
+      const char32_t* __bl = (const char32_t *)(__bt + __bedges);
+      for (size_type __i = 0; __i < _S_index_size; __i++)
+        if (_M_index[__i] > __npages)
+          return false;
+      if (!dict_detail::code_trie::check(__fn, __ft, __fl, 3, __fnodes, __fedges)
+          || !dict_detail::code_trie::check(__bn, __bt, __bl, 3, __bnodes, __bedges))
+        return false;
+      _M_backward.assign(__bn, __bt, __bl, 3);
+      _M_forward.assign(__fn, __ft, __fl, 3);
+      _M_hmm = __h[7] != 0;
+      return true;
     }
 
-    size_type
-    find_last_not_of(const ustring& __str, size_type __pos = npos) const noexcept
-    { return this->find_last_not_of(__str._M_ptr, __pos, __str._M_len); }
+    // Whether a dictionary is loaded.
+    bool
+    valid() const noexcept
+    { return _M_forward.nodes != nullptr; }
 
-    size_type 
-    find_last_not_of(const _CodeT* __arr, size_type __pos, size_type __n) const noexcept
+    // Whether the dictionary comes with an HMM for unknown words.
+    bool
+    has_hmm() const noexcept
+    { return _M_hmm; }
+
+    // Frequency of the word in the dictionary, 0 if it is not a word.
+    std::uint32_t
+    frequency(const char* __word, size_type __len) const noexcept
     {
-      bool flag = true;
-      size_type __len = this->_M_len;
-      if (__len)
+      std::uint32_t __node = 0;
+      char32_t __cp;
+      for (size_type __i = 0; __i < __len && valid(); )
       {
-        __pos = std::min(--__len, __pos);
-        do
+        __i += utf8_decode(__word + __i, __cp, __len - __i);
+        if (!(__node = _M_forward.child(__node, __cp)))
+          return 0;
+      }
+      return __node ? _M_forward.node(__node)[2] : 0;
+    }
+
+    std::uint32_t
+    frequency(const std::string& __word) const noexcept
+    { return frequency(__word.data(), __word.size()); }
+
+    /**
+     * @brief Segment the utf8 string.
+     * @param __str  utf8 string.
+     * @param __len  Length of @a __str.
+     * @param __tokens  Replaced by the tokens, covering all of @a __str.
+     * @param __ws  Buffers of the calling thread.
+     * @param __mode  Maximum matching strategy. Bidirectional takes the
+     * result with fewer words, then fewer single characters, then backward.
+     * @param __hmm  Whether to join runs of single characters by the HMM.
+     */
+    void
+    cut(const char* __str, size_type __len, std::vector<token_span>& __tokens,
+        workspace& __ws, match_mode __mode = match_mode::bidirectional,
+        bool __hmm = true) const
+    {
+      __tokens.clear();
+      size_type __i = 0;
+      while (__i < __len)
+      {
+        char32_t __cp;
+        size_type __j = __i + utf8_decode(__str + __i, __cp, __len - __i);
+        if (_S_is_han(__cp) && valid())
         {
-          flag = true;
-          for (size_type __i = 0; __i < __n; __i++)
+          while (__j < __len)
           {
-            if (__arr[__i] == _M_ptr[__pos])
-            {
-              flag = false;
+            const width_type __n = utf8_decode(__str + __j, __cp, __len - __j);
+            if (!_S_is_han(__cp))
               break;
-            }
+            __j += __n;
           }
-          if (flag)
-            return __pos;
-        } while (__pos-- > 0);
+          _M_cut_han(__str, __i, __j, __tokens, __ws, __mode, __hmm && _M_hmm);
+        }
+        else
+        {
+          const int __kind = _S_ascii_kind(__cp);
+          if (__kind)
+            while (__j < __len && _S_ascii_kind((unsigned char)__str[__j]) == __kind)
+              __j++;
+          __tokens.push_back({ __i, __j - __i });
+        }
+        __i = __j;
       }
-      return npos;
     }
 
-    size_type
-    find_last_not_of(const _CodeT* __arr, size_type __pos = npos) const
-    { return this->find_last_not_of(__arr, __pos, codelen(__arr)); }
-
-    size_type
-    find_last_not_of(_CodeT __c, size_type __pos = npos) const noexcept
+    std::vector<std::string>
+    cut(const std::string& __str, match_mode __mode = match_mode::bidirectional,
+        bool __hmm = true) const
     {
-      size_type __len = this->_M_len;
-      if (__len)
-      {
-        __pos = std::min(--__len, __pos);
-        do
-        {
-          if (_M_ptr[__pos] != __c)
-            return __pos;
-        } while (__pos-- > 0);
-      }
-      return npos;
+      workspace __ws;
+      std::vector<token_span> __tokens;
+      cut(__str.data(), __str.size(), __tokens, __ws, __mode, __hmm);
+      std::vector<std::string> __words;
+      __words.reserve(__tokens.size());
+      for (const token_span& __t : __tokens)
+        __words.emplace_back(__str, __t.offset, __t.length);
+      return __words;
     }
 
-    // convert to utf8 string
-    std::string 
-    to_string() const
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    std::vector<std::string_view>
+    cut(std::string_view __str, match_mode __mode = match_mode::bidirectional,
+        bool __hmm = true) const
     {
-      size_type __cur = 0;
-      std::string __str(this->size_bytes(), '\0');
-      char* __s = (char *)malloc(8);
-      width_type __num_bytes;
-      for (size_type __i = 0; __i < _M_len; __i++)
-      {
-        __num_bytes = utf8_encode(_M_ptr[__i], __s);
-        for (width_type __j = 0; __j < __num_bytes; __j++)
-          __str[__cur + __j] = __s[__j];
-        __cur += __num_bytes;
-      }
-      free(__s);
-      return __str;
+      workspace __ws;
+      std::vector<token_span> __tokens;
+      cut(__str.data(), __str.size(), __tokens, __ws, __mode, __hmm);
+      std::vector<std::string_view> __words;
+      __words.reserve(__tokens.size());
+      for (const token_span& __t : __tokens)
+        __words.push_back(__str.substr(__t.offset, __t.length));
+      return __words;
     }
+#endif
 
-    char*
-    to_c_str() const
+  private:
+    static const std::uint32_t _S_magic = 0x4753485A;  // 'ZHSG'
+    static const std::uint32_t _S_version = 1;
+    static const size_type _S_header_size = 32;
+    static const size_type _S_index_size = 0x1100;
+
+    enum { _S_B, _S_E, _S_M, _S_S };
+
+    static bool
+    _S_is_han(char32_t __cp) noexcept
     {
-      size_type __cur = 0;
-      char* __str = (char *)malloc(this->size_bytes());
-      char* __s = (char *)malloc(8);
-      width_type __num_bytes;
-      for (size_type __i = 0; __i < _M_len; __i++)
-      {
-        __num_bytes = utf8_encode(_M_ptr[__i], __s);
-        for (width_type __j = 0; __j < __num_bytes; __j++)
-          __str[__cur + __j] = __s[__j];
-        __cur += __num_bytes;
-      }
-      __str[__cur] = '\0';
-      free(__s);
-      return __str;
+      return (__cp >= 0x4E00 && __cp <= 0x9FFF) || (__cp >= 0x3400 && __cp <= 0x4DBF) ||
+          (__cp >= 0x20000 && __cp <= 0x2CEAF) || (__cp >= 0xF900 && __cp <= 0xFAFF) ||
+          (__cp >= 0x2F800 && __cp <= 0x2FA1F);
     }
 
-    width_type
-    get_unit_bytes(size_type __pos) const noexcept
+    // 1 for ascii letters and digits, 2 for ascii spaces, 0 otherwise.
+    static int
+    _S_ascii_kind(char32_t __c) noexcept
     {
-      __glibcxx_assert(__pos < _M_len);
-      return get_codepoint_bytes(_M_ptr[__pos]);
+      if ((__c >= '0' && __c <= '9') || ((__c | 0x20) >= 'a' && (__c | 0x20) <= 'z'))
+        return 1;
+      return __c == ' ' || __c == '\t' || __c == '\n' || __c == '\r' ? 2 : 0;
     }
 
+    // Number of characters of the longest word at __chars[__i], 0 if none.
     size_type
-    get_index(size_type __bytes) const noexcept
+    _M_longest_forward(const char32_t* __chars, size_type __i, size_type __n) const noexcept
     {
-      size_type __cur_pos = 0, __cur_bytes = 0;
-      while (__cur_pos < _M_len)
+      size_type __best = 0;
+      std::uint32_t __node = 0;
+      for (size_type __k = __i; __k < __n; __k++)
       {
-        if (__cur_bytes == __bytes)
-          return __cur_pos;
-        else if (__cur_bytes > __bytes)
-          return npos;
-        __cur_bytes += get_unit_bytes(__cur_pos);
-        __cur_pos ++;
+        if (!(__node = _M_forward.child(__node, __chars[__k])))
+          break;
+        if (_M_forward.node(__node)[2])
+          __best = __k + 1 - __i;
       }
-      return npos;
+      return __best;
     }
 
+    // Number of characters of the longest word ending before __chars[__j].
     size_type
-    get_byte_position(size_type __pos) const noexcept
+    _M_longest_backward(const char32_t* __chars, size_type __j) const noexcept
     {
-      __glibcxx_assert(__pos < _M_len);
-      size_type __cur_pos = 0, __cur_bytes = 0;
-      while (__cur_pos < _M_len)
+      size_type __best = 0;
+      std::uint32_t __node = 0;
+      for (size_type __k = __j; __k > 0; __k--)
       {
-        if (__cur_pos == __pos)
-          return __cur_bytes;
-        __cur_bytes += get_unit_bytes(__cur_pos);
-        __cur_pos ++;
+        if (!(__node = _M_backward.child(__node, __chars[__k - 1])))
+          break;
+        if (_M_backward.node(__node)[2])
+          __best = __j - __k + 1;
       }
-      return npos;
+      return __best;
     }
 
-  private:
-    size_type _M_allocated_capacity;
-    size_type _M_len;
-    pointer   _M_ptr;
-};
-
-// operator==
-template <typename _CodeT>
-inline bool
-operator==(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) == 0; }
-
-template <typename _CodeT>
-inline bool
-operator==(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) == 0; }
-
-template <typename _CodeT>
-inline bool
-operator==(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) == 0; }
-
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator==(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) == 0; }
-
-template <typename _CodeT>
-inline bool
-operator==(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) == 0; }
-#endif
-
-template <typename _CodeT>
-inline bool
-operator==(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) == 0; }
-
-template <typename _CodeT>
-inline bool
-operator==(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) == 0; }
-
-template <typename _CodeT>
-inline bool
-operator==(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) == 0; }
+    static size_type
+    _S_singles(const std::vector<token_span>& __t) noexcept
+    {
+      size_type __n = 0;
+      for (const token_span& __s : __t)
+        __n += __s.length == 1;
+      return __n;
+    }
 
-template <typename _CodeT>
-inline bool
-operator==(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) == 0; }
+    // Append the characters [__from, __to) of the run as a token.
+    static void
+    _S_emit(const workspace& __ws, size_type __from, size_type __to,
+        std::vector<token_span>& __tokens)
+    {
+      __tokens.push_back({ __ws._M_offsets[__from],
+          __ws._M_offsets[__to] - __ws._M_offsets[__from] });
+    }
 
-// operator!=
-template <typename _CodeT>
-inline bool
-operator!=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) != 0; }
+    void
+    _M_cut_han(const char* __str, size_type __begin, size_type __end,
+        std::vector<token_span>& __tokens, workspace& __ws, match_mode __mode,
+        bool __hmm) const
+    {
+      std::vector<char32_t>& __chars = __ws._M_chars;
+      std::vector<size_type>& __offsets = __ws._M_offsets;
+      __chars.clear();
+      __offsets.clear();
+      for (size_type __i = __begin; __i < __end; )
+      {
+        char32_t __cp;
+        __offsets.push_back(__i);
+        __i += utf8_decode(__str + __i, __cp, __end - __i);
+        __chars.push_back(__cp);
+      }
+      __offsets.push_back(__end);
+      const char32_t* __c = __chars.data();
+      const size_type __n = __chars.size();
+
+      std::vector<token_span>& __fw = __ws._M_forward;
+      std::vector<token_span>& __bw = __ws._M_backward;
+      __fw.clear();
+      __bw.clear();
+      if (__mode != match_mode::backward)
+        for (size_type __i = 0; __i < __n; )
+        {
+          const size_type __k = std::max<size_type>(_M_longest_forward(__c, __i, __n), 1);
+          __fw.push_back({ __i, __k });
+          __i += __k;
+        }
+      if (__mode != match_mode::forward)
+      {
+        for (size_type __j = __n; __j > 0; )
+        {
+          const size_type __k = std::max<size_type>(_M_longest_backward(__c, __j), 1);
+          __bw.push_back({ __j - __k, __k });
+          __j -= __k;
+        }
+        std::reverse(__bw.begin(), __bw.end());
+      }
+      const std::vector<token_span>* __best = &__fw;
+      if (__mode == match_mode::backward)
+        __best = &__bw;
+      else if (__mode == match_mode::bidirectional)
+      {
+        if (__bw.size() != __fw.size())
+          __best = __bw.size() < __fw.size() ? &__bw : &__fw;
+        else
+          __best = _S_singles(__fw) < _S_singles(__bw) ? &__fw : &__bw;
+      }
 
-template <typename _CodeT>
-inline bool
-operator!=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) != 0; }
+      // Runs of single characters that don't form a word go through the HMM.
+      const std::vector<token_span>& __t = *__best;
+      for (size_type __i = 0; __i < __t.size(); )
+      {
+        size_type __j = __i;
+        if (__hmm)
+          while (__j < __t.size() && __t[__j].length == 1)
+            __j++;
+        if (__j - __i > 1 && !_M_is_word(__c, __t[__i].offset, __t[__j - 1].offset + 1))
+          _M_viterbi(__t[__i].offset, __t[__j - 1].offset + 1, __tokens, __ws);
+        else
+        {
+          __j = std::max(__j, __i + 1);
+          for (size_type __k = __i; __k < __j; __k++)
+            _S_emit(__ws, __t[__k].offset, __t[__k].offset + __t[__k].length, __tokens);
+        }
+        __i = __j;
+      }
+    }
 
-template <typename _CodeT>
-inline bool
-operator!=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) != 0; }
+    bool
+    _M_is_word(const char32_t* __chars, size_type __from, size_type __to) const noexcept
+    {
+      std::uint32_t __node = 0;
+      for (size_type __k = __from; __k < __to; __k++)
+        if (!(__node = _M_forward.child(__node, __chars[__k])))
+          return false;
+      return _M_forward.node(__node)[2] != 0;
+    }
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator!=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) != 0; }
+    // Emission log probability of the code point in each state.
+    const float*
+    _M_emit(char32_t __cp) const noexcept
+    {
+      static const float __unknown[4] = { -1e30f, -1e30f, -1e30f, -1e30f };
+      const unsigned int __page = __cp < 0x110000 ? _M_index[__cp >> 8] : 0;
+      return __page ? _M_pages + 1024 * (__page - 1) + 4 * (__cp & 0xFF) : __unknown;
+    }
 
-template <typename _CodeT>
-inline bool
-operator!=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) != 0; }
-#endif
+    // Segment the characters [__from, __to) of the run by the HMM.
+    void
+    _M_viterbi(size_type __from, size_type __to, std::vector<token_span>& __tokens,
+        workspace& __ws) const
+    {
+      const char32_t* __chars = __ws._M_chars.data() + __from;
+      std::vector<std::uint8_t>& __path = __ws._M_path;
+      const size_type __n = __to - __from;
+      __path.resize(4 * __n);
+      // States that may precede each state.
+      static const int __prev[4][2] = { { _S_E, _S_S }, { _S_B, _S_M },
+          { _S_M, _S_B }, { _S_S, _S_E } };
+      double __v[4], __w[4];
+      const float* __e = _M_emit(__chars[0]);
+      for (int __y = 0; __y < 4; __y++)
+        __v[__y] = (double)_M_start[__y] + __e[__y];
+      for (size_type __t = 1; __t < __n; __t++)
+      {
+        __e = _M_emit(__chars[__t]);
+        for (int __y = 0; __y < 4; __y++)
+        {
+          const int __a = __prev[__y][0], __b = __prev[__y][1];
+          const double __pa = __v[__a] + _M_trans[4 * __a + __y];
+          const double __pb = __v[__b] + _M_trans[4 * __b + __y];
+          __w[__y] = (__pa >= __pb ? __pa : __pb) + __e[__y];
+          __path[4 * __t + __y] = (std::uint8_t)(__pa >= __pb ? __a : __b);
+        }
+        std::copy(__w, __w + 4, __v);
+      }
+      // Walk back from the better of E and S, then emit B..E and S words.
+      int __y = __v[_S_S] >= __v[_S_E] ? _S_S : _S_E;
+      for (size_type __t = __n; __t-- > 0; )
+      {
+        const int __p = __t ? __path[4 * __t + __y] : 0;
+        __path[4 * __t] = (std::uint8_t)__y;
+        __y = __p;
+      }
+      size_type __start = 0;
+      for (size_type __t = 0; __t < __n; __t++)
+      {
+        const int __s = __path[4 * __t];
+        if (__s == _S_B)
+          __start = __t;
+        else if (__s == _S_E || __s == _S_S)
+          _S_emit(__ws, __from + (__s == _S_S ? __t : __start), __from + __t + 1, __tokens);
+      }
+    }
 
-template <typename _CodeT>
-inline bool
-operator!=(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) != 0; }
+    dict_detail::mapped_file  _M_file;
+    dict_detail::code_trie    _M_forward;
+    dict_detail::code_trie    _M_backward;
+    const float*              _M_start;
+    const float*              _M_trans;
+    const std::uint16_t*      _M_index;
+    const float*              _M_pages;
+    bool                      _M_hmm;
+};
 
-template <typename _CodeT>
-inline bool
-operator!=(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) != 0; }
 
-template <typename _CodeT>
-inline bool
-operator!=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) != 0; }
+// Output of pinyin_converter.
+enum class pinyin_style
+{
+  plain,          // zhong guo, v for ü
+  tone_marks,     // zhōng guó
+  tone_numbers,   // zhong1 guo2, no number for the neutral tone
+  initials        // z g
+};
 
-template <typename _CodeT>
-inline bool
-operator!=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) != 0; }
+/**
+ * @brief Hanzi to pinyin converter on utf8 bytes, with a dictionary
+ * compiled by tools/gen_pinyin.py. The reading of U+4E00-U+9FFF is looked
+ * up by cp - 0x4E00, other characters by binary search, and polyphones
+ * are resolved by the longest phrase in a trie on code points.
+ *
+ * @code
+ *   pinyin_converter py;
+ *   py.open("pinyin.bin");
+ *   py.convert(u8"重庆", pinyin_style::tone_marks);   // chóng qìng
+ *   py.convert(u8"重庆", pinyin_style::initials, 0);  // cq
+ * @endcode
+ */
+class pinyin_converter
+{
+  public:
+    using size_type = size_t;
 
-// operator>=
-template <typename _CodeT>
-inline bool
-operator>=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) >= 0; }
+    pinyin_converter() noexcept
+    : _M_common(nullptr), _M_extra(nullptr), _M_nextra(0), _M_readings(nullptr),
+      _M_syllables(nullptr)
+    { _M_trie.nodes = nullptr; }
 
-template <typename _CodeT>
-inline bool
-operator>=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) >= 0; }
+    pinyin_converter(const pinyin_converter&) = delete;
+    pinyin_converter& operator=(const pinyin_converter&) = delete;
 
-template <typename _CodeT>
-inline bool
-operator>=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) <= 0; }
+    /**
+     * @brief Load the dictionary file at @a __path.
+     * @return  Whether the file is a valid dictionary.
+     */
+    bool
+    open(const char* __path)
+    { return _M_file.open(__path) && assign(_M_file.data(), _M_file.size()); }
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator>=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) >= 0; }
+    bool
+    open(const std::string& __path)
+    { return open(__path.c_str()); }
+
+    /**
+     * @brief Use a dictionary already in memory, which must outlive the
+     * converter. @a __data must be 4-byte aligned.
+     * @return  Whether the buffer is a valid dictionary.
+     */
+    bool
+    assign(const char* __data, size_type __size)
+    {
+      const std::uint32_t* __h = (const std::uint32_t *)__data;
+      _M_trie.nodes = nullptr;
+      if (__size < _S_header_size || __h[0] != _S_magic || __h[1] != _S_version)
+        return false;
+      const size_type __nsyllables = __h[2], __nextra = __h[3], __nnodes = __h[4],
+          __nedges = __h[5], __nreadings = __h[6];
+      const size_type __expected = _S_header_size + 2 * _S_common_size + 8 * __nextra
+          + 12 * __nnodes + 8 * __nedges + 2 * __nreadings + 8 * __nsyllables;
+      if (__nnodes == 0 || __nreadings % 2 || __size != __expected)
+        return false;
+      _M_common = (const std::uint16_t *)(__data + _S_header_size);
+      _M_extra = (const std::uint32_t *)(_M_common + _S_common_size);
+      _M_nextra = __nextra;
+      const std::uint32_t* __nodes = _M_extra + 2 * __nextra;
+      const std::uint32_t* __targets = __nodes + 3 * __nnodes;
+      const char32_t* __labels = (const char32_t *)(__targets + __nedges);
+      _M_readings = (const std::uint16_t *)(__labels + __nedges);
+      _M_syllables = (const char *)(_M_readings + __nreadings);
+      if (!_M_check(__nsyllables, __nodes, __targets, __labels, __nnodes, __nedges,
+          __nreadings))
+        return false;
+      _M_trie.assign(__nodes, __targets, __labels, 3);
+      return true;
+    }
 
-template <typename _CodeT>
-inline bool
-operator>=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) <= 0; }
-#endif
+    // Whether a dictionary is loaded.
+    bool
+    valid() const noexcept
+    { return _M_trie.nodes != nullptr; }
 
-template <typename _CodeT>
-inline bool
-operator>=(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) >= 0; }
+    // Size of the buffer needed to convert @a __len bytes.
+    size_type
+    max_size(size_type __len) const noexcept
+    { return 3 * __len; }
+
+    /**
+     * @brief Write the pinyin of the utf8 string. Characters without a
+     * reading are copied unchanged.
+     * Need to pre-allocate memory: dest = (char *)malloc(max_size(len))
+     * @param __str  utf8 string.
+     * @param __len  Length of @a __str.
+     * @param __dest  Character buffer.
+     * @param __style  Output style.
+     * @param __sep  Separator written between two syllables, none if 0.
+     * @return  Number of bytes written.
+     */
+    size_type
+    convert(const char* __str, size_type __len, char* __dest,
+        pinyin_style __style = pinyin_style::plain, char __sep = ' ') const noexcept
+    {
+      const unsigned char* __s = (const unsigned char *)__str;
+      size_type __i = 0, __cur = 0;
+      bool __after = false;
+      while (__i < __len)
+      {
+        if (__s[__i] < 0x80)
+        {
+          const size_type __n = simd_detail::ascii_prefix(__str + __i, __len - __i);
+          memcpy(__dest + __cur, __str + __i, __n);
+          __i += __n;
+          __cur += __n;
+          __after = false;
+          continue;
+        }
+        char32_t __cp;
+        const width_type __n = utf8_decode(__str + __i, __cp, __len - __i);
+        // Longest phrase of two characters or more.
+        size_type __bytes = 0, __chars = 0;
+        const std::uint16_t* __r = nullptr;
+        std::uint32_t __node = valid() ? _M_trie.child(0, __cp) : 0;
+        for (size_type __j = __i + __n, __k = 2; __node && __j < __len; __k++)
+        {
+          char32_t __c;
+          __j += utf8_decode(__str + __j, __c, __len - __j);
+          if (!(__node = _M_trie.child(__node, __c)))
+            break;
+          const std::uint32_t __off = _M_trie.node(__node)[2];
+          if (__off)
+          {
+            __bytes = __j - __i;
+            __chars = __k;
+            __r = _M_readings + __off - 1;
+          }
+        }
+        if (__chars)
+        {
+          for (size_type __k = 0; __k < __chars; __k++)
+          {
+            if (__after && __sep)
+              __dest[__cur++] = __sep;
+            __cur += _M_put(__r[__k], __dest + __cur, __style);
+            __after = true;
+          }
+          __i += __bytes;
+          continue;
+        }
+        const std::uint16_t __reading = reading(__cp);
+        if (__reading)
+        {
+          if (__after && __sep)
+            __dest[__cur++] = __sep;
+          __cur += _M_put(__reading, __dest + __cur, __style);
+        }
+        else
+        {
+          memcpy(__dest + __cur, __str + __i, __n);
+          __cur += __n;
+        }
+        __after = __reading != 0;
+        __i += __n;
+      }
+      return __cur;
+    }
 
-template <typename _CodeT>
-inline bool
-operator>=(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) <= 0; }
+    std::string
+    convert(const char* __str, size_type __len, pinyin_style __style = pinyin_style::plain,
+        char __sep = ' ') const
+    {
+      std::string __result(max_size(__len), '\0');
+      __result.resize(convert(__str, __len, &__result[0], __style, __sep));
+      return __result;
+    }
 
-template <typename _CodeT>
-inline bool
-operator>=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) >= 0; }
+    std::string
+    convert(const std::string& __str, pinyin_style __style = pinyin_style::plain,
+        char __sep = ' ') const
+    { return convert(__str.data(), __str.size(), __style, __sep); }
 
-template <typename _CodeT>
-inline bool
-operator>=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) <= 0; }
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    std::string
+    convert(std::string_view __str, pinyin_style __style = pinyin_style::plain,
+        char __sep = ' ') const
+    { return convert(__str.data(), __str.size(), __style, __sep); }
+#endif
 
-// operator<=
-template <typename _CodeT>
-inline bool
-operator<=(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) <= 0; }
+    // Reading of the code point out of phrases: (syllable + 1) << 3 | tone,
+    // 0 if it has none.
+    std::uint16_t
+    reading(char32_t __cp) const noexcept
+    {
+      if (!valid())
+        return 0;
+      if (__cp >= _S_common_first && __cp < _S_common_first + _S_common_size)
+        return _M_common[__cp - _S_common_first];
+      size_type __lo = 0, __hi = _M_nextra;
+      while (__lo < __hi)
+      {
+        const size_type __mid = (__lo + __hi) / 2;
+        if (_M_extra[2 * __mid] < __cp)
+          __lo = __mid + 1;
+        else
+          __hi = __mid;
+      }
+      return __lo < _M_nextra && _M_extra[2 * __lo] == __cp ? (std::uint16_t)_M_extra[2 * __lo + 1] : 0;
+    }
 
-template <typename _CodeT>
-inline bool
-operator<=(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) <= 0; }
+  private:
+    static const std::uint32_t _S_magic = 0x5950485A;  // 'ZHPY'
+    static const std::uint32_t _S_version = 1;
+    static const size_type _S_header_size = 32;
+    static const char32_t _S_common_first = 0x4E00;
+    static const size_type _S_common_size = 0x5200;
+
+    static bool
+    _S_valid_reading(std::uint32_t __reading, size_type __nsyllables) noexcept
+    { return (__reading >> 3) && (__reading >> 3) <= __nsyllables && (__reading & 7) <= 4; }
+
+    // Whether the tables are valid for their sizes: every reading names a
+    // syllable and a tone up to 4, every syllable is 1 to 6 letters and 7
+    // bytes at most with its tone mark, and every character with a reading
+    // is 3 bytes or more in utf8, which max_size() relies on.
+    bool
+    _M_check(size_type __nsyllables, const std::uint32_t* __nodes,
+        const std::uint32_t* __targets, const char32_t* __labels, size_type __nnodes,
+        size_type __nedges, size_type __nreadings) const
+    {
+      for (size_type __i = 0; __i < __nsyllables; __i++)
+      {
+        const char* __syl = _M_syllables + 8 * __i;
+        size_type __n = 0, __bytes = 1;
+        while (__n < 8 && __syl[__n] >= 'a' && __syl[__n] <= 'z')
+          __bytes += 1 + (__syl[__n++] == 'v');
+        if (__n == 0 || __n > 6 || __bytes > 7)
+          return false;
+        while (__n < 8)
+          if (__syl[__n++])
+            return false;
+      }
+      for (size_type __i = 0; __i < _S_common_size; __i++)
+        if (_M_common[__i] && !_S_valid_reading(_M_common[__i], __nsyllables))
+          return false;
+      for (size_type __i = 0; __i < _M_nextra; __i++)
+      {
+        const std::uint32_t __cp = _M_extra[2 * __i], __r = _M_extra[2 * __i + 1];
+        if (__cp < 0x800 || __cp >= 0x110000 || (__i && __cp <= _M_extra[2 * __i - 2])
+            || __r > 0xFFFF || (__r && !_S_valid_reading(__r, __nsyllables)))
+          return false;
+      }
+      if (!dict_detail::code_trie::check(__nodes, __targets, __labels, 3, __nnodes, __nedges))
+        return false;
+      for (size_type __e = 0; __e < __nedges; __e++)
+        if (__labels[__e] < 0x800 || __labels[__e] >= 0x110000)
+          return false;
+      // A phrase has as many readings as its depth; children come after
+      // their parent.
+      std::vector<std::uint32_t> __depth(__nnodes, 0);
+      for (size_type __i = 0; __i < __nnodes; __i++)
+      {
+        const std::uint32_t* __n = __nodes + 3 * __i;
+        if (__n[2] && (!__depth[__i] || __depth[__i] > __nreadings
+            || __n[2] - 1 > __nreadings - __depth[__i]))
+          return false;
+        for (std::uint32_t __k = 0; __n[2] && __k < __depth[__i]; __k++)
+          if (!_S_valid_reading(_M_readings[__n[2] - 1 + __k], __nsyllables))
+            return false;
+        for (std::uint32_t __e = __n[0]; __e < __n[0] + __n[1]; __e++)
+          __depth[__targets[__e]] = __depth[__i] + 1;
+      }
+      return true;
+    }
 
-template <typename _CodeT>
-inline bool
-operator<=(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) >= 0; }
+    // Write the syllable of the reading and return its length.
+    size_type
+    _M_put(std::uint16_t __reading, char* __dest, pinyin_style __style) const noexcept
+    {
+      const char* __syl = _M_syllables + 8 * ((__reading >> 3) - 1);
+      const unsigned int __tone = __reading & 7;
+      size_type __n = 0;
+      while (__n < 8 && __syl[__n])
+        __n++;
+      switch (__style)
+      {
+        case pinyin_style::initials:
+          __dest[0] = __syl[0];
+          return 1;
+        case pinyin_style::plain:
+          memcpy(__dest, __syl, __n);
+          return __n;
+        case pinyin_style::tone_numbers:
+          memcpy(__dest, __syl, __n);
+          if (__tone)
+            __dest[__n++] = char('0' + __tone);
+          return __n;
+        default:
+          break;
+      }
+      // The tone mark goes on a or e, on the o of ou, else on the last vowel.
+      static const char __vowels[] = "aeiouv";
+      static const char __marks[6][4][3] = {
+        { "\xC4\x81", "\xC3\xA1", "\xC7\x8E", "\xC3\xA0" },
+        { "\xC4\x93", "\xC3\xA9", "\xC4\x9B", "\xC3\xA8" },
+        { "\xC4\xAB", "\xC3\xAD", "\xC7\x90", "\xC3\xAC" },
+        { "\xC5\x8D", "\xC3\xB3", "\xC7\x92", "\xC3\xB2" },
+        { "\xC5\xAB", "\xC3\xBA", "\xC7\x94", "\xC3\xB9" },
+        { "\xC7\x96", "\xC7\x98", "\xC7\x9A", "\xC7\x9C" } };
+      size_type __pos = npos;
+      for (size_type __k = 0; __k < __n; __k++)
+      {
+        const char __c = __syl[__k];
+        if (__c == 'a' || __c == 'e' || (__c == 'o' && __k + 1 < __n && __syl[__k + 1] == 'u'))
+        {
+          __pos = __k;
+          break;
+        }
+        if (strchr(__vowels, __c))
+          __pos = __k;
+      }
+      size_type __cur = 0;
+      for (size_type __k = 0; __k < __n; __k++)
+      {
+        const char __c = __syl[__k];
+        if (__k == __pos && __tone)
+        {
+          memcpy(__dest + __cur, __marks[strchr(__vowels, __c) - __vowels][__tone - 1], 2);
+          __cur += 2;
+        }
+        else if (__c == 'v')
+        {
+          memcpy(__dest + __cur, "\xC3\xBC", 2);
+          __cur += 2;
+        }
+        else
+          __dest[__cur++] = __c;
+      }
+      return __cur;
+    }
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator<=(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) <= 0; }
+    dict_detail::mapped_file  _M_file;
+    dict_detail::code_trie    _M_trie;
+    const std::uint16_t*      _M_common;
+    const std::uint32_t*      _M_extra;
+    size_type                 _M_nextra;
+    const std::uint16_t*      _M_readings;
+    const char*               _M_syllables;
+};
 
-template <typename _CodeT>
-inline bool
-operator<=(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) >= 0; }
-#endif
 
-template <typename _CodeT>
-inline bool
-operator<=(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) <= 0; }
+namespace pipeline_detail {
+  // A stage takes the bytes of a token in runs through put(s, n, next) and
+  // its end through cut(next), and hands what it makes to next, which has
+  // put(s, n) and cut(). Runs are only valid during the call. reset()
+  // readies a stage for a new string.
 
-template <typename _CodeT>
-inline bool
-operator<=(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) >= 0; }
+  // Knuth-Morris-Pratt failure function of the pattern.
+  inline std::vector<size_t> failure(const std::string& pattern)
+  {
+    std::vector<size_t> fail(pattern.size() + 1, 0);
+    for (size_t i = 1, k = 0; i < pattern.size(); i++)
+    {
+      while (k && pattern[i] != pattern[k])
+        k = fail[k];
+      if (pattern[i] == pattern[k])
+        k++;
+      fail[i + 1] = k;
+    }
+    return fail;
+  }
 
-template <typename _CodeT>
-inline bool
-operator<=(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) <= 0; }
+  // Leftmost non-overlapping matches of a pattern in a stream of runs, like
+  // std::string::find from the end of the last match.
+  struct matcher
+  {
+    std::string pattern;
+    std::vector<size_t> fail;
+    size_t matched;
+
+    explicit matcher(const std::string& p)
+    : pattern(p), fail(failure(p)), matched(0) { }
+
+    /**
+     * Scan the run, giving the bytes which are no part of a match to
+     * next.put and calling found() for every match.
+     */
+    template <typename _Next, typename _Found>
+    void scan(const char* s, size_t n, _Next& next, _Found found)
+    {
+      size_t i = 0;
+      while (i < n)
+      {
+        if (!matched)
+        {
+          // Nothing can match before the next first byte of the pattern.
+          const char* hit = (const char *)memchr(s + i, pattern[0], n - i);
+          const size_t j = hit ? size_t(hit - s) : n;
+          if (j > i)
+            next.put(s + i, j - i);
+          if ((i = j) == n)
+            break;
+        }
+        while (matched && pattern[matched] != s[i])
+        {
+          const size_t k = fail[matched];
+          next.put(pattern.data(), matched - k);
+          matched = k;
+        }
+        if (pattern[matched] != s[i])
+          next.put(s + i, 1);
+        else if (++matched == pattern.size())
+        {
+          matched = 0;
+          found();
+        }
+        i++;
+      }
+    }
 
-template <typename _CodeT>
-inline bool
-operator<=(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) >= 0; }
+    // Give the bytes of a partial match to next.put.
+    template <typename _Next>
+    void flush(_Next& next)
+    {
+      if (matched)
+        next.put(pattern.data(), matched);
+      matched = 0;
+    }
+  };
 
-// operator>
-template <typename _CodeT>
-inline bool
-operator>(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) > 0; }
+  // Set of bytes, whitespace by default like isspace in the C locale.
+  struct byte_set
+  {
+    std::uint64_t bits[4];
 
-template <typename _CodeT>
-inline bool
-operator>(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) > 0; }
+    explicit byte_set(const std::string& chars = "") noexcept
+    : bits{0, 0, 0, 0}
+    {
+      for (unsigned char c : chars.empty() ? std::string(" \t\n\v\f\r") : chars)
+        bits[c >> 6] |= std::uint64_t(1) << (c & 63);
+    }
 
-template <typename _CodeT>
-inline bool
-operator>(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) < 0; }
+    bool operator()(char c) const noexcept
+    { return (bits[(unsigned char)c >> 6] >> ((unsigned char)c & 63)) & 1; }
+  };
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator>(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) > 0; }
+  // Remove leading and trailing whitespace, or bytes of chars, of every token.
+  struct strip
+  {
+    byte_set stripped;
+    std::string held;
+    bool started;
 
-template <typename _CodeT>
-inline bool
-operator>(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) < 0; }
-#endif
+    explicit strip(const std::string& chars)
+    : stripped(chars), started(false) { }
 
-template <typename _CodeT>
-inline bool
-operator>(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) > 0; }
+    void reset() { held.clear(); started = false; }
+
+    template <typename _Next>
+    void put(const char* s, size_t n, _Next& next)
+    {
+      size_t i = 0;
+      if (!started)
+      {
+        while (i < n && stripped(s[i]))
+          i++;
+        started = i < n;
+      }
+      while (i < n)
+      {
+        size_t j = i;
+        while (j < n && !stripped(s[j]))
+          j++;
+        if (j > i)
+        {
+          if (!held.empty())
+          {
+            next.put(held.data(), held.size());
+            held.clear();
+          }
+          next.put(s + i, j - i);
+        }
+        // Held until a byte to keep shows they aren't trailing.
+        for (i = j; j < n && stripped(s[j]); )
+          j++;
+        held.append(s + i, j - i);
+        i = j;
+      }
+    }
 
-template <typename _CodeT>
-inline bool
-operator>(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) < 0; }
+    template <typename _Next>
+    void cut(_Next& next)
+    {
+      reset();
+      next.cut();
+    }
+  };
 
-template <typename _CodeT>
-inline bool
-operator>(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) > 0; }
+  // Convert ascii to lowercase, like toLower, a chunk at a time.
+  struct lower
+  {
+    void reset() noexcept { }
 
-template <typename _CodeT>
-inline bool
-operator>(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) < 0; }
+    template <typename _Next>
+    void put(const char* s, size_t n, _Next& next)
+    {
+      char chunk[256];
+      for (size_t i = 0; i < n; i += sizeof(chunk))
+      {
+        const size_t m = std::min(n - i, sizeof(chunk));
+        for (size_t k = 0; k < m; k++)
+          chunk[k] = char(s[i + k] + ((unsigned char)(s[i + k] - 'A') < 26 ? 32 : 0));
+        next.put(chunk, m);
+      }
+    }
 
-// operator<
-template <typename _CodeT>
-inline bool
-operator<(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{ return __lhs.compare(__rhs) < 0; }
+    template <typename _Next>
+    void cut(_Next& next)
+    { next.cut(); }
+  };
 
-template <typename _CodeT>
-inline bool
-operator<(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{ return __lhs.compare(__rhs) < 0; }
+  // Replace every occurrence of a substring, like replace.
+  struct replace
+  {
+    matcher match;
+    std::string newstr;
 
-template <typename _CodeT>
-inline bool
-operator<(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) > 0; }
+    replace(const std::string& oldstr, const std::string& n)
+    : match(oldstr), newstr(n) { }
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline bool
-operator<(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{ return __lhs.compare(__rhs) < 0; }
+    void reset() noexcept { match.matched = 0; }
 
-template <typename _CodeT>
-inline bool
-operator<(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs) > 0; }
-#endif
+    template <typename _Next>
+    void put(const char* s, size_t n, _Next& next)
+    {
+      if (match.pattern.empty())
+        next.put(s, n);
+      else
+        match.scan(s, n, next, [&]() { next.put(newstr.data(), newstr.size()); });
+    }
 
-template <typename _CodeT>
-inline bool
-operator<(const ustring<_CodeT>& __lhs, const char* __rhs)
-{ return __lhs.compare(__rhs, strlen(__rhs)) < 0; }
+    template <typename _Next>
+    void cut(_Next& next)
+    {
+      match.flush(next);
+      next.cut();
+    }
+  };
 
-template <typename _CodeT>
-inline bool
-operator<(const char* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, strlen(__lhs)) > 0; }
+  // Cut tokens at every separator, or at whitespace if it is empty, like split.
+  struct split
+  {
+    matcher match;
+    byte_set space;
 
-template <typename _CodeT>
-inline bool
-operator<(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{ return __lhs.compare(__rhs, codelen(__rhs)) < 0; }
+    explicit split(const std::string& sep)
+    : match(sep) { }
 
-template <typename _CodeT>
-inline bool
-operator<(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{ return __rhs.compare(__lhs, codelen(__lhs)) > 0; }
+    void reset() noexcept { match.matched = 0; }
 
-// operator+
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, const ustring<_CodeT>& __rhs)
-{
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __rhs.size());
-  __str.append(__lhs);
-  __str.append(__rhs);
-  return __str;
-}
+    template <typename _Next>
+    void put(const char* s, size_t n, _Next& next)
+    {
+      if (!match.pattern.empty())
+      {
+        match.scan(s, n, next, [&]() { next.cut(); });
+        return;
+      }
+      for (size_t i = 0, j; i < n; i = j + 1)
+      {
+        for (j = i; j < n && !space(s[j]); )
+          j++;
+        if (j > i)
+          next.put(s + i, j - i);
+        if (j < n)
+          next.cut();
+      }
+    }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, const std::string& __rhs)
-{
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __rhs.size());
-  __str.append(__lhs);
-  __str.append(__rhs);
-  return __str;
-}
+    template <typename _Next>
+    void cut(_Next& next)
+    {
+      match.flush(next);
+      next.cut();
+    }
+  };
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const std::string& __lhs, const ustring<_CodeT>& __rhs)
-{
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __rhs.size());
-  __str.append(__lhs);
-  __str.append(__rhs);
-  return __str;
-}
+  // Collect the bytes of a token in the buffer and give non-empty tokens
+  // to the callback.
+  template <typename _Callback>
+  struct token_sink
+  {
+    std::string& buffer;
+    _Callback& callback;
+    size_t size;
 
-#if STRINGUTILS_CPLUSPLUS >= 201703L
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, std::string_view __rhs)
-{
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __rhs.size());
-  __str.append(__lhs);
-  __str.append(__rhs);
-  return __str;
-}
+    void put(const char* s, size_t n)
+    {
+      if (size + n > buffer.size())
+        buffer.resize(std::max(2 * buffer.size(), size + n));
+      memcpy(&buffer[0] + size, s, n);
+      size += n;
+    }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(std::string_view __lhs, const ustring<_CodeT>& __rhs)
-{
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __rhs.size());
-  __str.append(__lhs);
-  __str.append(__rhs);
-  return __str;
-}
-#endif
+    void cut()
+    {
+      if (size)
+      {
+        callback((const char *)buffer.data(), size);
+        size = 0;
+      }
+    }
+  };
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, const char* __rhs)
-{
-  const size_t __len = strlen(__rhs);
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __len);
-  __str.append(__lhs);
-  __str.append(__rhs, __len);
-  return __str;
-}
+  // Stage _Index of the tuple followed by the rest of the stages and the sink.
+  template <size_t _Index, typename _Tuple, typename _Sink,
+      bool = (_Index == std::tuple_size<_Tuple>::value)>
+  struct chain
+  {
+    _Tuple& stages;
+    _Sink& sink;
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const char* __lhs, const ustring<_CodeT>& __rhs)
-{
-  const size_t __len = strlen(__lhs);
-  ustring<_CodeT> __str;
-  __str.reserve(__len + __rhs.size());
-  __str.append(__lhs, __len);
-  __str.append(__rhs);
-  return __str;
-}
+    void put(const char* s, size_t n)
+    {
+      chain<_Index + 1, _Tuple, _Sink> next = { stages, sink };
+      std::get<_Index>(stages).put(s, n, next);
+    }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, const _CodeT* __rhs)
-{
-  const size_t __len = codelen(__rhs);
-  ustring<_CodeT> __str;
-  __str.reserve(__lhs.size() + __len);
-  __str.append(__lhs);
-  __str.append(__rhs, __len);
-  return __str;
-}
+    void cut()
+    {
+      chain<_Index + 1, _Tuple, _Sink> next = { stages, sink };
+      std::get<_Index>(stages).cut(next);
+    }
+  };
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const _CodeT* __lhs, const ustring<_CodeT>& __rhs)
-{
-  const size_t __len = codelen(__lhs);
-  ustring<_CodeT> __str;
-  __str.reserve(__len + __rhs.size());
-  __str.append(__lhs, __len);
-  __str.append(__rhs);
-  return __str;
-}
+  template <size_t _Index, typename _Tuple, typename _Sink>
+  struct chain<_Index, _Tuple, _Sink, true>
+  {
+    _Tuple& stages;
+    _Sink& sink;
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, _CodeT __rhs)
-{
-  ustring<_CodeT> __str(__lhs);
-  __str.append(1, __rhs);
-  return __str;
-}
+    void put(const char* s, size_t n) { sink.put(s, n); }
+    void cut() { sink.cut(); }
+  };
+} // namespace pipeline_detail
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(_CodeT __lhs, const ustring<_CodeT>& __rhs)
+/**
+ * Text processing steps fused into one pass over the string: runs of bytes
+ * go through all the stages in turn, without intermediate strings, and the
+ * tokens are built in one buffer reused from string to string. Stages are
+ * declared in order and composed at compile time, e.g.
+ *
+ *   auto p = text_pipeline<>().strip().lower().replace("\t", " ").split(",");
+ *   p.run(str, len, [](const char* token, size_t n) { ... });
+ *
+ * Each stage sees the output of the one before, as if the functions of the
+ * same names were called one after the other; stages after split work on
+ * every token. Without split the result is a single token. Empty tokens are
+ * skipped, like split does.
+ */
+template <typename... _Stages>
+class text_pipeline
 {
-  ustring<_CodeT> __str;
-  __str.reserve(__rhs.size() + 1);
-  __str.append(1, __lhs);
-  __str.append(__rhs);
-  return __str;
-}
-
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(ustring<_CodeT>&& __lhs, const ustring<_CodeT>& __rhs)
-{ return std::move(__lhs.append(__rhs)); }
-
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const ustring<_CodeT>& __lhs, ustring<_CodeT>&& __rhs)
-{ return std::move(__rhs.insert(0, __lhs)); }
+  public:
+    using size_type = size_t;
+
+    text_pipeline() = default;
+
+    explicit
+    text_pipeline(std::tuple<_Stages...> __stages)
+    : _M_stages(std::move(__stages)) { }
+
+    // Remove leading and trailing whitespace, or bytes of __chars.
+    text_pipeline<_Stages..., pipeline_detail::strip>
+    strip(const std::string& __chars = "") const
+    { return _M_then(pipeline_detail::strip(__chars)); }
+
+    // Convert ascii to lowercase.
+    text_pipeline<_Stages..., pipeline_detail::lower>
+    lower() const
+    { return _M_then(pipeline_detail::lower()); }
+
+    // Replace every occurrence of __oldstr by __newstr.
+    text_pipeline<_Stages..., pipeline_detail::replace>
+    replace(const std::string& __oldstr, const std::string& __newstr) const
+    { return _M_then(pipeline_detail::replace(__oldstr, __newstr)); }
+
+    // Cut tokens at __sep, or at runs of whitespace if it is empty.
+    text_pipeline<_Stages..., pipeline_detail::split>
+    split(const std::string& __sep = "") const
+    { return _M_then(pipeline_detail::split(__sep)); }
+
+    /**
+     * @brief Run the stages over the string in one pass.
+     * @param __str  The string.
+     * @param __len  Length of @a __str.
+     * @param __callback  Called as __callback(const char* token, size_t n)
+     * for every token, the bytes being valid until it returns.
+     */
+    template <typename _Callback>
+      void
+      run(const char* __str, size_type __len, _Callback&& __callback)
+      {
+        _M_reset(std::integral_constant<size_type, 0>());
+        if (_M_buffer.size() < __len)
+          _M_buffer.resize(__len);
+        using _Sink = pipeline_detail::token_sink<typename std::remove_reference<_Callback>::type>;
+        _Sink __sink = { _M_buffer, __callback, 0 };
+        pipeline_detail::chain<0, std::tuple<_Stages...>, _Sink> __head = { _M_stages, __sink };
+        __head.put(__str, __len);
+        __head.cut();
+      }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(ustring<_CodeT>&& __lhs, ustring<_CodeT>&& __rhs)
-{ return std::move(__lhs.append(__rhs)); }
+    std::vector<std::string>
+    run(const std::string& __str)
+    {
+      std::vector<std::string> __tokens;
+      run(__str.data(), __str.size(), [&__tokens](const char* __t, size_type __n)
+        { __tokens.emplace_back(__t, __n); });
+      return __tokens;
+    }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(ustring<_CodeT>&& __lhs, const _CodeT* __rhs)
-{ return std::move(__lhs.append(__rhs, codelen(__rhs))); }
+#if STRINGUTILS_CPLUSPLUS >= 201703L
+    std::vector<std::string>
+    run(std::string_view __str)
+    {
+      std::vector<std::string> __tokens;
+      run(__str.data(), __str.size(), [&__tokens](const char* __t, size_type __n)
+        { __tokens.emplace_back(__t, __n); });
+      return __tokens;
+    }
+#endif
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(const _CodeT* __lhs, ustring<_CodeT>&& __rhs)
-{ return std::move(__rhs.insert(0, __lhs)); }
+  private:
+    template <typename _Stage>
+      text_pipeline<_Stages..., _Stage>
+      _M_then(_Stage __stage) const
+      {
+        return text_pipeline<_Stages..., _Stage>(
+          std::tuple_cat(_M_stages, std::make_tuple(std::move(__stage))));
+      }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(ustring<_CodeT>&& __lhs, _CodeT __rhs)
-{ return std::move(__lhs.append(1, __rhs)); }
+    void
+    _M_reset(std::integral_constant<size_type, sizeof...(_Stages)>) noexcept { }
 
-template <typename _CodeT>
-inline ustring<_CodeT>
-operator+(_CodeT __lhs, ustring<_CodeT>&& __rhs)
-{ return std::move(__rhs.insert(0, 1, __lhs)); }
+    template <size_type _Index>
+      void
+      _M_reset(std::integral_constant<size_type, _Index>)
+      {
+        std::get<_Index>(_M_stages).reset();
+        _M_reset(std::integral_constant<size_type, _Index + 1>());
+      }
 
-using utf16_string = ustring<char16_t>;
-using utf32_string = ustring<char32_t>;
+    std::tuple<_Stages...> _M_stages;
+    std::string _M_buffer;
+};
 
 }
 
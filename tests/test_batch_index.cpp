@@ -0,0 +1,102 @@
+// Tests for the batch byte2index and index2byte of sorted offsets.
+//   g++ -std=c++11 -I.. -fsanitize=address test_batch_index.cpp && ./a.out
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Byte positions of the characters: the first byte and every byte which
+// is not a continuation byte, then the end of string.
+static std::vector<size_t> starts(const std::string& str)
+{
+  std::vector<size_t> result;
+  for (size_t i = 0; i < str.size(); i++)
+    if (i == 0 || ((unsigned char)str[i] & 0xC0) != 0x80)
+      result.push_back(i);
+  result.push_back(str.size());
+  return result;
+}
+
+template <typename T>
+static void check(const std::string& str, const std::vector<T>& offsets, std::mt19937& rng)
+{
+  const std::vector<size_t> pos = starts(str);
+  std::vector<T> indices, bytes;
+  byte2index(str, offsets, indices);
+  index2byte(str, offsets, bytes);
+  for (size_t i = 0; i < offsets.size(); i++)
+  {
+    const size_t b = (size_t)offsets[i];
+    const auto it = std::lower_bound(pos.begin(), pos.end(), b);
+    assert(indices[i] == (it != pos.end() && *it == b ? T(it - pos.begin()) : T(-1)));
+    assert(bytes[i] == (b < pos.size() ? T(pos[b]) : T(-1)));
+  }
+
+  // In place, with the raw pointer overloads.
+  std::vector<T> same = offsets;
+  if (rng() % 2)
+  {
+    byte2index(str.data(), str.size(), same.data(), same.size(), same.data());
+    assert(same == indices);
+  }
+  else
+  {
+    index2byte(str.data(), str.size(), same.data(), same.size(), same.data());
+    assert(same == bytes);
+  }
+}
+
+int main()
+{
+  const std::string str = "a\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80" "b";
+  std::vector<std::uint32_t> indices, bytes;
+  byte2index(str, std::vector<std::uint32_t>{ 0, 1, 2, 3, 6, 10, 11, 12 }, indices);
+  assert((indices == std::vector<std::uint32_t>{ 0, 1, std::uint32_t(-1), 2, 3, 4, 5,
+      std::uint32_t(-1) }));
+  index2byte(str, std::vector<std::uint32_t>{ 0, 1, 2, 3, 4, 5, 6 }, bytes);
+  assert((bytes == std::vector<std::uint32_t>{ 0, 1, 3, 6, 10, 11, std::uint32_t(-1) }));
+
+  // Unsorted offsets restart the sweep.
+  index2byte(str, std::vector<std::uint32_t>{ 4, 1, 7, 5, 0 }, bytes);
+  assert((bytes == std::vector<std::uint32_t>{ 10, 1, std::uint32_t(-1), 11, 0 }));
+  byte2index(str, std::vector<std::uint32_t>{ 11, 3, 3, 0 }, indices);
+  assert((indices == std::vector<std::uint32_t>{ 5, 2, 2, 0 }));
+
+  // The first byte starts a character even if it is a continuation byte.
+  byte2index(std::string("\x80\x80" "a"), std::vector<std::uint32_t>{ 0, 1, 2, 3 }, indices);
+  assert((indices == std::vector<std::uint32_t>{ 0, std::uint32_t(-1), 1, 2 }));
+  index2byte(std::string("\x80\x80" "a"), std::vector<std::uint32_t>{ 0, 1, 2 }, bytes);
+  assert((bytes == std::vector<std::uint32_t>{ 0, 2, 3 }));
+  index2byte(std::string(), std::vector<std::uint32_t>{ 0, 1 }, bytes);
+  assert((bytes == std::vector<std::uint32_t>{ 0, std::uint32_t(-1) }));
+
+  // Random text with long ascii and multibyte runs crossing the 8 and 16
+  // byte blocks, and stray continuation bytes.
+  const std::vector<std::string> chars = { "a", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80",
+      "\x80", "\xE4\xB8" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 2000; n++)
+  {
+    std::string s;
+    for (int i = 0, count = (int)(rng() % 30); i < count; i++)
+    {
+      const std::string& c = chars[rng() % chars.size()];
+      for (int k = 0, run = 1 + (int)(rng() % 12); k < run; k++)
+        s += c;
+    }
+    std::vector<std::uint32_t> offsets;
+    for (int i = 0, count = (int)(rng() % 20); i < count; i++)
+      offsets.push_back((std::uint32_t)(rng() % (s.size() + 3)));
+    if (rng() % 4)
+      std::sort(offsets.begin(), offsets.end());
+    check(s, offsets, rng);
+    check(s, std::vector<size_t>(offsets.begin(), offsets.end()), rng);
+  }
+  return 0;
+}
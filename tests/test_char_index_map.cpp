@@ -0,0 +1,77 @@
+// Tests for char_index_map against the dense idx2byte and byte2idx arrays.
+//   g++ -std=c++11 -I.. -fsanitize=address test_char_index_map.cpp && ./a.out
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static void check(const std::string& str)
+{
+  std::vector<char32_t> dense_codepoints, codepoints;
+  std::vector<std::uint32_t> idx2byte, byte2idx;
+  decode_and_build_map(str, dense_codepoints, idx2byte, byte2idx);
+  char_index_map map;
+  decode_and_build_map(str, codepoints, map);
+  assert(codepoints == dense_codepoints);
+  assert(map.size() == idx2byte.size() && map.bytes() == str.size());
+
+  for (size_t i = 0; i < idx2byte.size(); i++)
+    assert(map.index2byte(i) == idx2byte[i]);
+  assert(map.index2byte(idx2byte.size()) == npos);
+  for (size_t b = 0; b < str.size(); b++)
+    assert(map.byte2index(b) == (byte2idx[b] == std::uint32_t(-1) ? npos : byte2idx[b]));
+  assert(map.byte2index(str.size()) == npos);
+
+  const char_index_map other(str);
+  for (size_t i = 0; i < idx2byte.size(); i += 1 + i / 8)
+    assert(other.index2byte(i) == idx2byte[i]);
+}
+
+int main()
+{
+  const char_index_map empty;
+  assert(empty.size() == 0 && empty.bytes() == 0);
+  assert(empty.index2byte(0) == npos && empty.byte2index(0) == npos);
+  check(std::string());
+  check("a\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80" "b");
+  // The first byte starts a character even if it is a continuation byte.
+  check("\x80\x80" "a\x80");
+
+  const std::vector<std::string> chars = { "a", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 300; n++)
+  {
+    // Lengths around the 64-byte words, the 512-byte blocks and the sample
+    // of every 512th character, with runs of a single width.
+    std::string str;
+    const size_t len = rng() % (n < 200 ? 700 : 5000);
+    while (str.size() < len)
+    {
+      const std::string& c = chars[rng() % chars.size()];
+      for (int k = 0, run = 1 + (int)(rng() % 200); k < run; k++)
+        str += c;
+    }
+    if (n % 3 == 0)
+      for (int k = 0; k < 5; k++)
+        str[rng() % str.size()] = char(rng());
+    check(str);
+  }
+
+  // A long string stays compact and reassigning replaces the map.
+  std::string big;
+  while (big.size() < (1 << 20))
+    big += chars[rng() % chars.size()];
+  char_index_map map(big);
+  assert(map.memory_usage() < big.size() / 4);
+  check(big);
+  map.assign(std::string("\xE4\xB8\xAD" "a"));
+  assert(map.size() == 2 && map.index2byte(1) == 3 && map.byte2index(1) == npos);
+  map.clear();
+  assert(map.size() == 0 && map.index2byte(0) == npos);
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Tests for compact_ustring against utf32_string on the same utf8 input,
+// including stray continuation bytes.
+//   g++ -std=c++11 -I.. -fsanitize=address test_compact_ustring.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static void check(const compact_ustring& c, const utf32_string& u)
+{
+  assert(c.size() == u.size());
+  for (size_t i = 0; i < u.size(); i++)
+    assert(c[i] == u[i]);
+}
+
+static void check(const std::string& str)
+{
+  const utf32_string u(str);
+  compact_ustring c(str);
+  check(c, u);
+  compact_ustring a("x");
+  a.append(str);
+  assert(a.size() == u.size() + 1 && a[0] == U'x');
+  c = str;
+  check(c, u);
+}
+
+int main()
+{
+  check("caf\x80 ok");
+  assert(compact_ustring("caf\x80 ok").size() == 6);
+  check("caf\xC3\xA9");
+  assert(compact_ustring("caf\xC3\xA9").width() == 1);
+  check("\xE4\xB8\xAD\xE6\x96\x87");
+  assert(compact_ustring("\xE4\xB8\xAD").width() == 2);
+  check("a\xF0\x9F\x98\x80");
+  assert(compact_ustring("a\xF0\x9F\x98\x80").width() == 4);
+  for (size_t run : { 1, 7, 8, 9, 15, 16, 17, 32 })
+    for (const char* tail : { "\x80", "\x80\x80", "\xBF\xBF\xBF", "\x80 ok" })
+      check(std::string(run, 'a') + tail);
+
+  std::mt19937 rng(1);
+  const char* pieces[] = { "a", "\x80", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80" };
+  for (int n = 0; n < 5000; n++)
+  {
+    std::string str;
+    const size_t len = rng() % 60;
+    while (str.size() < len)
+      str.append(rng() % 4 ? pieces[0] : pieces[rng() % 5]);
+    check(str);
+  }
+
+  compact_ustring s("abc");
+  s.push_back(U'\x4E2D');
+  assert(s.size() == 4 && s.width() == 2 && s[0] == U'a' && s[3] == U'\x4E2D');
+  s.push_back(U'\x1F600');
+  assert(s.width() == 4 && s.back() == U'\x1F600');
+  s.pop_back();
+  assert(s.size() == 4 && s.back() == U'\x4E2D');
+  return 0;
+}
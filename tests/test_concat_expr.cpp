@@ -0,0 +1,49 @@
+// Tests for the lazy operator+ of STRINGUTILS_USE_CONCAT_EXPR.
+//   g++ -std=c++11 -I.. -fsanitize=address test_concat_expr.cpp && ./a.out
+#define STRINGUTILS_USE_CONCAT_EXPR
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+int main()
+{
+  // Operators of other types are not taken over.
+  const std::string a = "ab", b = "cd";
+  assert(a + b == "abcd");
+  std::vector<int> v = { 3, 1, 2 };
+  std::stable_sort(v.begin(), v.end());
+  assert(*(v.begin() + 1) == 2);
+  assert(!detect_encoding(std::string("plain ascii")).empty());
+
+  utf16_string u(std::string("x\xE4\xB8\xAD"));
+  assert(*(u.begin() + 1) == 0x4E2D);
+  assert(u.end() - u.begin() == 2);
+
+  // Expressions of every kind of piece.
+  const utf16_string w(std::string("w"));
+  utf16_string r = u + w;
+  assert(r == utf16_string(std::string("x\xE4\xB8\xADw")));
+  r = u + a + w + "!" + char16_t('?') + b;
+  assert(r == utf16_string(std::string("x\xE4\xB8\xAD" "abw!?cd")));
+  r = a + u;
+  assert(r == utf16_string(std::string("abx\xE4\xB8\xAD")));
+  r += w + a;
+  assert(r == utf16_string(std::string("abx\xE4\xB8\xAD" "wab")));
+
+  // Invalid utf8 pieces are sized exactly.
+  std::string stray;
+  for (int i = 0; i < 100; i++)
+    stray += "A\x80\x80\x80";
+  r = w + stray + w;
+  assert(r.size() == 202);
+
+  const utf32_string x(std::string("\xF0\x9F\x98\x80"));
+  utf32_string y = x + x + "z";
+  assert(y.size() == 3 && y[1] == 0x1F600 && y[2] == U'z');
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Tests for detect_encoding on BOM-less utf16 and the other encodings.
+//   g++ -std=c++11 -I.. -fsanitize=address test_detect_encoding.cpp && ./a.out
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static const std::string chinese =
+    "中文信息处理是自然语言处理的一个分支，研究如何用计算机处理汉字和词语。"
+    "分词、词性标注和命名实体识别都是常见的任务，也是许多应用的基础。";
+static const std::string japanese =
+    "日本語の文章には、ひらがなとカタカナと漢字が混ざっています。"
+    "自然言語処理では、まず文を単語に分割することが多いです。";
+static const std::string korean =
+    "한국어 문장은 한글로 쓰며 띄어쓰기로 단어를 나눕니다. "
+    "자연어 처리에서는 형태소 분석이 중요한 단계입니다.";
+
+static std::string utf16_bytes(const std::string& str, bool big_endian)
+{
+  std::string bytes;
+  for (char16_t c : to_u16string(str))
+  {
+    const char hi = char(c >> 8), lo = char(c & 0xFF);
+    bytes += big_endian ? hi : lo;
+    bytes += big_endian ? lo : hi;
+  }
+  return bytes;
+}
+
+static encoding best(const std::string& str)
+{
+  const std::vector<encoding_guess> guesses = detect_encoding(str);
+  assert(!guesses.empty());
+  for (const encoding_guess& g : guesses)
+    assert(g.confidence > 0 && g.confidence <= 1);
+  return guesses[0].enc;
+}
+
+static bool guessed(const std::string& str, encoding enc)
+{
+  for (const encoding_guess& g : detect_encoding(str))
+    if (g.enc == enc)
+      return true;
+  return false;
+}
+
+int main()
+{
+  assert(best("plain ascii text") == encoding::ascii);
+  assert(best("\xEF\xBB\xBF" + chinese) == encoding::utf8);
+  assert(best(chinese) == encoding::utf8);
+  assert(best(std::string("\xFF\xFE" "a\0b\0", 6)) == encoding::utf16le);
+  assert(best(utf16_bytes("latin text, mostly ascii", false)) == encoding::utf16le);
+  assert(best(utf16_bytes("latin text, mostly ascii", true)) == encoding::utf16be);
+
+  // utf16 of CJK text has no zero bytes.
+  for (const std::string& text : { chinese, japanese, korean })
+  {
+    assert(best(utf16_bytes(text, false)) == encoding::utf16le);
+    assert(best(utf16_bytes(text, true)) == encoding::utf16be);
+  }
+
+  // Legacy encodings are not taken for utf16.
+  std::string gbk(3 * chinese.size(), '\0');
+  gbk.resize(utf8_to_gb18030(chinese.data(), chinese.size(), &gbk[0]));
+  assert(best(gbk) == encoding::gb18030);
+  assert(!guessed(gbk, encoding::utf16le) && !guessed(gbk, encoding::utf16be));
+  const std::string latin1 = "Caf\xE9 cr\xE8me br\xFBl\xE9" "e, na\xEFve fa\xE7" "ade d\xE9j\xE0 vu.";
+  assert(best(latin1) == encoding::latin1);
+  assert(!guessed(latin1, encoding::utf16le) && !guessed(latin1, encoding::utf16be));
+  return 0;
+}
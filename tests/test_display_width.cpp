@@ -0,0 +1,120 @@
+// Tests for display_width, truncate_to_width and the width-aware padding.
+//   g++ -std=c++11 -I.. -fsanitize=address test_display_width.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Bytes and columns of each character of the utf8 string, one at a time. An
+// ascii byte is a character of its own, even before a stray continuation byte.
+static std::vector<std::pair<size_t, unsigned int>> characters(const std::string& str)
+{
+  std::vector<std::pair<size_t, unsigned int>> result;
+  char32_t cp;
+  for (size_t i = 0; i < str.size(); )
+  {
+    width_type n = 1;
+    if ((unsigned char)str[i] < 0x80)
+      cp = (unsigned char)str[i];
+    else
+      n = utf8_decode(str.data() + i, cp, str.size() - i);
+    result.push_back(std::make_pair(size_t(n), char_width(cp)));
+    i += n;
+  }
+  return result;
+}
+
+static size_t reference_width(const std::string& str)
+{
+  size_t width = 0;
+  for (const auto& c : characters(str))
+    width += c.second;
+  return width;
+}
+
+// Longest prefix in bytes that fits, keeping trailing zero-width characters.
+static size_t reference_truncate(const std::string& str, size_t width)
+{
+  size_t used = 0, bytes = 0;
+  for (const auto& c : characters(str))
+  {
+    if (used + c.second > width)
+      break;
+    used += c.second;
+    bytes += c.first;
+  }
+  return bytes;
+}
+
+int main()
+{
+  assert(char_width(U'a') == 1 && char_width(U'\n') == 0 && char_width(0x7F) == 0);
+  assert(char_width(0x4E2D) == 2 && char_width(0xFF21) == 2 && char_width(0x3000) == 2);
+  assert(char_width(0xAC00) == 2 && char_width(0x1F600) == 2 && char_width(0x20000) == 2);
+  assert(char_width(0x0301) == 0 && char_width(0x200B) == 0);
+  assert(char_width(0xE9) == 1 && char_width(0x110000) == 1);
+
+  const std::string zhong = "\xE4\xB8\xAD", acute = "\xCC\x81";
+  assert(display_width(std::string()) == 0);
+  assert(display_width(std::string("abc\tdef")) == 6);
+  assert(display_width("e" + acute + zhong + zhong) == 5);
+
+  assert(truncate_to_width(std::string("abcdef"), 3) == "abc");
+  assert(truncate_to_width(zhong + zhong, 3) == zhong);
+  assert(truncate_to_width(zhong + zhong, 1).empty());
+  assert(truncate_to_width("a" + acute + "b", 1) == "a" + acute);
+  assert(truncate_to_width(std::string("abc"), 10) == "abc");
+
+  assert(truncate_to_width(std::string("abcdef"), 5, "...") == "ab...");
+  assert(truncate_to_width(std::string("abcde"), 5, "...") == "abcde");
+  assert(truncate_to_width(zhong + zhong + zhong, 5, "...") == zhong + "...");
+  assert(truncate_to_width(std::string("abcdef"), 2, "...") == "..");
+
+  assert(ljust(std::string("ab"), 5) == "ab   ");
+  assert(rjust(std::string("ab"), 5, '*') == "***ab");
+  assert(center(std::string("ab"), 5, '-') == "-ab--");
+  assert(ljust(zhong, 4) == zhong + "  ");
+  assert(center(zhong + "a", 6) == " " + zhong + "a  ");
+  assert(rjust(std::string("abcdef"), 3) == "abcdef");
+
+  // Random text with long ascii runs, controls, wide and zero-width characters.
+  const std::vector<std::string> others = { zhong, acute, "\xC3\xA9", "\xF0\x9F\x98\x80",
+      "\xE2\x80\x8B", "\xEF\xBC\xA1", "\x80", "\xE4\xB8" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 3000; n++)
+  {
+    std::string str;
+    for (int i = 0, count = (int)(rng() % 30); i < count; i++)
+    {
+      if (rng() % 3)
+        for (int k = 0, run = 1 + (int)(rng() % 40); k < run; k++)
+          str += char(rng() % 8 ? 0x20 + rng() % 0x5F : rng() % 0x20);
+      else
+        str += others[rng() % others.size()];
+    }
+    const size_t w = reference_width(str);
+    assert(display_width(str) == w);
+    for (size_t width = 0; width <= w + 1; width += 1 + rng() % 4)
+    {
+      const std::string prefix = truncate_to_width(str, width);
+      assert(prefix.size() == reference_truncate(str, width));
+      assert(display_width(prefix) <= width);
+
+      const std::string cut = truncate_to_width(str, width, "\xE2\x80\xA6");
+      assert(display_width(cut) <= width);
+      assert(w <= width ? cut == str : cut.size() >= 3 || width == 0);
+
+      const std::string padded = center(str, width, '.');
+      assert(display_width(padded) == (w > width ? w : width));
+      std::vector<char> dest(str.size() + width + 1);
+      const size_t written = ljust(str.data(), str.size(), width, dest.data());
+      assert(std::string(dest.data(), written) == ljust(str, width));
+      assert(written == str.size() + (w < width ? width - w : 0));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+// Tests for the full-width and half-width conversions.
+//   g++ -std=c++11 -I.. -fsanitize=address test_fullwidth.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// The utf8 of the full-width form of printable ascii c.
+static std::string full(char c)
+{
+  if (c == ' ')
+    return "\xE3\x80\x80";
+  const unsigned u = 0xFEE0 + (unsigned char)c;
+  std::string result;
+  result += char(0xE0 | u >> 12);
+  result += char(0x80 | (u >> 6 & 0x3F));
+  result += char(0x80 | (u & 0x3F));
+  return result;
+}
+
+int main()
+{
+  assert(full_to_half(std::string("\xEF\xBC\xA1\xEF\xBC\xA2\xEF\xBC\xA3\xEF\xBC\x91"
+      "\xEF\xBC\x92\xEF\xBC\x93\xEF\xBC\x81")) == "ABC123!");
+  assert(full_to_half(std::string("a\xE3\x80\x80" "b")) == "a b");
+  assert(half_to_full(std::string("a b")) == full('a') + full(' ') + full('b'));
+  assert(full_to_half(std::string()).empty() && half_to_full(std::string()).empty());
+
+  std::string ascii, wide;
+  for (char c = 0x20; c < 0x7F; c++)
+  {
+    ascii += c;
+    wide += full(c);
+  }
+  assert(half_to_full(ascii) == wide);
+  assert(full_to_half(wide) == ascii);
+
+  // Neighbours of the converted ranges are copied unchanged.
+  const std::string kept = "\xEF\xBC\x80\xEF\xBD\x9F\xE3\x80\x81\xEF\xBF\xA0\t\x7F\n"
+      "\xE4\xB8\xAD\xC3\xA9\xF0\x9F\x98\x80";
+  assert(full_to_half(kept) == kept);
+  assert(half_to_full(std::string("\t\x7F\n\xE4\xB8\xAD")) == "\t\x7F\n\xE4\xB8\xAD");
+
+  // Random mixes crossing the 16-byte blocks, converted both ways and in place.
+  const std::vector<std::string> others = { "\xE4\xB8\xAD", "\xC3\xA9", "\xF0\x9F\x98\x80",
+      "\xE3\x80\x81", "\n" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 3000; n++)
+  {
+    std::string half, wide, mixed;
+    const int count = (int)(rng() % 80);
+    for (int i = 0; i < count; i++)
+    {
+      std::string h, w;
+      if (rng() % 4)
+      {
+        // Runs of ascii exercise the block paths.
+        for (int k = 0, run = 1 + (int)(rng() % 20); k < run; k++)
+        {
+          const char c = char(0x20 + rng() % 0x5F);
+          h += c;
+          w += full(c);
+        }
+      }
+      else
+        h = w = others[rng() % others.size()];
+      half += h;
+      wide += w;
+      mixed += rng() % 2 ? h : w;
+    }
+    assert(half_to_full(half) == wide);
+    assert(full_to_half(wide) == half);
+    assert(full_to_half(mixed) == half);
+    assert(half_to_full(mixed) == wide);
+
+    std::string buf = wide;
+    buf.resize(full_to_half(&buf[0], buf.size(), &buf[0]));
+    assert(buf == half);
+
+    std::vector<char> dest(3 * half.size() + 1, '\x55');
+    const size_t written = half_to_full(half.data(), half.size(), dest.data());
+    assert(written == wide.size() && std::string(dest.data(), written) == wide);
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+// Regression tests for utf8 to gb18030/gbk on invalid utf8.
+//   g++ -std=c++11 -I.. -fsanitize=address test_gb18030.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+int main()
+{
+  // Lone bytes 0x80-0xFF would decode to U+0080-U+00FF, which take four
+  // bytes in gb18030.
+  std::string lone;
+  for (int i = 0; i < 1000; i++)
+    lone += "\x80 ";
+  std::string out = utf8_to_gb18030(lone);
+  assert(out.size() == lone.size());
+  for (size_t i = 0; i < out.size(); i += 2)
+    assert(out[i] == '?' && out[i + 1] == ' ');
+  assert(utf8_to_gbk(lone) == out);
+
+  for (int c = 0x80; c < 0x100; c++)
+    assert(utf8_to_gb18030(std::string(1, char(c))) == "?");
+
+  // Valid text is unchanged by the check.
+  const std::string valid = "\xC2\x80\xE4\xB8\xAD\xF0\x9F\x98\x80";
+  assert(gb18030_to_utf8(utf8_to_gb18030(valid)) == valid);
+
+  std::mt19937 rng(1);
+  for (int n = 0; n < 2000; n++)
+  {
+    std::string str(rng() % 64, ' ');
+    for (char& c : str)
+      c = char(rng() % 3 ? 0x80 + rng() % 0x80 : rng() % 0x80);
+    std::string dest(2 * str.size() + 1, '\xAA');
+    const size_t m = utf8_to_gb18030(str.data(), str.size(), &dest[0]);
+    assert(m <= 2 * str.size() && dest[2 * str.size()] == '\xAA');
+  }
+  return 0;
+}
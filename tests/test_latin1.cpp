@@ -0,0 +1,79 @@
+// Tests for the Latin-1 and CP1252 transcoders and decoders.
+//   g++ -std=c++11 -I.. -fsanitize=address test_latin1.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Latin-1 bytes to utf8, one byte at a time.
+static std::string reference(const std::string& str)
+{
+  std::string result;
+  for (unsigned char c : str)
+  {
+    if (c < 0x80)
+      result += char(c);
+    else
+    {
+      result += char(0xC0 | c >> 6);
+      result += char(0x80 | (c & 0x3F));
+    }
+  }
+  return result;
+}
+
+int main()
+{
+  std::string all;
+  for (int c = 1; c < 256; c++)
+    all += char(c);
+  assert(latin1_to_utf8(all) == reference(all));
+  assert(utf8_to_latin1(reference(all)) == all);
+
+  // CP1252 differs in 0x80-0x9F, the unassigned bytes map to C1 controls.
+  assert(cp1252_to_utf8(std::string("\x80\x81\x9F\xE9")) ==
+      "\xE2\x82\xAC\xC2\x81\xC5\xB8\xC3\xA9");
+  assert(utf8_to_cp1252(std::string("\xE2\x82\xAC\xC5\xB8\xC3\xA9")) == "\x80\x9F\xE9");
+  assert(utf8_to_cp1252(cp1252_to_utf8(all)) == all);
+
+  // Code points out of range are written as '?', the first reported.
+  const std::string mixed = "ab\xC3\xA9\xE4\xB8\xAD" "c\xE2\x82\xAC";
+  assert(utf8_to_latin1(mixed) == "ab\xE9?c?");
+  assert(utf8_to_cp1252(mixed) == "ab\xE9?c\x80");
+  char buf[16];
+  size_t error;
+  assert(utf8_to_latin1(mixed.data(), mixed.size(), buf, error) == 6 && error == 4);
+  assert(utf8_to_cp1252(mixed.data(), mixed.size(), buf, error) == 6 && error == 4);
+  assert(utf8_to_latin1("abc", 3, buf, error) == 3 && error == 3);
+
+  // Random text across the 16-byte blocks, with accents and controls.
+  std::mt19937 rng(1);
+  for (int n = 0; n < 20000; n++)
+  {
+    std::string s;
+    const size_t len = rng() % 70;
+    const unsigned int dense = rng() % 4;
+    for (size_t k = 0; k < len; k++)
+      s += char(rng() % 4 < dense ? 0x80 + rng() % 128 : 'a' + rng() % 26);
+    const std::string utf8 = reference(s);
+    assert(latin1_to_utf8(s) == utf8);
+    assert(utf8_to_latin1(utf8) == s);
+    assert(utf8_to_cp1252(cp1252_to_utf8(s)) == s);
+
+    // Decoding in chunks gives the same result.
+    latin1_decoder decoder;
+    std::string out;
+    for (size_t i = 0; i < s.size(); i += 7)
+      decoder.decode(s.data() + i, std::min<size_t>(7, s.size() - i), out);
+    decoder.decode("", 0, out, true);
+    assert(out == utf8);
+    cp1252_decoder cp;
+    utf32_string text;
+    cp.decode(s.data(), s.size(), text, true);
+    assert(text.to_string() == cp1252_to_utf8(s));
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+// Tests for offset_alignment and the transformations which record it.
+//   g++ -std=c++11 -I.. -fsanitize=address test_offset_alignment.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Invariants of the alignment of a step from src to dst. Without edits of
+// equal lengths, a target byte between two offsets which map exactly, one
+// source byte apart, is a copy.
+static void check(const offset_alignment& align, const std::string& src,
+    const std::string& dst, bool same_lengths)
+{
+  assert(align.source_size() == src.size() && align.target_size() == dst.size());
+  assert(align.map_back(0) == 0 && align.map_forward(0) == 0);
+  assert(align.map_back(dst.size(), true) == src.size());
+  assert(align.map_forward(src.size(), true) == dst.size());
+  assert(align.map_back(dst.size() + 1) == npos && align.map_forward(src.size() + 1) == npos);
+  size_t last = 0;
+  for (size_t t = 0; t <= dst.size(); t++)
+  {
+    const size_t lo = align.map_back(t), hi = align.map_back(t, true);
+    assert(lo >= last && lo <= hi && hi <= src.size());
+    last = lo;
+    if (!same_lengths && t < dst.size() && lo == hi && align.map_back(t + 1) == lo + 1
+        && align.map_back(t + 1, true) == lo + 1)
+      assert(dst[t] == src[lo]);
+  }
+}
+
+int main()
+{
+  offset_alignment a;
+  assert(a.size() == 0 && a.source_size() == 0 && a.map_back(0) == 0);
+  a.copy(3);
+  a.edit(1, 3);
+  a.copy(2);
+  a.edit(2, 0);
+  a.copy(0);
+  assert(a.size() == 4 && a.source_size() == 8 && a.target_size() == 8);
+  assert(a.map_back(2) == 2 && a.map_back(3) == 3 && a.map_back(4) == 3);
+  assert(a.map_back(4, true) == 4 && a.map_back(7) == 5 && a.map_back(8) == 6);
+  assert(a.map_back(8, true) == 8 && a.map_forward(4) == 6 && a.map_forward(7) == 8);
+  assert(a.map_forward(7, true) == 8 && a.map_forward(6) == 8);
+
+  // strip deletes at both ends; rounding up skips the deleted bytes.
+  const std::string text = "  \xEF\xBC\xA1\xEF\xBC\xA2 c\t\n";
+  std::string s1 = strip(text, a);
+  assert(s1 == "\xEF\xBC\xA1\xEF\xBC\xA2 c");
+  assert(a.map_back(0) == 0 && a.map_back(0, true) == 2 && a.map_back(8) == 10);
+  assert(a.map_back(8, true) == 12 && a.map_forward(1) == 0 && a.map_forward(11) == 8);
+  s1 = lstrip(text, a);
+  assert(a.map_back(s1.size()) == text.size());
+  s1 = rstrip(text, a, "\n\t");
+  assert(s1 == "  \xEF\xBC\xA1\xEF\xBC\xA2 c" && a.map_back(10, true) == 12);
+
+  // Chained with full_to_half, spans of the result map back to the text.
+  s1 = strip(text, a);
+  offset_alignment b;
+  const std::string s2 = full_to_half(s1, b);
+  assert(s2 == "AB c");
+  assert(b.map_back(1) == 3 && b.map_back(1, true) == 3 && b.map_back(2) == 6);
+  assert(b.map_back(3) == 7 && b.map_forward(4) == 1 && b.map_forward(4, true) == 2);
+  assert(a.then(b));
+  assert(a.source_size() == text.size() && a.target_size() == s2.size());
+  assert(text.substr(a.map_back(0, true), a.map_back(2, true) - a.map_back(0, true))
+      == "\xEF\xBC\xA1\xEF\xBC\xA2");
+  assert(a.map_back(3) == 9 && a.map_back(4, true) == text.size());
+  assert(!a.then(b));
+
+  const std::string s3 = replace(std::string("one two one"), "one", "1", b);
+  assert(s3 == "1 two 1" && b.map_back(1) == 3 && b.map_back(6) == 8 && b.map_back(7) == 11);
+  assert(b.map_back(6, true) == 8 && b.map_forward(9) == 6 && b.map_forward(9, true) == 7);
+  replace(std::string("aaa"), "a", "bc", b, 2);
+  assert(b.target_size() == 5 && b.map_back(4) == 2);
+
+  // Random steps, composed against mapping through each of them.
+  const std::vector<std::string> pieces = { "a", "b", " ", "\t", "\xEF\xBC\xA1", "\xE3\x80\x80",
+      "\xE4\xB8\xAD", "ab" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 1000; n++)
+  {
+    std::string src;
+    for (int i = 0, count = (int)(rng() % 20); i < count; i++)
+      src += pieces[rng() % pieces.size()];
+    offset_alignment total;
+    std::vector<offset_alignment> steps;
+    std::string cur = src;
+    for (int k = 0, count = 1 + (int)(rng() % 4); k < count; k++)
+    {
+      offset_alignment step;
+      std::string next;
+      bool same_lengths = false;
+      switch (rng() % 5)
+      {
+        case 0: next = strip(cur, step); break;
+        case 1: next = full_to_half(cur, step); break;
+        case 2: next = half_to_full(cur, step); break;
+        case 3: next = replace(cur, "ab", "x", step); break;
+        default: next = replace(cur, "b", "c", step); same_lengths = true; break;
+      }
+      check(step, cur, next, same_lengths);
+      if (k == 0)
+        total = step;
+      else
+        assert(total.then(step));
+      steps.push_back(step);
+      cur = next;
+    }
+    assert(total.source_size() == src.size() && total.target_size() == cur.size());
+
+    // Merged edits only widen the span an offset maps back to.
+    for (size_t t = 0; t <= cur.size(); t++)
+    {
+      size_t lo = t, hi = t;
+      for (size_t k = steps.size(); k-- > 0; )
+      {
+        lo = steps[k].map_back(lo);
+        hi = steps[k].map_back(hi, true);
+      }
+      assert(total.map_back(t) <= lo && total.map_back(t, true) >= hi);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Tests for loading pinyin_converter dictionaries, valid and corrupt.
+//   g++ -std=c++11 -I.. -fsanitize=address test_pinyin.cpp && ./a.out
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static std::uint16_t reading(std::uint16_t syllable, std::uint16_t tone)
+{ return (std::uint16_t)((syllable + 1) << 3 | tone); }
+
+// The layout written by tools/gen_pinyin.py, with 中 zhong1, 重 zhong4,
+// 庆 qing4, 〇 ling2 and the phrase 重庆 chong2 qing4.
+struct dictionary
+{
+  std::vector<std::uint16_t> common = std::vector<std::uint16_t>(0x5200, 0);
+  std::vector<std::uint32_t> extra = { 0x3007, reading(3, 2) };
+  std::vector<std::uint32_t> nodes = { 0, 1, 0, 1, 1, 0, 2, 0, 1 };
+  std::vector<std::uint32_t> targets = { 1, 2 };
+  std::vector<char32_t> labels = { 0x91CD, 0x5E86 };
+  std::vector<std::uint16_t> readings = { reading(1, 2), reading(2, 4) };
+  std::string syllables = std::string("zhong\0\0\0chong\0\0\0qing\0\0\0\0ling\0\0\0\0", 32);
+
+  dictionary()
+  {
+    common[0x4E2D - 0x4E00] = reading(0, 1);
+    common[0x91CD - 0x4E00] = reading(0, 4);
+    common[0x5E86 - 0x4E00] = reading(2, 4);
+  }
+
+  std::vector<std::uint32_t> build() const
+  {
+    std::string buf;
+    const std::uint32_t header[8] = { 0x5950485A, 1, (std::uint32_t)syllables.size() / 8,
+        (std::uint32_t)extra.size() / 2, (std::uint32_t)nodes.size() / 3,
+        (std::uint32_t)targets.size(), (std::uint32_t)readings.size(), 0 };
+    buf.append((const char *)header, sizeof(header));
+    buf.append((const char *)common.data(), 2 * common.size());
+    buf.append((const char *)extra.data(), 4 * extra.size());
+    buf.append((const char *)nodes.data(), 4 * nodes.size());
+    buf.append((const char *)targets.data(), 4 * targets.size());
+    buf.append((const char *)labels.data(), 4 * labels.size());
+    buf.append((const char *)readings.data(), 2 * readings.size());
+    buf += syllables;
+    std::vector<std::uint32_t> words(buf.size() / 4 + 1);
+    memcpy(words.data(), buf.data(), buf.size());
+    words.back() = (std::uint32_t)buf.size();
+    return words;
+  }
+};
+
+static bool load(pinyin_converter& py, const dictionary& dict)
+{
+  static std::vector<std::uint32_t> keep;
+  keep = dict.build();
+  return py.assign((const char *)keep.data(), keep.back());
+}
+
+int main()
+{
+  pinyin_converter py;
+  dictionary dict;
+  assert(load(py, dict));
+  const std::string text = "\xE9\x87\x8D\xE5\xBA\x86\xE4\xB8\xAD\xE3\x80\x87";
+  assert(py.convert(text) == "chong qing zhong ling");
+  assert(py.convert(text, pinyin_style::tone_numbers, 0) == "chong2qing4zhong1ling2");
+
+  dictionary bad = dict;
+  bad.common[0x10] = reading(4, 1);
+  assert(!load(py, bad) && !py.valid());
+  bad = dict;
+  bad.common[0x10] = reading(0, 5);
+  assert(!load(py, bad));
+  bad = dict;
+  bad.readings[1] = 0;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.nodes[3 * 2 + 2] = 2;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.nodes[3 * 1 + 2] = 2;
+  assert(load(py, bad));
+  bad.nodes[3 * 1 + 2] = 3;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.targets[1] = 1;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.labels[0] = 0xE9;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.extra[0] = 0xE9;
+  assert(!load(py, bad));
+  bad = dict;
+  bad.extra[1] = 0x10000 | reading(0, 1);
+  assert(!load(py, bad));
+  bad = dict;
+  bad.syllables[8] = 'v';
+  bad.syllables[9] = 'v';
+  assert(!load(py, bad));
+  bad = dict;
+  bad.syllables[0] = 'Z';
+  assert(!load(py, bad));
+  bad = dict;
+  bad.syllables[7] = 'x';
+  assert(!load(py, bad));
+
+  // Random corruption is either rejected or safe to convert with.
+  std::mt19937 rng(1);
+  const std::vector<std::uint32_t> dump = dict.build();
+  const std::string input = text + "\xE9\x87\x8D ab\x80\xC3\xA9\xE9\x87\x8D\xE5\xBA";
+  for (int n = 0; n < 20000; n++)
+  {
+    std::vector<std::uint32_t> w = dump;
+    const size_t size = w.back();
+    for (int k = 0; k < 1 + (int)(rng() % 3); k++)
+      ((unsigned char *)w.data())[rng() % size] ^= (unsigned char)(1 << (rng() % 8));
+    pinyin_converter p;
+    if (p.assign((const char *)w.data(), size))
+      for (pinyin_style s : { pinyin_style::plain, pinyin_style::tone_marks,
+          pinyin_style::tone_numbers, pinyin_style::initials })
+      {
+        std::vector<char> out(p.max_size(input.size()));
+        p.convert(input.data(), input.size(), out.data(), s);
+      }
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Tests for ustring_rope edits inside surrogate pairs.
+//   g++ -std=c++11 -I.. -fsanitize=address test_rope.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static void check(const utf16_rope& rope, const utf16_string& ref)
+{
+  assert(rope.to_ustring() == ref);
+  assert(rope.to_string() == ref.to_string());
+  assert(rope.size_bytes() == ref.to_string().size());
+}
+
+int main()
+{
+  // 2000 emoji: the insert at 1001 lands between a high and a low surrogate.
+  std::string emoji;
+  for (int i = 0; i < 2000; i++)
+    emoji += "\xF0\x9F\x98\x80";
+  utf16_rope rope(emoji);
+  const utf16_string x(std::string("x"));
+  rope.insert(1001, x);
+  rope.erase(1001, 1);
+  assert(rope.to_string() == emoji);
+  assert(rope.size_bytes() == 8000);
+
+  // Random edits against a plain utf16_string.
+  std::mt19937 rng(1);
+  const char* pieces[] = { "a", "\xF0\x9F\x98\x80", "\xE4\xB8\xAD", "\xF0\x90\x80\x80" "b" };
+  utf16_string ref;
+  for (int i = 0; i < 3000; i++)
+    ref.append(std::string(pieces[rng() % 4]));
+  utf16_rope r(ref);
+  check(r, ref);
+  for (int n = 0; n < 1500; n++)
+  {
+    const size_t pos = rng() % (ref.size() + 1);
+    if (rng() % 2)
+    {
+      utf16_string ins;
+      const size_t m = rng() % 4 ? 1 + rng() % 3 : 600 + rng() % 600;
+      for (size_t i = 0; i < m; i++)
+        ins.append(std::string(pieces[rng() % 4]));
+      // A lone surrogate at either end of the inserted text.
+      if (rng() % 4 == 0)
+        ins.erase(0, 1);
+      r.insert(pos, ins);
+      ref.insert(pos, ins);
+    }
+    else
+    {
+      const size_t m = rng() % 3 ? rng() % 4 : rng() % 3000;
+      r.erase(pos, m);
+      ref.erase(pos, m);
+    }
+    check(r, ref);
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Tests for loading segmenter dictionaries, valid and corrupt.
+//   g++ -std=c++11 -I.. -fsanitize=address test_segmenter.cpp && ./a.out
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// The layout written by tools/gen_segdict.py, with the words 中国 and 人
+// and one emission page for U+4E00...U+4EFF.
+struct dictionary
+{
+  std::vector<float> model = std::vector<float>(20, -1.0f);
+  std::vector<std::uint16_t> index = std::vector<std::uint16_t>(0x1100, 0);
+  std::vector<float> pages = std::vector<float>(1024, -2.0f);
+  std::vector<std::uint32_t> fnodes = { 0, 2, 0, 2, 1, 0, 3, 0, 5, 3, 0, 10 };
+  std::vector<std::uint32_t> ftargets = { 1, 2, 3 };
+  std::vector<char32_t> flabels = { 0x4E2D, 0x4EBA, 0x56FD };
+  std::vector<std::uint32_t> bnodes = { 0, 2, 0, 2, 0, 5, 2, 1, 0, 3, 0, 10 };
+  std::vector<std::uint32_t> btargets = { 1, 2, 3 };
+  std::vector<char32_t> blabels = { 0x4EBA, 0x56FD, 0x4E2D };
+  std::uint32_t hmm = 1;
+
+  dictionary()
+  { index[0x4E] = 1; }
+
+  std::vector<std::uint32_t> build() const
+  {
+    std::string buf;
+    const std::uint32_t header[8] = { 0x4753485A, 1, (std::uint32_t)fnodes.size() / 3,
+        (std::uint32_t)ftargets.size(), (std::uint32_t)bnodes.size() / 3,
+        (std::uint32_t)btargets.size(), (std::uint32_t)pages.size() / 1024, hmm };
+    buf.append((const char *)header, sizeof(header));
+    buf.append((const char *)model.data(), 4 * model.size());
+    buf.append((const char *)index.data(), 2 * index.size());
+    buf.append((const char *)pages.data(), 4 * pages.size());
+    buf.append((const char *)fnodes.data(), 4 * fnodes.size());
+    buf.append((const char *)ftargets.data(), 4 * ftargets.size());
+    buf.append((const char *)flabels.data(), 4 * flabels.size());
+    buf.append((const char *)bnodes.data(), 4 * bnodes.size());
+    buf.append((const char *)btargets.data(), 4 * btargets.size());
+    buf.append((const char *)blabels.data(), 4 * blabels.size());
+    std::vector<std::uint32_t> words(buf.size() / 4 + 1);
+    memcpy(words.data(), buf.data(), buf.size());
+    words.back() = (std::uint32_t)buf.size();
+    return words;
+  }
+};
+
+static bool load(segmenter& seg, const dictionary& dict)
+{
+  static std::vector<std::uint32_t> keep;
+  keep = dict.build();
+  return seg.assign((const char *)keep.data(), keep.back());
+}
+
+int main()
+{
+  segmenter seg;
+  dictionary dict;
+  assert(load(seg, dict) && seg.has_hmm());
+  const std::string text = "\xE4\xB8\xAD\xE5\x9B\xBD\xE4\xBA\xBA";
+  std::vector<std::string> words = seg.cut(text, match_mode::forward, false);
+  assert(words.size() == 2 && words[0] == "\xE4\xB8\xAD\xE5\x9B\xBD");
+  words = seg.cut(text, match_mode::backward, false);
+  assert(words.size() == 2 && words[1] == "\xE4\xBA\xBA");
+
+  dictionary bad = dict;
+  bad.index[0x4F] = 2;
+  assert(!load(seg, bad) && !seg.valid());
+  bad = dict;
+  bad.ftargets[2] = 4;
+  assert(!load(seg, bad));
+  bad = dict;
+  bad.ftargets[1] = 0;
+  assert(!load(seg, bad));
+  bad = dict;
+  bad.fnodes[3 * 1 + 1] = 2;
+  assert(!load(seg, bad));
+  bad = dict;
+  bad.btargets[2] = 1;
+  assert(!load(seg, bad));
+  bad = dict;
+  bad.blabels[0] = 0x57000;
+  assert(!load(seg, bad));
+  bad = dict;
+  bad.bnodes[3 * 3] = 4;
+  assert(!load(seg, bad));
+
+  // Random corruption is either rejected or safe to segment with.
+  std::mt19937 rng(1);
+  const std::vector<std::uint32_t> dump = dict.build();
+  const std::string input = text + "\xE4\xB8\x80\xE4\xBA\xBA ab1\xE5\x9B\xBD\xE4\xB8\xAD\x80";
+  segmenter::workspace ws;
+  std::vector<token_span> tokens;
+  for (int n = 0; n < 20000; n++)
+  {
+    std::vector<std::uint32_t> w = dump;
+    const size_t size = w.back();
+    for (int k = 0; k < 1 + (int)(rng() % 3); k++)
+      ((unsigned char *)w.data())[rng() % size] ^= (unsigned char)(1 << (rng() % 8));
+    segmenter s;
+    if (s.assign((const char *)w.data(), size))
+      for (match_mode m : { match_mode::forward, match_mode::backward,
+          match_mode::bidirectional })
+      {
+        s.cut(input.data(), input.size(), tokens, ws, m);
+        size_t end = 0;
+        for (const token_span& t : tokens)
+        {
+          assert(t.offset == end && t.length > 0);
+          end += t.length;
+        }
+        assert(end == input.size());
+      }
+  }
+  return 0;
+}
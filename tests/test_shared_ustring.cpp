@@ -0,0 +1,54 @@
+// Regression tests for shared_ustring construction and ordering.
+//   g++ -std=c++11 -I.. -fsanitize=address test_shared_ustring.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+int main()
+{
+  // Invalid utf8 which decodes above U+FFFF is sized like utf8_to_utf16.
+  std::string stray;
+  for (int i = 0; i < 1000; i++)
+    stray += "A\x80\x80\x80";
+  shared_ustring<char16_t> s16(stray);
+  assert(s16.size() == 2000);
+  assert(s16 == utf16_string(stray));
+
+  // Ordering is by code unit value, whatever the byte order in memory.
+  const char16_t a16[] = { 0x0100, 0 }, b16[] = { 0x0001, 0 };
+  assert(shared_ustring<char16_t>(utf16_string(a16)).compare(b16, 1) > 0);
+  assert(shared_ustring<char16_t>(utf16_string(b16)) <
+      shared_ustring<char16_t>(utf16_string(a16)));
+
+  const char32_t a32[] = { 0x10000, 0 }, b32[] = { 0x00FF, 0 };
+  assert(shared_ustring<char32_t>(utf32_string(a32)).compare(b32, 1) > 0);
+  assert(shared_ustring<char32_t>(utf32_string(b32)) <
+      shared_ustring<char32_t>(utf32_string(a32)));
+
+  // ustring orders alike, so the two types sort the same.
+  assert(utf16_string(a16).compare(b16, 1) > 0);
+  assert(utf16_string(b16) < utf16_string(a16));
+  assert(utf32_string(a32).compare(b32, 1) > 0);
+  assert(utf32_string(a32).compare(0, 1, b32, 1) > 0);
+  std::mt19937 rng(1);
+  const char16_t units[] = { 0x0001, 0x0100, 0x00FF, 0xFF00, 0xD83D, 0x4E2D };
+  for (int n = 0; n < 10000; n++)
+  {
+    std::u16string a, b;
+    for (size_t k = rng() % 4; k > 0; k--)
+      a += units[rng() % 6];
+    for (size_t k = rng() % 4; k > 0; k--)
+      b += units[rng() % 6];
+    const int expected = a.compare(b);
+    const utf16_string ua(a.data(), a.size());
+    const shared_ustring<char16_t> sa(ua);
+    const int u = ua.compare(b.data(), b.size()), s = sa.compare(b.data(), b.size());
+    assert((u < 0) == (expected < 0) && (u > 0) == (expected > 0));
+    assert((s < 0) == (expected < 0) && (s > 0) == (expected > 0));
+  }
+  return 0;
+}
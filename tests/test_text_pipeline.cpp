@@ -0,0 +1,127 @@
+// Tests for text_pipeline against strip, toLower, replace and split called in turn.
+//   g++ -std=c++11 -I.. -fsanitize=address test_text_pipeline.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// A stage of a random pipeline: 0 strip, 1 lower, 2 replace, 3 split.
+struct stage
+{
+  int kind;
+  std::string a, b;
+};
+
+template <typename _Pipeline>
+static std::vector<std::string> finish(_Pipeline& p, const std::string& str)
+{
+  // Twice, the buffer and the stages being reused.
+  std::vector<std::string> tokens = p.run(str);
+  assert(p.run(str) == tokens);
+  return tokens;
+}
+
+// Build the pipeline of the stages from k on, at most _Depth of them so
+// that the pipeline types stay finite.
+template <typename _Pipeline>
+static std::vector<std::string> build(_Pipeline p, const std::vector<stage>&, size_t,
+    const std::string& str, std::integral_constant<int, 0>)
+{ return finish(p, str); }
+
+template <typename _Pipeline, int _Depth>
+static std::vector<std::string> build(_Pipeline p, const std::vector<stage>& stages,
+    size_t k, const std::string& str, std::integral_constant<int, _Depth>)
+{
+  if (k == stages.size())
+    return finish(p, str);
+  const stage& s = stages[k];
+  const std::integral_constant<int, _Depth - 1> next;
+  switch (s.kind)
+  {
+    case 0: return build(p.strip(s.a), stages, k + 1, str, next);
+    case 1: return build(p.lower(), stages, k + 1, str, next);
+    case 2: return build(p.replace(s.a, s.b), stages, k + 1, str, next);
+    default: return build(p.split(s.a), stages, k + 1, str, next);
+  }
+}
+
+static std::vector<std::string> reference(const std::vector<stage>& stages,
+    const std::string& str)
+{
+  std::vector<std::string> tokens(1, str);
+  for (const stage& s : stages)
+  {
+    std::vector<std::string> next;
+    for (const std::string& t : tokens)
+    {
+      if (s.kind == 3)
+      {
+        for (const std::string& u : split(t, s.a))
+          next.push_back(u);
+        continue;
+      }
+      next.push_back(s.kind == 0 ? strip(t, s.a) : s.kind == 1 ? toLower(t)
+          : replace(t, s.a, s.b));
+    }
+    tokens.swap(next);
+  }
+  std::vector<std::string> result;
+  for (const std::string& t : tokens)
+    if (!t.empty())
+      result.push_back(t);
+  return result;
+}
+
+int main()
+{
+  const std::string str = "  Hello\tWorld,hello  there ,, HELLO\n";
+  auto p = text_pipeline<>().strip().lower().replace("\t", ",").replace("hello", "hi").split(",");
+  assert((p.run(str) == std::vector<std::string>{ "hi", "world", "hi  there ", " hi" }));
+  std::vector<std::string> tokens;
+  p.run(str.data(), str.size(), [&tokens](const char* t, size_t n) { tokens.emplace_back(t, n); });
+  assert((tokens == std::vector<std::string>{ "hi", "world", "hi  there ", " hi" }));
+
+  // Stages after split work on every token; empty tokens are skipped.
+  auto q = text_pipeline<>().split(",").strip().replace("x", "");
+  assert((q.run(std::string(" a ,  , x ,b x")) == std::vector<std::string>{ "a", "b " }));
+  assert(text_pipeline<>().strip().run(std::string(" \t ")).empty());
+  assert((text_pipeline<>().run(std::string("ab")) == std::vector<std::string>{ "ab" }));
+  assert((text_pipeline<>().split().run(std::string(" a\tb\n c "))
+      == std::vector<std::string>{ "a", "b", "c" }));
+
+  // Overlapping patterns replace leftmost and without overlaps, like replace.
+  assert((text_pipeline<>().replace("aa", "a").run(std::string("aaaaa"))
+      == std::vector<std::string>{ "aaa" }));
+  assert((text_pipeline<>().replace("aab", "x").replace("ax", "y").run(std::string("aaabaab"))
+      == std::vector<std::string>{ "yx" }));
+  assert((text_pipeline<>().split("aba").run(std::string("ababababa"))
+      == std::vector<std::string>{ "b", "ba" }));
+
+  // Random pipelines over a small alphabet, where partial matches abound.
+  const std::string alphabet = "aAbB ,\t";
+  const std::vector<std::string> patterns = { "", "a", "ab", "aab", "aa", "aba", " ,", "b a" };
+  std::mt19937 rng(1);
+  for (int n = 0; n < 3000; n++)
+  {
+    std::string s;
+    for (int i = 0, len = (int)(rng() % 600); i < len; i++)
+      s += alphabet[rng() % alphabet.size()];
+    std::vector<stage> stages;
+    for (int k = 0, count = 1 + (int)(rng() % 3); k < count; k++)
+    {
+      stage st = { (int)(rng() % 4), patterns[rng() % patterns.size()],
+          patterns[rng() % patterns.size()] };
+      if (st.kind == 0)
+        st.a = rng() % 2 ? "" : "a ";
+      stages.push_back(st);
+    }
+    assert(build(text_pipeline<>(), stages, 0, s, std::integral_constant<int, 3>())
+        == reference(stages, s));
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Tests for truncate_bytes and floor/ceil_char_boundary.
+//   g++ -std=c++11 -I.. -fsanitize=address test_truncate_bytes.cpp && ./a.out
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+int main()
+{
+  const std::string str = "a\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80" "b";
+  const size_t floors[] = { 0, 1, 1, 3, 3, 3, 6, 6, 6, 6, 10, 11, 11 };
+  const size_t ceils[] = { 0, 1, 3, 3, 6, 6, 6, 10, 10, 10, 10, 11, 11 };
+  for (size_t pos = 0; pos <= str.size() + 1; pos++)
+  {
+    assert(floor_char_boundary(str, pos) == floors[pos]);
+    assert(ceil_char_boundary(str, pos) == ceils[pos]);
+    assert(truncate_bytes(str, pos) == str.substr(0, floors[pos]));
+  }
+  assert(truncate_bytes(std::string(), 3).empty());
+
+  // Stray continuation bytes: a long run is returned unchanged, never past
+  // the ends of the string.
+  const std::string stray = "\x80\x80" "a\x80\x80\x80\x80\x80";
+  assert(floor_char_boundary(stray, 0) == 0 && floor_char_boundary(stray, 1) == 1);
+  assert(floor_char_boundary(stray, 5) == 2 && floor_char_boundary(stray, 7) == 7);
+  assert(ceil_char_boundary(stray, 5) == 8 && ceil_char_boundary(stray, 4) == 4);
+
+  // Random valid utf8 against the boundaries found by decoding it.
+  const std::vector<std::string> chars = { "a", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80" };
+  std::mt19937 rng(1);
+  std::vector<std::string> column;
+  std::string data;
+  std::vector<std::uint32_t> offsets(1, 0);
+  for (int n = 0; n < 500; n++)
+  {
+    std::string s;
+    std::vector<bool> boundary(1, true);
+    for (int i = 0, count = (int)(rng() % 40); i < count; i++)
+    {
+      const std::string& c = chars[rng() % chars.size()];
+      s += c;
+      boundary.resize(s.size() + 1, false);
+      boundary[s.size()] = true;
+    }
+    for (size_t pos = 0; pos <= s.size(); pos++)
+    {
+      size_t lo = pos, hi = pos;
+      while (!boundary[lo])
+        lo--;
+      while (!boundary[hi])
+        hi++;
+      assert(floor_char_boundary(s, pos) == lo && ceil_char_boundary(s, pos) == hi);
+    }
+    column.push_back(s);
+    data += s;
+    offsets.push_back((std::uint32_t)data.size());
+  }
+
+  for (size_t max_bytes : { 0, 1, 2, 5, 17, 200 })
+  {
+    std::vector<std::uint32_t> lens(column.size());
+    truncate_bytes(data.data(), offsets.data(), column.size(), max_bytes, lens.data());
+    std::vector<std::string> cut = column;
+    truncate_bytes(cut, max_bytes);
+    for (size_t i = 0; i < column.size(); i++)
+    {
+      const std::string expected = truncate_bytes(column[i], max_bytes);
+      assert(expected.size() <= max_bytes &&
+          floor_char_boundary(column[i], expected.size()) == expected.size());
+      assert(cut[i] == expected && lens[i] == expected.size());
+    }
+  }
+  return 0;
+}
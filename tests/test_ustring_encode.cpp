@@ -0,0 +1,80 @@
+// Tests for encoding ustring into reused strings and caller buffers.
+//   g++ -std=c++11 -I.. -fsanitize=address test_ustring_encode.cpp && ./a.out
+#include <cassert>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+template <typename _String>
+static void check(const std::string& utf8)
+{
+  const _String str(utf8);
+  std::string out = "old contents";
+  str.to_string(out);
+  assert(out == utf8);
+  assert(str.size_bytes() == utf8.size());
+
+  // append_to with and without room for the longest encoding.
+  std::string tight = "x";
+  str.append_to(tight);
+  assert(tight == "x" + utf8);
+  std::string roomy = "x";
+  roomy.reserve(1 + 4 * utf8.size() + 8);
+  str.append_to(roomy);
+  assert(roomy == tight);
+
+  // encode_into writes whole characters and a null character.
+  for (size_t cap = 0; cap <= utf8.size() + 2; cap++)
+  {
+    std::string buf(cap + 1, '#');
+    assert(str.encode_into(&buf[0], cap) == utf8.size());
+    assert(buf[cap] == '#');
+    if (!cap)
+      continue;
+    const size_t written = strlen(buf.c_str());
+    assert(written < cap && utf8.compare(0, written, buf, 0, written) == 0);
+    assert(written == utf8.size() || ((unsigned char)utf8[written] & 0xC0) != 0x80);
+    // The next character did not fit.
+    if (written < utf8.size())
+    {
+      size_t next = 1;
+      while (written + next < utf8.size() && ((unsigned char)utf8[written + next] & 0xC0) == 0x80)
+        next++;
+      assert(written + next > cap - 1);
+    }
+  }
+}
+
+int main()
+{
+  const char* samples[] = { "", "abc", "caf\xC3\xA9", "\xE4\xB8\xAD\xE6\x96\x87",
+    "a\xF0\x9F\x98\x80" "b\xF0\x9F\x98\x80" };
+  for (const char* s : samples)
+  {
+    check<utf16_string>(s);
+    check<utf32_string>(s);
+  }
+
+  std::mt19937 rng(1);
+  const char* pieces[] = { "a", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80" };
+  for (int n = 0; n < 300; n++)
+  {
+    std::string s;
+    for (size_t k = rng() % 50; k > 0; k--)
+      s += pieces[rng() % 4];
+    check<utf16_string>(s);
+    check<utf32_string>(s);
+  }
+
+  // The bounded encode reports how many units it consumed.
+  const utf16_string u("a\xF0\x9F\x98\x80" "b");
+  char buf[8];
+  size_t consumed;
+  assert(encode(u.data(), u.size(), buf, 4, consumed) == 1 && consumed == 1);
+  assert(encode(u.data(), u.size(), buf, 5, consumed) == 5 && consumed == 3);
+  return 0;
+}
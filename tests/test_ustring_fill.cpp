@@ -0,0 +1,63 @@
+// Tests for filling ustring and compact_ustring with a repeated code unit.
+//   g++ -std=c++11 -I.. -fsanitize=address test_ustring_fill.cpp && ./a.out
+#include <cassert>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+template <typename _CodeT>
+static bool all_of(const ustring<_CodeT>& str, size_t pos, size_t n, _CodeT c)
+{
+  for (size_t i = pos; i < pos + n; i++)
+    if (str[i] != c)
+      return false;
+  return true;
+}
+
+template <typename _CodeT>
+static void check(_CodeT c)
+{
+  for (size_t n : { 0, 1, 3, 7, 8, 9, 15, 16, 17, 40, 100 })
+  {
+    ustring<_CodeT> s(n, c);
+    assert(s.size() == n && all_of(s, 0, n, c));
+    s.append(n, _CodeT('x'));
+    assert(s.size() == 2 * n && all_of(s, n, n, _CodeT('x')));
+    s.assign(n, c);
+    assert(s.size() == n && all_of(s, 0, n, c));
+    s.resize(2 * n + 1, c);
+    assert(s.size() == 2 * n + 1 && all_of(s, 0, 2 * n + 1, c));
+    ustring<_CodeT> t(2, _CodeT('y'));
+    t.insert(1, n, c);
+    assert(t.size() == n + 2 && t[0] == _CodeT('y') && t[n + 1] == _CodeT('y'));
+    assert(all_of(t, 1, n, c));
+    t.replace(1, n, n + 1, _CodeT('z'));
+    assert(t.size() == n + 3 && all_of(t, 1, n + 1, _CodeT('z')));
+  }
+}
+
+int main()
+{
+  // Units whose bytes differ, which memset cannot fill.
+  check<char16_t>(0x4E2D);
+  check<char16_t>(0x0101);
+  check<char16_t>(u'a');
+  check<char32_t>(0x1F600);
+  check<char32_t>(0x01010101);
+  check<char32_t>(U'a');
+  assert(utf16_string(3, 0x4E2D) == utf16_string("\xE4\xB8\xAD\xE4\xB8\xAD\xE4\xB8\xAD"));
+
+  for (size_t n : { 1, 5, 16, 33 })
+  {
+    compact_ustring c("ab");
+    c.append(n, U'\x1F600');
+    assert(c.size() == n + 2 && c.width() == 4 && c[1] == U'b');
+    for (size_t i = 2; i < n + 2; i++)
+      assert(c[i] == U'\x1F600');
+    c.append(n, U'\x4E2D');
+    assert(c.size() == 2 * n + 2 && c.back() == U'\x4E2D');
+  }
+  return 0;
+}
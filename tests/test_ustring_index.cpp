@@ -0,0 +1,63 @@
+// Tests for the utf8 byte index of STRINGUTILS_USTRING_INDEX.
+//   g++ -std=c++11 -I.. -fsanitize=address test_ustring_index.cpp && ./a.out
+#define STRINGUTILS_USTRING_INDEX
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+template <typename _CodeT>
+static void check(const ustring<_CodeT>& str)
+{
+  const std::string utf8 = str.to_string();
+  assert(str.size_bytes() == utf8.size());
+  size_t bytes = 0;
+  for (size_t i = 0; i < str.size(); i++)
+  {
+    if (sizeof(_CodeT) == 2 && ((char32_t)str[i] & 0xFC00) == 0xDC00)
+      continue;
+    assert(str.get_byte_position(i) == bytes);
+    assert(str.get_index(bytes) == i);
+    bytes += get_num_bytes_of_utf8_char(utf8.data() + bytes, utf8.size() - bytes);
+  }
+}
+
+int main()
+{
+  // assign() from iterators replaces the indexed prefix.
+  utf16_string s(std::string("\xE4\xB8\xAD\xE6\x96\x87\xE5\xAD\x97\xE7\xAC\xA6"));
+  const utf16_string& cs = s;
+  assert(cs.size_bytes() == 12);
+  const std::vector<char16_t> ascii = { 'a', 'b', 'c', 'd' };
+  s.assign(ascii.begin(), ascii.end());
+  assert(cs.size_bytes() == 4);
+  check(cs);
+
+  utf32_string t(std::string(200, 'x'));
+  const utf32_string& ct = t;
+  assert(ct.size_bytes() == 200);
+  check(ct);
+  const std::vector<char32_t> wide(100, 0x4E2D);
+  t.assign(wide.begin(), wide.end());
+  assert(ct.size_bytes() == 300);
+  check(ct);
+  const std::vector<char32_t> five(5, U'y');
+  t.assign(five.begin(), five.end());
+  assert(ct.size_bytes() == 5);
+  check(ct);
+
+  // Edits after the index was built.
+  utf16_string u(std::string(300, 'a') + "\xF0\x9F\x98\x80" + std::string(300, 'b'));
+  const utf16_string& cu = u;
+  check(cu);
+  u.replace(10, 5, utf16_string(std::string("\xE4\xB8\xAD")));
+  check(cu);
+  u.append(std::string("\xF0\x9F\x98\x80"));
+  check(cu);
+  u.erase(0, 100);
+  check(cu);
+  return 0;
+}
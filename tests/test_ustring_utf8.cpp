@@ -0,0 +1,74 @@
+// Tests for ustring built from utf8 with stray continuation bytes after
+// ascii runs: the decoded units must fill the exactly sized buffer.
+//   g++ -std=c++11 -I.. -fsanitize=address test_ustring_utf8.cpp && ./a.out
+#define _GLIBCXX_ASSERTIONS 1
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Code points of the utf8 string, a byte grouped with the continuation
+// bytes after it.
+static std::vector<char32_t> reference(const std::string& str)
+{
+  std::vector<char32_t> cps;
+  for (size_t i = 0; i < str.size(); )
+  {
+    size_t n = 1;
+    while (i + n < str.size() && ((unsigned char)str[i + n] & 0xC0) == 0x80)
+      n++;
+    char32_t cp = (unsigned char)str[i];
+    if (n > 1)
+      cp &= n < 8 ? 0x7F >> n : 0;
+    for (size_t k = 1; k < n; k++)
+      cp = cp << 6 | ((unsigned char)str[i + k] & 0x3F);
+    cps.push_back(cp);
+    i += n;
+  }
+  return cps;
+}
+
+static void check(const std::string& str)
+{
+  const std::vector<char32_t> cps = reference(str);
+  utf32_string u32(str);
+  assert(u32.size() == cps.size());
+  for (size_t i = 0; i < cps.size(); i++)
+    assert(u32[i] == cps[i]);
+  utf32_string a32("x");
+  a32.append(str);
+  assert(a32.size() == cps.size() + 1);
+  a32.assign(str);
+  assert(a32.size() == cps.size());
+  utf16_string u16(str);
+  utf16_string a16("x");
+  a16.append(str);
+  assert(a16.size() == u16.size() + 1);
+  a16.assign(str);
+  assert(a16.size() == u16.size());
+}
+
+int main()
+{
+  for (size_t run : { 1, 15, 16, 17, 31, 32, 33, 64 })
+    for (const char* tail : { "\x80", "\x80\x80\x80", "\x80 ok", "\xE4\xB8\xAD" })
+      check(std::string(run, 'a') + tail);
+
+  std::mt19937 rng(1);
+  const char* pieces[] = { "\x80", "\xBF\x80", "\xC3\xA9", "\xF0\x9F\x98\x80" };
+  for (int n = 0; n < 2000; n++)
+  {
+    std::string str;
+    while (str.size() < 100)
+    {
+      str.append(rng() % 40, 'a');
+      str += pieces[rng() % 4];
+    }
+    check(str);
+  }
+  return 0;
+}
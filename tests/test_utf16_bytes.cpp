@@ -0,0 +1,81 @@
+// Tests for utf16 byte streams: byte orders, BOMs, unpaired surrogates and
+// chunked decoding.
+//   g++ -std=c++11 -I.. -fsanitize=address test_utf16_bytes.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static std::string bytes(const std::u16string& units, bool big)
+{
+  std::string result;
+  for (char16_t c : units)
+  {
+    result += char(big ? c >> 8 : c & 0xFF);
+    result += char(big ? c & 0xFF : c >> 8);
+  }
+  return result;
+}
+
+int main()
+{
+  const std::string utf8 = "a\xC3\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80";
+  const std::u16string units = u"a\x00E9\x4E2D\U0001F600";
+  const std::string le = bytes(units, false), be = bytes(units, true);
+
+  assert(utf16_bytes_to_utf8(le, byte_order::little) == utf8);
+  assert(utf16_bytes_to_utf8(be, byte_order::big) == utf8);
+  assert(utf16_bytes_to_u16string(be, byte_order::big) == units);
+  // detect reads and skips a BOM, and falls back to little endian.
+  assert(utf16_bytes_to_utf8("\xFE\xFF" + be) == utf8);
+  assert(utf16_bytes_to_utf8("\xFF\xFE" + le) == utf8);
+  assert(utf16_bytes_to_utf8(le) == utf8);
+
+  assert(utf8_to_utf16_bytes(utf8) == le);
+  assert(utf8_to_utf16_bytes(utf8, byte_order::big) == be);
+  assert(utf8_to_utf16_bytes(utf8, byte_order::big, true) == "\xFE\xFF" + be);
+  assert(to_utf16_bytes(units, byte_order::little, true) == "\xFF\xFE" + le);
+
+  // Unpaired surrogates and an odd last byte become U+FFFD.
+  const std::string fffd = "\xEF\xBF\xBD";
+  assert(utf16_bytes_to_utf8(bytes(u"a\xD83D" "b", false), byte_order::little) ==
+      "a" + fffd + "b");
+  assert(utf16_bytes_to_utf8(bytes(u"\xDE00" "a", true), byte_order::big) == fffd + "a");
+  assert(utf16_bytes_to_utf8(le + "x", byte_order::little) == utf8 + fffd);
+
+  // Units of any width, through the SIMD blocks.
+  std::mt19937 rng(1);
+  const char16_t pool[] = { u'a', 0x00E9, 0x4E2D, 0xD83D, 0xDE00, 0xFFFD, 0x0100 };
+  for (int n = 0; n < 5000; n++)
+  {
+    std::u16string u;
+    for (size_t k = rng() % 40; k > 0; k--)
+      u += pool[rng() % (rng() % 2 ? 3 : 7)];
+    const std::u16string clean = utf16_bytes_to_u16string(bytes(u, false), byte_order::little);
+    assert(clean.size() == u.size());
+    const bool big = rng() % 2;
+    const std::string b = bytes(clean, big);
+    const byte_order order = big ? byte_order::big : byte_order::little;
+    assert(utf16_bytes_to_u16string(b, order) == clean);
+
+    std::vector<char32_t> cps(b.size() / 2 + 1);
+    cps.resize(utf16_bytes_to_units(b.data(), b.size(), cps.data(), order));
+    assert(std::u32string(cps.begin(), cps.end()) == to_u32string(clean));
+    std::string back(4 * cps.size() + 2, '\0');
+    back.resize(units_to_utf16_bytes(cps.data(), cps.size(), &back[0], order));
+    assert(back == b);
+
+    // Chunks may split a unit or a surrogate pair.
+    utf16_decoder decoder(order);
+    std::string out;
+    for (size_t i = 0; i < b.size(); i += 3)
+      decoder.decode(b.data() + i, std::min<size_t>(3, b.size() - i), out);
+    decoder.decode("", 0, out, true);
+    assert(out == utf16_bytes_to_utf8(b, order));
+  }
+  return 0;
+}
@@ -0,0 +1,50 @@
+// Regression tests for get_utf16_length on invalid utf8.
+//   g++ -std=c++11 -I.. -fsanitize=address test_utf16_length.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+static void check(const std::string& str)
+{
+  std::vector<char16_t> units(4 * str.size() + 4);
+  assert(get_utf16_length(str.data(), str.size()) ==
+      utf8_to_utf16(str.data(), str.size(), units.data()));
+}
+
+int main()
+{
+  // A stray continuation run after a lead decodes above U+FFFF.
+  check("A\x80\x80\x80");
+  check("\x80\x80\x80\x80");
+  check("\xF0\x9F\x98\x80");
+  check("\xF0\x80\x80\x80");
+  check("\xF7\xBF\xBF\xBF");
+  check("A\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80");
+  check(std::string(40, '\x80'));
+
+  std::string stray;
+  for (int i = 0; i < 1000; i++)
+    stray += "A\x80\x80\x80";
+  check(stray);
+
+  utf16_string u(stray);
+  assert(u.size() == 2000);
+  u.append(stray);
+  assert(u.size() == 4000);
+
+  std::mt19937 rng(1);
+  const char bytes[] = { 'a', '\x80', '\xBF', '\xC3', '\xE4', '\xF0', '\x9F', '\xF8' };
+  for (int n = 0; n < 2000; n++)
+  {
+    std::string str(rng() % 64, ' ');
+    for (char& c : str)
+      c = bytes[rng() % sizeof(bytes)];
+    check(str);
+  }
+  return 0;
+}
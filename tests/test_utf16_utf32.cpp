@@ -0,0 +1,74 @@
+// Tests for the direct conversions between utf16 and utf32.
+//   g++ -std=c++11 -I.. -fsanitize=address test_utf16_utf32.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Scalar conversions, one unit or code point at a time.
+static std::u32string reference32(const std::u16string& str)
+{
+  std::u32string result;
+  char32_t cp;
+  for (size_t i = 0; i < str.size(); )
+  {
+    i += utf16_decode(str.data() + i, cp, str.size() - i);
+    result += cp;
+  }
+  return result;
+}
+
+static std::u16string reference16(const std::u32string& str)
+{
+  std::u16string result;
+  char16_t units[2];
+  for (char32_t cp : str)
+    result.append(units, utf16_encode(cp, units));
+  return result;
+}
+
+int main()
+{
+  const std::u16string pair = u"a\U0001F600b";
+  assert(pair.size() == 4);
+  assert(to_u32string(pair) == U"a\U0001F600b");
+  assert(to_u16string(std::u32string(U"a\U0001F600b")) == pair);
+  assert(to_u32string(std::u16string(u"\x4E2D\x6587")) == U"\x4E2D\x6587");
+
+  // Random mixes of ascii, BMP, supplementary code points and lone
+  // surrogates, across the 8-unit SIMD blocks.
+  std::mt19937 rng(1);
+  const char32_t cps[] = { U'a', 0x7F, 0x80, 0xFF, 0x100, 0x4E2D, 0xFFFF, 0x8000,
+    0xFFFE, 0x10000, 0x1F600, 0x10FFFF };
+  const char16_t units[] = { u'a', 0x4E2D, 0xD83D, 0xDE00, 0xDBFF, 0xDC00, 0xFFFF };
+  for (int n = 0; n < 20000; n++)
+  {
+    std::u32string u32;
+    std::u16string u16;
+    const size_t len = rng() % 40;
+    const bool dense = rng() % 2;
+    for (size_t k = 0; k < len; k++)
+    {
+      u32 += dense ? cps[rng() % 12] : cps[rng() % 7];
+      u16 += dense ? units[rng() % 7] : units[rng() % 2];
+    }
+    assert(to_u16string(u32) == reference16(u32));
+    assert(to_u32string(to_u16string(u32)) == u32);
+    assert(to_u32string(u16) == reference32(u16));
+
+    std::vector<char32_t> out(u16.size() + 1, 0xABCD);
+    const size_t m = utf16_to_utf32(u16.data(), u16.size(), out.data());
+    assert(m == reference32(u16).size() && out[m] == 0xABCD);
+
+    const utf32_string s32(u32.data(), u32.size());
+    const utf16_string s16(s32);
+    assert(std::u16string(s16.data(), s16.size()) == reference16(u32));
+    const utf32_string back(s16);
+    assert(back == s32);
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Regression tests for the ascii blocks of utf8_to_utf16 followed by a
+// stray continuation byte, which groups with the last ascii byte.
+//   g++ -std=c++11 -I.. -fsanitize=address test_utf8_to_utf16.cpp && ./a.out
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+template <typename _CodeT>
+static void check(const std::string& str)
+{
+  const size_t n = sizeof(_CodeT) == 2 ? get_utf16_length(str.data(), str.size()) :
+      get_characters_number(str.data(), str.size());
+  std::vector<_CodeT> units(n + 1, _CodeT(0xFFFF));
+  assert(utf8_to_utf16(str.data(), str.size(), units.data()) == n);
+  assert(units[n] == _CodeT(0xFFFF));
+  assert(decode<_CodeT>(str).size() == n);
+}
+
+int main()
+{
+  for (size_t run : { 15, 16, 17, 31, 32, 33 })
+    for (const char* tail : { "\x80", "\x80\x80", "\x80\x80\x80", "\x80 x", "\xC3\xA9" })
+    {
+      const std::string str = std::string(run, 'a') + tail;
+      check<char16_t>(str);
+      check<char32_t>(str);
+    }
+
+  const std::string str = std::string(16, 'a') + "\x80";
+  utf32_string u32(str);
+  assert(u32.size() == 16 && u32[15] == U'\x40');
+  assert(u32.size() == to_u32string(str).size());
+  utf16_string u16(std::string(32, 'a') + "\x80");
+  assert(u16.size() == 32);
+  u32.append(str);
+  assert(u32.size() == 32);
+  u32.assign(std::string(32, 'b') + "\x80");
+  assert(u32.size() == 32 && u32[31] == U'\x80');
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Tests for the utf8 validity check of detect_encoding against the codec.
+//   g++ -std=c++11 -I.. -fsanitize=address test_utf8_valid.cpp && ./a.out
+#include <cassert>
+#include <random>
+#include <string>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// Length of the longest prefix of whole valid characters, and the number
+// of those which are not ascii.
+static size_t reference(const std::string& s, size_t& count)
+{
+  const unsigned char* p = (const unsigned char *)s.data();
+  size_t i = 0;
+  count = 0;
+  while (i < s.size())
+  {
+    char32_t cp;
+    const size_t n = mb_detail::utf8_codec::step(p + i, s.size() - i, cp);
+    if (!n || (n == 1 && p[i] >= 0x80))
+      break;
+    count += n > 1;
+    i += n;
+  }
+  return i;
+}
+
+static void check(const std::string& s)
+{
+  size_t count = 0, expected_count;
+  const size_t valid = simd_detail::utf8_valid_prefix(s.data(), s.size(), count);
+  const size_t expected = reference(s, expected_count);
+  assert(valid <= expected);
+  size_t prefix_count;
+  assert(reference(s.substr(0, valid), prefix_count) == valid && prefix_count == count);
+#ifdef STRINGUTILS_HAVE_SSE2
+  assert(expected - valid < 20);
+#endif
+}
+
+int main()
+{
+  const char* pieces[] = { "a", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80",
+    "\xE0\xA0\x80", "\xED\x9F\xBF", "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF",
+    "\xC0\x80", "\xC1\xBF", "\xE0\x9F\xBF", "\xED\xA0\x80", "\xF0\x8F\xBF\xBF",
+    "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xFF", "\x80", "\xE4\xB8", "\xF0\x9F" };
+  const size_t valid_pieces = 8, all_pieces = sizeof(pieces) / sizeof(pieces[0]);
+  std::mt19937 rng(1);
+  for (int n = 0; n < 200000; n++)
+  {
+    std::string s;
+    const size_t len = rng() % 80;
+    const size_t bad = rng() % 4 ? len : rng() % (len + 1);
+    while (s.size() < len)
+      s += pieces[s.size() >= bad ? rng() % all_pieces : rng() % valid_pieces];
+    if (rng() % 4 == 0)
+      s.resize(rng() % (s.size() + 1));
+    check(s);
+  }
+  const std::string text = std::string(100, 'a') + "\xE4\xB8\xAD\xE6\x96\x87";
+  assert(detect_encoding(text)[0].enc == encoding::utf8);
+  assert(detect_encoding(text)[0].confidence >= 0.8);
+  // A character cut by the end of the sample is left out.
+  assert(detect_encoding(text + "\xE4\xB8", text.size() + 1)[0].enc == encoding::utf8);
+  assert(detect_encoding(text + "\xE4")[0].enc != encoding::utf8);
+  return 0;
+}
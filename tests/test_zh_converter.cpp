@@ -0,0 +1,125 @@
+// Tests for loading zh_converter dictionaries, valid and corrupt.
+//   g++ -std=c++11 -I.. -fsanitize=address test_zh_converter.cpp && ./a.out
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stringutils.h"
+
+using namespace stringutils;
+
+// The layout written by tools/gen_zhconv.py, with 头 -> 頭 and the phrase
+// 头发 -> 頭髮.
+struct dictionary
+{
+  std::vector<std::uint16_t> index = std::vector<std::uint16_t>(0x1100, 0);
+  std::vector<std::uint32_t> pages = std::vector<std::uint32_t>(256, 0);
+  std::vector<std::uint32_t> nodes, targets;
+  std::string labels, pool = "\xE9\xA0\xAD\xE9\xAB\xAE";
+  std::uint32_t ratio = 1;
+
+  dictionary()
+  {
+    index[0x59] = 1;
+    pages[0x34] = 0x982D;
+    const std::string key = "\xE5\xA4\xB4\xE5\x8F\x91";
+    for (std::uint32_t i = 0; i <= key.size(); i++)
+    {
+      const bool last = i == key.size();
+      nodes.insert(nodes.end(), { last ? 0 : i, last ? 0u : 1u, 0, last ? 6u : 0u });
+      if (!last)
+      {
+        targets.push_back(i + 1);
+        labels += key[i];
+      }
+    }
+  }
+
+  std::vector<std::uint32_t> build() const
+  {
+    std::string buf;
+    const std::uint32_t header[8] = { 0x5643485A, 1, (std::uint32_t)pages.size() / 256,
+        (std::uint32_t)nodes.size() / 4, (std::uint32_t)targets.size(),
+        (std::uint32_t)pool.size(), ratio, 0 };
+    buf.append((const char *)header, sizeof(header));
+    buf.append((const char *)index.data(), 2 * index.size());
+    buf.append((const char *)pages.data(), 4 * pages.size());
+    buf.append((const char *)nodes.data(), 4 * nodes.size());
+    buf.append((const char *)targets.data(), 4 * targets.size());
+    buf += labels + pool;
+    std::vector<std::uint32_t> words((buf.size() + 3) / 4 + 1);
+    memcpy(words.data(), buf.data(), buf.size());
+    words.back() = (std::uint32_t)buf.size();
+    return words;
+  }
+};
+
+static bool load(zh_converter& conv, const dictionary& dict)
+{
+  const std::vector<std::uint32_t> words = dict.build();
+  static std::vector<std::uint32_t> keep;
+  keep = words;
+  return conv.assign((const char *)keep.data(), keep.back());
+}
+
+int main()
+{
+  zh_converter conv;
+  dictionary dict;
+  assert(load(conv, dict));
+  assert(conv.convert(std::string("\xE5\xA4\xB4\xE5\x8F\x91\xE5\xA4\xB4")) ==
+      "\xE9\xA0\xAD\xE9\xAB\xAE\xE9\xA0\xAD");
+
+  dictionary bad = dict;
+  bad.index[0x10] = 2;
+  assert(!load(conv, bad) && !conv.valid());
+  bad = dict;
+  bad.pages[0x35] = 0x110000;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.pages[0x35] = 0x10000;
+  assert(!load(conv, bad));
+  bad.ratio = 2;
+  assert(load(conv, bad));
+  bad = dict;
+  bad.targets[2] = 100;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.targets[2] = 2;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.nodes[4 * 2] = 6;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.nodes[4 * 6 + 2] = 1;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.nodes[4 * 3 + 3] = 6;
+  bad.nodes[4 * 3 + 2] = 0;
+  assert(!load(conv, bad));
+  bad = dict;
+  bad.pool = std::string(7, 'x');
+  bad.nodes[4 * 6 + 3] = 7;
+  assert(!load(conv, bad));
+
+  // Random corruption is either rejected or safe to convert with.
+  std::mt19937 rng(1);
+  const std::vector<std::uint32_t> words = dict.build();
+  const std::string text = "\xE5\xA4\xB4\xE5\x8F\x91 ab\x80\xC3\xA9\xE5\xA4\xB4\xE5\x8F";
+  for (int n = 0; n < 20000; n++)
+  {
+    std::vector<std::uint32_t> w = words;
+    const size_t size = w.back();
+    for (int k = 0; k < 1 + (int)(rng() % 3); k++)
+      ((unsigned char *)w.data())[rng() % size] ^= (unsigned char)(1 << (rng() % 8));
+    zh_converter c;
+    if (c.assign((const char *)w.data(), size))
+    {
+      std::vector<char> out(c.max_size(text.size()));
+      c.convert(text.data(), text.size(), out.data());
+    }
+  }
+  return 0;
+}
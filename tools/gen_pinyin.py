@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022-present, Zejun Wang (wangzejunscut@126.com)
+# All rights reserved.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+"""Compile hanzi to pinyin readings for pinyin_converter.
+
+Usage: python3 tools/gen_pinyin.py OUTPUT CHARS [PHRASES]
+
+CHARS has one character per line in the pypinyin pinyin.txt format,
+'U+4E2D: zhōng,zhòng  # 中', of which the first reading is used. PHRASES
+has one polyphone phrase per line in the pypinyin phrases format,
+'重庆: chóng qìng'. Syllables may carry tone marks or a tone number
+('chong2'); ü may be written as v.
+
+Layout of OUTPUT, little endian, read in place by pinyin_converter:
+
+  uint32 header[8]     magic 'ZHPY', version, number of syllables, of
+                       extra characters, of trie nodes and edges, of
+                       phrase readings, 0
+  uint16 common[0x5200]  reading of U+4E00-U+9FFF, or 0
+  uint32 extra[][2]    other code points and their readings, sorted
+  uint32 nodes[][3]    phrase trie on code points: first edge, number of
+                       edges, offset of the readings plus one, or 0
+  uint32 targets[]     child node of every edge, sorted by label per node
+  uint32 labels[]      code point of every edge
+  uint16 readings[]    phrase readings, padded to 4 bytes
+  char   syllables[][8]  toneless syllables, v for ü, zero padded
+
+A reading is (syllable number + 1) << 3 | tone, tone 0 being neutral.
+"""
+
+import re
+import struct
+import sys
+import unicodedata
+
+from gen_zhconv import layout_trie
+
+MAGIC = 0x5950485A  # 'ZHPY'
+VERSION = 1
+COMMON_FIRST, COMMON_SIZE = 0x4E00, 0x5200
+
+
+def parse_syllable(s):
+    """Return (toneless syllable with v for ü, tone)."""
+    s = unicodedata.normalize('NFD', s.strip().lower())
+    tone = 0
+    for mark, t in (('\u0304', 1), ('\u0301', 2), ('\u030c', 3), ('\u0300', 4)):
+        if mark in s:
+            tone = t
+            s = s.replace(mark, '')
+    s = unicodedata.normalize('NFC', s).replace('ü', 'v').replace('u:', 'v')
+    if s and s[-1] in '012345':
+        tone, s = int(s[-1]) % 5, s[:-1]
+    if not re.fullmatch('[a-z]{1,6}', s):
+        raise ValueError('bad syllable %r' % s)
+    return s, tone
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    syllables = {}
+
+    def reading(text):
+        s, tone = parse_syllable(text)
+        if s not in syllables:
+            syllables[s] = len(syllables)
+        return (syllables[s] + 1) << 3 | tone
+
+    chars = {}
+    with open(sys.argv[2], encoding='utf-8') as f:
+        for line in f:
+            line = line.split('#')[0].strip()
+            if not line.startswith('U+') or ':' not in line:
+                continue
+            cp, readings = line.split(':', 1)
+            chars[int(cp[2:], 16)] = reading(readings.split(',')[0])
+
+    phrases = {}
+    if len(sys.argv) == 4:
+        with open(sys.argv[3], encoding='utf-8') as f:
+            for line in f:
+                line = line.split('#')[0].strip()
+                if ':' not in line:
+                    continue
+                key, value = line.split(':', 1)
+                key, value = key.strip(), value.split()
+                if len(key) >= 2 and len(key) == len(value):
+                    phrases[key] = [reading(v) for v in value]
+
+    common = [0] * COMMON_SIZE
+    extra = []
+    for cp in sorted(chars):
+        if COMMON_FIRST <= cp < COMMON_FIRST + COMMON_SIZE:
+            common[cp - COMMON_FIRST] = chars[cp]
+        else:
+            extra.append((cp, chars[cp]))
+
+    pool = []
+
+    def payload(value):
+        if value is None:
+            return (0,)
+        pool.extend(value)
+        return (len(pool) - len(value) + 1,)
+
+    nodes, targets, labels = layout_trie(phrases, payload)
+    if len(pool) % 2:
+        pool.append(0)
+    names = sorted(syllables, key=syllables.get)
+    with open(sys.argv[1], 'wb') as f:
+        f.write(struct.pack('<8I', MAGIC, VERSION, len(names), len(extra), len(nodes),
+                            len(targets), len(pool), 0))
+        f.write(struct.pack('<%dH' % COMMON_SIZE, *common))
+        for pair in extra:
+            f.write(struct.pack('<2I', *pair))
+        for node in nodes:
+            f.write(struct.pack('<3I', *node))
+        f.write(struct.pack('<%dI' % len(targets), *targets))
+        f.write(struct.pack('<%dI' % len(labels), *map(ord, labels)))
+        f.write(struct.pack('<%dH' % len(pool), *pool))
+        for name in names:
+            f.write(name.encode('ascii').ljust(8, b'\0'))
+    sys.stderr.write('%s: %d characters, %d phrases, %d syllables\n' % (
+        sys.argv[1], len(chars), len(phrases), len(names)))
+
+
+if __name__ == '__main__':
+    main()
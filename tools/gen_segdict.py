@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022-present, Zejun Wang (wangzejunscut@126.com)
+# All rights reserved.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+"""Compile a Chinese word dictionary and HMM model for segmenter.
+
+Usage: python3 tools/gen_segdict.py OUTPUT DICT [--hmm DIR]
+
+DICT is a text file with one word per line, optionally followed by its
+frequency and tag separated by spaces (the jieba dict.txt format). DIR
+holds the HMM model as prob_start.py, prob_trans.py and prob_emit.py
+(the jieba finalseg format: P = {state: log probability, ...} over the
+states B, E, M, S).
+
+Layout of OUTPUT, little endian, read in place by segmenter:
+
+  uint32 header[8]     magic 'ZHSG', version, number of nodes and edges
+                       of the forward and of the backward trie, number
+                       of emission pages, whether there is an HMM
+  float  start[4]      log probabilities of B, E, M, S
+  float  trans[4][4]   log probabilities from the first state to the second
+  uint16 index[0x1100] one per 256 code points: page number plus one, or 0
+  float  pages[][256][4]  emission log probabilities of B, E, M, S
+  uint32 nodes[][3]    forward trie on code points: first edge, number of
+                       edges, frequency of the word ending there or 0
+  uint32 targets[]     child node of every edge, sorted by label per node
+  uint32 labels[]      code point of every edge
+  uint32 nodes[][3]    backward trie, on the reversed words
+  uint32 targets[]
+  uint32 labels[]
+"""
+
+import ast
+import os
+import struct
+import sys
+
+from gen_zhconv import layout_trie
+
+MAGIC = 0x4753485A  # 'ZHSG'
+VERSION = 1
+STATES = 'BEMS'
+MIN_PROB = -1e30
+
+
+def read_dict(path):
+    words = {}
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            fields = line.split()
+            if not fields:
+                continue
+            freq = int(fields[1]) if len(fields) > 1 and fields[1].isdigit() else 1
+            words[fields[0]] = max(freq, 1)
+    return words
+
+
+def read_model(path):
+    with open(path, encoding='utf-8') as f:
+        text = f.read()
+    return ast.literal_eval(text[text.index('=') + 1:].strip())
+
+
+def clamp(p):
+    return max(p, MIN_PROB)
+
+
+def read_hmm(directory):
+    start = read_model(os.path.join(directory, 'prob_start.py'))
+    trans = read_model(os.path.join(directory, 'prob_trans.py'))
+    emit = read_model(os.path.join(directory, 'prob_emit.py'))
+    start = [clamp(start.get(s, MIN_PROB)) for s in STATES]
+    trans = [clamp(trans.get(a, {}).get(b, MIN_PROB)) for a in STATES for b in STATES]
+    index, pages = [0] * 0x1100, []
+    for k, state in enumerate(STATES):
+        for ch, p in emit.get(state, {}).items():
+            cp = ord(ch)
+            if not index[cp >> 8]:
+                pages.append([MIN_PROB] * 1024)
+                index[cp >> 8] = len(pages)
+            pages[index[cp >> 8] - 1][4 * (cp & 0xFF) + k] = clamp(p)
+    return start, trans, index, pages
+
+
+def main():
+    args = sys.argv[1:]
+    hmm = None
+    if '--hmm' in args:
+        i = args.index('--hmm')
+        hmm = read_hmm(args[i + 1])
+        del args[i:i + 2]
+    if len(args) != 2:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    words = read_dict(args[1])
+
+    def freq(value):
+        return (value or 0,)
+
+    forward = layout_trie(words, freq)
+    backward = layout_trie({w[::-1]: f for w, f in words.items()}, freq)
+    start, trans, index, pages = hmm or ([0.0] * 4, [0.0] * 16, [0] * 0x1100, [])
+    with open(args[0], 'wb') as f:
+        f.write(struct.pack('<8I', MAGIC, VERSION, len(forward[0]), len(forward[1]),
+                            len(backward[0]), len(backward[1]), len(pages), hmm is not None))
+        f.write(struct.pack('<20f', *(start + trans)))
+        f.write(struct.pack('<%dH' % len(index), *index))
+        for page in pages:
+            f.write(struct.pack('<1024f', *page))
+        for nodes, targets, labels in (forward, backward):
+            for node in nodes:
+                f.write(struct.pack('<3I', *node))
+            f.write(struct.pack('<%dI' % len(targets), *targets))
+            f.write(struct.pack('<%dI' % len(labels), *map(ord, labels)))
+    sys.stderr.write('%s: %d words, %d trie nodes, %s\n' % (
+        args[0], len(words), len(forward[0]) + len(backward[0]),
+        '%d emission pages' % len(pages) if hmm else 'no HMM'))
+
+
+if __name__ == '__main__':
+    main()
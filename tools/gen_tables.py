@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022-present, Zejun Wang (wangzejunscut@126.com)
+# All rights reserved.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+"""Generate stringutils_tables.h from the codecs of the Python standard library.
+
+Usage: python3 tools/gen_tables.py > stringutils_tables.h
+"""
+
+import sys
+import unicodedata
+
+
+def emit_array(out, ctype, name, values, per_line=16):
+    out.append('  inline const %s* %s() noexcept' % (ctype, name))
+    out.append('  {')
+    out.append('    static const %s table[%d] = {' % (ctype, len(values)))
+    for i in range(0, len(values), per_line):
+        out.append('      ' + ', '.join(str(v) for v in values[i:i + per_line]) + ',')
+    out.append('    };')
+    out.append('    return table;')
+    out.append('  }')
+    out.append('')
+
+
+def dbcs(out, name, codec, rows, cols, encode_bytes):
+    """Double-byte table: code points of every (row, col), 0 when unmapped.
+
+    Rows without any mapping are left out; row_index maps a row to its
+    position in the cells plus one, or 0.
+    """
+    row_index, cells = [], []
+    for row in rows:
+        line = []
+        for col in cols:
+            try:
+                ch = encode_bytes(row, col).decode(codec)
+                cp = ord(ch) if len(ch) == 1 and ord(ch) <= 0xFFFF else 0
+            except (UnicodeDecodeError, ValueError):
+                cp = 0
+            line.append(cp)
+        if any(line):
+            cells.extend(line)
+            row_index.append(len(cells) // len(line))
+        else:
+            row_index.append(0)
+    out.append('  // %s: rows %#x-%#x, columns %#x-%#x' % (name, rows[0], rows[-1], cols[0], cols[-1]))
+    emit_array(out, 'std::uint16_t', name + '_rows', row_index)
+    emit_array(out, 'std::uint16_t', name + '_cells', cells)
+
+
+def gb18030(out):
+    dbcs(out, 'gb18030', 'gb18030', list(range(0x81, 0xFF)), list(range(0x40, 0xFF)),
+         lambda r, c: bytes([r, c]) if c != 0x7F else b'\xff')
+
+    # Four-byte sequences of the BMP, in linear order, form runs of
+    # consecutive code points: store the first linear index and code point
+    # of every run.
+    def from_linear(l):
+        b4 = l % 10; l //= 10
+        b3 = l % 126; l //= 126
+        b2 = l % 10; b1 = l // 10
+        return bytes([b1 + 0x81, b2 + 0x30, b3 + 0x81, b4 + 0x30])
+
+    ranges, prev = [], None
+    for l in range(39420):
+        cp = ord(from_linear(l).decode('gb18030'))
+        if prev is None or cp != prev + 1:
+            ranges.extend([l, cp])
+        prev = cp
+    out.append('  // gb18030 four-byte BMP runs: linear index, first code point')
+    emit_array(out, 'std::uint32_t', 'gb18030_ranges', ranges, 8)
+
+
+def big5(out):
+    dbcs(out, 'big5', 'cp950', list(range(0x81, 0xFF)), list(range(0x40, 0xFF)),
+         lambda r, c: bytes([r, c]) if c != 0x7F else b'\xff')
+
+
+def shift_jis_bytes(ku, ten):
+    s1 = (ku + 0x101) // 2 if ku <= 62 else (ku + 0x181) // 2
+    if ku % 2:
+        s2 = ten + 0x3F + (1 if ten >= 64 else 0)
+    else:
+        s2 = ten + 0x9E
+    return bytes([s1, s2])
+
+
+def jis(out):
+    # JIS X 0208 by (ku, ten) as extended by Windows code page 932 (NEC and
+    # IBM rows up to ku 120), shared by Shift_JIS and EUC-JP.
+    dbcs(out, 'jis0208', 'cp932', list(range(1, 121)), list(range(1, 95)), shift_jis_bytes)
+    # JIS X 0212, the three-byte 0x8F plane of EUC-JP.
+    dbcs(out, 'jis0212', 'euc_jp', list(range(1, 95)), list(range(1, 95)),
+         lambda ku, ten: bytes([0x8F, ku + 0xA0, ten + 0xA0]))
+
+
+def cp1252(out):
+    # Code points of bytes 0x80-0x9F; the five unassigned bytes keep their
+    # C1 control code point, as in the WHATWG encoding standard.
+    cells = []
+    for b in range(0x80, 0xA0):
+        try:
+            cells.append(ord(bytes([b]).decode('cp1252')))
+        except UnicodeDecodeError:
+            cells.append(b)
+    out.append('  // cp1252: bytes 0x80-0x9f')
+    emit_array(out, 'std::uint16_t', 'cp1252_high', cells, 8)
+
+
+def char_width(cp):
+    """Terminal columns of a code point: 0 for controls, combining and
+    format characters, 2 for East Asian wide and full-width ones, else 1."""
+    ch = chr(cp)
+    if cp < 0x20 or 0x7F <= cp < 0xA0:
+        return 0
+    if cp == 0xAD:
+        return 1
+    if unicodedata.category(ch) in ('Mn', 'Me', 'Cf') or 0x1160 <= cp <= 0x11FF:
+        return 0
+    if unicodedata.east_asian_width(ch) in 'WF':
+        return 2
+    # Unassigned code points of the ideographic planes are wide as well.
+    if 0x20000 <= cp <= 0x2FFFD or 0x30000 <= cp <= 0x3FFFD:
+        return 2
+    return 1
+
+
+def width(out):
+    # Two-level table of char_width: block width_index[cp >> 8] of
+    # width_blocks holds 2 bits per code point, 4 code points per byte.
+    blocks, index = {}, []
+    for b in range(0x1100):
+        widths = tuple(char_width(b << 8 | k) for k in range(256))
+        index.append(blocks.setdefault(widths, len(blocks)))
+    packed = []
+    for widths in sorted(blocks, key=blocks.get):
+        packed.extend(widths[k] | widths[k + 1] << 2 | widths[k + 2] << 4 | widths[k + 3] << 6
+                      for k in range(0, 256, 4))
+    out.append('  // East Asian display width, unicode %s: 2 bits per code point' %
+               unicodedata.unidata_version)
+    emit_array(out, 'std::uint8_t', 'width_index', index, 32)
+    emit_array(out, 'std::uint8_t', 'width_blocks', packed, 32)
+
+
+GENERATORS = [gb18030, big5, jis, cp1252, width]
+
+
+def main():
+    out = [
+        '/**',
+        ' * Copyright (c) 2022-present, Zejun Wang (wangzejunscut@126.com)',
+        ' * All rights reserved.',
+        ' *',
+        ' * This source code is licensed under the MIT license found in the',
+        ' * LICENSE file in the root directory of this source tree.',
+        ' */',
+        '',
+        '// Generated by tools/gen_tables.py from Python %d.%d, do not edit.' % sys.version_info[:2],
+        '',
+        '#ifndef STRINGUTILS_TABLES_H',
+        '#define STRINGUTILS_TABLES_H',
+        '',
+        '#include <cstdint>',
+        '',
+        'namespace stringutils {',
+        'namespace table_detail {',
+        '',
+    ]
+    for gen in GENERATORS:
+        gen(out)
+    out += ['} // namespace table_detail', '} // namespace stringutils', '',
+            '#endif // STRINGUTILS_TABLES_H']
+    sys.stdout.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022-present, Zejun Wang (wangzejunscut@126.com)
+# All rights reserved.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+"""Compile Traditional/Simplified Chinese dictionaries for zh_converter.
+
+Usage: python3 tools/gen_zhconv.py OUTPUT DICT [DICT ...]
+
+Every DICT is a text file in the OpenCC format, one mapping per line:
+a key, a tab and one or more space-separated candidates of which the
+first is used. Blank lines and lines starting with '#' are skipped, and
+later files override earlier ones. For simplified to traditional, e.g.:
+
+  python3 tools/gen_zhconv.py s2t.bin STCharacters.txt STPhrases.txt
+
+Layout of OUTPUT, little endian, read in place by zh_converter:
+
+  uint32 header[8]     magic 'ZHCV', version, number of pages, nodes and
+                       edges, pool size, expansion ratio, 0
+  uint16 index[0x1100] one per 256 code points: page number plus one, or 0
+  uint32 pages[][256]  mapped code point, or 0 when unchanged
+  uint32 nodes[][4]    phrase trie on utf8 bytes, breadth first: first
+                       edge, number of edges, value offset and length
+  uint32 targets[]     child node of every edge, sorted by label per node
+  uint8  labels[]      byte of every edge
+  char   pool[]        utf8 values
+
+Single characters mapped to a single character go to the pages, all
+other keys to the trie.
+"""
+
+import struct
+import sys
+
+MAGIC = 0x5643485A  # 'ZHCV'
+VERSION = 1
+
+
+def read_dicts(paths):
+    entries = {}
+    for path in paths:
+        with open(path, encoding='utf-8') as f:
+            for line in f:
+                line = line.rstrip('\r\n')
+                if not line or line.startswith('#') or '\t' not in line:
+                    continue
+                key, values = line.split('\t', 1)
+                values = values.split()
+                if key and values:
+                    entries[key] = values[0]
+    return entries
+
+
+def build(entries):
+    chars, phrases = {}, {}
+    for key, value in entries.items():
+        if len(key) == 1 and len(value) == 1:
+            if key != value:
+                chars[ord(key)] = ord(value)
+        else:
+            phrases[key.encode('utf-8')] = value.encode('utf-8')
+
+    index, pages = [0] * 0x1100, []
+    for cp in sorted(chars):
+        if not index[cp >> 8]:
+            pages.append([0] * 256)
+            index[cp >> 8] = len(pages)
+        pages[index[cp >> 8] - 1][cp & 0xFF] = chars[cp]
+
+    # The converter checks the ratio against every mapping. A lone invalid
+    # byte decodes to a code point up to U+00FF, so those count as 1 byte.
+    ratio = 1
+    for cp, to in chars.items():
+        size = 1 if cp <= 0xFF else len(chr(cp).encode('utf-8'))
+        ratio = max(ratio, -(-len(chr(to).encode('utf-8')) // size))
+    for key, value in phrases.items():
+        ratio = max(ratio, -(-len(value) // len(key)))
+
+    pool = bytearray()
+
+    def payload(value):
+        offset = len(pool)
+        pool.extend(value or b'')
+        return (offset, len(value or b''))
+
+    nodes, targets, labels = layout_trie(phrases, payload)
+    return index, pages, nodes, targets, labels, bytes(pool), ratio
+
+
+def layout_trie(entries, payload):
+    """Lay out a trie of the keys of entries, byte or unicode strings,
+    breadth first so that the children of a node are consecutive edges
+    sorted by label.
+
+    Node n is (first edge, number of edges) + payload(value), the value
+    being None for nodes that end no key.
+    """
+    root = {}
+    for key, value in entries.items():
+        node = root
+        for b in key:
+            node = node.setdefault(b, {})
+        node[None] = value
+    order, nodes, targets, labels = [root], [], [], []
+    for node in order:
+        children = sorted(b for b in node if b is not None)
+        nodes.append((len(targets), len(children)) + payload(node.get(None)))
+        for b in children:
+            labels.append(b)
+            targets.append(len(order))
+            order.append(node[b])
+    return nodes, targets, labels
+
+
+def write(path, index, pages, nodes, targets, labels, pool, ratio):
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<8I', MAGIC, VERSION, len(pages), len(nodes), len(targets),
+                            len(pool), ratio, 0))
+        f.write(struct.pack('<%dH' % len(index), *index))
+        for page in pages:
+            f.write(struct.pack('<256I', *page))
+        for node in nodes:
+            f.write(struct.pack('<4I', *node))
+        f.write(struct.pack('<%dI' % len(targets), *targets))
+        f.write(bytes(labels))
+        f.write(pool)
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    entries = read_dicts(sys.argv[2:])
+    tables = build(entries)
+    write(sys.argv[1], *tables)
+    index, pages, nodes = tables[:3]
+    sys.stderr.write('%s: %d characters, %d phrases, %d trie nodes\n' % (
+        sys.argv[1], sum(1 for page in pages for cp in page if cp),
+        sum(1 for node in nodes if node[3]), len(nodes)))
+
+
+if __name__ == '__main__':
+    main()